@@ -0,0 +1,106 @@
+/**
+ * Cost of one CounterSampler::sample() (IPT_SO_GET_ENTRIES and counter copy)
+ * and of ranking the hot rules, for tables of given sizes. Tables are loaded
+ * in a private network namespace so host rules are untouched, root is
+ * required.
+ *
+ * usage: counter_sampler_bench [rules ...]
+ */
+#include "backend/firewall/counter_sampler.h"
+#include "backend/firewall/firewall_backend.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/table_compiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fmt/core.h>
+#include <memory>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+using std::make_shared;
+
+namespace {
+const string kTable = "filter";
+const string kChain = "CP_BENCH";
+
+constexpr int kSamples = 20;
+constexpr size_t kTopRules = 20;
+
+auto makeRules(int count) -> vector<shared_ptr<RuleRequest>> {
+  static constexpr int kOctet = 256;
+
+  vector<shared_ptr<RuleRequest>> rules;
+  rules.reserve(count);
+  for (int i = 0; i < count; i++) {
+    auto rule = make_shared<RuleRequest>();
+    rule->src_ip_ = fmt::format("10.{}.{}.{}", i / kOctet / kOctet % kOctet,
+                                i / kOctet % kOctet, i % kOctet);
+    rule->target_ = IPTC_LABEL_ACCEPT;
+    rules.emplace_back(rule);
+  }
+  return rules;
+}
+
+auto elapsedMs(std::chrono::steady_clock::time_point start) -> double {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (unshare(CLONE_NEWNET) != 0) {
+    fmt::print("unshare failed: {}, run as root\n", strerror(errno));
+    return 1;
+  }
+
+  vector<int> sizes = {1000, 10000, 50000};
+  if (argc > 1) {
+    sizes.clear();
+    for (int i = 1; i < argc; i++) {
+      sizes.emplace_back(std::stoi(argv[i]));
+    }
+  }
+
+  fmt::print("{:>10} {:>14} {:>14} {:>14}\n", "rules", "first(ms)",
+             "sample(ms)", "top(ms)");
+  for (auto size : sizes) {
+    auto fwb = make_shared<FirewallBackend>();
+    auto ctx = fwb->createContext(make_shared<FirewallContext>(), kTable);
+    TableRuleset ruleset{kTable,
+                         {ChainRuleset{kChain, std::nullopt, makeRules(size)}}};
+    if (!fwb->replaceTable(ctx, ruleset)) {
+      fmt::print("replace failed: {}\n", ctx->getLastError());
+      return 1;
+    }
+
+    /* first sample also labels the rules */
+    CounterSampler sampler(kTable);
+    auto start = std::chrono::steady_clock::now();
+    if (!sampler.sample()) {
+      fmt::print("sample failed: {}\n", strerror(errno));
+      return 1;
+    }
+    auto first_ms = elapsedMs(start);
+
+    double worst_ms = 0;
+    for (int i = 0; i < kSamples; i++) {
+      start = std::chrono::steady_clock::now();
+      sampler.sample();
+      worst_ms = std::max(worst_ms, elapsedMs(start));
+    }
+
+    start = std::chrono::steady_clock::now();
+    auto top = sampler.topRules(kTopRules);
+    auto top_ms = elapsedMs(start);
+
+    fmt::print("{:>10} {:>14.2f} {:>14.2f} {:>14.2f}\n", size, first_ms,
+               worst_ms, top_ms);
+  }
+
+  return 0;
+}
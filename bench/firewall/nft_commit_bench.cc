@@ -0,0 +1,167 @@
+/**
+ * Latency of committing one rule change against the total number of rules,
+ * through NftBackend (one nf_tables batch with only the change) and through
+ * libiptc (iptc_commit replaces the whole table). Rules are spread over
+ * chains of kChainRules so the nf_tables figure is not dominated by the
+ * kernel rebuilding a single huge chain. Runs in a private network namespace
+ * so host rules are untouched, root is required.
+ *
+ * usage: nft_commit_bench [rules ...]
+ */
+#include "backend/firewall/chain_request.h"
+#include "backend/firewall/firewall_backend.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/nft_backend.h"
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/table_compiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/core.h>
+#include <memory>
+#include <sched.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::make_shared;
+
+namespace {
+const string kTable = "filter";
+
+constexpr int kChainRules = 1000;
+constexpr int kChanges = 20;
+
+auto makeRules(int offset, int count) -> vector<shared_ptr<RuleRequest>> {
+  static constexpr int kOctet = 256;
+
+  vector<shared_ptr<RuleRequest>> rules;
+  rules.reserve(count);
+  for (int i = offset; i < offset + count; i++) {
+    auto rule = make_shared<RuleRequest>();
+    rule->index_ = i - offset;
+    rule->proto_ = RequestProto::ALL;
+    rule->src_ip_ = fmt::format("10.{}.{}.{}", i / kOctet / kOctet % kOctet,
+                                i / kOctet % kOctet, i % kOctet);
+    rule->target_ = IPTC_LABEL_DROP;
+    rules.emplace_back(rule);
+  }
+  return rules;
+}
+
+auto chainName(int index) -> string { return fmt::format("CP_{}", index); }
+
+auto makeChange() -> shared_ptr<RuleRequest> {
+  auto rule = make_shared<RuleRequest>();
+  rule->index_ = kChainRules / 2;
+  rule->proto_ = RequestProto::ALL;
+  rule->src_ip_ = "192.168.0.1";
+  rule->target_ = IPTC_LABEL_ACCEPT;
+  return rule;
+}
+
+auto elapsedMs(std::chrono::steady_clock::time_point start) -> double {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+/* average latency of kChanges commits of one insert each */
+auto benchChanges(RuleBackend &backend, const ctx_t &table_ctx,
+                  int chains) -> double {
+  double total_ms = 0;
+  for (int i = 0; i < kChanges; i++) {
+    auto chain_ctx =
+        RuleBackend::createContext(table_ctx, chainName(i % chains));
+    backend.insertRule(chain_ctx, makeChange());
+
+    auto start = std::chrono::steady_clock::now();
+    if (!backend.commit()) {
+      fmt::print("commit failed: {}\n", backend.lastCommitError());
+      std::exit(1);
+    }
+    total_ms += elapsedMs(start);
+  }
+  return total_ms / kChanges;
+}
+
+auto benchNft(int size) -> std::pair<double, double> {
+  auto nft = make_shared<NftBackend>();
+  auto root = make_shared<FirewallContext>();
+  auto table = fmt::format("cp_bench_{}", size);
+  if (!nft->insertTable(root, table)) {
+    fmt::print("table failed: {}\n", root->getLastError());
+    std::exit(1);
+  }
+  auto table_ctx = RuleBackend::createContext(root, table);
+
+  auto chains = std::max(1, size / kChainRules);
+  for (int c = 0; c < chains; c++) {
+    nft->insertChain(table_ctx, make_shared<ChainRequest>(chainName(c)));
+    auto chain_ctx = RuleBackend::createContext(table_ctx, chainName(c));
+    for (const auto &rule : makeRules(c * kChainRules, kChainRules)) {
+      nft->insertRule(chain_ctx, rule);
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  if (!nft->commit()) {
+    fmt::print("load failed: {}\n", nft->lastCommitError());
+    std::exit(1);
+  }
+  auto load_ms = elapsedMs(start);
+  return {load_ms, benchChanges(*nft, table_ctx, chains)};
+}
+
+auto benchLibiptc(int size) -> std::pair<double, double> {
+  auto fwb = make_shared<FirewallBackend>();
+  auto table_ctx = fwb->createContext(make_shared<FirewallContext>(), kTable);
+
+  auto chains = std::max(1, size / kChainRules);
+  TableRuleset ruleset{kTable, {}};
+  for (int c = 0; c < chains; c++) {
+    ruleset.chains_.push_back(ChainRuleset{
+        chainName(c), std::nullopt, makeRules(c * kChainRules, kChainRules)});
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  if (!fwb->replaceTable(table_ctx, ruleset)) {
+    fmt::print("replace failed: {}\n", table_ctx->getLastError());
+    std::exit(1);
+  }
+  auto load_ms = elapsedMs(start);
+  auto change_ms = benchChanges(*fwb, table_ctx, chains);
+
+  /* leave an empty table for the next size */
+  fwb->replaceTable(table_ctx, TableRuleset{kTable, {}});
+  return {load_ms, change_ms};
+}
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (unshare(CLONE_NEWNET) != 0) {
+    fmt::print("unshare failed: {}, run as root\n", strerror(errno));
+    return 1;
+  }
+
+  vector<int> sizes = {1000, 10000, 100000};
+  if (argc > 1) {
+    sizes.clear();
+    for (int i = 1; i < argc; i++) {
+      sizes.emplace_back(std::stoi(argv[i]));
+    }
+  }
+
+  fmt::print("{:>10} {:>14} {:>14} {:>14} {:>14}\n", "rules", "nft load(ms)",
+             "nft change(ms)", "iptc load(ms)", "iptc change(ms)");
+  for (auto size : sizes) {
+    auto [nft_load, nft_change] = benchNft(size);
+    auto [iptc_load, iptc_change] = benchLibiptc(size);
+    fmt::print("{:>10} {:>14.2f} {:>14.3f} {:>14.2f} {:>14.3f}\n", size,
+               nft_load, nft_change, iptc_load, iptc_change);
+  }
+
+  return 0;
+}
@@ -0,0 +1,102 @@
+/**
+ * Time of FirewallBackend::queryRules over tables of given sizes, the first
+ * run also decodes the ruleset model. Tables are loaded in a private network
+ * namespace so host rules are untouched, root is required.
+ *
+ * usage: rule_query_bench [rules ...]
+ */
+#include "backend/firewall/firewall_backend.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/table_compiler.h"
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <fmt/core.h>
+#include <memory>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+using std::make_shared;
+
+namespace {
+const string kTable = "filter";
+const string kChain = "CP_BENCH";
+
+constexpr std::array<const char *, 3> kQueries = {
+    "proto == tcp && dport overlaps 8000-9000 && target == DROP",
+    "src within 10.1.0.0/16 || packets > 1000",
+    "!(target == ACCEPT) && dport overlaps 1-1024",
+};
+
+auto makeRules(int count) -> vector<shared_ptr<RuleRequest>> {
+  static constexpr int kOctet = 256;
+  static constexpr int kPortNum = 65535;
+
+  vector<shared_ptr<RuleRequest>> rules;
+  rules.reserve(count);
+  for (int i = 0; i < count; i++) {
+    auto rule = make_shared<RuleRequest>();
+    rule->src_ip_ = fmt::format("10.{}.{}.{}", i / kOctet / kOctet % kOctet,
+                                i / kOctet % kOctet, i % kOctet);
+    auto port = std::to_string(i % kPortNum + 1);
+    rule->matches_.push_back({std::nullopt, std::make_tuple(port, port)});
+    rule->target_ = i % 2 == 0 ? IPTC_LABEL_ACCEPT : IPTC_LABEL_DROP;
+    rules.emplace_back(rule);
+  }
+  return rules;
+}
+
+auto elapsedMs(std::chrono::steady_clock::time_point start) -> double {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (unshare(CLONE_NEWNET) != 0) {
+    fmt::print("unshare failed: {}, run as root\n", strerror(errno));
+    return 1;
+  }
+
+  vector<int> sizes = {10000, 100000};
+  if (argc > 1) {
+    sizes.clear();
+    for (int i = 1; i < argc; i++) {
+      sizes.emplace_back(std::stoi(argv[i]));
+    }
+  }
+
+  fmt::print("{:>10} {:>12} {:>12} {:>10}  {}\n", "rules", "first(ms)",
+             "query(ms)", "matched", "query");
+  for (auto size : sizes) {
+    auto fwb = make_shared<FirewallBackend>();
+    auto ctx = fwb->createContext(make_shared<FirewallContext>(), kTable);
+    TableRuleset ruleset{kTable,
+                         {ChainRuleset{kChain, std::nullopt, makeRules(size)}}};
+    if (!fwb->replaceTable(ctx, ruleset)) {
+      fmt::print("replace failed: {}\n", ctx->getLastError());
+      return 1;
+    }
+
+    for (const auto *query : kQueries) {
+      auto count = [](const RulesetModel &, uint32_t) { return true; };
+      fwb->reloadTable(ctx);
+      auto start = std::chrono::steady_clock::now();
+      fwb->queryRules(query, count);
+      auto first_ms = elapsedMs(start);
+
+      start = std::chrono::steady_clock::now();
+      auto stat = fwb->queryRules(query, count);
+      auto query_ms = elapsedMs(start);
+
+      fmt::print("{:>10} {:>12.2f} {:>12.2f} {:>10}  {}\n", size, first_ms,
+                 query_ms, stat.matched_, query);
+    }
+  }
+
+  return 0;
+}
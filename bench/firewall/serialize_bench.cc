@@ -0,0 +1,147 @@
+/**
+ * Per-rule cost of the chain listing text: the former std::string based
+ * serializer (fmt::format + inet_ntoa) compared with appending into a reused
+ * fmt::memory_buffer. Rules are only added to a libiptc handle inside a
+ * private network namespace and never committed, root is required.
+ *
+ * usage: serialize_bench [rules ...]
+ */
+#include "backend/firewall/firewall_backend.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/rule_request.h"
+#include "tools/nettools.h"
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <libiptc/libiptc.h>
+#include <memory>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+using std::make_shared;
+
+namespace {
+const string kTable = "filter";
+const string kChain = "INPUT";
+
+/* serializer before buffers were introduced, kept as baseline */
+auto legacyShortRule(iptc_handle *handle,
+                     const struct ipt_entry *rule) -> string {
+  std::string result;
+  result += fmt::format(
+      "SRC: {}, DST: {}, PROTO: {}", string(inet_ntoa(rule->ip.src)),
+      string(inet_ntoa(rule->ip.dst)), proto2String(rule->ip.proto));
+
+  static constexpr int kMinPort = 0;
+  static constexpr int kMaxPort = 65535;
+  const auto *match = reinterpret_cast<const ipt_entry_match *>(rule->elems);
+  while (reinterpret_cast<const char *>(match) !=
+         reinterpret_cast<const char *>(rule) + rule->target_offset) {
+    const auto *tcp = reinterpret_cast<const ipt_tcp *>(match->data);
+    auto srcs = std::make_pair<int, int>(tcp->spts[0], tcp->spts[1]);
+    auto dsts = std::make_pair<int, int>(tcp->dpts[0], tcp->dpts[1]);
+    if (srcs.first != kMinPort && srcs.second != kMaxPort) {
+      result += fmt::format(", SRC PORT: {}-{}", srcs.first, srcs.second);
+    }
+    if (dsts.first != kMinPort && dsts.second != kMaxPort) {
+      result += fmt::format(", DST PORT: {}-{}", dsts.first, dsts.second);
+    }
+
+    match = reinterpret_cast<const ipt_entry_match *>(
+        reinterpret_cast<const char *>(match) + match->u.match_size);
+  }
+
+  if (rule->target_offset != rule->next_offset) {
+    auto target_name = string(iptc_get_target(rule, handle));
+    if (!target_name.empty()) {
+      result += fmt::format(" | {}\n", target_name);
+    }
+  }
+
+  return result;
+}
+
+auto fillChain(iptc_handle *handle, int count) -> bool {
+  static constexpr int kOctet = 256;
+  static constexpr int kPortNum = 65535;
+
+  auto context = make_shared<FirewallContext>();
+  for (int i = 0; i < count; i++) {
+    RuleRequest rule;
+    rule.src_ip_ = fmt::format("10.{}.{}.{}", i / kOctet / kOctet % kOctet,
+                               i / kOctet % kOctet, i % kOctet);
+    auto port = std::to_string(i % kPortNum + 1);
+    rule.matches_.push_back({std::nullopt, std::make_tuple(port, port)});
+    rule.target_ = IPTC_LABEL_DROP;
+
+    auto entry = rule.to_entry_bytes(context);
+    if (!entry || iptc_append_entry(
+                      kChain.c_str(),
+                      reinterpret_cast<const ipt_entry *>(entry->data()),
+                      handle) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Func>
+auto nsPerRule(iptc_handle *handle, int count, Func func) -> double {
+  auto start = std::chrono::steady_clock::now();
+  for (const auto *rule = iptc_first_rule(kChain.c_str(), handle);
+       rule != nullptr; rule = iptc_next_rule(rule, handle)) {
+    func(rule);
+  }
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         count;
+}
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (unshare(CLONE_NEWNET) != 0) {
+    fmt::print("unshare failed: {}, run as root\n", strerror(errno));
+    return 1;
+  }
+
+  vector<int> sizes = {1000, 10000, 100000};
+  if (argc > 1) {
+    sizes.clear();
+    for (int i = 1; i < argc; i++) {
+      sizes.emplace_back(std::stoi(argv[i]));
+    }
+  }
+
+  fmt::print("{:>10} {:>16} {:>16}\n", "rules", "string(ns/rule)",
+             "buffer(ns/rule)");
+  for (auto size : sizes) {
+    auto *handle = iptc_init(kTable.c_str());
+    if (handle == nullptr || !fillChain(handle, size)) {
+      fmt::print("setup failed: {}\n", iptc_strerror(errno));
+      return 1;
+    }
+
+    size_t sink = 0;
+    auto legacy_ns = nsPerRule(handle, size, [&](const ipt_entry *rule) {
+      sink += legacyShortRule(handle, rule).size();
+    });
+
+    fmt::memory_buffer buffer;
+    auto buffer_ns = nsPerRule(handle, size, [&](const ipt_entry *rule) {
+      buffer.clear();
+      FirewallBackend::serializeShortRule(handle, rule, buffer);
+      sink += buffer.size();
+    });
+
+    fmt::print("{:>10} {:>16.1f} {:>16.1f}   ({} bytes)\n", size, legacy_ns,
+               buffer_ns, sink);
+    iptc_free(handle);
+  }
+
+  return 0;
+}
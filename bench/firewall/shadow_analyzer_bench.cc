@@ -0,0 +1,131 @@
+/**
+ * Time of FirewallBackend::analyzeChain over chains of given sizes, with
+ * single port rules, port ranges and rules without port. The model is decoded
+ * before timing. Tables are loaded in a private network namespace so host
+ * rules are untouched, root is required.
+ *
+ * usage: shadow_analyzer_bench [rules ...]
+ */
+#include "backend/firewall/firewall_backend.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/table_compiler.h"
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <fmt/core.h>
+#include <functional>
+#include <memory>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+using std::make_shared;
+
+namespace {
+const string kTable = "filter";
+const string kChain = "CP_BENCH";
+
+/* port match of rule i, nullopt for a rule without port */
+using PortOf = std::function<optional<std::tuple<string, string>>(int)>;
+
+class Case {
+public:
+  const char *name_;
+  PortOf port_;
+};
+
+const std::array<Case, 3> kCases = {
+    Case{"single port",
+         [](int i) -> optional<std::tuple<string, string>> {
+           static constexpr int kPortNum = 65535;
+           auto port = std::to_string(i % kPortNum + 1);
+           return std::make_tuple(port, port);
+         }},
+    Case{"port range",
+         [](int i) -> optional<std::tuple<string, string>> {
+           static constexpr int kRangeNum = 60000;
+           static constexpr int kWidth = 1000;
+           auto port = i % kRangeNum + 1;
+           return std::make_tuple(std::to_string(port),
+                                  std::to_string(port + kWidth));
+         }},
+    Case{"no port",
+         [](int) -> optional<std::tuple<string, string>> {
+           return std::nullopt;
+         }},
+};
+
+auto makeRules(int count, const PortOf &port_of)
+    -> vector<shared_ptr<RuleRequest>> {
+  static constexpr int kOctet = 256;
+
+  vector<shared_ptr<RuleRequest>> rules;
+  rules.reserve(count);
+  for (int i = 0; i < count; i++) {
+    auto rule = make_shared<RuleRequest>();
+    rule->src_ip_ = fmt::format("10.{}.{}.{}", i / kOctet / kOctet % kOctet,
+                                i / kOctet % kOctet, i % kOctet);
+    if (auto port = port_of(i)) {
+      rule->matches_.push_back({std::nullopt, *port});
+    }
+    rule->target_ = IPTC_LABEL_DROP;
+    rules.emplace_back(rule);
+  }
+  return rules;
+}
+
+auto elapsedMs(std::chrono::steady_clock::time_point start) -> double {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (unshare(CLONE_NEWNET) != 0) {
+    fmt::print("unshare failed: {}, run as root\n", strerror(errno));
+    return 1;
+  }
+
+  vector<int> sizes = {10000, 100000};
+  if (argc > 1) {
+    sizes.clear();
+    for (int i = 1; i < argc; i++) {
+      sizes.emplace_back(std::stoi(argv[i]));
+    }
+  }
+
+  fmt::print("{:>10} {:>12} {:>10}  {}\n", "rules", "analyze(ms)",
+             "anomalies", "case");
+  for (auto size : sizes) {
+    for (const auto &bench_case : kCases) {
+      auto fwb = make_shared<FirewallBackend>();
+      auto ctx = fwb->createContext(make_shared<FirewallContext>(), kTable);
+      TableRuleset ruleset{
+          kTable,
+          {ChainRuleset{kChain, std::nullopt,
+                        makeRules(size, bench_case.port_)}}};
+      if (!fwb->replaceTable(ctx, ruleset)) {
+        fmt::print("replace failed: {}\n", ctx->getLastError());
+        return 1;
+      }
+
+      auto chain_ctx = fwb->createContext(ctx, kChain);
+      fwb->getRulesetModel(chain_ctx);
+      auto start = std::chrono::steady_clock::now();
+      auto report = fwb->analyzeChain(chain_ctx);
+      auto analyze_ms = elapsedMs(start);
+      if (!report) {
+        fmt::print("analyze failed: {}\n", chain_ctx->getLastError());
+        return 1;
+      }
+
+      fmt::print("{:>10} {:>12.2f} {:>10}  {}\n", size, analyze_ms,
+                 report->anomalies_.size(), bench_case.name_);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,120 @@
+/**
+ * Full-table load through TableCompiler (single IPT_SO_SET_REPLACE) compared
+ * with libiptc (insertRules + iptc_commit). Runs in a private network
+ * namespace so host rules are untouched, root is required.
+ *
+ * usage: table_compiler_bench [rules ...]
+ */
+#include "backend/firewall/chain_request.h"
+#include "backend/firewall/firewall_backend.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/table_compiler.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/core.h>
+#include <memory>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+using std::make_shared;
+
+namespace {
+const string kTable = "filter";
+const string kChain = "CP_BENCH";
+
+auto makeRules(int count) -> vector<shared_ptr<RuleRequest>> {
+  static constexpr int kOctet = 256;
+  static constexpr int kPortNum = 65535;
+
+  vector<shared_ptr<RuleRequest>> rules;
+  rules.reserve(count);
+  for (int i = 0; i < count; i++) {
+    auto rule = make_shared<RuleRequest>();
+    rule->index_ = i;
+    rule->src_ip_ = fmt::format("10.{}.{}.{}", i / kOctet / kOctet % kOctet,
+                                i / kOctet % kOctet, i % kOctet);
+    auto port = std::to_string(i % kPortNum + 1);
+    rule->matches_.push_back({std::nullopt, std::make_tuple(port, port)});
+    rule->target_ = IPTC_LABEL_DROP;
+    rules.emplace_back(rule);
+  }
+  return rules;
+}
+
+auto elapsedMs(std::chrono::steady_clock::time_point start) -> double {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+auto resetTable(const shared_ptr<FirewallBackend> &fwb, const ctx_t &ctx)
+    -> void {
+  if (!fwb->replaceTable(ctx, TableRuleset{kTable, {}})) {
+    fmt::print("reset failed: {}\n", ctx->getLastError());
+    std::exit(1);
+  }
+}
+
+auto benchLibiptc(const vector<shared_ptr<RuleRequest>> &rules) -> double {
+  auto fwb = make_shared<FirewallBackend>();
+  auto table_ctx = fwb->createContext(make_shared<FirewallContext>(), kTable);
+  resetTable(fwb, table_ctx);
+
+  auto start = std::chrono::steady_clock::now();
+  fwb->insertChain(table_ctx, make_shared<ChainRequest>(kChain));
+  auto chain_ctx = fwb->createContext(table_ctx, kChain);
+  fwb->insertRules(chain_ctx, rules);
+  if (!fwb->commit()) {
+    fmt::print("libiptc commit failed\n");
+  }
+  return elapsedMs(start);
+}
+
+auto benchCompiler(const vector<shared_ptr<RuleRequest>> &rules) -> double {
+  auto fwb = make_shared<FirewallBackend>();
+  auto table_ctx = fwb->createContext(make_shared<FirewallContext>(), kTable);
+  resetTable(fwb, table_ctx);
+
+  auto start = std::chrono::steady_clock::now();
+  TableRuleset ruleset{kTable, {ChainRuleset{kChain, std::nullopt, rules}}};
+  if (!fwb->replaceTable(table_ctx, ruleset)) {
+    fmt::print("replace failed: {}\n", table_ctx->getLastError());
+  }
+  auto elapsed = elapsedMs(start);
+
+  auto chain_ctx = fwb->createContext(table_ctx, kChain);
+  if (fwb->getRuleCount(chain_ctx) != static_cast<int>(rules.size())) {
+    fmt::print("replace verification failed\n");
+  }
+  return elapsed;
+}
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (unshare(CLONE_NEWNET) != 0) {
+    fmt::print("unshare failed: {}, run as root\n", strerror(errno));
+    return 1;
+  }
+
+  vector<int> sizes = {1000, 10000, 100000};
+  if (argc > 1) {
+    sizes.clear();
+    for (int i = 1; i < argc; i++) {
+      sizes.emplace_back(std::stoi(argv[i]));
+    }
+  }
+
+  fmt::print("{:>10} {:>14} {:>14}\n", "rules", "libiptc(ms)", "replace(ms)");
+  for (auto size : sizes) {
+    auto rules = makeRules(size);
+    auto libiptc_ms = benchLibiptc(rules);
+    auto compiler_ms = benchCompiler(rules);
+    fmt::print("{:>10} {:>14.2f} {:>14.2f}\n", size, libiptc_ms, compiler_ms);
+  }
+
+  return 0;
+}
@@ -1,6 +1,7 @@
 #ifndef CONFIG_BACKEND_BASE_H
 #define CONFIG_BACKEND_BASE_H
 
+#include <cstddef>
 #include <memory>
 #include <string>
 #include <unistd.h>
@@ -13,6 +14,44 @@ public:
 
   virtual ~ConfigBackendBase() = default;
 
+  /**
+   * @brief commit all pending changes of the backend to system, called by
+   * ConfigManager once per apply no matter how many changes are recorded
+   */
+  virtual auto commit() -> bool { return true; }
+
+  /**
+   * @brief estimated cost of next commit, in entries written to system
+   */
+  virtual auto estimateCommitCost() -> size_t { return 0; }
+
+  /**
+   * @brief reason of last failed commit, empty if it succeeded
+   */
+  [[nodiscard]] virtual auto lastCommitError() const -> std::string {
+    return {};
+  }
+
+  /**
+   * @brief whether changes of a scope ("table/chain") are still to be
+   * committed, false once a partial commit wrote them to system
+   */
+  [[nodiscard]] virtual auto isPending(const std::string &scope) const
+      -> bool {
+    (void)scope;
+    return true;
+  }
+
+  /**
+   * @brief called when changes cancelled out in the journal, with scopes of
+   * the backend still pending. State outside them equals the system again
+   * and needs no commit.
+   */
+  virtual auto settle(const std::vector<std::string> &pending_scopes)
+      -> void {
+    (void)pending_scopes;
+  }
+
 private:
 };
 
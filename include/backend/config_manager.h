@@ -10,7 +10,9 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <typeindex>
+#include <utility>
 #include <vector>
 
 using std::function;
@@ -22,6 +24,42 @@ using std::type_index;
 using std::unordered_map;
 using std::vector;
 
+enum class ChangeKind {
+  INSERT_RULE,
+  REMOVE_RULE,
+  UPDATE_RULE,
+  INSERT_CHAIN,
+  REMOVE_CHAIN
+};
+
+/**
+ * @brief one operation recorded in the pending change journal
+ */
+class PendingChange {
+public:
+  PendingChange(ChangeKind kind, string scope, int index = -1)
+      : kind_(kind), scope_(std::move(scope)), index_(index) {}
+
+  ChangeKind kind_;
+
+  /* object changed, e.g. "filter/INPUT" for firewall */
+  string scope_;
+
+  /* rule index in scope, -1 for changes not related to rule */
+  int index_;
+
+  [[nodiscard]] auto serialize() const -> string;
+};
+
+/**
+ * @brief pending changes of one backend, committed together
+ */
+class BackendJournal {
+public:
+  shared_ptr<ConfigBackendBase> backend_;
+  vector<PendingChange> changes_;
+};
+
 class ConfigManager : public ConfigBackendBase {
 public:
   using initializer = function<shared_ptr<ConfigBackendBase>(void)>;
@@ -41,6 +79,9 @@ public:
 
       if (initializer_func.has_value()) {
         backends.insert({key, initializer_func.value()()});
+      } else if constexpr (std::is_abstract_v<BackendType>) {
+        yuiError() << "No backend registered for " << key << std::endl;
+        return nullptr;
       } else {
         backends.insert({key, std::make_shared<BackendType>()});
       }
@@ -49,15 +90,53 @@ public:
     return dynamic_pointer_cast<BackendType>(backends[key]);
   }
 
-  auto hasUnsavedConfig() -> bool { return !unsavedConfigs_.empty(); }
+  auto hasUnsavedConfig() -> bool {
+    return !unsavedConfigs_.empty() || !journals_.empty();
+  }
 
   auto registerApplyFunc(const function<bool(void)> &) -> int;
 
+  /**
+   * @brief record a change of backend, changes are coalesced so each backend
+   * is committed once per apply, and a change undone by a later one (e.g.
+   * insert then remove the same rule) is dropped from journal, and the
+   * backend is told which scopes remain, see ConfigBackendBase::settle
+   */
+  auto recordChange(const shared_ptr<ConfigBackendBase> &backend,
+                    PendingChange change) -> void;
+
+  /**
+   * @brief drop pending changes of backend whose scope starts with prefix,
+   * once the backend discarded them itself, e.g. "filter/" for a table
+   */
+  auto discardChanges(const shared_ptr<ConfigBackendBase> &backend,
+                      const string &prefix) -> void;
+
+  auto pendingChangeCount() const -> size_t;
+
+  auto estimatedCommitCost() const -> size_t;
+
+  auto pendingChanges() const -> vector<PendingChange>;
+
+  /**
+   * @brief commit every backend with pending changes, changes of a backend
+   * that failed stay pending until a later apply succeeds
+   */
   auto apply() -> bool;
 
+  /**
+   * @brief errors of backends that failed in last apply, one per line
+   */
+  [[nodiscard]] auto lastCommitError() const -> string override;
+
 private:
+  string last_commit_error_;
+
   vector<function<bool(void)>> unsavedConfigs_;
 
+  /* pending change journal, in order of first change of each backend */
+  vector<BackendJournal> journals_;
+
   // backend manager
   unordered_map<string, shared_ptr<ConfigBackendBase>> backends;
 
@@ -0,0 +1,94 @@
+#ifndef BPF_COMPILER_H
+#define BPF_COMPILER_H
+
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/rule_space.h"
+#include "backend/firewall/ruleset_model.h"
+
+#include <linux/filter.h>
+#include <linux/netfilter/xt_bpf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+using std::optional;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+/**
+ * consecutive rules of a chain compiled into one bpf match
+ */
+class BpfRun {
+public:
+  /* rule with the bpf match, replaces the first member, index_ is its
+   * position in chain */
+  shared_ptr<RuleRequest> rule_;
+
+  /* indices of member rules in chain, ascending and contiguous */
+  vector<int> members_;
+};
+
+class BpfPlan {
+public:
+  string chain_;
+
+  /* by position */
+  vector<BpfRun> runs_;
+
+  /* members other than the first of each run, ascending */
+  vector<int> removed_;
+
+  size_t rule_count_{};
+
+  [[nodiscard]] auto summary() const -> string;
+};
+
+/**
+ * Compiles runs of consecutive rules of one chain into classic BPF programs
+ * for the bpf match. Rules of a run have the same terminal target or RETURN
+ * and the same interfaces, which stay on the rule, so the first match of a
+ * packet in the run decides the same verdict as the run as a whole. The
+ * program tests address, protocol and port columns the way the ip, tcp and
+ * udp matches do, including that ports never match non-first fragments.
+ * The kernel accepts XT_BPF_MAX_NUM_INSTR instructions per program, a run
+ * ends when the next rule would not fit.
+ */
+class BpfCompiler {
+public:
+  /* shorter runs are cheaper as plain rules than running a program */
+  static constexpr size_t kMinMembers = 4;
+
+  static constexpr size_t kMaxInstructions = XT_BPF_MAX_NUM_INSTR;
+
+  /* packets verify() checks before a plan is applied */
+  static constexpr size_t kVerifyPackets = 100000;
+
+  static auto plan(const RulesetModel &model, uint32_t chain,
+                   size_t min_members = kMinMembers) -> BpfPlan;
+
+  /**
+   * program returning non-zero iff an IPv4 packet matches any of rules,
+   * interfaces of rules are ignored. It may be longer than kMaxInstructions.
+   */
+  static auto compile(std::span<const RuleSpace> rules)
+      -> vector<struct sock_filter>;
+
+  /**
+   * Differential check of plan against the chain it was planned for: for
+   * packets generated around every rule and at random, the first rule of
+   * the chain matching the packet and the first rule of the planned chain
+   * must have the same target, programs run in BpfInterpreter. nullopt if
+   * all agree, otherwise the first packet that does not.
+   */
+  static auto verify(const RulesetModel &model, uint32_t chain,
+                     const BpfPlan &plan, size_t packets,
+                     uint32_t seed) -> optional<string>;
+};
+
+#endif
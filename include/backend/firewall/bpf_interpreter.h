@@ -0,0 +1,38 @@
+#ifndef BPF_INTERPRETER_H
+#define BPF_INTERPRETER_H
+
+#include <linux/filter.h>
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+
+using std::optional;
+using std::string;
+
+/**
+ * classic BPF as the kernel runs it for the bpf match, the packet starts at
+ * the IPv4 header. Ancillary loads (negative offsets) are not supported.
+ */
+class BpfInterpreter {
+public:
+  /* scratch memory words M[] */
+  static constexpr uint32_t kMemWords = BPF_MEMWORDS;
+
+  /**
+   * the checks bpf_check_classic does before the kernel accepts a program,
+   * nullopt if program is valid, otherwise what is wrong with it
+   */
+  static auto check(std::span<const struct sock_filter> program)
+      -> optional<string>;
+
+  /**
+   * return value of program, a load beyond the end of packet returns 0 like
+   * in the kernel. program must have passed check().
+   */
+  static auto run(std::span<const struct sock_filter> program,
+                  std::span<const uint8_t> packet) -> uint32_t;
+};
+
+#endif
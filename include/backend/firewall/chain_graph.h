@@ -0,0 +1,119 @@
+#ifndef CHAIN_GRAPH_H
+#define CHAIN_GRAPH_H
+
+#include <libiptc/libiptc.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using std::optional;
+using std::string;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+
+/**
+ * what evaluating one rule can do to the packet path
+ */
+class GraphRule {
+public:
+  enum class Kind : uint8_t {
+    PLAIN,    /* no verdict, e.g. LOG or no target */
+    TERMINAL, /* ACCEPT, DROP, REJECT, ... */
+    RETURN,
+    JUMP, /* to user chain and back */
+    GOTO  /* to user chain, no return */
+  };
+
+  Kind kind_;
+
+  /* id of target chain for JUMP and GOTO */
+  uint32_t chain_{};
+
+  uint64_t pcnt_{};
+};
+
+/**
+ * rules evaluated per packet entering a builtin chain
+ */
+class HookCost {
+public:
+  string chain_;
+
+  /* every rule visited and every jump taken, saturates at UINT64_MAX */
+  uint64_t worst_{};
+
+  /* from packet counters, 0 if no packet was counted */
+  double expected_{};
+  uint64_t packets_{};
+
+  /* chain reaches a jump cycle, worst_ and expected_ are not meaningful */
+  bool cyclic_{};
+};
+
+/**
+ * Jumps between the chains of one table. Each chain keeps the kind and
+ * target of its rules and the number of rules jumping to it, so reference
+ * counts are lookups. Chains are re-read one at a time when invalidated,
+ * the whole table is only read when the graph is built.
+ */
+class ChainGraph {
+public:
+  static auto build(struct iptc_handle *handle) -> ChainGraph;
+
+  /* chain (new, modified or removed) is re-read on next sync */
+  auto invalidate(const string &chain) -> void;
+
+  [[nodiscard]] auto needsSync() const -> bool { return !stale_.empty(); }
+
+  auto sync(struct iptc_handle *handle) -> void;
+
+  [[nodiscard]] auto hasChain(const string &chain) const -> bool;
+
+  /* rules of any chain jumping or going to chain */
+  [[nodiscard]] auto references(const string &chain) const -> size_t;
+
+  /* chains with a rule jumping or going to chain, in chain order */
+  [[nodiscard]] auto referrers(const string &chain) const -> vector<string>;
+
+  /* user chains no builtin chain reaches */
+  [[nodiscard]] auto unreachable() const -> vector<string>;
+
+  /* one cycle of jumps, first chain repeated at the end, or empty */
+  [[nodiscard]] auto findCycle() const -> vector<string>;
+
+  [[nodiscard]] auto hookCosts() const -> vector<HookCost>;
+
+private:
+  class Node {
+  public:
+    string name_;
+    bool builtin_{};
+    bool alive_{};
+    vector<GraphRule> rules_;
+    size_t refs_{};
+    uint64_t policy_pcnt_{};
+  };
+
+  /* ids stay valid while a chain exists, removed ids are not reused */
+  vector<Node> nodes_;
+  unordered_map<string, uint32_t> ids_;
+  unordered_set<string> stale_;
+
+  auto addNode(const string &chain, bool builtin) -> uint32_t;
+
+  /* read rules of chain, references to other chains are adjusted */
+  auto readRules(uint32_t id, struct iptc_handle *handle) -> void;
+
+  auto setRules(uint32_t id, vector<GraphRule> rules) -> void;
+
+  /* targets of rules of node, each once, in rule order */
+  [[nodiscard]] auto successors(const Node &node) const -> vector<uint32_t>;
+};
+
+#endif
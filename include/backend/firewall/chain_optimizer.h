@@ -0,0 +1,61 @@
+#ifndef CHAIN_OPTIMIZER_H
+#define CHAIN_OPTIMIZER_H
+
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/ruleset_model.h"
+#include "backend/firewall/table_compiler.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+using std::optional;
+using std::string;
+using std::vector;
+
+/**
+ * restructured chain, first entry of ruleset_ is the new content of the
+ * optimized chain and the others are user chains to be created
+ */
+class ChainPlan {
+public:
+  string chain_;
+  TableRuleset ruleset_;
+
+  /* rules evaluated until the matching rule, weighted by rule counters */
+  double before_avg_{};
+  double after_avg_{};
+
+  /* rules evaluated by a packet matching no rule on its longest path */
+  size_t before_worst_{};
+  size_t after_worst_{};
+
+  /* rules in all chains of the plan, dispatch rules included */
+  [[nodiscard]] auto ruleCount() const -> size_t;
+
+  [[nodiscard]] auto summary() const -> string;
+};
+
+/**
+ * Rewrite a flat builtin chain into a tree of user chains. Every node
+ * dispatches on iniface, protocol, a dst/src prefix bit or a dport range,
+ * each child gets the rules overlapping its region in original order and
+ * ends with the chain policy, so first-match semantics is kept for every
+ * packet. Rules matching packets outside all regions stay in the node.
+ */
+class ChainOptimizer {
+public:
+  /* chains with at most this many rules are not split further */
+  static constexpr size_t kLeafSize = 16;
+
+  /**
+   * plan for chain of model, nullopt with error in context if chain cannot
+   * be expressed by RuleRequest or no split makes it shorter
+   */
+  static auto plan(const RulesetModel &model, const string &chain,
+                   const ctx_t &context) -> optional<ChainPlan>;
+};
+
+#endif
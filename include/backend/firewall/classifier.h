@@ -0,0 +1,122 @@
+#ifndef CLASSIFIER_H
+#define CLASSIFIER_H
+
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using std::optional;
+using std::shared_ptr;
+using std::string;
+using std::string_view;
+using std::vector;
+
+/**
+ * header fields of a simulated packet, addresses in host byte order
+ */
+class PacketTuple {
+public:
+  uint32_t src_{};
+  uint32_t dst_{};
+  uint8_t proto_{};
+  uint16_t sport_{};
+  uint16_t dport_{};
+  string iniface_;
+  string outiface_;
+
+  /**
+   * "src dst proto sport dport [iniface [outiface]]", proto is tcp, udp or a
+   * number, "-" leaves an interface empty
+   */
+  static auto parse(string_view line) -> optional<PacketTuple>;
+};
+
+class ClassifyResult {
+public:
+  /* rows whose jump was taken, in order */
+  vector<uint32_t> jumps_;
+
+  /* row that decided the verdict, nullopt if policy or end of chain did */
+  optional<uint32_t> rule_;
+
+  /* verdict, index in RulesetModel::targets_, nullopt if packet returns
+   * from a user chain it started in */
+  optional<uint16_t> target_;
+
+  /* rows skipped because their matches cannot be simulated, or passed
+   * because their extension target is not known to end the traversal */
+  vector<uint32_t> uncertain_;
+};
+
+/**
+ * hit counts of a batch, rows count when they decide the verdict or jump,
+ * chains count when their policy decides
+ */
+class ClassifyHistogram {
+public:
+  vector<uint64_t> rule_hits_;
+  vector<uint64_t> policy_hits_;
+  uint64_t packets_{};
+  uint64_t invalid_lines_{};
+};
+
+/**
+ * Evaluates packets against a RulesetModel the way ipt_do_table does,
+ * following jumps and RETURN. Address, protocol and port columns of four
+ * rules are compared per step with vector instructions, candidates are then
+ * confirmed one by one for interfaces.
+ */
+class Classifier {
+public:
+  explicit Classifier(shared_ptr<const RulesetModel> model);
+
+  [[nodiscard]] auto classify(const PacketTuple &packet,
+                              uint32_t chain) const -> ClassifyResult;
+
+  /**
+   * classify every line of input starting at chain, invalid lines are
+   * counted and skipped
+   */
+  auto classifyBatch(std::istream &input, uint32_t chain) const
+      -> ClassifyHistogram;
+
+  [[nodiscard]] auto model() const -> const RulesetModel & { return *model_; }
+
+private:
+  /* interface ids matched by packet, indexed by id in ifaces_ */
+  class InterfaceMatch {
+  public:
+    string iniface_;
+    string outiface_;
+    vector<uint8_t> in_;
+    vector<uint8_t> out_;
+  };
+
+  shared_ptr<const RulesetModel> model_;
+
+  auto matchInterfaces(const PacketTuple &packet, InterfaceMatch &ifaces) const
+      -> void;
+
+  [[nodiscard]] auto classify(const PacketTuple &packet, uint32_t chain,
+                              const InterfaceMatch &ifaces) const
+      -> ClassifyResult;
+
+  /* first row in [begin, end) matching packet, end if none */
+  [[nodiscard]] auto firstMatch(const PacketTuple &packet,
+                                const InterfaceMatch &ifaces, uint32_t begin,
+                                uint32_t end,
+                                vector<uint32_t> &uncertain) const -> uint32_t;
+
+  [[nodiscard]] auto matchRow(const PacketTuple &packet,
+                              const InterfaceMatch &ifaces,
+                              uint32_t row) const -> bool;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef CONNTRACK_BYPASS_H
+#define CONNTRACK_BYPASS_H
+
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using std::optional;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+using PortRange = std::pair<uint16_t, uint16_t>;
+
+/**
+ * stateless service on this host, e.g. DNS or NTP, whose flows should skip
+ * connection tracking
+ */
+class BypassService {
+public:
+  /* RequestProto::TCP or UDP, RequestProto::ALL for both */
+  string proto_{RequestProto::UDP};
+
+  /* local ports of the service */
+  vector<PortRange> ports_;
+
+  /* local address of the service, any address if absent */
+  optional<string> addr_;
+  optional<string> mask_;
+
+  /* interface the service is reached on, any interface if absent */
+  optional<string> iface_;
+};
+
+class BypassRule {
+public:
+  string table_;
+  string chain_;
+
+  /**
+   * index_ is where the rule is inserted: the top of raw chains, in filter
+   * chains the rule accepting ESTABLISHED packets so that rules dropping
+   * packets before it keep doing so
+   */
+  shared_ptr<RuleRequest> rule_;
+
+  /* an equal rule is in the chain already, it is not inserted again */
+  bool present_{};
+
+  /* indices of DROP or REJECT rules after index_ matching some packets of
+   * rule, these packets are accepted before reaching them */
+  vector<int> shadowed_;
+
+  /* "  (present)" or the rules shadowed, empty if neither */
+  [[nodiscard]] auto note() const -> string;
+};
+
+class BypassPlan {
+public:
+  /* raw rules first, then the filter rules accepting the same packets */
+  vector<BypassRule> rules_;
+
+  /* rules not present yet */
+  [[nodiscard]] auto pending() const -> size_t;
+
+  [[nodiscard]] auto summary() const -> string;
+};
+
+/**
+ * Symmetric conntrack bypass of a service: CT --notrack for requests in
+ * raw/PREROUTING and for replies in raw/OUTPUT, and ACCEPT of the same
+ * packets in filter/INPUT and filter/OUTPUT. Untracked packets never match
+ * ESTABLISHED or RELATED, so without the filter rules a stateful ruleset
+ * would drop them; they take the place of the ESTABLISHED accept rule.
+ */
+class ConntrackBypass {
+public:
+  static const string kRawTable;
+  static const string kFilterTable;
+
+  /**
+   * "53,123,8000:8100", a range may also be written "8000-8100". nullopt
+   * if text is empty or malformed.
+   */
+  static auto parsePorts(std::string_view text) -> optional<vector<PortRange>>;
+
+  /**
+   * "a.b.c.d" or "a.b.c.d/len" into addr_ and mask_ of service, false if
+   * malformed
+   */
+  static auto parseAddress(std::string_view text,
+                           BypassService &service) -> bool;
+
+  /**
+   * rules of service at the top of their chains, none is present yet.
+   * Throws std::invalid_argument if service has no port or an unknown
+   * protocol.
+   */
+  static auto plan(const BypassService &service) -> BypassPlan;
+
+  /**
+   * rule matches the same packets as one of chain and has the same target,
+   * chain as decoded from the kernel
+   */
+  static auto isPresent(const RuleRequest &rule,
+                        std::span<const shared_ptr<RuleRequest>> chain)
+      -> bool;
+
+  /**
+   * indices of DROP or REJECT rules of chain in model at or after index_ of
+   * rule whose packets overlap those of rule. Rules with matches the model
+   * does not know are left out.
+   */
+  static auto shadowed(const RuleRequest &rule, const RulesetModel &model,
+                       uint32_t chain) -> vector<int>;
+};
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef COUNTER_SAMPLER_H
+#define COUNTER_SAMPLER_H
+
+#include <libiptc/libiptc.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using std::optional;
+using std::string;
+using std::vector;
+
+/**
+ * counters and rates of one rule over the sampling window
+ */
+class RuleRate {
+public:
+  string chain_;
+
+  /* position of rule in chain, as used by FirewallBackend */
+  int index_{};
+
+  /* packets and bytes per second */
+  double pps_{};
+  double bps_{};
+
+  /* counters of latest sample */
+  uint64_t pcnt_{};
+  uint64_t bcnt_{};
+};
+
+/**
+ * Periodic reader of the packet and byte counters of every rule in one
+ * table. Each sample is a single IPT_SO_GET_ENTRIES, no libiptc state is
+ * built. Rules are labeled only when the layout reported by IPT_SO_GET_INFO
+ * or the entries apart from their counters change, otherwise a sample only
+ * copies counters at known offsets into a ring buffer of the last history
+ * samples, from which rates are computed.
+ */
+class CounterSampler {
+public:
+  static constexpr size_t kHistory = 10;
+
+  explicit CounterSampler(string table, size_t history = kHistory);
+
+  /**
+   * read counters from kernel, errno is kept if failed. History is reset if
+   * the table layout changed since the last sample.
+   */
+  auto sample() -> bool;
+
+  [[nodiscard]] auto table() const -> const string & { return table_; }
+
+  [[nodiscard]] auto ruleCount() const -> size_t { return chains_.size(); }
+
+  /* samples in ring buffer */
+  [[nodiscard]] auto sampleCount() const -> size_t { return count_; }
+
+  /**
+   * rate of rule over the samples in ring buffer, zero rates with less than
+   * two samples. Counters going backwards (zeroed) count as no traffic.
+   */
+  [[nodiscard]] auto rate(size_t rule) const -> RuleRate;
+
+  /**
+   * n rules with highest packet rate, ties broken by packet counter
+   */
+  [[nodiscard]] auto topRules(size_t n) const -> vector<RuleRate>;
+
+  /**
+   * latest sample in Prometheus text exposition format
+   */
+  auto writePrometheus(std::ostream &output) const -> void;
+
+  /**
+   * write latest sample for the node_exporter textfile collector, the file is
+   * replaced atomically. Error message if failed.
+   */
+  auto writeTextfile(const string &path) const -> optional<string>;
+
+private:
+  string table_;
+  size_t history_;
+
+  /* layout and entries of table the labels refer to */
+  optional<struct ipt_getinfo> info_;
+  uint64_t digest_{};
+  vector<char> buffer_;
+
+  /* per rule, chain and position of rule and offset of its entry */
+  vector<string> chains_;
+  vector<int> indices_;
+  vector<uint32_t> offsets_;
+
+  /* ring buffer, counters of slot s are at [s * ruleCount(), ...) */
+  vector<std::chrono::steady_clock::time_point> times_;
+  vector<uint64_t> pcnt_;
+  vector<uint64_t> bcnt_;
+  size_t head_{};
+  size_t count_{};
+
+  auto relabel(const struct ipt_get_entries &entries) -> void;
+
+  /* slot of sample taken age samples before the latest one */
+  [[nodiscard]] auto slot(size_t age) const -> size_t;
+};
+
+#endif
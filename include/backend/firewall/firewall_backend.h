@@ -4,32 +4,120 @@
 #include "iptables.h"
 #include "libiptc/libiptc.h"
 
-#include "backend/config_backend_base.h"
+#include "backend/firewall/bpf_compiler.h"
+#include "backend/firewall/chain_graph.h"
+#include "backend/firewall/chain_optimizer.h"
 #include "backend/firewall/chain_request.h"
+#include "backend/firewall/conntrack_bypass.h"
+#include "backend/firewall/counter_sampler.h"
 #include "backend/firewall/firewall_context.h"
+#include "backend/firewall/kernel_table.h"
+#include "backend/firewall/rule_compactor.h"
+#include "backend/firewall/rule_backend.h"
+#include "backend/firewall/rule_query.h"
+#include "backend/firewall/rule_reorderer.h"
 #include "backend/firewall/rule_request.h"
+#include "backend/firewall/rule_search.h"
+#include "backend/firewall/ruleset_model.h"
+#include "backend/firewall/save_format.h"
+#include "backend/firewall/set_converter.h"
+#include "backend/firewall/shadow_analyzer.h"
+#include "backend/firewall/table_compiler.h"
+#include "backend/firewall/xtables_lock.h"
+#include "fmt/format.h"
 #include "tools/log.h"
 #include "tools/sys.h"
 
 #include <bits/ranges_algo.h>
+#include <chrono>
 #include <functional>
+#include <istream>
 #include <memory>
+#include <optional>
+#include <ostream>
+#include <span>
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 using std::array;
 using std::function;
+using std::optional;
 using std::ostringstream;
 using std::shared_ptr;
 using std::string;
 using std::stringstream;
+using std::unique_ptr;
 using std::unordered_map;
+using std::unordered_set;
 using std::vector;
 
-class FirewallBackend : public ConfigBackendBase {
+/**
+ * result of batch operation, error message of each item or nullopt if the
+ * item succeeded
+ */
+using BatchResult = vector<optional<string>>;
+
+/**
+ * statistics of loading one iptables table from kernel
+ */
+class TableLoadStat {
+public:
+  std::chrono::microseconds load_time_{};
+  int load_count_{};
+};
+
+/**
+ * commit attempts and contention on the xtables lock since backend creation
+ */
+class CommitStat {
+public:
+  int commits_{};
+  int failures_{};
+
+  /* commits that found the lock held by another program */
+  int contended_{};
+  int lock_timeouts_{};
+
+  /* iptc_commit retried after a transient error */
+  int retries_{};
+
+  std::chrono::microseconds lock_wait_{};
+  std::chrono::microseconds max_lock_wait_{};
+};
+
+/**
+ * chains of one table as they were before a multi-step edit, so that a
+ * failed edit is undone without losing earlier uncommitted changes
+ */
+class ChainSnapshot {
+public:
+  class Chain {
+  public:
+    string name_;
+
+    /* policy of builtin chain */
+    optional<string> policy_;
+    struct ipt_counters policy_counters_ {};
+
+    /* entries as iptc_append_entry takes them, see copyEntry() */
+    vector<vector<char>> entries_;
+  };
+
+  string table_;
+  bool dirty_{};
+
+  /* every chain of the table, chains created since are deleted on restore */
+  vector<string> chain_names_;
+
+  /* chains whose rules and policy are restored */
+  vector<Chain> chains_;
+};
+
+class FirewallBackend : public RuleBackend {
 public:
   FirewallBackend();
 
@@ -40,46 +128,405 @@ public:
    */
   auto apply() -> function<bool()>;
 
+  /*
+   * commit all modified tables. libiptc commits table by table, tables
+   * committed before a failing one stay committed and are no longer pending.
+   */
+  auto commit() -> bool override;
+
+  /*
+   * reason the last commit failed, e.g. lock timeout or table changed
+   */
+  [[nodiscard]] auto lastCommitError() const -> string override;
+
+  [[nodiscard]] auto getCommitStat() const -> const CommitStat & {
+    return commit_stat_;
+  }
+
+  /*
+   * libiptc replaces whole table on commit, cost is rules in dirty tables
+   */
+  auto estimateCommitCost() -> size_t override;
+
+  /*
+   * scope ("table/chain") is pending while its table is dirty
+   */
+  [[nodiscard]] auto isPending(const string &scope) const -> bool override;
+
+  /*
+   * tables without pending scope ("table/chain") are no longer committed,
+   * unless changes outside the journal keep their handle apart from kernel
+   */
+  auto settle(const vector<string> &pending_scopes) -> void override;
+
   /*
    * get all firewall tables statically
    */
   static auto getTableNames() -> vector<string>;
 
-  static auto createContext(const ctx_t &current, const string &name) -> ctx_t;
-
-  auto getFirewallChildren(const ctx_t &context) -> vector<string>;
+  auto getFirewallChildren(const ctx_t &context) -> vector<string> override;
 
-  auto getRuleDetails(const ctx_t &context, int index) -> string;
+  auto getRuleDetails(const ctx_t &context, int index) -> string override;
 
-  auto removeChain(const ctx_t &context) -> bool;
+  auto removeChain(const ctx_t &context) -> bool override;
 
   auto insertChain(const ctx_t &context,
-                   const shared_ptr<ChainRequest> &request) -> bool;
+                   const shared_ptr<ChainRequest> &request) -> bool override;
 
-  auto removeRule(const ctx_t &context, int index) -> bool;
+  auto removeRule(const ctx_t &context, int index) -> bool override;
 
   auto insertRule(const ctx_t &context,
-                  const shared_ptr<RuleRequest> &request) -> bool;
+                  const shared_ptr<RuleRequest> &request) -> bool override;
 
   auto updateRule(const ctx_t &context,
-                  const shared_ptr<RuleRequest> &request) -> bool;
+                  const shared_ptr<RuleRequest> &request) -> bool override;
+
+  auto getRule(const ctx_t &context,
+               int index) -> shared_ptr<RuleRequest> override;
+
+  auto getRuleCount(const ctx_t &context) -> int override;
+
+  /**
+   * Batch mutation over chain in context. All entries are encoded into one
+   * buffer, indices of requests refer to the chain before the batch, and
+   * requests with same index are kept in request order.
+   */
+  auto insertRules(const ctx_t &context,
+                   std::span<const shared_ptr<RuleRequest>> requests)
+      -> BatchResult;
+
+  /**
+   * append requests to chain in context in request order, indices of requests
+   * are ignored. Unlike insertRules the chain is not walked to count its
+   * rules, so bulk loads stay linear.
+   */
+  auto appendRules(const ctx_t &context,
+                   std::span<const shared_ptr<RuleRequest>> requests)
+      -> BatchResult;
 
-  auto getRule(const ctx_t &context, int index) -> shared_ptr<RuleRequest>;
+  auto removeRules(const ctx_t &context,
+                   std::span<const int> indices) -> BatchResult;
+
+  auto replaceRules(const ctx_t &context,
+                    std::span<const shared_ptr<RuleRequest>> requests)
+      -> BatchResult;
+
+  /**
+   * Rewrite chain in context with its entries in given order, order[i] is
+   * the current index of the rule placed at i. Entries are copied as they
+   * are, so matches, targets and counters are kept.
+   */
+  auto reorderRules(const ctx_t &context, std::span<const int> order) -> bool;
+
+  /**
+   * Replace whole table with ruleset by a single IPT_SO_SET_REPLACE, for bulk
+   * loads. Uncommitted libiptc changes of the table are discarded.
+   */
+  auto replaceTable(const ctx_t &context, const TableRuleset &ruleset) -> bool;
+
+  /**
+   * remove all rules and user chains of table in context
+   */
+  auto flushTable(const ctx_t &context) -> bool;
+
+  auto setChainPolicy(const ctx_t &context, const string &policy) -> bool;
+
+  /**
+   * Load iptables-save text like iptables-restore, every table in input is
+   * flushed and rebuilt with batched inserts. Nothing is committed, on error
+   * the touched tables are restored as they were before the import.
+   */
+  auto importRuleset(std::istream &input) -> optional<string>;
+
+  /**
+   * write table in context, or all loadable tables at overall level, in
+   * iptables-save format, returns number of rules that cannot be expressed
+   */
+  auto exportRuleset(std::ostream &output, const ctx_t &context) -> size_t;
+
+  /**
+   * columnar model of table in context, decoded once and shared until the
+   * table is modified or reloaded. nullptr with error in context if the
+   * table cannot be loaded.
+   */
+  auto getRulesetModel(const ctx_t &context) -> shared_ptr<const RulesetModel>;
+
+  /**
+   * Chains changed since the last search are indexed again first, tables
+   * changed outside since they were indexed are reloaded and indexed again.
+   */
+  auto searchRules(const string &query,
+                   size_t limit) -> vector<SearchHit> override;
+
+  /**
+   * stream rules of all tables matching query (see RuleQuery) to sink,
+   * tables the query excludes are not loaded. Throws std::invalid_argument
+   * on malformed query.
+   */
+  auto queryRules(const string &query,
+                  const RuleQuery::Sink &sink) -> QueryStat;
+
+  /**
+   * shadowed, redundant and correlated rules of chain in context, rows of
+   * the report refer to getRulesetModel(context). nullopt with error in
+   * context if the chain cannot be loaded, as for the plans below.
+   */
+  auto analyzeChain(const ctx_t &context) -> optional<ShadowReport>;
+
+  /**
+   * decision-tree restructuring of chain in context, nothing is modified,
+   * nullopt with error in context if the chain cannot be optimized
+   */
+  auto planOptimization(const ctx_t &context) -> optional<ChainPlan>;
+
+  /**
+   * create the user chains of plan and replace content of the chain, on
+   * error the chain is restored and the created chains are deleted
+   */
+  auto applyOptimization(const ctx_t &context, const ChainPlan &plan) -> bool;
+
+  /**
+   * rules of chain in context that merge into adjacent CIDR blocks or port
+   * ranges, nothing is modified
+   */
+  auto planCompaction(const ctx_t &context) -> optional<CompactionPlan>;
+
+  /**
+   * replace widened rules and remove merged ones with batch operations, on
+   * error the chain is restored
+   */
+  auto applyCompaction(const ctx_t &context,
+                       const CompactionPlan &plan) -> bool;
+
+  /**
+   * families of rules of chain in context that fold into set lookups, see
+   * SetConverter, nothing is modified
+   */
+  auto planSetConversion(const ctx_t &context,
+                         size_t min_members = SetConverter::kMinMembers)
+      -> optional<SetPlan>;
+
+  /**
+   * create the sets of plan, taking a free name for each, then replace the
+   * first member of each family with its set rule and remove the others.
+   * Sets exist in the kernel right away, rules only after commit. On error
+   * the created sets are destroyed and the chain is restored.
+   */
+  auto applySetConversion(const ctx_t &context, const SetPlan &plan) -> bool;
+
+  /**
+   * runs of rules of chain in context that compile into bpf matches, see
+   * BpfCompiler, nothing is modified
+   */
+  auto planBpfCompilation(const ctx_t &context,
+                          size_t min_members = BpfCompiler::kMinMembers)
+      -> optional<BpfPlan>;
+
+  /**
+   * verify plan on BpfCompiler::kVerifyPackets packets, then replace the
+   * first member of each run with its bpf rule and remove the others. Fails
+   * without changes if a packet gets another verdict, on other errors the
+   * chain is restored.
+   */
+  auto applyBpfCompilation(const ctx_t &context, const BpfPlan &plan) -> bool;
+
+  /**
+   * raw and filter rules bypassing conntrack for service, see
+   * ConntrackBypass, rules already in their chain are marked present.
+   * Filter rules are placed at the rule accepting ESTABLISHED packets, the
+   * top of the chain without one, with the DROP and REJECT rules they
+   * shadow. Nothing is modified.
+   */
+  auto planConntrackBypass(const BypassService &service) -> BypassPlan;
+
+  /**
+   * insert rules of plan that are not present at their planned index, error
+   * is set in context. On error the chains of plan are restored.
+   */
+  auto applyConntrackBypass(const ctx_t &context,
+                            const BypassPlan &plan) -> bool;
+
+  /**
+   * counter-guided order of chain in context, see RuleReorderer
+   */
+  auto planReorder(const ctx_t &context) -> optional<ReorderPlan>;
+
+  /**
+   * jumps between chains of table in context, built on first use and then
+   * kept up to date chain by chain as the table is modified. nullptr with
+   * error in context if the table cannot be loaded.
+   */
+  auto getChainGraph(const ctx_t &context) -> const ChainGraph *;
+
+  /**
+   * counter sampler of table in context, created on first use and kept so
+   * that its history survives across calls
+   */
+  auto getCounterSampler(const ctx_t &context) -> shared_ptr<CounterSampler>;
+
+  /**
+   * append rule description to buffer, the buffer can be reused across rules
+   * so that no allocation happens once it has grown
+   */
+  static auto serializeRule(iptc_handle *handle, const struct ipt_entry *rule,
+                            fmt::memory_buffer &buffer) -> void;
+
+  static auto serializeShortRule(iptc_handle *handle,
+                                 const struct ipt_entry *rule,
+                                 fmt::memory_buffer &buffer) -> void;
+
+  /**
+   * true if the handle of table in context was loaded and the table in kernel
+   * changed since, cached rules and models of the table are outdated then.
+   * Costs one IPT_SO_GET_INFO.
+   */
+  auto isStale(const ctx_t &context) -> bool;
+
+  /**
+   * drop cached state of table in context if it is stale and has no
+   * uncommitted change, true if dropped. It is loaded again on next access.
+   */
+  auto reloadIfStale(const ctx_t &context) -> bool override;
+
+  auto reloadTable(const ctx_t &context) -> void override;
+
+  /*
+   * load statistic of table, nullopt if table has never been loaded
+   */
+  auto getTableLoadStat(const string &table) const -> optional<TableLoadStat>;
 
 private:
+  /* handles are materialized on first access, see getHandle() */
   unordered_map<string, struct iptc_handle *> handles_;
+  unordered_map<string, TableLoadStat> load_stats_;
+
+  /* kernel layout of table when its handle was loaded */
+  unordered_map<string, TableFingerprint> fingerprints_;
+
+  CommitStat commit_stat_;
+  string last_commit_error_;
+
+  /**
+   * take the xtables lock like iptables does, contention is recorded in
+   * commit_stat_ and error in last_commit_error_ if it cannot be taken
+   */
+  auto lockXtables() -> unique_ptr<XtablesLock>;
+
+  /* iptc_commit of one table, transient errors are retried while the table
+   * in kernel is still the one the handle was loaded from. EAGAIN means it
+   * was replaced meanwhile and fails like a stale table */
+  auto commitTable(const string &table) -> bool;
+
+  /* tables modified since last commit, only these are committed */
+  unordered_set<string> dirty_tables_;
+
+  /**
+   * ipsets created for uncommitted set conversions by table. Rules can only
+   * refer to existing sets, so they are created before the commit and
+   * destroyed again when the changes of their table are discarded.
+   */
+  unordered_map<string, vector<string>> created_sets_;
+
+  auto destroyCreatedSets(const string &table) -> void;
+
+  /* loaded handle of table holds the same chains, policies and rules as
+   * the kernel table, counters aside */
+  auto matchesKernel(const string &table) -> bool;
 
   auto getChains(const ctx_t &context) -> vector<string>;
 
-  auto getRules(const ctx_t &context) -> vector<const struct ipt_entry *>;
+  unordered_map<string, shared_ptr<const RulesetModel>> models_;
+
+  unordered_map<string, shared_ptr<CounterSampler>> samplers_;
+
+  unordered_map<string, ChainGraph> graphs_;
+
+  RuleSearchIndex search_index_;
+
+  /* kernel layout of each table the search index holds */
+  unordered_map<string, TableFingerprint> indexed_fingerprints_;
+
+  /* model of table, throws like getHandle() */
+  auto loadModel(const string &table) -> shared_ptr<const RulesetModel>;
+
+  /* model of table in context and index of its chain in it, throws
+   * std::out_of_range if the chain is not in the table */
+  auto loadChain(const ctx_t &context)
+      -> std::pair<shared_ptr<const RulesetModel>, uint32_t>;
+
+  /* rule entries of each chain by table, built once per handle generation */
+  unordered_map<string, unordered_map<string, vector<const struct ipt_entry *>>>
+      rule_cache_;
+
+  /**
+   * entries of chain in context, the result is cached until chain modified
+   */
+  auto getRules(const ctx_t &context)
+      -> const vector<const struct ipt_entry *> &;
+
+  auto getRuleEntry(const ctx_t &context,
+                    int index) -> const struct ipt_entry *;
+
+  auto invalidateChain(const string &table, const string &chain) -> void;
+
+  /**
+   * get handle of table, iptc_init is called on first access of each table
+   */
+  auto getHandle(const string &table) -> struct iptc_handle *;
+
+  /**
+   * handle of table in context, nullptr with error in context if it cannot
+   * be loaded. Used by the RuleBackend operations, which must not throw.
+   */
+  auto findHandle(const ctx_t &context) -> struct iptc_handle *;
 
   /**
    * iptc handlers need freshed after committing
    */
-  auto createHandlers() -> bool;
+  auto createHandler(const string &table) -> bool;
+
+  auto destroyHandler(const string &table) -> void;
+
+  /* free handle and caches built from it, search index is kept */
+  auto releaseHandler(const string &table) -> void;
 
   auto destroyHandlers() -> bool;
 
+  auto markDirty(const string &table) -> void;
+
+  /**
+   * copy of entry for iptc_append_entry. libiptc keeps standard targets and
+   * jumps as verdicts with an empty name, which it would map back to a
+   * fallthrough, so the real target name is written into the copy.
+   */
+  static auto copyEntry(struct iptc_handle *handle,
+                        const struct ipt_entry *entry) -> vector<char>;
+
+  /**
+   * save rules and policies of chains of table in context before editing
+   * them, nullopt with error in context if the table cannot be loaded
+   */
+  auto snapshotChains(const ctx_t &context, std::span<const string> chains)
+      -> optional<ChainSnapshot>;
+
+  /**
+   * put chains of snapshot back as they were and delete user chains created
+   * since, the table is as dirty as it was. Only if that fails too the
+   * uncommitted changes of the table are discarded. Nothing to do if the
+   * handle was discarded meanwhile.
+   */
+  auto restoreChains(const ChainSnapshot &snapshot) -> void;
+
+  /**
+   * encode requests into one buffer, returns offset of each entry, or nullopt
+   * with error in result if the request cannot be encoded. Jump targets are
+   * looked up in handle.
+   */
+  static auto encodeRules(const ctx_t &context, struct iptc_handle *handle,
+                          std::span<const shared_ptr<RuleRequest>> requests,
+                          vector<char> &buffer, BatchResult &result)
+      -> vector<optional<size_t>>;
+
   /* tool func for iptable rules */
   static auto serializeRule(iptc_handle *handle,
                             const struct ipt_entry *rule) -> string;
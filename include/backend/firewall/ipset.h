@@ -0,0 +1,76 @@
+#ifndef IPSET_H
+#define IPSET_H
+
+#include "backend/firewall/firewall_context.h"
+
+#include <linux/netfilter/ipset/ip_set.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::optional;
+using std::string;
+using std::vector;
+
+/**
+ * what the members of a set are, decides the ipset type
+ */
+enum class SetKind : uint8_t {
+  NET, /* hash:net, IPv4 address ranges */
+  PORT /* bitmap:port, port ranges, matched for tcp and udp */
+};
+
+/**
+ * closed range of addresses or ports in host byte order
+ */
+using SetRange = std::pair<uint32_t, uint32_t>;
+
+class SetRequest {
+public:
+  string name_;
+  SetKind kind_{SetKind::NET};
+
+  /* may overlap, they are merged before loading */
+  vector<SetRange> members_;
+};
+
+/**
+ * ipset sets of the current network namespace, spoken on a
+ * NETLINK_NETFILTER socket like the ipset tool does. Set indices for the
+ * iptables set match are resolved over SO_IP_SET like libxt_set does.
+ */
+class Ipset {
+public:
+  /* longest set name, without the terminating NUL */
+  static constexpr size_t kMaxNameLen = IPSET_MAXNAMELEN - 1;
+
+  /**
+   * create set and add its members in bulk, a few thousand per message.
+   * Fails with EEXIST in context if a set of the name exists, a set that
+   * cannot be filled is destroyed again.
+   */
+  static auto create(const ctx_t &context, const SetRequest &request) -> bool;
+
+  /* fails if the set is still referenced by a rule */
+  static auto destroy(const string &name) -> bool;
+
+  /* kernel index of set for the set match, nullopt if there is no such set */
+  static auto indexOf(const string &name) -> optional<uint16_t>;
+
+  static auto nameOf(uint16_t index) -> optional<string>;
+
+  /**
+   * members as the kernel lists them, i.e. CIDR blocks of hash:net and
+   * single ports of bitmap:port, nullopt if the set cannot be listed
+   */
+  static auto list(const string &name) -> optional<vector<SetRange>>;
+
+  /* sorted, overlapping and adjacent ranges joined */
+  static auto mergeRanges(vector<SetRange> ranges) -> vector<SetRange>;
+};
+
+#endif
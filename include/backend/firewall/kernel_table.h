@@ -0,0 +1,91 @@
+#ifndef KERNEL_TABLE_H
+#define KERNEL_TABLE_H
+
+#include <libiptc/libiptc.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+using std::array;
+using std::optional;
+using std::string;
+using std::vector;
+
+/**
+ * Layout of a table as reported by IPT_SO_GET_INFO. Any change of the rules
+ * moves entries, so a different fingerprint means the table was replaced.
+ * Replacing a rule by one of the same size keeps the fingerprint, and the
+ * kernel rejects a replace whose entry count is outdated with EAGAIN.
+ */
+class TableFingerprint {
+public:
+  uint32_t valid_hooks_{};
+  uint32_t num_entries_{};
+  uint32_t size_{};
+  array<uint32_t, NF_INET_NUMHOOKS> hook_entry_{};
+  array<uint32_t, NF_INET_NUMHOOKS> underflow_{};
+
+  static auto from(const struct ipt_getinfo &info) -> TableFingerprint;
+
+  auto operator==(const TableFingerprint &) const -> bool = default;
+};
+
+/**
+ * Direct access to iptables tables through the kernel sockopt interface,
+ * without building libiptc state.
+ */
+class KernelTable {
+public:
+  /**
+   * name of builtin chain attached to each netfilter hook
+   */
+  static auto hookNames() -> const array<string, NF_INET_NUMHOOKS> &;
+
+  /**
+   * IPT_SO_GET_INFO of table, errno is kept if failed
+   */
+  static auto getInfo(const string &table) -> optional<struct ipt_getinfo>;
+
+  /**
+   * fingerprint of table currently in kernel, errno is kept if failed
+   */
+  static auto fingerprint(const string &table) -> optional<TableFingerprint>;
+
+  /**
+   * IPT_SO_GET_ENTRIES of table described by info into buffer, which is
+   * grown as needed and can be reused across calls. Returns entries inside
+   * buffer, nullptr with errno kept if failed (EAGAIN if the table changed
+   * size since info was read).
+   */
+  static auto getEntries(const struct ipt_getinfo &info, vector<char> &buffer)
+      -> struct ipt_get_entries *;
+
+  /**
+   * IPT_SO_SET_REPLACE with a complete table blob of given size (header
+   * included), errno is kept if failed
+   */
+  static auto replace(struct ipt_replace *blob, size_t size) -> bool;
+
+private:
+  /* RAII raw socket used for iptables sockopts */
+  class Socket {
+  public:
+    Socket();
+    ~Socket();
+
+    Socket(const Socket &) = delete;
+    auto operator=(const Socket &) -> Socket & = delete;
+
+    [[nodiscard]] auto fd() const -> int { return fd_; }
+
+  private:
+    int fd_;
+  };
+};
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef NFT_BACKEND_H
+#define NFT_BACKEND_H
+
+#include "backend/firewall/chain_request.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/nft_netlink.h"
+#include "backend/firewall/rule_backend.h"
+#include "backend/firewall/rule_request.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using std::optional;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+/**
+ * transactions sent by NftBackend since its creation
+ */
+class NftCommitStat {
+public:
+  int commits_{};
+  int failures_{};
+
+  /* netlink messages in the last transaction, batch markers excluded */
+  size_t last_messages_{};
+
+  std::chrono::microseconds last_latency_{};
+  std::chrono::microseconds max_latency_{};
+};
+
+/**
+ * Firewall backend over nf_tables (family ip), spoken directly on a
+ * NETLINK_NETFILTER socket. Tables are dumped once on first access and then
+ * edited in memory. A commit sends one batch with only the changes: new
+ * rules are positioned by the handle of the rule they precede, removed and
+ * updated rules are addressed by handle, so the batch does not grow with
+ * the ruleset. The batch carries the ruleset
+ * generation the cache was read at, the kernel refuses it if another
+ * program changed the ruleset since.
+ *
+ * Only rules made of what RuleRequest expresses can be edited, other rules
+ * in kernel are listed and can be removed.
+ */
+class NftBackend : public RuleBackend {
+public:
+  NftBackend();
+
+  ~NftBackend() override;
+
+  auto commit() -> bool override;
+
+  [[nodiscard]] auto lastCommitError() const -> string override;
+
+  /* netlink messages the next commit sends */
+  auto estimateCommitCost() -> size_t override;
+
+  [[nodiscard]] auto getCommitStat() const -> const NftCommitStat & {
+    return commit_stat_;
+  }
+
+  auto getFirewallChildren(const ctx_t &context) -> vector<string> override;
+
+  auto getRuleDetails(const ctx_t &context, int index) -> string override;
+
+  auto removeChain(const ctx_t &context) -> bool override;
+
+  /* regular chain, see insertBaseChain() for chains attached to a hook */
+  auto insertChain(const ctx_t &context,
+                   const shared_ptr<ChainRequest> &request) -> bool override;
+
+  auto removeRule(const ctx_t &context, int index) -> bool override;
+
+  auto insertRule(const ctx_t &context,
+                  const shared_ptr<RuleRequest> &request) -> bool override;
+
+  auto updateRule(const ctx_t &context,
+                  const shared_ptr<RuleRequest> &request) -> bool override;
+
+  /* nullptr if the rule has expressions RuleRequest cannot describe */
+  auto getRule(const ctx_t &context,
+               int index) -> shared_ptr<RuleRequest> override;
+
+  auto getRuleCount(const ctx_t &context) -> int override;
+
+  auto reloadIfStale(const ctx_t &context) -> bool override;
+
+  auto reloadTable(const ctx_t &context) -> void override;
+
+  /**
+   * new table of family ip, context is at overall level
+   */
+  auto insertTable(const ctx_t &context, const string &table) -> bool;
+
+  /**
+   * new filter chain of table in context attached to hook, named like the
+   * iptables builtin chains (INPUT, OUTPUT, ...)
+   */
+  auto insertBaseChain(const ctx_t &context,
+                       const shared_ptr<ChainRequest> &request,
+                       const string &hook, int priority,
+                       const string &policy) -> bool;
+
+  /**
+   * kernel handle of rule, nullopt if the rule is not committed yet
+   */
+  auto getRuleHandle(const ctx_t &context, int index) -> optional<uint64_t>;
+
+  /**
+   * discard uncommitted changes and cached state of all tables
+   */
+  auto reload() -> void;
+
+private:
+  class Rule {
+  public:
+    enum class State : uint8_t { KERNEL, ADDED, REPLACED };
+
+    State state_{State::KERNEL};
+
+    /* kernel handle, 0 until the rule is committed */
+    uint64_t handle_{};
+
+    shared_ptr<RuleRequest> request_;
+
+    /* expressions as listed when request_ cannot describe them */
+    string expressions_;
+
+    uint64_t packets_{};
+    uint64_t bytes_{};
+  };
+
+  class Chain {
+  public:
+    string name_;
+    optional<uint32_t> hook_;
+    int32_t priority_{};
+    uint32_t policy_{};
+    bool added_{};
+
+    vector<Rule> rules_;
+
+    /* handles of removed rules, deleted on commit */
+    vector<uint64_t> removed_;
+    bool dirty_{};
+  };
+
+  class Table {
+  public:
+    string name_;
+    bool added_{};
+    vector<Chain> chains_;
+
+    /* chains in kernel removed since last commit */
+    vector<string> removed_chains_;
+  };
+
+  unique_ptr<NftSocket> socket_;
+
+  /* tables of family ip in kernel order, rules are loaded on first access */
+  optional<vector<string>> table_names_;
+  unordered_map<string, Table> tables_;
+
+  /* ruleset generation the cached tables were read at, 0 if none */
+  uint32_t genid_{};
+
+  NftCommitStat commit_stat_;
+  string last_commit_error_;
+
+  /* messages of the batch being committed, by seq */
+  unordered_map<uint32_t, string> scopes_;
+  unordered_map<uint32_t, Rule *> echoes_;
+
+  auto getSocket() -> NftSocket &;
+
+  auto getGeneration() -> optional<uint32_t>;
+
+  /* drop cached tables if the ruleset changed and nothing is pending */
+  auto syncGeneration() -> bool;
+
+  [[nodiscard]] auto pendingMessages() const -> size_t;
+
+  auto getTableNames() -> const vector<string> &;
+
+  /* table is loaded from kernel on first access, nullptr if absent */
+  auto getTable(const ctx_t &context) -> Table *;
+
+  auto getChain(const ctx_t &context) -> Chain *;
+
+  auto loadTable(const string &name, Table &table) -> bool;
+
+  auto getRuleAt(const ctx_t &context, int index) -> Rule *;
+
+  /**
+   * one batch of all pending changes, returns seq of the batch begin and of
+   * the last change. scopes_ describes each message for errors, echoes_
+   * the added rules whose handle the kernel sends back.
+   */
+  auto buildBatch(NlBuilder &batch) -> std::pair<uint32_t, uint32_t>;
+
+  auto markCommitted() -> void;
+
+  static auto describeRule(const Rule &rule) -> string;
+};
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef NFT_NETLINK_H
+#define NFT_NETLINK_H
+
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using std::function;
+using std::optional;
+using std::string;
+using std::string_view;
+using std::vector;
+
+/**
+ * attribute inside a received message, integer values of nf_tables
+ * attributes are in network byte order and converted by the accessors
+ */
+class NlAttr {
+public:
+  uint16_t type_{};
+  std::span<const uint8_t> data_;
+
+  [[nodiscard]] auto present() const -> bool { return data_.data() != nullptr; }
+
+  [[nodiscard]] auto u8() const -> uint8_t;
+
+  [[nodiscard]] auto u16() const -> uint16_t;
+
+  [[nodiscard]] auto u32() const -> uint32_t;
+
+  [[nodiscard]] auto u64() const -> uint64_t;
+
+  /* up to the terminating NUL */
+  [[nodiscard]] auto str() const -> string;
+
+  /* nested attributes indexed by type, absent ones are not present() */
+  [[nodiscard]] auto nested(size_t max) const -> vector<NlAttr>;
+
+  /* nested attributes in order, e.g. the elements of NFTA_*_EXPRESSIONS */
+  [[nodiscard]] auto list() const -> vector<NlAttr>;
+
+  /* attributes of an nfnetlink message, after its nfgenmsg */
+  static auto parse(const struct nlmsghdr *msg, size_t max) -> vector<NlAttr>;
+};
+
+/**
+ * Netlink messages written back to back into one buffer, so a whole batch
+ * goes to the kernel with a single send. Nests are closed in reverse order
+ * of opening.
+ */
+class NlBuilder {
+public:
+  /* message with nfgenmsg header, closed by end() */
+  auto begin(uint16_t type, uint16_t flags, uint32_t seq, uint8_t family,
+             uint16_t res_id = 0) -> void;
+
+  auto end() -> void;
+
+  /* add flags to the message begun last, e.g. NLM_F_ACK once it is known
+   * to be the last one of a batch */
+  auto addFlags(uint16_t flags) -> void;
+
+  auto put(uint16_t type, const void *data, size_t len) -> void;
+
+  /* value is written in network byte order */
+  auto putU32(uint16_t type, uint32_t value) -> void;
+
+  auto putU64(uint16_t type, uint64_t value) -> void;
+
+  /* NUL terminated */
+  auto putStr(uint16_t type, string_view value) -> void;
+
+  /* returns offset to be passed to endNest() */
+  auto nest(uint16_t type) -> size_t;
+
+  auto endNest(size_t offset) -> void;
+
+  [[nodiscard]] auto data() const -> std::span<const uint8_t> {
+    return buffer_;
+  }
+
+  [[nodiscard]] auto messages() const -> size_t { return messages_; }
+
+  auto clear() -> void;
+
+private:
+  vector<uint8_t> buffer_;
+  size_t message_{};
+  size_t messages_{};
+
+  auto reserve(size_t len) -> uint8_t *;
+};
+
+/**
+ * error of one message of a batch, seq of the batch begin message if the
+ * whole batch was refused
+ */
+class NlError {
+public:
+  uint32_t seq_;
+  int error_;
+};
+
+/**
+ * RAII NETLINK_NETFILTER socket, errno is kept if a call failed
+ */
+class NftSocket {
+public:
+  using Handler = function<void(const struct nlmsghdr *)>;
+
+  NftSocket();
+  ~NftSocket();
+
+  NftSocket(const NftSocket &) = delete;
+  auto operator=(const NftSocket &) -> NftSocket & = delete;
+
+  [[nodiscard]] auto valid() const -> bool { return fd_ >= 0; }
+
+  auto nextSeq() -> uint32_t { return seq_++; }
+
+  /**
+   * send request (a dump or a message with NLM_F_ACK) and pass every reply
+   * to handler until NLMSG_DONE or the ack. False if failed, errno is the
+   * error the kernel replied, or EINTR if the dump was interrupted by a
+   * concurrent change.
+   */
+  auto request(const NlBuilder &request, const Handler &handler) -> bool;
+
+  /**
+   * send batch and wait until the message with seq last is acked, only it
+   * needs NLM_F_ACK since failed messages are always reported. Replies that
+   * are not errors, e.g. echoed rules, are passed to handler. Returns the
+   * errors of the batch, nullopt with errno kept if the socket failed.
+   */
+  auto transact(const NlBuilder &batch, uint32_t first, uint32_t last,
+                const Handler &handler) -> optional<vector<NlError>>;
+
+private:
+  int fd_;
+  uint32_t seq_;
+  vector<uint8_t> buffer_;
+
+  /* handler returns false once the last expected reply was seen */
+  auto receive(const function<bool(const struct nlmsghdr *)> &handler)
+      -> bool;
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef RULE_BACKEND_H
+#define RULE_BACKEND_H
+
+#include "backend/config_backend_base.h"
+#include "backend/firewall/chain_request.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/rule_search.h"
+#include "tools/log.h"
+
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+/**
+ * Context, children and rule operations every firewall backend offers, so
+ * pages can browse and edit rules without knowing whether they are kept by
+ * legacy iptables or by nf_tables. Rule indices are 0 based, an insert at
+ * an index past the end of the chain appends.
+ */
+class RuleBackend : public ConfigBackendBase {
+public:
+  /* context one level below current, named table or chain */
+  static auto createContext(const ctx_t &current, const string &name) -> ctx_t;
+
+  /* tables, chains of table or short description of rules of chain */
+  virtual auto getFirewallChildren(const ctx_t &context) -> vector<string> = 0;
+
+  virtual auto getRuleDetails(const ctx_t &context, int index) -> string = 0;
+
+  virtual auto removeChain(const ctx_t &context) -> bool = 0;
+
+  virtual auto insertChain(const ctx_t &context,
+                           const shared_ptr<ChainRequest> &request) -> bool = 0;
+
+  virtual auto removeRule(const ctx_t &context, int index) -> bool = 0;
+
+  virtual auto insertRule(const ctx_t &context,
+                          const shared_ptr<RuleRequest> &request) -> bool = 0;
+
+  virtual auto updateRule(const ctx_t &context,
+                          const shared_ptr<RuleRequest> &request) -> bool = 0;
+
+  virtual auto getRule(const ctx_t &context,
+                       int index) -> shared_ptr<RuleRequest> = 0;
+
+  virtual auto getRuleCount(const ctx_t &context) -> int = 0;
+
+  /**
+   * drop cached state of table in context if the ruleset in kernel changed
+   * and nothing is pending, true if dropped
+   */
+  virtual auto reloadIfStale(const ctx_t &context) -> bool = 0;
+
+  /**
+   * discard uncommitted changes and cached state of table in context, it is
+   * read again from kernel on next access
+   */
+  virtual auto reloadTable(const ctx_t &context) -> void = 0;
+
+  /**
+   * rules of all tables matching query, see SearchQuery for the syntax.
+   * Throws std::invalid_argument on malformed query, or if the backend
+   * cannot search.
+   */
+  virtual auto searchRules(const string &query,
+                           size_t limit) -> vector<SearchHit> {
+    (void)query;
+    (void)limit;
+    throw std::invalid_argument("Rule search is not supported by this "
+                                "firewall backend.");
+  }
+
+protected:
+  /**
+   * result of op, or fallback with the error in context if op throws, e.g.
+   * when a table cannot be loaded, so errors never escape into UI callbacks
+   */
+  template <typename Result, typename Op>
+  static auto guarded(const ctx_t &context, Result fallback,
+                      Op &&op) -> Result {
+    try {
+      return op();
+    } catch (const std::exception &e) {
+      yuiError() << e.what() << std::endl;
+      context->setLastError(e.what());
+      return fallback;
+    }
+  }
+};
+
+#endif
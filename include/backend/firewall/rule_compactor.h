@@ -0,0 +1,48 @@
+#ifndef RULE_COMPACTOR_H
+#define RULE_COMPACTOR_H
+
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+/**
+ * rules of one chain to rewrite, indices refer to the chain before the
+ * compaction so replaced rules are written before removed ones
+ */
+class CompactionPlan {
+public:
+  string chain_;
+
+  /* widened rules, index_ is position of rule in chain */
+  vector<shared_ptr<RuleRequest>> replaced_;
+
+  /* rules merged into an earlier rule, ascending */
+  vector<int> removed_;
+
+  size_t rule_count_{};
+};
+
+/**
+ * Merges rules with the same target that differ only in buddy CIDR blocks
+ * of source or destination, or in adjacent or overlapping port ranges. The
+ * later rule is folded into the earlier one only if every rule between them
+ * that overlaps it ends evaluation with the same target, so the verdict of
+ * every packet is kept. Passes repeat until no rule merges, which yields
+ * the minimal CIDR blocks of runs of adjacent addresses.
+ */
+class RuleCompactor {
+public:
+  static auto compact(const RulesetModel &model,
+                      uint32_t chain) -> CompactionPlan;
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef RULE_QUERY_H
+#define RULE_QUERY_H
+
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using std::string;
+using std::string_view;
+using std::vector;
+
+/**
+ * counts of one query run, summed over tables by FirewallBackend
+ */
+class QueryStat {
+public:
+  size_t tables_{};  /* tables whose rules were scanned */
+  size_t skipped_{}; /* tables excluded before loading their rules */
+  size_t scanned_{}; /* rows in the scanned ranges */
+  size_t matched_{};
+  bool stopped_{}; /* sink asked to stop */
+};
+
+/**
+ * Predicate over the decoded rule columns, e.g.
+ *
+ *   proto == tcp && dport overlaps 8000-9000 && target == DROP
+ *   table == nat && !(src within 10.0.0.0/8) || packets > 1000
+ *
+ * fields and operators:
+ *   table, chain, target, in, out   == !=
+ *   proto                           == !=, name or number
+ *   src, dst                        == != overlaps within, address or CIDR
+ *   sport, dport                    == != overlaps within, port or lo-hi
+ *   packets, bytes                  == != < <= > >=
+ *
+ * A rule without address or port match has 0.0.0.0/0 or 0-65535, inverted
+ * matches are compared as written. && binds tighter than ||.
+ *
+ * The parsed tree is bound to each model before it runs: names are resolved
+ * to ids once, table predicates are folded to constants so tables are skipped
+ * before their rules are loaded, chain predicates become row ranges that
+ * narrow the scan, and operands of && and || are ordered by the width of the
+ * columns they read. Rows are filtered in blocks of kBlock, every predicate
+ * is a branch-free loop over one column filling a byte mask.
+ */
+class RuleQuery {
+public:
+  static constexpr uint32_t kBlock = 1024;
+
+  enum class Field : uint8_t {
+    TABLE,
+    CHAIN,
+    TARGET,
+    IN,
+    OUT,
+    PROTO,
+    SRC,
+    DST,
+    SPORT,
+    DPORT,
+    PACKETS,
+    BYTES
+  };
+
+  enum class Cmp : uint8_t { EQ, NE, LT, LE, GT, GE, OVERLAPS, WITHIN };
+
+  enum class Kind : uint8_t { AND, OR, NOT, LEAF };
+
+  class Node {
+  public:
+    Kind kind_;
+
+    /* LEAF only, value_ is the operand as written */
+    Field field_{};
+    Cmp cmp_{};
+    string value_;
+    uint64_t lo_{}; /* address, low port, proto or counter */
+    uint64_t hi_{}; /* mask or high port */
+
+    vector<Node> children_;
+  };
+
+  /* called for every matching row in table order, false stops the run */
+  using Sink = std::function<bool(const RulesetModel &model, uint32_t row)>;
+
+  /**
+   * throws std::invalid_argument naming the offending token and its offset
+   */
+  static auto parse(string_view text) -> RuleQuery;
+
+  /* false if no rule of table can match, whatever its other fields are */
+  [[nodiscard]] auto mayMatchTable(const string &table) const -> bool;
+
+  /**
+   * stream matching rows of model to sink, the counts are added to stat
+   */
+  auto run(const RulesetModel &model, const Sink &sink,
+           QueryStat &stat) const -> void;
+
+  /* plan bound to model, one line per step in evaluation order */
+  [[nodiscard]] auto explain(const RulesetModel &model) const -> string;
+
+private:
+  Node root_;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef RULE_REORDERER_H
+#define RULE_REORDERER_H
+
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+/**
+ * new order of the rules of one chain
+ */
+class ReorderPlan {
+public:
+  string chain_;
+
+  /* index of rule in chain before reordering, by new position */
+  vector<int> order_;
+
+  /* rules evaluated until the matching rule, weighted by packet counters */
+  double before_avg_{};
+  double after_avg_{};
+
+  /* rules at a new position */
+  size_t moved_{};
+
+  [[nodiscard]] auto summary() const -> string;
+};
+
+/**
+ * Moves rules with high packet counters towards the head of a chain. A rule
+ * only passes an earlier rule whose match space is disjoint from its own, or
+ * which has the same target, so every packet still gets the same verdict.
+ * Rules with inversion or unmodeled matches pass nothing and are not passed.
+ */
+class RuleReorderer {
+public:
+  static auto plan(const RulesetModel &model, uint32_t chain) -> ReorderPlan;
+};
+
+#endif
@@ -3,6 +3,9 @@
 
 #include "backend/firewall/firewall_context.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <optional>
 #include <string>
 #include <tuple>
@@ -10,6 +13,7 @@
 #include <vector>
 
 #include <libiptc/libiptc.h>
+#include <linux/filter.h>
 
 using std::optional;
 using std::string;
@@ -19,14 +23,77 @@ using std::vector;
 namespace RequestProto {
 const string TCP = "TCP";
 const string UDP = "UDP";
+const string ALL = "ALL"; /* any protocol, cannot have port match */
 } // namespace RequestProto
 
+/* targets with options of their own, other names are standard targets or
+ * user chains */
+namespace RequestTarget {
+const string CT = "CT"; /* raw table only */
+const string NFQUEUE = "NFQUEUE";
+} // namespace RequestTarget
+
+auto iptTargets() -> vector<string>;
+
+/* targets of rules in table, CT only exists in the raw table */
+auto iptTargets(const string &table) -> vector<string>;
+
 class RuleMatch {
 public:
   optional<tuple<string, string>> src_port_range_;
   optional<tuple<string, string>> dst_port_range_;
 };
 
+/**
+ * lookup of a packet field in an ipset (iptables set match), whether the
+ * field is an address or a port is decided by the type of the set
+ */
+class SetMatch {
+public:
+  string name_;
+
+  /* source address or port, destination otherwise */
+  bool src_{};
+};
+
+/**
+ * classic BPF program of the iptables bpf match, see BpfCompiler
+ */
+class BpfMatch {
+public:
+  vector<struct sock_filter> program_;
+};
+
+/**
+ * options of the CT target, connection tracking of matched packets
+ */
+class CtTarget {
+public:
+  /* packets are not tracked, their state is UNTRACKED */
+  bool notrack_{};
+
+  /* conntrack zone of tracked packets */
+  uint16_t zone_{};
+};
+
+/**
+ * options of the NFQUEUE target, packets go to userspace through queues
+ * [queue_num_, queue_num_ + queues_total_), flows are spread over them by
+ * hash or by the current CPU
+ */
+class NfqueueTarget {
+public:
+  uint16_t queue_num_{};
+  uint16_t queues_total_{1};
+
+  /* accept packets instead of dropping them if no program listens on the
+   * queue */
+  bool bypass_{};
+
+  /* queue of the current CPU instead of flow hash, needs queues_total_ > 1 */
+  bool cpu_fanout_{};
+};
+
 class RuleRequest {
 public:
   /* rule index in new rule list */
@@ -43,8 +110,18 @@ public:
 
   vector<RuleMatch> matches_;
 
+  optional<SetMatch> set_match_;
+
+  optional<BpfMatch> bpf_match_;
+
   string target_;
 
+  /* options of target_ CT, no option if absent */
+  optional<CtTarget> ct_target_;
+
+  /* options of target_ NFQUEUE, queue 0 if absent */
+  optional<NfqueueTarget> nfqueue_target_;
+
   RuleRequest() : proto_(RequestProto::TCP), target_(IPTC_LABEL_ACCEPT) {};
 
   RuleRequest(int index, optional<string> src_ip, optional<string> src_mask,
@@ -59,7 +136,25 @@ public:
 
   RuleRequest(iptc_handle *handle, const struct ipt_entry *rule, int index);
 
-  auto to_entry_bytes(const ctx_t &context) -> optional<vector<char>>;
+  /* is_chain tells whether a target names a user chain, see
+   * write_entry_bytes */
+  using ChainLookup = std::function<bool(const string &)>;
+
+  auto to_entry_bytes(const ctx_t &context,
+                      const ChainLookup &is_chain) -> optional<vector<char>>;
+
+  /**
+   * size of ipt_entry built by write_entry_bytes, aligned to XT_ALIGN
+   */
+  [[nodiscard]] auto entry_size() const -> size_t;
+
+  /**
+   * build ipt_entry in place, buffer must hold at least entry_size() bytes.
+   * The target must be a standard verdict, CT, NFQUEUE or a user chain
+   * is_chain knows, the kernel would refuse anything else only on commit.
+   */
+  auto write_entry_bytes(const ctx_t &context, char *buffer,
+                         const ChainLookup &is_chain) -> bool;
 };
 
 #endif
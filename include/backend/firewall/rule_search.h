@@ -0,0 +1,169 @@
+#ifndef RULE_SEARCH_H
+#define RULE_SEARCH_H
+
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using std::map;
+using std::string;
+using std::string_view;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+
+/**
+ * location of a rule found by search, index as used by FirewallBackend
+ */
+class SearchHit {
+public:
+  string table_;
+  string chain_;
+  int index_{};
+
+  auto operator==(const SearchHit &) const -> bool = default;
+};
+
+/**
+ * Parsed search text, a rule is found if it matches every criterion.
+ *
+ *   10.2.0.0/16, src 10.0.0.1  address or CIDR overlapping source or dest
+ *   port 443, dport 1000-2000  port or range overlapping the port match
+ *   anything else              chain, target, interface or protocol name
+ */
+class SearchQuery {
+public:
+  enum class Side : uint8_t { ANY, SRC, DST };
+
+  class Prefix {
+  public:
+    uint32_t addr_; /* host byte order, masked */
+    int length_;
+    Side side_;
+  };
+
+  class Ports {
+  public:
+    uint16_t lo_;
+    uint16_t hi_;
+    Side side_;
+  };
+
+  vector<Prefix> prefixes_;
+  vector<Ports> ports_;
+  vector<string> terms_; /* lower case */
+
+  /**
+   * throws std::invalid_argument on malformed address or port
+   */
+  static auto parse(string_view text) -> SearchQuery;
+
+  [[nodiscard]] auto empty() const -> bool {
+    return prefixes_.empty() && ports_.empty() && terms_.empty();
+  }
+};
+
+/**
+ * Inverted index of the rules of all tables. Names map to posting lists,
+ * address prefixes are kept ordered by network and length so that both the
+ * prefixes containing a query CIDR and those inside it are found by lookups,
+ * and single ports are kept ordered for range queries.
+ *
+ * Chains are reindexed from the decoded model when they are invalidated,
+ * postings of replaced rules are dropped lazily and compacted once they
+ * outnumber live rules.
+ */
+class RuleSearchIndex {
+public:
+  /* index every chain of table again on next update */
+  auto invalidateTable(const string &table) -> void;
+
+  /* index chain again on next update, no-op if chain does not exist then */
+  auto invalidateChain(const string &table, const string &chain) -> void;
+
+  [[nodiscard]] auto needsUpdate(const string &table) const -> bool;
+
+  /* reindex invalidated chains of model.table_ */
+  auto update(const RulesetModel &model) -> void;
+
+  /**
+   * at most limit hits ordered by table, chain and index
+   */
+  [[nodiscard]] auto search(const SearchQuery &query,
+                            size_t limit) const -> vector<SearchHit>;
+
+  [[nodiscard]] auto ruleCount() const -> size_t { return live_; }
+
+private:
+  class Doc {
+  public:
+    uint32_t table_; /* ids in names_ */
+    uint32_t chain_;
+    uint32_t index_;
+    bool alive_;
+  };
+
+  /* address whose mask is not a prefix, checked one by one */
+  class MaskedAddr {
+  public:
+    uint32_t addr_;
+    uint32_t mask_;
+    uint32_t doc_;
+    bool dst_;
+  };
+
+  class PortRange {
+  public:
+    uint16_t lo_;
+    uint16_t hi_;
+    uint32_t doc_;
+    bool dst_;
+  };
+
+  StringPool names_;
+  vector<Doc> docs_;
+  size_t live_{};
+
+  /* docs of each chain, key is table id << 32 | chain id */
+  unordered_map<uint64_t, vector<uint32_t>> chain_docs_;
+
+  unordered_set<string> indexed_;
+  unordered_set<string> stale_tables_;
+  unordered_map<string, unordered_set<string>> stale_chains_;
+
+  unordered_map<string, vector<uint32_t>> terms_;
+
+  /* key is network << 6 | prefix length */
+  map<uint64_t, vector<uint32_t>> src_prefixes_;
+  map<uint64_t, vector<uint32_t>> dst_prefixes_;
+  vector<MaskedAddr> masked_;
+
+  map<uint16_t, vector<uint32_t>> sports_;
+  map<uint16_t, vector<uint32_t>> dports_;
+  vector<PortRange> ranges_;
+
+  auto indexChain(const RulesetModel &model, uint32_t chain) -> void;
+
+  auto addRow(const RulesetModel &model, uint32_t row, string_view chain,
+              uint32_t doc) -> void;
+
+  auto dropChain(uint64_t key) -> void;
+
+  /* renumber live docs and drop postings of dead ones */
+  auto compact() -> void;
+
+  [[nodiscard]] auto matchPrefix(const SearchQuery::Prefix &prefix) const
+      -> vector<uint32_t>;
+
+  [[nodiscard]] auto matchPorts(const SearchQuery::Ports &ports) const
+      -> vector<uint32_t>;
+};
+
+#endif
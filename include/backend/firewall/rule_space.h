@@ -0,0 +1,57 @@
+#ifndef RULE_SPACE_H
+#define RULE_SPACE_H
+
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+using std::optional;
+using std::shared_ptr;
+using std::string;
+
+/**
+ * Packet region matched by one rule over the fields RuleRequest models.
+ * Only rules without inversion, fragment flag or opaque matches have a
+ * region, addresses are masked so that regions can be compared by bits.
+ */
+class RuleSpace {
+public:
+  uint32_t src_;
+  uint32_t smsk_;
+  uint32_t dst_;
+  uint32_t dmsk_;
+  uint8_t proto_; /* 0 for any protocol */
+  uint16_t iniface_;
+  uint16_t outiface_;
+  uint16_t sport_lo_;
+  uint16_t sport_hi_;
+  uint16_t dport_lo_;
+  uint16_t dport_hi_;
+
+  static auto fromRow(const RulesetModel &model,
+                      uint32_t row) -> optional<RuleSpace>;
+
+  /* rule can never match, address has bits outside of its mask */
+  static auto isUnmatchable(const RulesetModel &model, uint32_t row) -> bool;
+
+  /* every packet matched by other is matched by this */
+  [[nodiscard]] auto covers(const RuleSpace &other,
+                            const StringPool &ifaces) const -> bool;
+
+  /* some packet is matched by both */
+  [[nodiscard]] auto overlaps(const RuleSpace &other,
+                              const StringPool &ifaces) const -> bool;
+
+  [[nodiscard]] auto hasContiguousMasks() const -> bool;
+
+  /* rule matching exactly this region, nullptr if protocol is not modeled */
+  [[nodiscard]] auto toRequest(const StringPool &ifaces,
+                               const string &target) const
+      -> shared_ptr<RuleRequest>;
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef RULESET_MODEL_H
+#define RULESET_MODEL_H
+
+#include <libiptc/libiptc.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using std::optional;
+using std::shared_ptr;
+using std::string;
+using std::string_view;
+using std::unordered_map;
+using std::vector;
+
+/**
+ * interned strings, id 0 is always the empty string
+ */
+class StringPool {
+public:
+  StringPool() { intern(""); }
+
+  auto intern(string_view str) -> uint32_t;
+
+  [[nodiscard]] auto find(string_view str) const -> optional<uint32_t>;
+
+  [[nodiscard]] auto get(uint32_t id) const -> const string & {
+    return strings_[id];
+  }
+
+  [[nodiscard]] auto size() const -> size_t { return strings_.size(); }
+
+private:
+  vector<string> strings_;
+  unordered_map<string, uint32_t> ids_;
+};
+
+enum class TargetKind : uint8_t {
+  ACCEPT,
+  DROP,
+  QUEUE,
+  RETURN,
+  JUMP,        /* jump to user chain */
+  FALLTHROUGH, /* no target, continue with next rule */
+  EXTENSION    /* target module, e.g. LOG */
+};
+
+class ModelTarget {
+public:
+  uint32_t name_;
+  TargetKind kind_;
+
+  /* index of chain in RulesetModel::chains_ for JUMP */
+  uint32_t chain_;
+
+  [[nodiscard]] auto isTerminal() const -> bool {
+    return kind_ == TargetKind::ACCEPT || kind_ == TargetKind::DROP ||
+           kind_ == TargetKind::QUEUE;
+  }
+};
+
+class ModelChain {
+public:
+  uint32_t name_;
+
+  /* rules of chain are rows [begin_, end_) */
+  uint32_t begin_;
+  uint32_t end_;
+
+  bool builtin_;
+
+  /* id of policy target for builtin chain */
+  uint16_t policy_;
+
+  [[nodiscard]] auto size() const -> uint32_t { return end_ - begin_; }
+};
+
+/**
+ * Structure-of-arrays model of one table, decoded once per handle generation
+ * and shared by UI, search and analysis. Each rule is one row in the columns,
+ * addresses and masks are in host byte order, rules without port match have
+ * the full port range.
+ */
+class RulesetModel {
+public:
+  /* bits of flags_ */
+  static constexpr uint8_t kInvSrc = 1U << 0;
+  static constexpr uint8_t kInvDst = 1U << 1;
+  static constexpr uint8_t kInvIniface = 1U << 2;
+  static constexpr uint8_t kInvOutiface = 1U << 3;
+  static constexpr uint8_t kInvProto = 1U << 4;
+  static constexpr uint8_t kFragment = 1U << 5;
+  /* rule has a match (or inverted port match) not modeled by columns */
+  static constexpr uint8_t kOpaqueMatch = 1U << 6;
+
+  static auto decode(const string &table,
+                     struct iptc_handle *handle) -> shared_ptr<RulesetModel>;
+
+  string table_;
+
+  vector<uint32_t> src_;
+  vector<uint32_t> smsk_;
+  vector<uint32_t> dst_;
+  vector<uint32_t> dmsk_;
+  vector<uint8_t> proto_;
+  vector<uint8_t> flags_;
+  vector<uint16_t> iniface_; /* id in ifaces_, wildcard names end with '+' */
+  vector<uint16_t> outiface_;
+  vector<uint16_t> sport_lo_;
+  vector<uint16_t> sport_hi_;
+  vector<uint16_t> dport_lo_;
+  vector<uint16_t> dport_hi_;
+  vector<uint16_t> target_; /* index in targets_ */
+  vector<uint64_t> pcnt_;
+  vector<uint64_t> bcnt_;
+
+  vector<ModelChain> chains_;
+  vector<ModelTarget> targets_;
+
+  StringPool names_; /* chain and target names */
+  StringPool ifaces_;
+
+  [[nodiscard]] auto size() const -> size_t { return src_.size(); }
+
+  [[nodiscard]] auto findChain(string_view name) const -> optional<uint32_t>;
+
+  /* index of chain that row belongs to */
+  [[nodiscard]] auto chainOf(uint32_t row) const -> uint32_t;
+
+  [[nodiscard]] auto targetOf(uint32_t row) const -> const ModelTarget & {
+    return targets_[target_[row]];
+  }
+
+  /* approximate memory used by rule columns */
+  [[nodiscard]] auto columnBytes() const -> size_t;
+
+private:
+  /* name id to index in chains_ and targets_ */
+  unordered_map<uint32_t, uint32_t> chain_ids_;
+  unordered_map<uint32_t, uint16_t> target_ids_;
+
+  auto internTarget(const string &name) -> uint16_t;
+
+  auto appendRule(const struct ipt_entry *entry, uint16_t target) -> void;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SAVE_FORMAT_H
+#define SAVE_FORMAT_H
+
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/ruleset_model.h"
+#include "backend/firewall/table_compiler.h"
+
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+using std::optional;
+using std::shared_ptr;
+using std::string;
+
+/**
+ * receiver of parsed iptables-save content, every callback returns error
+ * message or nullopt, parsing stops at the first error
+ */
+class SaveSink {
+public:
+  virtual ~SaveSink() = default;
+
+  /* "*table" line */
+  virtual auto beginTable(const string &table) -> optional<string> = 0;
+
+  /* ":chain policy [pcnt:bcnt]" line, policy is nullopt for user chain */
+  virtual auto declareChain(const string &chain,
+                            const optional<string> &policy)
+      -> optional<string> = 0;
+
+  /* "-A chain ..." line */
+  virtual auto appendRule(const string &chain,
+                          shared_ptr<RuleRequest> request)
+      -> optional<string> = 0;
+
+  /* "COMMIT" line */
+  virtual auto commitTable() -> optional<string> = 0;
+};
+
+/**
+ * iptables-save compatible text format, limited to what RuleRequest can
+ * express: addresses, interfaces, tcp/udp ports, standard or jump targets and
+ * the CT and NFQUEUE targets
+ */
+class SaveFormat {
+public:
+  /**
+   * parse stream line by line, returns "line N: reason" on error
+   */
+  static auto parse(std::istream &input,
+                    SaveSink &sink) -> optional<string>;
+
+  /**
+   * parse one "-A" rule line into request, chain is set to the chain name
+   */
+  static auto parseRule(std::string_view line, string &chain,
+                        RuleRequest &request) -> optional<string>;
+
+  /**
+   * write table of model, rules which cannot be expressed are written as
+   * comments, returns number of such rules
+   */
+  static auto write(std::ostream &output, const RulesetModel &model) -> size_t;
+
+  /**
+   * write requests of ruleset, e.g. a ruleset built for review before it is
+   * applied, requests with unknown protocol are written as comments
+   */
+  static auto write(std::ostream &output, const TableRuleset &ruleset) -> void;
+};
+
+#endif
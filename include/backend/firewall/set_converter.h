@@ -0,0 +1,69 @@
+#ifndef SET_CONVERTER_H
+#define SET_CONVERTER_H
+
+#include "backend/firewall/ipset.h"
+#include "backend/firewall/rule_request.h"
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+/**
+ * rules of a chain folded into one lookup of a set of their members
+ */
+class SetFamily {
+public:
+  /* name is a proposal, a suffix is added on apply if it is taken */
+  SetRequest set_;
+
+  /* rule matching the set, replaces the first member, index_ is its
+   * position in chain */
+  shared_ptr<RuleRequest> rule_;
+
+  /* indices of member rules in chain, ascending */
+  vector<int> members_;
+};
+
+class SetPlan {
+public:
+  string chain_;
+
+  /* by position of their first member */
+  vector<SetFamily> families_;
+
+  /* members other than the first of each family, ascending */
+  vector<int> removed_;
+
+  size_t rule_count_{};
+
+  [[nodiscard]] auto summary() const -> string;
+};
+
+/**
+ * Finds families of rules of one chain that differ only in source address
+ * or only in destination port range and end with the same terminal target
+ * or RETURN. Each family becomes a single rule at the position of its first
+ * member that looks the field up in a hash:net or bitmap:port set, so a
+ * packet costs one lookup instead of one comparison per member. A rule joins
+ * a family only if every rule between the first member and it that overlaps
+ * it ends evaluation with the same target, so the verdict of every packet is
+ * kept. Source address families are taken first, the remaining rules are
+ * then grouped by destination port.
+ */
+class SetConverter {
+public:
+  /* smaller families are cheaper to scan than to look up */
+  static constexpr size_t kMinMembers = 8;
+
+  static auto plan(const RulesetModel &model, uint32_t chain,
+                   size_t min_members = kMinMembers) -> SetPlan;
+};
+
+#endif
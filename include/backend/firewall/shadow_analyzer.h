@@ -0,0 +1,58 @@
+#ifndef SHADOW_ANALYZER_H
+#define SHADOW_ANALYZER_H
+
+#include "backend/firewall/rule_space.h"
+#include "backend/firewall/ruleset_model.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+using std::optional;
+using std::string;
+using std::vector;
+
+enum class AnomalyKind {
+  SHADOWED,   /* covered by an earlier rule with another target */
+  REDUNDANT,  /* covered by an earlier rule with the same target */
+  CORRELATED, /* partly overlapped by an earlier rule with another target */
+  UNMATCHABLE /* address has bits outside of mask, never matches */
+};
+
+class RuleAnomaly {
+public:
+  AnomalyKind kind_;
+
+  /* rows in RulesetModel */
+  uint32_t row_;
+  optional<uint32_t> other_;
+
+  [[nodiscard]] auto serialize(const RulesetModel &model) const -> string;
+};
+
+class ShadowReport {
+public:
+  vector<RuleAnomaly> anomalies_;
+
+  /* rules with inversion, non-contiguous mask or unmodeled match */
+  uint32_t skipped_{};
+};
+
+/**
+ * Finds dead and overlapping rules of a chain. Earlier rules with terminal
+ * targets are indexed by source/destination prefix, a rule only looks up
+ * prefixes containing its own, single port rules by port and port ranges by
+ * every bucket of 256 ports they touch. Ranges over more than 16 buckets and
+ * rules without port are listed once per prefix pair. The cost per rule
+ * depends on the number of distinct prefix lengths rather than the chain
+ * length. Correlation is only reported against earlier rules found this way,
+ * i.e. whose address prefixes contain the rule's.
+ */
+class ShadowAnalyzer {
+public:
+  static auto analyze(const RulesetModel &model,
+                      uint32_t chain) -> ShadowReport;
+};
+
+#endif
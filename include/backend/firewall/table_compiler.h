@@ -0,0 +1,88 @@
+#ifndef TABLE_COMPILER_H
+#define TABLE_COMPILER_H
+
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/rule_request.h"
+
+#include <libiptc/libiptc.h>
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+using std::optional;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+class ChainRuleset {
+public:
+  string name_;
+
+  /* policy of builtin chain, ignored for user chain */
+  optional<string> policy_;
+
+  vector<shared_ptr<RuleRequest>> rules_;
+};
+
+/**
+ * complete in-memory content of one iptables table
+ */
+class TableRuleset {
+public:
+  string table_;
+  vector<ChainRuleset> chains_;
+};
+
+/**
+ * Fixed size buffer backed by anonymous mmap, pages are only committed when
+ * they are written, and released to system at once when destroyed.
+ */
+class MappedBuffer {
+public:
+  explicit MappedBuffer(size_t size);
+
+  ~MappedBuffer();
+
+  MappedBuffer(MappedBuffer &&other) noexcept;
+
+  auto operator=(MappedBuffer &&other) noexcept -> MappedBuffer &;
+
+  MappedBuffer(const MappedBuffer &) = delete;
+
+  auto operator=(const MappedBuffer &) -> MappedBuffer & = delete;
+
+  [[nodiscard]] auto data() const -> char * { return data_; }
+
+  [[nodiscard]] auto size() const -> size_t { return size_; }
+
+private:
+  char *data_{};
+  size_t size_{};
+};
+
+/**
+ * Compile a complete table into the ipt_replace blob accepted by kernel and
+ * submit it with a single IPT_SO_SET_REPLACE, bypassing libiptc. Used for
+ * full-table loads where libiptc's per-rule lists are too slow.
+ */
+class TableCompiler {
+public:
+  /**
+   * build blob for table described by info (valid hooks, current number of
+   * entries), counters pointer is left for caller
+   */
+  static auto compile(const TableRuleset &ruleset,
+                      const struct ipt_getinfo &info,
+                      const ctx_t &context) -> optional<MappedBuffer>;
+
+  /**
+   * compile ruleset and replace kernel table with it
+   */
+  static auto replace(const TableRuleset &ruleset,
+                      const ctx_t &context) -> bool;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef XTABLES_LOCK_H
+#define XTABLES_LOCK_H
+
+#include <chrono>
+#include <string>
+
+using std::string;
+
+/**
+ * RAII holder of the lock file the iptables tools take around every table
+ * replace. Acquiring polls a non-blocking flock with exponential backoff
+ * until the timeout, so a busy kube-proxy or fail2ban delays a commit
+ * instead of racing with it.
+ */
+class XtablesLock {
+public:
+  static constexpr const char *kPath = "/run/xtables.lock";
+  static constexpr std::chrono::milliseconds kTimeout{5000};
+  static constexpr std::chrono::milliseconds kMinBackoff{1};
+  static constexpr std::chrono::milliseconds kMaxBackoff{100};
+
+  explicit XtablesLock(std::chrono::milliseconds timeout = kTimeout,
+                       const string &path = kPath);
+
+  ~XtablesLock();
+
+  XtablesLock(const XtablesLock &) = delete;
+  auto operator=(const XtablesLock &) -> XtablesLock & = delete;
+
+  [[nodiscard]] auto locked() const -> bool { return locked_; }
+
+  /* time spent until the lock was taken or given up */
+  [[nodiscard]] auto waited() const -> std::chrono::microseconds {
+    return waited_;
+  }
+
+  /* lock was held by another process on first try */
+  [[nodiscard]] auto contended() const -> bool { return contended_; }
+
+  /* reason the lock was not taken, empty if locked */
+  [[nodiscard]] auto error() const -> const string & { return error_; }
+
+private:
+  int fd_{-1};
+  bool locked_{false};
+  bool contended_{false};
+  std::chrono::microseconds waited_{};
+  string error_;
+};
+
+#endif
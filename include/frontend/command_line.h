@@ -0,0 +1,56 @@
+#ifndef COMMAND_LINE_H
+#define COMMAND_LINE_H
+
+#include <functional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using std::function;
+using std::string;
+using std::tuple;
+using std::vector;
+
+/**
+ * @brief headless entry of control panel, e.g. `controlpanel save filter`
+ */
+class CommandLine {
+public:
+  using command_func = function<int(const vector<string> &)>;
+
+  /**
+   * run command in args (without program name), returns exit status
+   */
+  static auto run(const vector<string> &args) -> int;
+
+private:
+  /* name, usage and handler of each command */
+  static auto commands() -> const vector<tuple<string, string, command_func>> &;
+
+  static auto usage() -> int;
+
+  static auto save(const vector<string> &args) -> int;
+
+  static auto restore(const vector<string> &args) -> int;
+
+  static auto classify(const vector<string> &args) -> int;
+
+  static auto classifyBatch(const vector<string> &args) -> int;
+
+  static auto optimize(const vector<string> &args) -> int;
+
+  static auto compact(const vector<string> &args) -> int;
+  static auto sets(const vector<string> &args) -> int;
+  static auto bpf(const vector<string> &args) -> int;
+  static auto bypass(const vector<string> &args) -> int;
+
+  static auto reorder(const vector<string> &args) -> int;
+
+  static auto sample(const vector<string> &args) -> int;
+
+  static auto query(const vector<string> &args) -> int;
+
+  static auto graph(const vector<string> &args) -> int;
+};
+
+#endif
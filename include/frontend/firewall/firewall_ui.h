@@ -3,8 +3,10 @@
 
 #include "YInputField.h"
 #include "YWidget.h"
+#include "backend/config_manager.h"
 #include "backend/firewall/firewall_backend.h"
 #include "backend/firewall/firewall_context.h"
+#include "backend/firewall/rule_backend.h"
 #include "frontend/ui_base.h"
 
 #include "YPushButton.h"
@@ -41,13 +43,57 @@ private:
 
   auto userHandleEvent(YEvent *event) -> HandleResult override;
 
+  /* popup searching the rules of all tables */
+  auto userSearch() -> void override;
+
   auto createUpdateRule(optional<int> index) -> shared_ptr<RuleRequest>;
 
   auto createChain() -> shared_ptr<ChainRequest>;
 
   auto fresh(YDialog *main_dialog, DisplayLayout layout) -> bool;
 
+  /* shadowing analysis of current chain */
+  auto showAnalysisReport() -> void;
+
+  /* restructure current chain into a tree after confirmation, true if
+   * the chain was rewritten */
+  auto optimizeChain() -> bool;
+
+  /* merge adjacent rules of current chain after confirmation */
+  auto compactChain() -> bool;
+
+  /* move hot rules of current chain earlier after confirmation */
+  auto reorderChain() -> bool;
+
+  /* fold rule families of current chain into ipset lookups after
+   * confirmation */
+  auto convertToSets() -> bool;
+
+  /* compile runs of rules of current chain into bpf matches after
+   * confirmation */
+  auto compileToBpf() -> bool;
+
+  /* ask for a local service and insert raw rules skipping conntrack for it
+   * with filter rules accepting the same packets, after confirmation */
+  auto conntrackBypass() -> bool;
+
+  /* live view of rules of current table with highest packet rate, refreshed
+   * on each sample until closed */
+  auto showHotRules() -> void;
+
+  /* discard uncommitted changes of current table and read it again from
+   * kernel, after confirmation if there are any. True if reloaded */
+  auto reloadTable() -> bool;
+
+  /* record change to pending change journal, chain is under current table */
+  auto recordChange(ChangeKind kind, const string &chain,
+                    int index = -1) -> void;
+
   shared_ptr<FirewallContext> firewall_context_;
+  shared_ptr<RuleBackend> rule_backend_;
+
+  /* nullptr unless rules are kept by iptables, which the analysis, rewrite
+   * and counter features need */
   shared_ptr<FirewallBackend> firewall_backend_;
 
   vector<string> iptable_children;
@@ -56,6 +102,15 @@ private:
   const static string kAddRuleButtonText;
   const static string kAddChainButtonText;
   const static string kDelRuleButtonText;
+  const static string kAnalyzeButtonText;
+  const static string kOptimizeButtonText;
+  const static string kCompactButtonText;
+  const static string kReorderButtonText;
+  const static string kSetsButtonText;
+  const static string kBpfButtonText;
+  const static string kHotRulesButtonText;
+  const static string kBypassButtonText;
+  const static string kReloadButtonText;
 };
 
 #endif
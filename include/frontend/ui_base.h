@@ -117,6 +117,10 @@ private:
 
   virtual auto userHandleEvent(YEvent *event) -> HandleResult = 0;
 
+  /* handler of the search button, pages with searchable content override
+   * it */
+  virtual auto userSearch() -> void;
+
   [[nodiscard]] static auto checkExit() -> bool;
 };
 
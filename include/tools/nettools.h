@@ -1,8 +1,11 @@
 #ifndef NETTOOLS_H
 #define NETTOOLS_H
 
+#include "fmt/format.h"
+
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
@@ -15,12 +18,18 @@ auto ip2Tuple(uint32_t ip) -> std::tuple<uint8_t, uint8_t, uint8_t, uint8_t>;
 auto tuple2Ip(const std::tuple<uint8_t, uint8_t, uint8_t, uint8_t> &tuple)
     -> uint32_t;
 
-auto protocols() -> vector<tuple<string, uint8_t>>;
+/**
+ * append dotted quad of ip (host byte order) to buffer, without allocation
+ */
+auto appendIpv4(fmt::memory_buffer &buffer, uint32_t ip) -> void;
+
+auto protocols() -> const vector<tuple<string, uint8_t>> &;
 
 auto proto2String(uint8_t proto) -> string;
 
-auto string2Proto(string proto) -> uint8_t;
+/* name of proto, the view refers to static storage */
+auto proto2Name(uint8_t proto) -> std::string_view;
 
-auto iptTargets() -> vector<string>;
+auto string2Proto(string proto) -> uint8_t;
 
 #endif
\ No newline at end of file
@@ -18,4 +18,8 @@ static constexpr YLayoutSize_t kPopDialogMinHeight = 6;
 
 auto showDialog(const string &title, const string &msg) -> void;
 
+/* popup with confirm and cancel buttons, true if confirmed */
+auto askConfirm(const string &title, const string &msg,
+                const string &confirm) -> bool;
+
 #endif
@@ -1,16 +1,29 @@
 #include "backend/config_manager.h"
 #include "backend/firewall/firewall_backend.h"
+#include "backend/firewall/nft_backend.h"
 #include "backend/package_manager/package_manager_backend.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <typeinfo>
 #include <unordered_map>
 
 auto ConfigManager::getInitializers(const string &type)
     -> optional<initializer> {
   static unordered_map<string, initializer> initializers = {
-
+      /* nf_tables only when asked for, iptables-legacy stays the default */
+      {typeid(RuleBackend).name(),
+       []() -> shared_ptr<ConfigBackendBase> {
+         const auto *firewall = getenv("CONTROLPANEL_FIREWALL");
+         if (firewall != nullptr && std::string_view(firewall) == "nftables") {
+           return ConfigManager::instance().getBackend<NftBackend>();
+         }
+         return ConfigManager::instance().getBackend<FirewallBackend>();
+       }},
   };
 
   if (initializers.contains(type)) {
@@ -24,12 +37,149 @@ auto ConfigManager::registerApplyFunc(const function<bool(void)> &func) -> int {
   return static_cast<int>(unsavedConfigs_.size() - 1);
 }
 
+auto PendingChange::serialize() const -> string {
+  static const unordered_map<ChangeKind, string> kind_names = {
+      {ChangeKind::INSERT_RULE, "Insert rule"},
+      {ChangeKind::REMOVE_RULE, "Remove rule"},
+      {ChangeKind::UPDATE_RULE, "Update rule"},
+      {ChangeKind::INSERT_CHAIN, "Insert chain"},
+      {ChangeKind::REMOVE_CHAIN, "Remove chain"},
+  };
+
+  if (index_ < 0) {
+    return fmt::format("{}: {}", kind_names.at(kind_), scope_);
+  }
+  return fmt::format("{}: {} #{}", kind_names.at(kind_), scope_, index_);
+}
+
+auto ConfigManager::recordChange(const shared_ptr<ConfigBackendBase> &backend,
+                                 PendingChange change) -> void {
+  auto journal = std::ranges::find_if(journals_, [&backend](const auto &j) {
+    return j.backend_ == backend;
+  });
+  if (journal == journals_.end()) {
+    journals_.push_back({backend, {std::move(change)}});
+    return;
+  }
+
+  auto &changes = journal->changes_;
+  auto last = std::find_if(changes.rbegin(), changes.rend(),
+                           [&change](const auto &c) {
+                             return c.scope_ == change.scope_;
+                           });
+  if (last == changes.rend()) {
+    changes.emplace_back(std::move(change));
+    return;
+  }
+
+  /* coalesce with the last change over the same scope */
+  auto same_rule = last->index_ == change.index_;
+  auto cancel = false;
+  auto drop = false;
+  switch (change.kind_) {
+  case ChangeKind::REMOVE_RULE:
+    cancel = same_rule && last->kind_ == ChangeKind::INSERT_RULE;
+    break;
+  case ChangeKind::UPDATE_RULE:
+    /* insert or update followed by update is still a single change */
+    drop = same_rule && (last->kind_ == ChangeKind::INSERT_RULE ||
+                         last->kind_ == ChangeKind::UPDATE_RULE);
+    break;
+  case ChangeKind::REMOVE_CHAIN:
+    cancel = last->kind_ == ChangeKind::INSERT_CHAIN;
+    break;
+  default:
+    break;
+  }
+
+  if (cancel) {
+    changes.erase(std::next(last).base());
+
+    /* keep dirty state of backend in line, a cancelled pair is not committed
+     * and not counted in the commit cost */
+    vector<string> scopes;
+    for (const auto &pending : changes) {
+      scopes.push_back(pending.scope_);
+    }
+    journal->backend_->settle(scopes);
+    if (changes.empty()) {
+      journals_.erase(journal);
+    }
+  } else if (!drop) {
+    changes.emplace_back(std::move(change));
+  }
+}
+
+auto ConfigManager::discardChanges(
+    const shared_ptr<ConfigBackendBase> &backend, const string &prefix)
+    -> void {
+  auto journal = std::ranges::find_if(journals_, [&backend](const auto &j) {
+    return j.backend_ == backend;
+  });
+  if (journal == journals_.end()) {
+    return;
+  }
+
+  std::erase_if(journal->changes_, [&prefix](const PendingChange &change) {
+    return change.scope_.starts_with(prefix);
+  });
+  if (journal->changes_.empty()) {
+    journals_.erase(journal);
+  }
+}
+
+auto ConfigManager::pendingChangeCount() const -> size_t {
+  size_t count = unsavedConfigs_.size();
+  for (const auto &journal : journals_) {
+    count += journal.changes_.size();
+  }
+  return count;
+}
+
+auto ConfigManager::estimatedCommitCost() const -> size_t {
+  size_t cost = 0;
+  for (const auto &journal : journals_) {
+    cost += journal.backend_->estimateCommitCost();
+  }
+  return cost;
+}
+
+auto ConfigManager::pendingChanges() const -> vector<PendingChange> {
+  vector<PendingChange> changes;
+  for (const auto &journal : journals_) {
+    changes.insert(changes.end(), journal.changes_.begin(),
+                   journal.changes_.end());
+  }
+  return changes;
+}
+
 auto ConfigManager::apply() -> bool {
   auto res = true;
-  for (const auto &func : unsavedConfigs_) {
-    res &= func();
-  }
+  last_commit_error_.clear();
+  /* failed ones stay pending, so the changes are not lost for next apply */
+  std::erase_if(journals_, [this, &res](BackendJournal &journal) {
+    if (journal.backend_->commit()) {
+      return true;
+    }
+    res = false;
+    last_commit_error_ += journal.backend_->lastCommitError() + "\n";
+
+    /* a partial commit wrote some scopes already, only the rest is pending */
+    const auto &backend = journal.backend_;
+    std::erase_if(journal.changes_, [&backend](const PendingChange &change) {
+      return !backend->isPending(change.scope_);
+    });
+    return journal.changes_.empty();
+  });
 
-  unsavedConfigs_.clear();
+  std::erase_if(unsavedConfigs_, [&res](const function<bool(void)> &func) {
+    auto saved = func();
+    res &= saved;
+    return saved;
+  });
   return res;
 }
+
+auto ConfigManager::lastCommitError() const -> string {
+  return last_commit_error_;
+}
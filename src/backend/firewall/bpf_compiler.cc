@@ -0,0 +1,577 @@
+#include "backend/firewall/bpf_compiler.h"
+#include "backend/firewall/bpf_interpreter.h"
+#include "fmt/format.h"
+#include "tools/nettools.h"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <netinet/in.h>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+
+namespace {
+
+constexpr uint16_t kMaxPort = 65535;
+
+/* IPv4 header offsets, the program sees the packet from the IP header on */
+constexpr uint32_t kVersionIhlOffset = 0;
+constexpr uint32_t kTotalLenOffset = 2;
+constexpr uint32_t kFragOffset = 6;
+constexpr uint32_t kProtoOffset = 9;
+constexpr uint32_t kSrcOffset = 12;
+constexpr uint32_t kDstOffset = 16;
+constexpr uint32_t kFragOffsetMask = 0x1fff;
+
+/* transport header offsets after the IP header */
+constexpr uint32_t kSportOffset = 0;
+constexpr uint32_t kDportOffset = 2;
+
+constexpr uint32_t kNoMask = ~0U;
+constexpr uint32_t kNoMatch = 0;
+constexpr uint32_t kMatch = 1;
+
+/* where a jump of one rule's code goes */
+enum class Label : uint8_t {
+  NEXT,  /* following instruction */
+  FAIL,  /* code of next rule, or no match after the last rule */
+  MATCH, /* packet matches */
+};
+
+class Insn {
+public:
+  struct sock_filter insn_;
+  Label jt_{Label::NEXT};
+  Label jf_{Label::NEXT};
+};
+
+/* load instruction, offset and mask of a value in A */
+using Loaded = std::tuple<uint16_t, uint32_t, uint32_t>;
+
+class RuleCode {
+public:
+  vector<Insn> code_;
+
+  /* value the first test compares, a failed first test leaves it in A */
+  optional<Loaded> first_load_;
+
+  /* index in code_ of the first test */
+  size_t first_test_{};
+};
+
+auto statement(uint16_t code, uint32_t k) -> Insn {
+  return {BPF_STMT(code, k)};
+}
+
+auto jump(uint16_t op, uint32_t k, Label jt, Label jf) -> Insn {
+  return {BPF_JUMP(BPF_JMP | op | BPF_K, k, 0, 0), jt, jf};
+}
+
+auto isJump(const Insn &insn) -> bool {
+  return BPF_CLASS(insn.insn_.code) == BPF_JMP;
+}
+
+class RuleCodegen {
+public:
+  auto generate(const RuleSpace &rule) -> RuleCode {
+    if (rule.smsk_ != 0) {
+      load(BPF_LD | BPF_W | BPF_ABS, kSrcOffset, rule.smsk_);
+      test(jump(BPF_JEQ, rule.src_, Label::NEXT, Label::FAIL));
+    }
+    if (rule.dmsk_ != 0) {
+      load(BPF_LD | BPF_W | BPF_ABS, kDstOffset, rule.dmsk_);
+      test(jump(BPF_JEQ, rule.dst_, Label::NEXT, Label::FAIL));
+    }
+    if (rule.proto_ != 0) {
+      load(BPF_LD | BPF_B | BPF_ABS, kProtoOffset, kNoMask);
+      test(jump(BPF_JEQ, rule.proto_, Label::NEXT, Label::FAIL));
+    }
+
+    auto any_sport = rule.sport_lo_ == 0 && rule.sport_hi_ == kMaxPort;
+    auto any_dport = rule.dport_lo_ == 0 && rule.dport_hi_ == kMaxPort;
+    if (!any_sport || !any_dport) {
+      /* tcp and udp matches never match a fragment but the first */
+      load(BPF_LD | BPF_H | BPF_ABS, kFragOffset, kNoMask);
+      test(jump(BPF_JSET, kFragOffsetMask, Label::FAIL, Label::NEXT));
+      code_.code_.push_back(
+          statement(BPF_LDX | BPF_B | BPF_MSH, kVersionIhlOffset));
+      range(kSportOffset, rule.sport_lo_, rule.sport_hi_);
+      range(kDportOffset, rule.dport_lo_, rule.dport_hi_);
+    }
+
+    /* passing the last test is a match */
+    auto &code = code_.code_;
+    if (!code.empty() && isJump(code.back())) {
+      auto &last = code.back();
+      last.jt_ = last.jt_ == Label::NEXT ? Label::MATCH : last.jt_;
+      last.jf_ = last.jf_ == Label::NEXT ? Label::MATCH : last.jf_;
+    } else {
+      code.push_back({BPF_STMT(BPF_JMP | BPF_JA, 0), Label::MATCH});
+    }
+    return std::move(code_);
+  }
+
+private:
+  RuleCode code_;
+  bool first_{true};
+
+  auto load(uint16_t code, uint32_t k, uint32_t mask) -> void {
+    code_.code_.push_back(statement(code, k));
+    if (mask != kNoMask) {
+      code_.code_.push_back(statement(BPF_ALU | BPF_AND | BPF_K, mask));
+    }
+    if (first_) {
+      code_.first_load_ = Loaded{code, k, mask};
+      code_.first_test_ = code_.code_.size();
+      first_ = false;
+    }
+  }
+
+  auto test(const Insn &insn) -> void { code_.code_.push_back(insn); }
+
+  auto range(uint32_t offset, uint16_t lo, uint16_t hi) -> void {
+    if (lo == 0 && hi == kMaxPort) {
+      return;
+    }
+    code_.code_.push_back(statement(BPF_LD | BPF_H | BPF_IND, offset));
+    if (lo == hi) {
+      test(jump(BPF_JEQ, lo, Label::NEXT, Label::FAIL));
+      return;
+    }
+    if (lo != 0) {
+      test(jump(BPF_JGE, lo, Label::NEXT, Label::FAIL));
+    }
+    if (hi != kMaxPort) {
+      test(jump(BPF_JGT, hi, Label::FAIL, Label::NEXT));
+    }
+  }
+};
+
+auto offsetTo(size_t from, size_t to) -> uint8_t {
+  auto offset = to - from - 1;
+  if (offset > std::numeric_limits<uint8_t>::max()) {
+    throw std::length_error("bpf program too long for conditional jumps");
+  }
+  return static_cast<uint8_t>(offset);
+}
+
+/* interface pattern of the pool matches name */
+auto ifaceMatches(const StringPool &ifaces, uint16_t id, const string &name)
+    -> bool {
+  if (id == 0) {
+    return true;
+  }
+  const auto &pattern = ifaces.get(id);
+  if (pattern.back() == '+') {
+    return name.starts_with(
+        std::string_view(pattern).substr(0, pattern.size() - 1));
+  }
+  return name == pattern;
+}
+
+/* what verify feeds the chain, addresses in host byte order */
+class TestPacket {
+public:
+  uint32_t src_{};
+  uint32_t dst_{};
+  uint8_t proto_{};
+  uint16_t sport_{};
+  uint16_t dport_{};
+  uint16_t frag_{}; /* flags and offset field */
+  uint8_t ihl_{5};  /* header length in words, options are zero */
+  string iniface_;
+  string outiface_;
+
+  [[nodiscard]] auto bytes() const -> vector<uint8_t> {
+    static constexpr size_t kWordBytes = 4;
+    static constexpr size_t kTransportBytes = 8;
+    static constexpr uint8_t kVersion = 0x40;
+    static constexpr uint8_t kTtl = 64;
+    static constexpr uint32_t kTtlOffset = 8;
+
+    auto header = ihl_ * kWordBytes;
+    vector<uint8_t> packet(header + kTransportBytes);
+    auto put = [&packet](size_t offset, uint32_t value, size_t size) {
+      for (size_t i = 0; i < size; i++) {
+        packet[offset + i] =
+            static_cast<uint8_t>(value >> (8 * (size - i - 1)));
+      }
+    };
+    put(kVersionIhlOffset, kVersion | ihl_, 1);
+    put(kTotalLenOffset, packet.size(), 2);
+    put(kFragOffset, frag_, 2);
+    put(kTtlOffset, kTtl, 1);
+    put(kProtoOffset, proto_, 1);
+    put(kSrcOffset, src_, kWordBytes);
+    put(kDstOffset, dst_, kWordBytes);
+    put(header + kSportOffset, sport_, 2);
+    put(header + kDportOffset, dport_, 2);
+    return packet;
+  }
+
+  [[nodiscard]] auto describe() const -> string {
+    fmt::memory_buffer buffer;
+    appendIpv4(buffer, src_);
+    buffer.append(std::string_view(" -> "));
+    appendIpv4(buffer, dst_);
+    fmt::format_to(std::back_inserter(buffer),
+                   " proto {} ports {} -> {} frag 0x{:x} ihl {} in '{}' "
+                   "out '{}'",
+                   proto_, sport_, dport_, frag_, ihl_, iniface_, outiface_);
+    return fmt::to_string(buffer);
+  }
+};
+
+/* whether row matches packet, as the ip, tcp and udp matches decide it */
+auto rowMatches(const RulesetModel &model, uint32_t row,
+                const TestPacket &packet) -> bool {
+  auto any_ports =
+      model.sport_lo_[row] == 0 && model.sport_hi_[row] == kMaxPort &&
+      model.dport_lo_[row] == 0 && model.dport_hi_[row] == kMaxPort;
+  return (packet.src_ & model.smsk_[row]) == model.src_[row] &&
+         (packet.dst_ & model.dmsk_[row]) == model.dst_[row] &&
+         (model.proto_[row] == 0 || model.proto_[row] == packet.proto_) &&
+         ifaceMatches(model.ifaces_, model.iniface_[row], packet.iniface_) &&
+         ifaceMatches(model.ifaces_, model.outiface_[row], packet.outiface_) &&
+         (any_ports ||
+          ((packet.frag_ & kFragOffsetMask) == 0 &&
+           model.sport_lo_[row] <= packet.sport_ &&
+           packet.sport_ <= model.sport_hi_[row] &&
+           model.dport_lo_[row] <= packet.dport_ &&
+           packet.dport_ <= model.dport_hi_[row]));
+}
+
+class PacketGenerator {
+public:
+  PacketGenerator(const RulesetModel &model, const ModelChain &chain,
+                  uint32_t seed)
+      : model_(model), chain_(chain), random_(seed) {}
+
+  auto next() -> TestPacket {
+    static constexpr uint32_t kAroundRule = 3; /* of 4 packets */
+
+    TestPacket packet;
+    packet.src_ = word();
+    packet.dst_ = word();
+    packet.proto_ = proto();
+    packet.sport_ = static_cast<uint16_t>(word());
+    packet.dport_ = static_cast<uint16_t>(word());
+    packet.iniface_ = iface();
+    packet.outiface_ = iface();
+    if (chain_.size() > 0 && below(4) < kAroundRule) {
+      aroundRow(packet, chain_.begin_ + below(chain_.size()));
+    }
+
+    static constexpr uint32_t kMaxIhl = 15;
+    static constexpr uint16_t kMoreFragments = 0x2000;
+    packet.ihl_ = below(4) == 0 ? 5 + below(kMaxIhl - 5 + 1) : 5;
+    switch (below(8)) {
+    case 0:
+      packet.frag_ = 1 + below(kFragOffsetMask);
+      break;
+    case 1:
+      packet.frag_ = kMoreFragments;
+      break;
+    default:
+      break;
+    }
+    return packet;
+  }
+
+private:
+  const RulesetModel &model_;
+  const ModelChain &chain_;
+  std::mt19937 random_;
+
+  auto word() -> uint32_t { return random_(); }
+
+  auto below(uint32_t bound) -> uint32_t {
+    return std::uniform_int_distribution<uint32_t>(0, bound - 1)(random_);
+  }
+
+  auto proto() -> uint8_t {
+    static constexpr std::array<uint8_t, 3> kProtos = {
+        IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP};
+    return kProtos[below(kProtos.size())];
+  }
+
+  /* one of the interfaces of the chain's rules, or one matching a pattern */
+  auto iface() -> string {
+    if (model_.ifaces_.size() <= 1 || below(2) == 0) {
+      return "";
+    }
+    return expand(1 + below(model_.ifaces_.size() - 1));
+  }
+
+  /* name matching interface pattern id, with a random unit for a wildcard */
+  auto expand(uint16_t id) -> string {
+    static constexpr uint32_t kUnits = 10;
+    auto name = model_.ifaces_.get(id);
+    if (name.ends_with('+')) {
+      name.back() = static_cast<char>('0' + below(kUnits));
+    }
+    return name;
+  }
+
+  auto matchIface(uint16_t id, string &name) -> void {
+    if (id != 0 && below(8) != 0) {
+      name = expand(id);
+    }
+  }
+
+  /* port at or next to a bound of range, or inside it */
+  auto port(uint16_t lo, uint16_t hi) -> uint16_t {
+    switch (below(6)) {
+    case 0:
+      return lo == 0 ? lo : lo - 1;
+    case 1:
+      return lo;
+    case 2:
+      return hi;
+    case 3:
+      return hi == kMaxPort ? hi : hi + 1;
+    default:
+      return static_cast<uint16_t>(lo + below(hi - lo + 1));
+    }
+  }
+
+  /* move packet into the region of row, sometimes just outside of it */
+  auto aroundRow(TestPacket &packet, uint32_t row) -> void {
+    static constexpr uint32_t kAddressBits = 32;
+
+    packet.src_ = model_.src_[row] | (packet.src_ & ~model_.smsk_[row]);
+    packet.dst_ = model_.dst_[row] | (packet.dst_ & ~model_.dmsk_[row]);
+    if (model_.proto_[row] != 0 && below(8) != 0) {
+      packet.proto_ = model_.proto_[row];
+    }
+    if (model_.sport_lo_[row] <= model_.sport_hi_[row]) {
+      packet.sport_ = port(model_.sport_lo_[row], model_.sport_hi_[row]);
+    }
+    if (model_.dport_lo_[row] <= model_.dport_hi_[row]) {
+      packet.dport_ = port(model_.dport_lo_[row], model_.dport_hi_[row]);
+    }
+    matchIface(model_.iniface_[row], packet.iniface_);
+    matchIface(model_.outiface_[row], packet.outiface_);
+    if (below(4) == 0) {
+      auto &addr = below(2) == 0 ? packet.src_ : packet.dst_;
+      addr ^= 1U << below(kAddressBits);
+    }
+  }
+};
+
+} // namespace
+
+auto BpfPlan::summary() const -> string {
+  size_t members = removed_.size() + runs_.size();
+  return fmt::format("{} runs of {} rules compile into bpf matches, "
+                     "{} of {} rules removed",
+                     runs_.size(), members, removed_.size(), rule_count_);
+}
+
+auto BpfCompiler::compile(std::span<const RuleSpace> rules)
+    -> vector<struct sock_filter> {
+  vector<RuleCode> codes;
+  for (const auto &rule : rules) {
+    codes.push_back(RuleCodegen().generate(rule));
+  }
+
+  /* first instruction of each rule, entered with nothing in A */
+  vector<size_t> starts;
+  size_t size = 0;
+  for (const auto &code : codes) {
+    starts.push_back(size);
+    size += code.code_.size();
+  }
+  auto no_match = size;
+  auto match = size + 1;
+
+  vector<struct sock_filter> program;
+  for (size_t i = 0; i < codes.size(); i++) {
+    const auto &code = codes[i];
+    auto fail = i + 1 < codes.size() ? starts[i + 1] : no_match;
+
+    /* a failed first test leaves its value in A, the next rule may skip
+     * loading the same value */
+    auto first_fail = fail;
+    if (i + 1 < codes.size() && code.first_load_ &&
+        code.first_load_ == codes[i + 1].first_load_) {
+      first_fail = starts[i + 1] + codes[i + 1].first_test_;
+    }
+
+    for (size_t j = 0; j < code.code_.size(); j++) {
+      auto pc = starts[i] + j;
+      auto resolve = [&](Label label) -> size_t {
+        switch (label) {
+        case Label::NEXT:
+          return pc + 1;
+        case Label::FAIL:
+          return j == code.first_test_ ? first_fail : fail;
+        default:
+          return match;
+        }
+      };
+
+      auto insn = code.code_[j].insn_;
+      if (BPF_OP(insn.code) == BPF_JA && isJump(code.code_[j])) {
+        insn.k = resolve(code.code_[j].jt_) - pc - 1;
+      } else if (isJump(code.code_[j])) {
+        insn.jt = offsetTo(pc, resolve(code.code_[j].jt_));
+        insn.jf = offsetTo(pc, resolve(code.code_[j].jf_));
+      }
+      program.push_back(insn);
+    }
+  }
+  program.push_back(BPF_STMT(BPF_RET | BPF_K, kNoMatch));
+  program.push_back(BPF_STMT(BPF_RET | BPF_K, kMatch));
+  return program;
+}
+
+auto BpfCompiler::plan(const RulesetModel &model, uint32_t chain,
+                       size_t min_members) -> BpfPlan {
+  static const string kAnyAddr = "0.0.0.0";
+
+  const auto &model_chain = model.chains_[chain];
+  BpfPlan plan;
+  plan.chain_ = model.names_.get(model_chain.name_);
+  plan.rule_count_ = model_chain.size();
+
+  auto spaceOf = [&model](uint32_t row) -> optional<RuleSpace> {
+    const auto &target = model.targetOf(row);
+    if ((!target.isTerminal() && target.kind_ != TargetKind::RETURN) ||
+        RuleSpace::isUnmatchable(model, row)) {
+      return std::nullopt;
+    }
+    return RuleSpace::fromRow(model, row);
+  };
+  auto runKey = [&model](uint32_t row) {
+    return std::make_tuple(model.target_[row], model.iniface_[row],
+                           model.outiface_[row]);
+  };
+
+  auto row = model_chain.begin_;
+  while (row < model_chain.end_) {
+    auto first = spaceOf(row);
+    if (!first) {
+      row++;
+      continue;
+    }
+
+    auto head = row;
+    vector<RuleSpace> spaces = {*first};
+    auto program = compile(spaces);
+    for (row++; row < model_chain.end_ && runKey(row) == runKey(head); row++) {
+      auto space = spaceOf(row);
+      if (!space) {
+        break;
+      }
+      spaces.push_back(*space);
+      auto longer = compile(spaces);
+      if (longer.size() > kMaxInstructions) {
+        spaces.pop_back();
+        break;
+      }
+      program = std::move(longer);
+    }
+    if (spaces.size() < min_members) {
+      continue;
+    }
+
+    BpfRun run;
+    auto index = static_cast<int>(head - model_chain.begin_);
+    for (size_t i = 0; i < spaces.size(); i++) {
+      run.members_.push_back(index + static_cast<int>(i));
+    }
+    plan.removed_.insert(plan.removed_.end(), run.members_.begin() + 1,
+                         run.members_.end());
+
+    run.rule_ = std::make_shared<RuleRequest>();
+    run.rule_->index_ = index;
+    run.rule_->proto_ = RequestProto::ALL;
+    run.rule_->src_ip_ = run.rule_->src_mask_ = kAnyAddr;
+    run.rule_->dst_ip_ = run.rule_->dst_mask_ = kAnyAddr;
+    if (model.iniface_[head] != 0) {
+      run.rule_->iniface_ = model.ifaces_.get(model.iniface_[head]);
+    }
+    if (model.outiface_[head] != 0) {
+      run.rule_->outiface_ = model.ifaces_.get(model.outiface_[head]);
+    }
+    run.rule_->bpf_match_ = BpfMatch{std::move(program)};
+    run.rule_->target_ = model.names_.get(model.targetOf(head).name_);
+    plan.runs_.push_back(std::move(run));
+  }
+  return plan;
+}
+
+auto BpfCompiler::verify(const RulesetModel &model, uint32_t chain,
+                         const BpfPlan &plan, size_t packets,
+                         uint32_t seed) -> optional<string> {
+  const auto &model_chain = model.chains_[chain];
+
+  /* rows the planned chain keeps, and the run replacing each head */
+  vector<const BpfRun *> run_of(model_chain.size(), nullptr);
+  vector<uint8_t> removed(model_chain.size(), 0);
+  for (const auto &run : plan.runs_) {
+    const auto &program = run.rule_->bpf_match_->program_;
+    if (auto error = BpfInterpreter::check(program)) {
+      return fmt::format("program of rule #{}: {}", run.rule_->index_, *error);
+    }
+    if (program.size() > kMaxInstructions) {
+      return fmt::format("program of rule #{} has {} instructions",
+                         run.rule_->index_, program.size());
+    }
+    run_of[run.rule_->index_] = &run;
+  }
+  for (auto index : plan.removed_) {
+    removed[index] = 1;
+  }
+
+  /* rows with inversions or opaque matches are not simulated, they never
+   * match on both sides */
+  auto simulated = [&model](uint32_t row) { return model.flags_[row] == 0; };
+
+  PacketGenerator generator(model, model_chain, seed);
+  for (size_t n = 0; n < packets; n++) {
+    auto packet = generator.next();
+    auto bytes = packet.bytes();
+
+    optional<uint32_t> expected;
+    for (auto row = model_chain.begin_; row < model_chain.end_; row++) {
+      if (simulated(row) && rowMatches(model, row, packet)) {
+        expected = row;
+        break;
+      }
+    }
+
+    optional<uint32_t> actual;
+    for (auto row = model_chain.begin_; row < model_chain.end_; row++) {
+      const auto *run = run_of[row - model_chain.begin_];
+      if (run != nullptr) {
+        if (ifaceMatches(model.ifaces_, model.iniface_[row],
+                         packet.iniface_) &&
+            ifaceMatches(model.ifaces_, model.outiface_[row],
+                         packet.outiface_) &&
+            BpfInterpreter::run(run->rule_->bpf_match_->program_, bytes) !=
+                kNoMatch) {
+          actual = row;
+          break;
+        }
+      } else if (removed[row - model_chain.begin_] == 0 && simulated(row) &&
+                 rowMatches(model, row, packet)) {
+        actual = row;
+        break;
+      }
+    }
+
+    auto verdict = [&](optional<uint32_t> row) -> string {
+      return row ? model.names_.get(model.targetOf(*row).name_)
+                 : string("no match");
+    };
+    if (verdict(expected) != verdict(actual)) {
+      return fmt::format("{}: chain gives {}, plan gives {}",
+                         packet.describe(), verdict(expected),
+                         verdict(actual));
+    }
+  }
+  return std::nullopt;
+}
@@ -0,0 +1,289 @@
+#include "backend/firewall/bpf_interpreter.h"
+#include "fmt/format.h"
+
+#include <array>
+
+namespace {
+
+/* packet bytes [offset, offset + size) in network byte order */
+auto load(std::span<const uint8_t> packet, uint64_t offset, uint32_t size,
+          uint32_t &value) -> bool {
+  if (offset + size > packet.size()) {
+    return false;
+  }
+  value = 0;
+  for (uint32_t i = 0; i < size; i++) {
+    value = (value << 8) | packet[offset + i];
+  }
+  return true;
+}
+
+auto loadSize(uint16_t code) -> uint32_t {
+  switch (BPF_SIZE(code)) {
+  case BPF_W:
+    return 4;
+  case BPF_H:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+auto checkLoad(const struct sock_filter &insn) -> optional<string> {
+  switch (BPF_MODE(insn.code)) {
+  case BPF_IMM:
+  case BPF_LEN:
+    return std::nullopt;
+  case BPF_MEM:
+    if (insn.k >= BpfInterpreter::kMemWords) {
+      return fmt::format("scratch word {} out of range", insn.k);
+    }
+    return std::nullopt;
+  case BPF_ABS:
+  case BPF_IND:
+    if (BPF_CLASS(insn.code) == BPF_LDX) {
+      break;
+    }
+    if (static_cast<int32_t>(insn.k) < 0) {
+      return "ancillary loads are not supported";
+    }
+    return std::nullopt;
+  case BPF_MSH:
+    if (BPF_CLASS(insn.code) == BPF_LDX && BPF_SIZE(insn.code) == BPF_B) {
+      return std::nullopt;
+    }
+    break;
+  default:
+    break;
+  }
+  return fmt::format("unknown load 0x{:x}", insn.code);
+}
+
+auto checkAlu(const struct sock_filter &insn) -> optional<string> {
+  switch (BPF_OP(insn.code)) {
+  case BPF_DIV:
+  case BPF_MOD:
+    if (BPF_SRC(insn.code) == BPF_K && insn.k == 0) {
+      return "division by constant 0";
+    }
+    [[fallthrough]];
+  case BPF_ADD:
+  case BPF_SUB:
+  case BPF_MUL:
+  case BPF_OR:
+  case BPF_AND:
+  case BPF_XOR:
+  case BPF_NEG:
+    return std::nullopt;
+  case BPF_LSH:
+  case BPF_RSH:
+    if (BPF_SRC(insn.code) == BPF_K && insn.k >= 32) {
+      return fmt::format("shift by {}", insn.k);
+    }
+    return std::nullopt;
+  default:
+    return fmt::format("unknown alu operation 0x{:x}", insn.code);
+  }
+}
+
+auto checkJump(std::span<const struct sock_filter> program,
+               size_t pc) -> optional<string> {
+  const auto &insn = program[pc];
+  auto remaining = program.size() - pc - 1;
+  if (BPF_OP(insn.code) == BPF_JA) {
+    if (insn.k >= remaining) {
+      return fmt::format("jump out of program at {}", pc);
+    }
+    return std::nullopt;
+  }
+  switch (BPF_OP(insn.code)) {
+  case BPF_JEQ:
+  case BPF_JGT:
+  case BPF_JGE:
+  case BPF_JSET:
+    if (insn.jt >= remaining || insn.jf >= remaining) {
+      return fmt::format("jump out of program at {}", pc);
+    }
+    return std::nullopt;
+  default:
+    return fmt::format("unknown jump 0x{:x}", insn.code);
+  }
+}
+
+auto alu(uint16_t code, uint32_t a, uint32_t operand) -> uint32_t {
+  switch (BPF_OP(code)) {
+  case BPF_ADD:
+    return a + operand;
+  case BPF_SUB:
+    return a - operand;
+  case BPF_MUL:
+    return a * operand;
+  case BPF_DIV:
+    return a / operand;
+  case BPF_MOD:
+    return a % operand;
+  case BPF_OR:
+    return a | operand;
+  case BPF_AND:
+    return a & operand;
+  case BPF_XOR:
+    return a ^ operand;
+  case BPF_LSH:
+    return operand >= 32 ? 0 : a << operand;
+  case BPF_RSH:
+    return operand >= 32 ? 0 : a >> operand;
+  default: /* BPF_NEG */
+    return -a;
+  }
+}
+
+auto jumpTaken(uint16_t code, uint32_t a, uint32_t operand) -> bool {
+  switch (BPF_OP(code)) {
+  case BPF_JEQ:
+    return a == operand;
+  case BPF_JGT:
+    return a > operand;
+  case BPF_JGE:
+    return a >= operand;
+  default: /* BPF_JSET */
+    return (a & operand) != 0;
+  }
+}
+
+} // namespace
+
+auto BpfInterpreter::check(std::span<const struct sock_filter> program)
+    -> optional<string> {
+  if (program.empty() || program.size() > BPF_MAXINSNS) {
+    return fmt::format("program of {} instructions", program.size());
+  }
+
+  for (size_t pc = 0; pc < program.size(); pc++) {
+    const auto &insn = program[pc];
+    optional<string> error;
+    switch (BPF_CLASS(insn.code)) {
+    case BPF_LD:
+    case BPF_LDX:
+      error = checkLoad(insn);
+      break;
+    case BPF_ST:
+    case BPF_STX:
+      if (insn.k >= kMemWords) {
+        error = fmt::format("scratch word {} out of range", insn.k);
+      }
+      break;
+    case BPF_ALU:
+      error = checkAlu(insn);
+      break;
+    case BPF_JMP:
+      error = checkJump(program, pc);
+      break;
+    case BPF_RET:
+      if (BPF_RVAL(insn.code) != BPF_K && BPF_RVAL(insn.code) != BPF_A) {
+        error = fmt::format("unknown return 0x{:x}", insn.code);
+      }
+      break;
+    default: /* BPF_MISC */
+      if (BPF_MISCOP(insn.code) != BPF_TAX &&
+          BPF_MISCOP(insn.code) != BPF_TXA) {
+        error = fmt::format("unknown instruction 0x{:x}", insn.code);
+      }
+      break;
+    }
+    if (error) {
+      return fmt::format("instruction {}: {}", pc, *error);
+    }
+  }
+
+  if (BPF_CLASS(program.back().code) != BPF_RET) {
+    return "program does not end with a return";
+  }
+  return std::nullopt;
+}
+
+auto BpfInterpreter::run(std::span<const struct sock_filter> program,
+                         std::span<const uint8_t> packet) -> uint32_t {
+  uint32_t a = 0;
+  uint32_t x = 0;
+  std::array<uint32_t, kMemWords> mem{};
+
+  /* jumps only go forward, so the loop ends */
+  for (size_t pc = 0; pc < program.size(); pc++) {
+    const auto &insn = program[pc];
+    auto operand = BPF_SRC(insn.code) == BPF_X ? x : insn.k;
+    switch (BPF_CLASS(insn.code)) {
+    case BPF_LD:
+      switch (BPF_MODE(insn.code)) {
+      case BPF_IMM:
+        a = insn.k;
+        break;
+      case BPF_LEN:
+        a = packet.size();
+        break;
+      case BPF_MEM:
+        a = mem[insn.k];
+        break;
+      default: {
+        uint64_t offset = insn.k;
+        if (BPF_MODE(insn.code) == BPF_IND) {
+          offset += x;
+        }
+        if (!load(packet, offset, loadSize(insn.code), a)) {
+          return 0;
+        }
+        break;
+      }
+      }
+      break;
+    case BPF_LDX:
+      switch (BPF_MODE(insn.code)) {
+      case BPF_IMM:
+        x = insn.k;
+        break;
+      case BPF_LEN:
+        x = packet.size();
+        break;
+      case BPF_MEM:
+        x = mem[insn.k];
+        break;
+      default: /* BPF_MSH, length of IPv4 header */
+        if (!load(packet, insn.k, 1, x)) {
+          return 0;
+        }
+        x = (x & 0xf) << 2;
+        break;
+      }
+      break;
+    case BPF_ST:
+      mem[insn.k] = a;
+      break;
+    case BPF_STX:
+      mem[insn.k] = x;
+      break;
+    case BPF_ALU:
+      if ((BPF_OP(insn.code) == BPF_DIV || BPF_OP(insn.code) == BPF_MOD) &&
+          operand == 0) {
+        return 0;
+      }
+      a = alu(insn.code, a, operand);
+      break;
+    case BPF_JMP:
+      if (BPF_OP(insn.code) == BPF_JA) {
+        pc += insn.k;
+      } else {
+        pc += jumpTaken(insn.code, a, operand) ? insn.jt : insn.jf;
+      }
+      break;
+    case BPF_RET:
+      return BPF_RVAL(insn.code) == BPF_A ? a : insn.k;
+    default: /* BPF_MISC */
+      if (BPF_MISCOP(insn.code) == BPF_TAX) {
+        x = a;
+      } else {
+        a = x;
+      }
+      break;
+    }
+  }
+  return 0;
+}
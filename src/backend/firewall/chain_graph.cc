@@ -0,0 +1,398 @@
+#include "backend/firewall/chain_graph.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <string_view>
+#include <utility>
+
+namespace {
+
+using Kind = GraphRule::Kind;
+
+/* targets after which no later rule sees the packet */
+constexpr std::array<std::string_view, 10> kTerminalTargets = {
+    IPTC_LABEL_ACCEPT, IPTC_LABEL_DROP, IPTC_LABEL_QUEUE, "REJECT",
+    "NFQUEUE",         "DNAT",          "SNAT",           "MASQUERADE",
+    "REDIRECT",        "TPROXY"};
+
+auto saturatingAdd(uint64_t a, uint64_t b) -> uint64_t {
+  return a > std::numeric_limits<uint64_t>::max() - b
+             ? std::numeric_limits<uint64_t>::max()
+             : a + b;
+}
+
+class ChainCost {
+public:
+  uint64_t worst_{};
+  double evals_{};   /* rules evaluated per entering packet */
+  double returns_{}; /* fraction of entering packets that come back */
+  double packets_{};
+  bool cyclic_{};
+};
+
+/**
+ * costs of chains by depth first walk, a chain is settled once all chains
+ * it jumps to are, a chain met again while it is being walked closes a cycle
+ */
+class CostWalker {
+public:
+  template <typename Nodes>
+  CostWalker(const Nodes &nodes, vector<double> entering)
+      : entering_(std::move(entering)), state_(nodes.size()),
+        costs_(nodes.size()) {
+    for (const auto &node : nodes) {
+      rules_.push_back(&node.rules_);
+      builtin_.push_back(node.builtin_);
+      policy_.push_back(static_cast<double>(node.policy_pcnt_));
+    }
+  }
+
+  auto cost(uint32_t root) -> ChainCost {
+    /* explicit stack, chains can nest deeper than the call stack allows */
+    class Frame {
+    public:
+      uint32_t id_;
+      size_t pos_;
+    };
+
+    if (state_[root] == State::NEW) {
+      vector<Frame> stack;
+      stack.push_back({root, 0});
+      state_[root] = State::ACTIVE;
+      while (!stack.empty()) {
+        auto &frame = stack.back();
+        const auto &rules = *rules_[frame.id_];
+        if (frame.pos_ == rules.size()) {
+          costs_[frame.id_] = settle(frame.id_);
+          state_[frame.id_] = State::DONE;
+          stack.pop_back();
+          continue;
+        }
+        const auto &rule = rules[frame.pos_++];
+        if ((rule.kind_ == Kind::JUMP || rule.kind_ == Kind::GOTO) &&
+            state_[rule.chain_] == State::NEW) {
+          state_[rule.chain_] = State::ACTIVE;
+          stack.push_back({rule.chain_, 0});
+        }
+      }
+    }
+    return settled(root);
+  }
+
+private:
+  enum class State : uint8_t { NEW, ACTIVE, DONE };
+
+  /* a chain still being walked closes a cycle */
+  [[nodiscard]] auto settled(uint32_t id) const -> ChainCost {
+    if (state_[id] == State::DONE) {
+      return costs_[id];
+    }
+    return {.cyclic_ = true};
+  }
+
+  /* cost of a chain whose callees are all settled or on the walk */
+  auto settle(uint32_t id) const -> ChainCost {
+    const auto &rules = *rules_[id];
+    ChainCost result;
+
+    /* worst case from the last rule backwards, a taken goto ends the chain */
+    uint64_t worst = 0;
+    for (auto rule = rules.rbegin(); rule != rules.rend(); rule++) {
+      if (rule->kind_ == Kind::JUMP || rule->kind_ == Kind::GOTO) {
+        auto sub = settled(rule->chain_);
+        result.cyclic_ = result.cyclic_ || sub.cyclic_;
+        worst = rule->kind_ == Kind::JUMP
+                    ? saturatingAdd(sub.worst_, worst)
+                    : std::max(sub.worst_, worst);
+      }
+      worst = saturatingAdd(worst, 1);
+    }
+    result.worst_ = worst;
+
+    /* packets that left the chain before each rule, from rule counters */
+    vector<double> left(rules.size());
+    double gone = 0;
+    double returned = 0;
+    double sub_evals = 0;
+    for (size_t i = 0; i < rules.size(); i++) {
+      const auto &rule = rules[i];
+      auto pcnt = static_cast<double>(rule.pcnt_);
+      left[i] = gone;
+      switch (rule.kind_) {
+      case Kind::JUMP: {
+        auto sub = settled(rule.chain_);
+        sub_evals += pcnt * sub.evals_;
+        gone += pcnt * (1 - sub.returns_);
+        break;
+      }
+      case Kind::GOTO:
+        sub_evals += pcnt * settled(rule.chain_).evals_;
+        gone += pcnt;
+        break;
+      case Kind::RETURN:
+        returned += pcnt;
+        gone += pcnt;
+        break;
+      case Kind::TERMINAL:
+        gone += pcnt;
+        break;
+      default:
+        break;
+      }
+    }
+
+    /* a builtin chain is entered by what it decides plus its policy hits */
+    auto entering = builtin_[id] ? policy_[id] + gone : entering_[id];
+    result.packets_ = entering;
+    if (entering > 0) {
+      double evals = sub_evals;
+      for (auto before : left) {
+        evals += std::max(0.0, entering - before);
+      }
+      result.evals_ = evals / entering;
+      result.returns_ =
+          builtin_[id]
+              ? 0
+              : std::min(1.0, (std::max(0.0, entering - gone) + returned) /
+                                  entering);
+    } else {
+      result.returns_ = 1;
+    }
+    return result;
+  }
+
+  vector<const vector<GraphRule> *> rules_;
+  vector<bool> builtin_;
+  vector<double> policy_;
+  vector<double> entering_;
+  vector<State> state_;
+  vector<ChainCost> costs_;
+};
+
+} // namespace
+
+auto ChainGraph::build(struct iptc_handle *handle) -> ChainGraph {
+  ChainGraph graph;
+  for (const auto *chain = iptc_first_chain(handle); chain != nullptr;
+       chain = iptc_next_chain(handle)) {
+    graph.addNode(chain, iptc_builtin(chain, handle) != 0);
+  }
+  for (uint32_t id = 0; id < graph.nodes_.size(); id++) {
+    graph.readRules(id, handle);
+  }
+  return graph;
+}
+
+auto ChainGraph::invalidate(const string &chain) -> void {
+  stale_.insert(chain);
+}
+
+auto ChainGraph::sync(struct iptc_handle *handle) -> void {
+  /* nodes of new chains first, rules of other stale chains may jump there */
+  vector<uint32_t> changed;
+  for (const auto &chain : stale_) {
+    if (iptc_is_chain(chain.c_str(), handle) != 0) {
+      changed.push_back(
+          addNode(chain, iptc_builtin(chain.c_str(), handle) != 0));
+    } else if (auto iter = ids_.find(chain); iter != ids_.end()) {
+      setRules(iter->second, {});
+      nodes_[iter->second].alive_ = false;
+      ids_.erase(iter);
+    }
+  }
+  for (auto id : changed) {
+    readRules(id, handle);
+  }
+  stale_.clear();
+}
+
+auto ChainGraph::addNode(const string &chain, bool builtin) -> uint32_t {
+  if (auto iter = ids_.find(chain); iter != ids_.end()) {
+    return iter->second;
+  }
+  auto id = static_cast<uint32_t>(nodes_.size());
+  nodes_.push_back({chain, builtin, true});
+  ids_.emplace(chain, id);
+  return id;
+}
+
+auto ChainGraph::readRules(uint32_t id, struct iptc_handle *handle) -> void {
+  auto &node = nodes_[id];
+  vector<GraphRule> rules;
+  for (const auto *entry = iptc_first_rule(node.name_.c_str(), handle);
+       entry != nullptr; entry = iptc_next_rule(entry, handle)) {
+    GraphRule rule{Kind::PLAIN, 0, entry->counters.pcnt};
+    std::string_view target = iptc_get_target(entry, handle);
+    if (target == IPTC_LABEL_RETURN) {
+      rule.kind_ = Kind::RETURN;
+    } else if (std::ranges::find(kTerminalTargets, target) !=
+               kTerminalTargets.end()) {
+      rule.kind_ = Kind::TERMINAL;
+    } else if (auto iter = ids_.find(string(target)); iter != ids_.end()) {
+      rule.kind_ =
+          (entry->ip.flags & IPT_F_GOTO) != 0 ? Kind::GOTO : Kind::JUMP;
+      rule.chain_ = iter->second;
+    }
+    rules.push_back(rule);
+  }
+
+  if (node.builtin_) {
+    struct xt_counters counters {};
+    iptc_get_policy(node.name_.c_str(), &counters, handle);
+    node.policy_pcnt_ = counters.pcnt;
+  }
+  setRules(id, std::move(rules));
+}
+
+auto ChainGraph::setRules(uint32_t id, vector<GraphRule> rules) -> void {
+  auto isJump = [](const GraphRule &rule) {
+    return rule.kind_ == Kind::JUMP || rule.kind_ == Kind::GOTO;
+  };
+  for (const auto &rule : nodes_[id].rules_) {
+    if (isJump(rule)) {
+      nodes_[rule.chain_].refs_--;
+    }
+  }
+  for (const auto &rule : rules) {
+    if (isJump(rule)) {
+      nodes_[rule.chain_].refs_++;
+    }
+  }
+  nodes_[id].rules_ = std::move(rules);
+}
+
+auto ChainGraph::hasChain(const string &chain) const -> bool {
+  return ids_.contains(chain);
+}
+
+auto ChainGraph::references(const string &chain) const -> size_t {
+  auto iter = ids_.find(chain);
+  return iter == ids_.end() ? 0 : nodes_[iter->second].refs_;
+}
+
+auto ChainGraph::referrers(const string &chain) const -> vector<string> {
+  vector<string> names;
+  auto iter = ids_.find(chain);
+  if (iter == ids_.end()) {
+    return names;
+  }
+  for (const auto &node : nodes_) {
+    auto next = successors(node);
+    if (node.alive_ && std::ranges::find(next, iter->second) != next.end()) {
+      names.push_back(node.name_);
+    }
+  }
+  return names;
+}
+
+auto ChainGraph::successors(const Node &node) const -> vector<uint32_t> {
+  vector<uint32_t> ids;
+  for (const auto &rule : node.rules_) {
+    if ((rule.kind_ == Kind::JUMP || rule.kind_ == Kind::GOTO) &&
+        std::ranges::find(ids, rule.chain_) == ids.end()) {
+      ids.push_back(rule.chain_);
+    }
+  }
+  return ids;
+}
+
+auto ChainGraph::unreachable() const -> vector<string> {
+  vector<bool> seen(nodes_.size());
+  vector<uint32_t> pending;
+  for (uint32_t id = 0; id < nodes_.size(); id++) {
+    if (nodes_[id].alive_ && nodes_[id].builtin_) {
+      seen[id] = true;
+      pending.push_back(id);
+    }
+  }
+  while (!pending.empty()) {
+    auto id = pending.back();
+    pending.pop_back();
+    for (auto next : successors(nodes_[id])) {
+      if (!seen[next]) {
+        seen[next] = true;
+        pending.push_back(next);
+      }
+    }
+  }
+
+  vector<string> names;
+  for (uint32_t id = 0; id < nodes_.size(); id++) {
+    if (nodes_[id].alive_ && !seen[id]) {
+      names.push_back(nodes_[id].name_);
+    }
+  }
+  return names;
+}
+
+auto ChainGraph::findCycle() const -> vector<string> {
+  enum class State : uint8_t { NEW, ACTIVE, DONE };
+  vector<State> state(nodes_.size(), State::NEW);
+
+  /* explicit stack, chains can nest deeper than the call stack allows */
+  class Frame {
+  public:
+    uint32_t id_;
+    vector<uint32_t> next_;
+    size_t pos_;
+  };
+
+  for (uint32_t root = 0; root < nodes_.size(); root++) {
+    if (!nodes_[root].alive_ || state[root] != State::NEW) {
+      continue;
+    }
+    vector<Frame> stack;
+    stack.push_back({root, successors(nodes_[root]), 0});
+    state[root] = State::ACTIVE;
+    while (!stack.empty()) {
+      auto &frame = stack.back();
+      if (frame.pos_ == frame.next_.size()) {
+        state[frame.id_] = State::DONE;
+        stack.pop_back();
+        continue;
+      }
+      auto next = frame.next_[frame.pos_++];
+      if (state[next] == State::NEW) {
+        state[next] = State::ACTIVE;
+        stack.push_back({next, successors(nodes_[next]), 0});
+      } else if (state[next] == State::ACTIVE) {
+        auto begin = std::ranges::find_if(
+            stack, [next](const Frame &item) { return item.id_ == next; });
+        vector<string> cycle;
+        for (auto iter = begin; iter != stack.end(); iter++) {
+          cycle.push_back(nodes_[iter->id_].name_);
+        }
+        cycle.push_back(nodes_[next].name_);
+        return cycle;
+      }
+    }
+  }
+  return {};
+}
+
+auto ChainGraph::hookCosts() const -> vector<HookCost> {
+  /* user chains are entered by the packets their referrers counted */
+  vector<double> entering(nodes_.size());
+  for (const auto &node : nodes_) {
+    for (const auto &rule : node.rules_) {
+      if (rule.kind_ == Kind::JUMP || rule.kind_ == Kind::GOTO) {
+        entering[rule.chain_] += static_cast<double>(rule.pcnt_);
+      }
+    }
+  }
+
+  CostWalker walker(nodes_, std::move(entering));
+  vector<HookCost> costs;
+  for (uint32_t id = 0; id < nodes_.size(); id++) {
+    if (!nodes_[id].alive_ || !nodes_[id].builtin_) {
+      continue;
+    }
+    auto cost = walker.cost(id);
+    costs.push_back({nodes_[id].name_, cost.worst_, cost.evals_,
+                     static_cast<uint64_t>(cost.packets_), cost.cyclic_});
+  }
+  return costs;
+}
@@ -0,0 +1,461 @@
+#include "backend/firewall/chain_optimizer.h"
+#include "backend/firewall/rule_space.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <bit>
+#include <netinet/in.h>
+#include <numeric>
+#include <unordered_map>
+
+namespace {
+
+constexpr size_t kMaxDepth = 16;
+constexpr size_t kMaxChains = 1024;
+constexpr size_t kMaxParts = 16;
+
+/* rules of plan are bounded by this multiple of the chain size */
+constexpr size_t kMaxGrowth = 4;
+constexpr uint16_t kMaxPort = 65535;
+constexpr int kAddrBits = 32;
+
+/* "<base>_t<id>" has to fit into 28 chars of chain name */
+constexpr size_t kBaseNameLength = 20;
+
+auto anySpace() -> RuleSpace {
+  return RuleSpace{0, 0, 0, 0, 0, 0, 0, 0, kMaxPort, 0, kMaxPort};
+}
+
+auto prefixMask(int length) -> uint32_t {
+  return length == 0 ? 0 : ~0U << (kAddrBits - length);
+}
+
+/* addresses known for every packet reaching a node */
+class NodeContext {
+public:
+  uint32_t dst_{};
+  int dst_len_{};
+  uint32_t src_{};
+  int src_len_{};
+};
+
+/**
+ * dispatch of one node, rows of each part overlap its region, rest rows are
+ * not covered by any region and stay in the node after the dispatch rules
+ */
+class Split {
+public:
+  vector<RuleSpace> regions_;
+  vector<NodeContext> contexts_;
+  vector<vector<uint32_t>> parts_;
+  vector<uint32_t> rest_;
+
+  /* rules evaluated on the longest path through the node and one child */
+  size_t cost_{};
+  size_t total_{};
+};
+
+class TreeBuilder {
+public:
+  TreeBuilder(const RulesetModel &model, const ModelChain &chain,
+              ChainPlan &plan)
+      : model_(model), chain_(chain), plan_(plan) {}
+
+  auto build(const ctx_t &context) -> bool {
+    const auto &name = model_.names_.get(chain_.name_);
+    if (!chain_.builtin_) {
+      context->setLastError(
+          fmt::format("Only builtin chains can be optimized: {}", name));
+      return false;
+    }
+    policy_ = model_.names_.get(model_.targets_[chain_.policy_].name_);
+    base_name_ = name.substr(0, kBaseNameLength);
+
+    vector<uint32_t> rows;
+    for (auto row = chain_.begin_; row < chain_.end_; row++) {
+      const auto &target = model_.targetOf(row);
+      auto space = RuleSpace::fromRow(model_, row);
+      auto proto = model_.proto_[row];
+      if (!space || target.kind_ == TargetKind::EXTENSION ||
+          (proto != 0 && proto != IPPROTO_TCP && proto != IPPROTO_UDP)) {
+        context->setLastError(
+            fmt::format("Rule #{} of {} cannot be rewritten",
+                        row - chain_.begin_, name));
+        return false;
+      }
+
+      spaces_.push_back(*space);
+      if (target.kind_ == TargetKind::RETURN) {
+        /* children never return, RETURN of builtin chain is the policy */
+        targets_.push_back(policy_);
+      } else if (target.kind_ == TargetKind::FALLTHROUGH) {
+        targets_.emplace_back();
+      } else {
+        targets_.push_back(model_.names_.get(target.name_));
+      }
+
+      /* rule never matches, address has bits outside of mask */
+      if (!RuleSpace::isUnmatchable(model_, row)) {
+        rows.push_back(row - chain_.begin_);
+      }
+    }
+
+    assigned_ = rows.size();
+    if (rows.size() <= ChainOptimizer::kLeafSize ||
+        !bestSplit(rows, NodeContext{})) {
+      context->setLastError(
+          fmt::format("No field splits {} into shorter chains", name));
+      return false;
+    }
+
+    cost_sum_.assign(spaces_.size(), 0);
+    paths_.assign(spaces_.size(), 0);
+    plan_.chain_ = name;
+    plan_.ruleset_.table_ = model_.table_;
+    plan_.ruleset_.chains_.push_back(ChainRuleset{name, policy_, {}});
+    fill(0, rows, NodeContext{}, 0, 0);
+
+    measure();
+    return true;
+  }
+
+private:
+  const RulesetModel &model_;
+  const ModelChain &chain_;
+  ChainPlan &plan_;
+
+  string policy_;
+  string base_name_;
+  uint32_t next_id_{};
+
+  /* rules assigned to chains of the plan so far */
+  size_t assigned_{};
+
+  /* by rule index in chain */
+  vector<RuleSpace> spaces_;
+  vector<string> targets_;
+  vector<size_t> cost_sum_;
+  vector<size_t> paths_;
+
+  auto nextChainName() -> string {
+    string name;
+    do {
+      name = fmt::format("{}_t{}", base_name_, ++next_id_);
+    } while (model_.findChain(name).has_value());
+    return name;
+  }
+
+  auto request(const RuleSpace &space,
+               const string &target) const -> shared_ptr<RuleRequest> {
+    return space.toRequest(model_.ifaces_, target);
+  }
+
+  /* prefix is the number of rules evaluated before entering the chain */
+  auto fill(size_t index, vector<uint32_t> rows, const NodeContext &node,
+            size_t prefix, size_t depth) -> void {
+    auto &chains = plan_.ruleset_.chains_;
+    optional<Split> split;
+    if (rows.size() > ChainOptimizer::kLeafSize && depth < kMaxDepth &&
+        chains.size() < kMaxChains) {
+      split = bestSplit(rows, node);
+    }
+    if (split) {
+      assigned_ += split->total_ - rows.size();
+    }
+
+    size_t position = 0;
+    if (split) {
+      for (size_t k = 0; k < split->regions_.size(); k++) {
+        auto name = nextChainName();
+        chains.push_back(ChainRuleset{name, std::nullopt, {}});
+        auto child = chains.size() - 1;
+        chains[index].rules_.push_back(request(split->regions_[k], name));
+        position++;
+        fill(child, std::move(split->parts_[k]), split->contexts_[k],
+             prefix + position, depth + 1);
+      }
+      rows = std::move(split->rest_);
+    }
+
+    for (auto row : rows) {
+      chains[index].rules_.push_back(request(spaces_[row], targets_[row]));
+      position++;
+      cost_sum_[row] += prefix + position;
+      paths_[row]++;
+    }
+
+    /* child must not return into the dispatching chain */
+    if (index != 0) {
+      chains[index].rules_.push_back(request(anySpace(), policy_));
+      position++;
+    }
+    plan_.after_worst_ = std::max(plan_.after_worst_, prefix + position);
+  }
+
+  auto measure() -> void {
+    auto size = spaces_.size();
+    auto counted = std::any_of(model_.pcnt_.begin() + chain_.begin_,
+                               model_.pcnt_.begin() + chain_.end_,
+                               [](uint64_t pcnt) { return pcnt != 0; });
+
+    double weights = 0;
+    double before = 0;
+    double after = 0;
+    for (size_t row = 0; row < size; row++) {
+      if (paths_[row] == 0) {
+        continue;
+      }
+      auto weight = counted ? static_cast<double>(
+                                  model_.pcnt_[chain_.begin_ + row])
+                            : 1.0;
+      weights += weight;
+      before += weight * static_cast<double>(row + 1);
+      after += weight * static_cast<double>(cost_sum_[row]) /
+               static_cast<double>(paths_[row]);
+    }
+
+    if (weights > 0) {
+      plan_.before_avg_ = before / weights;
+      plan_.after_avg_ = after / weights;
+    }
+    plan_.before_worst_ = size;
+  }
+
+  auto partition(const vector<uint32_t> &rows, vector<RuleSpace> regions,
+                 vector<NodeContext> contexts) const -> Split {
+    Split split;
+    split.parts_.resize(regions.size());
+    for (auto row : rows) {
+      auto covered = false;
+      for (size_t k = 0; k < regions.size(); k++) {
+        if (regions[k].overlaps(spaces_[row], model_.ifaces_)) {
+          split.parts_[k].push_back(row);
+          covered = covered || regions[k].covers(spaces_[row], model_.ifaces_);
+        }
+      }
+      if (!covered) {
+        split.rest_.push_back(row);
+      }
+    }
+
+    /* larger parts are dispatched first */
+    vector<size_t> order(regions.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::stable_sort(order, std::ranges::greater{}, [&](size_t k) {
+      return split.parts_[k].size();
+    });
+
+    vector<vector<uint32_t>> parts;
+    for (auto k : order) {
+      split.regions_.push_back(regions[k]);
+      split.contexts_.push_back(contexts[k]);
+      parts.push_back(std::move(split.parts_[k]));
+    }
+    split.parts_ = std::move(parts);
+
+    split.total_ = split.regions_.size() + split.rest_.size();
+    split.cost_ = split.total_;
+    for (size_t k = 0; k < split.parts_.size(); k++) {
+      split.cost_ = std::max(split.cost_, k + 1 + split.parts_[k].size());
+      split.total_ += split.parts_[k].size();
+    }
+    return split;
+  }
+
+  auto protoSplit(const vector<uint32_t> &rows,
+                  const NodeContext &node) const -> optional<Split> {
+    vector<uint8_t> protos;
+    for (auto row : rows) {
+      auto proto = spaces_[row].proto_;
+      if (proto != 0 && std::ranges::find(protos, proto) == protos.end()) {
+        protos.push_back(proto);
+      }
+    }
+    if (protos.empty()) {
+      return std::nullopt;
+    }
+
+    vector<RuleSpace> regions;
+    for (auto proto : protos) {
+      regions.push_back(anySpace());
+      regions.back().proto_ = proto;
+    }
+    return partition(rows, std::move(regions),
+                     vector<NodeContext>(protos.size(), node));
+  }
+
+  auto ifaceSplit(const vector<uint32_t> &rows,
+                  const NodeContext &node) const -> optional<Split> {
+    std::unordered_map<uint16_t, size_t> counts;
+    for (auto row : rows) {
+      auto iface = spaces_[row].iniface_;
+      if (iface != 0 && model_.ifaces_.get(iface).back() != '+') {
+        counts[iface]++;
+      }
+    }
+    if (counts.empty()) {
+      return std::nullopt;
+    }
+
+    vector<std::pair<uint16_t, size_t>> frequent(counts.begin(), counts.end());
+    std::ranges::sort(frequent, std::ranges::greater{},
+                      &std::pair<uint16_t, size_t>::second);
+    frequent.resize(std::min(frequent.size(), kMaxParts));
+
+    vector<RuleSpace> regions;
+    for (auto [iface, count] : frequent) {
+      regions.push_back(anySpace());
+      regions.back().iniface_ = iface;
+    }
+    return partition(rows, std::move(regions),
+                     vector<NodeContext>(frequent.size(), node));
+  }
+
+  /* split on the first address bit beyond node prefix where rules differ */
+  auto prefixSplit(const vector<uint32_t> &rows, const NodeContext &node,
+                   bool dst) const -> optional<Split> {
+    auto addrOf = [&](uint32_t row) {
+      return dst ? spaces_[row].dst_ : spaces_[row].src_;
+    };
+    auto lengthOf = [&](uint32_t row) {
+      return std::countl_one(dst ? spaces_[row].dmsk_ : spaces_[row].smsk_);
+    };
+
+    auto length = dst ? node.dst_len_ : node.src_len_;
+    optional<uint32_t> sample;
+    int bit = length;
+    for (; bit < kAddrBits; bit++) {
+      auto mask = 1U << (kAddrBits - 1 - bit);
+      auto zeros = false;
+      auto ones = false;
+      sample.reset();
+      for (auto row : rows) {
+        if (lengthOf(row) > bit) {
+          sample = addrOf(row);
+          ((addrOf(row) & mask) != 0 ? ones : zeros) = true;
+        }
+      }
+      if (!sample || (zeros && ones)) {
+        break;
+      }
+    }
+    if (!sample) {
+      return std::nullopt;
+    }
+
+    auto common = *sample & prefixMask(bit);
+    vector<RuleSpace> regions(2, anySpace());
+    vector<NodeContext> contexts(2, node);
+    for (uint32_t half = 0; half < 2; half++) {
+      auto addr = common | (half << (kAddrBits - 1 - bit));
+      auto mask = prefixMask(bit + 1);
+      if (dst) {
+        regions[half].dst_ = addr;
+        regions[half].dmsk_ = mask;
+        contexts[half].dst_ = addr;
+        contexts[half].dst_len_ = bit + 1;
+      } else {
+        regions[half].src_ = addr;
+        regions[half].smsk_ = mask;
+        contexts[half].src_ = addr;
+        contexts[half].src_len_ = bit + 1;
+      }
+    }
+    return partition(rows, std::move(regions), std::move(contexts));
+  }
+
+  /* split dport of the only port protocol at the median boundary */
+  auto portSplit(const vector<uint32_t> &rows,
+                 const NodeContext &node) const -> optional<Split> {
+    uint8_t proto = 0;
+    vector<uint32_t> bounds;
+    for (auto row : rows) {
+      const auto &space = spaces_[row];
+      if (space.proto_ == 0) {
+        continue;
+      }
+      if (proto != 0 && proto != space.proto_) {
+        return std::nullopt;
+      }
+      proto = space.proto_;
+      if (space.dport_lo_ != 0) {
+        bounds.push_back(space.dport_lo_);
+      }
+      if (space.dport_hi_ != kMaxPort) {
+        bounds.push_back(space.dport_hi_ + 1);
+      }
+    }
+    if (bounds.empty()) {
+      return std::nullopt;
+    }
+
+    auto median = bounds.begin() + static_cast<long>(bounds.size() / 2);
+    std::ranges::nth_element(bounds, median);
+    auto low = static_cast<uint16_t>(*median);
+
+    vector<RuleSpace> regions(2, anySpace());
+    regions[0].proto_ = proto;
+    regions[0].dport_hi_ = static_cast<uint16_t>(low - 1);
+    regions[1].proto_ = proto;
+    regions[1].dport_lo_ = low;
+    return partition(rows, std::move(regions), vector<NodeContext>(2, node));
+  }
+
+  auto bestSplit(const vector<uint32_t> &rows,
+                 const NodeContext &node) const -> optional<Split> {
+    optional<Split> best;
+    auto consider = [&](optional<Split> split) {
+      /* require a real gain and bound the duplication of rules */
+      if (!split || split->cost_ * 10 >= rows.size() * 9 ||
+          assigned_ + split->total_ - rows.size() >
+              spaces_.size() * kMaxGrowth) {
+        return;
+      }
+      if (!best || split->cost_ < best->cost_ ||
+          (split->cost_ == best->cost_ && split->total_ < best->total_)) {
+        best = std::move(split);
+      }
+    };
+
+    consider(ifaceSplit(rows, node));
+    consider(protoSplit(rows, node));
+    consider(prefixSplit(rows, node, true));
+    consider(prefixSplit(rows, node, false));
+    consider(portSplit(rows, node));
+    return best;
+  }
+};
+
+} // namespace
+
+auto ChainPlan::ruleCount() const -> size_t {
+  size_t count = 0;
+  for (const auto &chain : ruleset_.chains_) {
+    count += chain.rules_.size();
+  }
+  return count;
+}
+
+auto ChainPlan::summary() const -> string {
+  return fmt::format(
+      "{} rules in {} chains, rules evaluated per matched packet {:.1f} -> "
+      "{:.1f}, longest path {} -> {}",
+      ruleCount(), ruleset_.chains_.size(), before_avg_, after_avg_,
+      before_worst_, after_worst_);
+}
+
+auto ChainOptimizer::plan(const RulesetModel &model, const string &chain,
+                          const ctx_t &context) -> optional<ChainPlan> {
+  auto index = model.findChain(chain);
+  if (!index) {
+    context->setLastError(fmt::format("Unknown chain: {}", chain));
+    return std::nullopt;
+  }
+
+  ChainPlan plan;
+  TreeBuilder builder(model, model.chains_[*index], plan);
+  if (!builder.build(context)) {
+    return std::nullopt;
+  }
+  return plan;
+}
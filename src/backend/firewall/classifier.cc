@@ -0,0 +1,360 @@
+#include "backend/firewall/classifier.h"
+#include "tools/nettools.h"
+
+#include <arpa/inet.h>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <netinet/in.h>
+#include <tuple>
+#include <utility>
+
+namespace {
+
+/* 128-bit lanes, available on every x86-64 (SSE2) and aarch64 (NEON) */
+constexpr uint32_t kLanes = 4;
+
+using lane_u32 = uint32_t __attribute__((vector_size(kLanes * 4)));
+using lane_i32 = int32_t __attribute__((vector_size(kLanes * 4)));
+using lane_u16 = uint16_t __attribute__((vector_size(kLanes * 2)));
+using lane_u8 = uint8_t __attribute__((vector_size(kLanes)));
+
+template <typename Lane, typename T> auto load(const T *column) -> Lane {
+  Lane lane;
+  memcpy(&lane, column, sizeof(lane));
+  return lane;
+}
+
+auto widen(lane_u16 lane) -> lane_u32 {
+  return __builtin_convertvector(lane, lane_u32);
+}
+
+auto widen(lane_u8 lane) -> lane_u32 {
+  return __builtin_convertvector(lane, lane_u32);
+}
+
+/* extension targets which continue with the next rule */
+auto isContinuing(const string &target) -> bool {
+  static const std::array<string_view, 19> kTargets = {
+      "LOG",      "NFLOG",   "MARK",        "CONNMARK", "TRACE",
+      "CLASSIFY", "TOS",     "TTL",         "CT",       "DSCP",
+      "TCPMSS",   "SECMARK", "CONNSECMARK", "SET",      "NOTRACK",
+      "AUDIT",    "HMARK",   "ECN",         "CHECKSUM"};
+  return std::ranges::find(kTargets, target) != kTargets.end();
+}
+
+/* extension targets which end the traversal with a verdict */
+auto isTerminal(const string &target) -> bool {
+  static const std::array<string_view, 8> kTargets = {
+      "REJECT",   "DNAT",   "SNAT",    "MASQUERADE",
+      "REDIRECT", "NETMAP", "NFQUEUE", "TPROXY"};
+  return std::ranges::find(kTargets, target) != kTargets.end();
+}
+
+/* iptables interface pattern, trailing '+' matches any suffix */
+auto matchIface(string_view pattern, string_view name) -> bool {
+  if (!pattern.empty() && pattern.back() == '+') {
+    pattern.remove_suffix(1);
+    return name.substr(0, pattern.size()) == pattern;
+  }
+  return pattern == name;
+}
+
+auto nextField(string_view &line) -> string_view {
+  auto begin = line.find_first_not_of(" \t,");
+  if (begin == string_view::npos) {
+    line = {};
+    return {};
+  }
+  line.remove_prefix(begin);
+  auto end = std::min(line.find_first_of(" \t,"), line.size());
+  auto field = line.substr(0, end);
+  line.remove_prefix(end);
+  return field;
+}
+
+template <typename T>
+auto parseField(string_view field, T &value) -> bool {
+  const auto *end = field.data() + field.size();
+  auto [ptr, ec] = std::from_chars(field.data(), end, value);
+  return ec == std::errc() && ptr == end && !field.empty();
+}
+
+auto parseAddr(string_view field, uint32_t &addr) -> bool {
+  /* "255.255.255.255" */
+  std::array<char, 16> text{};
+  if (field.size() >= text.size()) {
+    return false;
+  }
+  std::copy(field.begin(), field.end(), text.begin());
+  struct in_addr parsed {};
+  if (inet_pton(AF_INET, text.data(), &parsed) != 1) {
+    return false;
+  }
+  addr = ntohl(parsed.s_addr);
+  return true;
+}
+
+} // namespace
+
+auto PacketTuple::parse(string_view line) -> optional<PacketTuple> {
+  PacketTuple packet;
+  auto src = nextField(line);
+  auto dst = nextField(line);
+  auto proto = nextField(line);
+  auto sport = nextField(line);
+  auto dport = nextField(line);
+  if (!parseAddr(src, packet.src_) || !parseAddr(dst, packet.dst_) ||
+      !parseField(sport, packet.sport_) || !parseField(dport, packet.dport_)) {
+    return std::nullopt;
+  }
+
+  if (proto == "tcp" || proto == "TCP") {
+    packet.proto_ = IPPROTO_TCP;
+  } else if (proto == "udp" || proto == "UDP") {
+    packet.proto_ = IPPROTO_UDP;
+  } else if (!parseField(proto, packet.proto_)) {
+    return std::nullopt;
+  }
+
+  auto iniface = nextField(line);
+  auto outiface = nextField(line);
+  if (iniface != "-") {
+    packet.iniface_ = string(iniface);
+  }
+  if (outiface != "-") {
+    packet.outiface_ = string(outiface);
+  }
+  return packet;
+}
+
+Classifier::Classifier(shared_ptr<const RulesetModel> model)
+    : model_(std::move(model)) {}
+
+auto Classifier::matchInterfaces(const PacketTuple &packet,
+                                 InterfaceMatch &ifaces) const -> void {
+  const auto &pool = model_->ifaces_;
+  if (ifaces.in_.size() != pool.size() || ifaces.iniface_ != packet.iniface_) {
+    ifaces.iniface_ = packet.iniface_;
+    ifaces.in_.resize(pool.size());
+    for (uint32_t id = 0; id < pool.size(); id++) {
+      ifaces.in_[id] = matchIface(pool.get(id), packet.iniface_) ? 1 : 0;
+    }
+  }
+  if (ifaces.out_.size() != pool.size() ||
+      ifaces.outiface_ != packet.outiface_) {
+    ifaces.outiface_ = packet.outiface_;
+    ifaces.out_.resize(pool.size());
+    for (uint32_t id = 0; id < pool.size(); id++) {
+      ifaces.out_[id] = matchIface(pool.get(id), packet.outiface_) ? 1 : 0;
+    }
+  }
+}
+
+auto Classifier::matchRow(const PacketTuple &packet,
+                          const InterfaceMatch &ifaces,
+                          uint32_t row) const -> bool {
+  const auto &model = *model_;
+  auto flags = model.flags_[row];
+  auto inverse = [flags](uint8_t flag) { return (flags & flag) != 0; };
+
+  if (((packet.src_ & model.smsk_[row]) == model.src_[row]) ==
+          inverse(RulesetModel::kInvSrc) ||
+      ((packet.dst_ & model.dmsk_[row]) == model.dst_[row]) ==
+          inverse(RulesetModel::kInvDst)) {
+    return false;
+  }
+
+  /* empty interface is id 0 and matches every packet */
+  auto iniface = model.iniface_[row];
+  auto outiface = model.outiface_[row];
+  if ((iniface != 0 &&
+       (ifaces.in_[iniface] != 0) == inverse(RulesetModel::kInvIniface)) ||
+      (outiface != 0 &&
+       (ifaces.out_[outiface] != 0) == inverse(RulesetModel::kInvOutiface))) {
+    return false;
+  }
+
+  auto proto = model.proto_[row];
+  if (proto != 0 &&
+      (packet.proto_ == proto) == inverse(RulesetModel::kInvProto)) {
+    return false;
+  }
+
+  return !inverse(RulesetModel::kFragment) &&
+         model.sport_lo_[row] <= packet.sport_ &&
+         packet.sport_ <= model.sport_hi_[row] &&
+         model.dport_lo_[row] <= packet.dport_ &&
+         packet.dport_ <= model.dport_hi_[row];
+}
+
+auto Classifier::firstMatch(const PacketTuple &packet,
+                            const InterfaceMatch &ifaces, uint32_t begin,
+                            uint32_t end,
+                            vector<uint32_t> &uncertain) const -> uint32_t {
+  const auto &model = *model_;
+  auto confirm = [&](uint32_t row) {
+    if (!matchRow(packet, ifaces, row)) {
+      return false;
+    }
+    if ((model.flags_[row] & RulesetModel::kOpaqueMatch) != 0) {
+      uncertain.push_back(row);
+      return false;
+    }
+    return true;
+  };
+
+  const lane_u32 src = packet.src_ - lane_u32{};
+  const lane_u32 dst = packet.dst_ - lane_u32{};
+  const lane_u32 proto = packet.proto_ - lane_u32{};
+  const lane_u32 sport = packet.sport_ - lane_u32{};
+  const lane_u32 dport = packet.dport_ - lane_u32{};
+  const lane_u32 zero{};
+
+  auto row = begin;
+  for (; row + kLanes <= end; row += kLanes) {
+    auto flags = widen(load<lane_u8>(&model.flags_[row]));
+    auto inv_src = (flags & RulesetModel::kInvSrc) != zero;
+    auto inv_dst = (flags & RulesetModel::kInvDst) != zero;
+    auto inv_proto = (flags & RulesetModel::kInvProto) != zero;
+
+    lane_i32 hit =
+        ((src & load<lane_u32>(&model.smsk_[row])) ==
+         load<lane_u32>(&model.src_[row])) ^
+        inv_src;
+    hit &= ((dst & load<lane_u32>(&model.dmsk_[row])) ==
+            load<lane_u32>(&model.dst_[row])) ^
+           inv_dst;
+
+    auto rule_proto = widen(load<lane_u8>(&model.proto_[row]));
+    hit &= (rule_proto == zero) | ((rule_proto == proto) ^ inv_proto);
+    hit &= (flags & RulesetModel::kFragment) == zero;
+
+    hit &= widen(load<lane_u16>(&model.sport_lo_[row])) <= sport;
+    hit &= sport <= widen(load<lane_u16>(&model.sport_hi_[row]));
+    hit &= widen(load<lane_u16>(&model.dport_lo_[row])) <= dport;
+    hit &= dport <= widen(load<lane_u16>(&model.dport_hi_[row]));
+
+    for (uint32_t lane = 0; lane < kLanes; lane++) {
+      if (hit[lane] != 0 && confirm(row + lane)) {
+        return row + lane;
+      }
+    }
+  }
+
+  for (; row < end; row++) {
+    if (confirm(row)) {
+      return row;
+    }
+  }
+  return end;
+}
+
+auto Classifier::classify(const PacketTuple &packet,
+                          uint32_t chain) const -> ClassifyResult {
+  InterfaceMatch ifaces;
+  matchInterfaces(packet, ifaces);
+  return classify(packet, chain, ifaces);
+}
+
+auto Classifier::classify(const PacketTuple &packet, uint32_t chain,
+                          const InterfaceMatch &ifaces) const
+    -> ClassifyResult {
+  const auto &model = *model_;
+  ClassifyResult result;
+
+  /* return addresses of taken jumps, kernel rejects loops so the depth is
+   * bounded by the number of chains */
+  vector<std::pair<uint32_t, uint32_t>> stack;
+  auto current = chain;
+  auto row = model.chains_[current].begin_;
+
+  while (true) {
+    const auto &range = model.chains_[current];
+    auto hit = firstMatch(packet, ifaces, row, range.end_, result.uncertain_);
+    const auto *target = hit == range.end_ ? nullptr : &model.targetOf(hit);
+
+    /* end of chain and RETURN leave it the same way */
+    if (target == nullptr || target->kind_ == TargetKind::RETURN) {
+      if (stack.empty()) {
+        /* start chain left, policy of builtin or return to caller */
+        if (range.builtin_) {
+          result.target_ = range.policy_;
+        }
+        return result;
+      }
+      std::tie(current, row) = stack.back();
+      stack.pop_back();
+      continue;
+    }
+
+    switch (target->kind_) {
+    case TargetKind::FALLTHROUGH:
+      row = hit + 1;
+      continue;
+    case TargetKind::JUMP:
+      if (stack.size() >= model.chains_.size()) {
+        result.rule_ = hit;
+        result.target_ = model.target_[hit];
+        return result;
+      }
+      result.jumps_.push_back(hit);
+      stack.emplace_back(current, hit + 1);
+      current = target->chain_;
+      row = model.chains_[current].begin_;
+      continue;
+    case TargetKind::EXTENSION:
+      if (const auto &name = model.names_.get(target->name_);
+          !isTerminal(name)) {
+        /* whether an unknown target ends the traversal is not guessed, the
+         * rule is reported uncertain like an opaque match */
+        if (!isContinuing(name)) {
+          result.uncertain_.push_back(hit);
+        }
+        row = hit + 1;
+        continue;
+      }
+      [[fallthrough]];
+    default:
+      result.rule_ = hit;
+      result.target_ = model.target_[hit];
+      return result;
+    }
+  }
+}
+
+auto Classifier::classifyBatch(std::istream &input, uint32_t chain) const
+    -> ClassifyHistogram {
+  ClassifyHistogram histogram;
+  histogram.rule_hits_.resize(model_->size());
+  histogram.policy_hits_.resize(model_->chains_.size());
+
+  InterfaceMatch ifaces;
+  string line;
+  while (std::getline(input, line)) {
+    if (line.empty() || line.front() == '#') {
+      continue;
+    }
+
+    auto packet = PacketTuple::parse(line);
+    if (!packet) {
+      histogram.invalid_lines_++;
+      continue;
+    }
+
+    matchInterfaces(*packet, ifaces);
+    auto result = classify(*packet, chain, ifaces);
+    histogram.packets_++;
+    for (auto row : result.jumps_) {
+      histogram.rule_hits_[row]++;
+    }
+    if (result.rule_) {
+      histogram.rule_hits_[*result.rule_]++;
+    } else if (model_->chains_[chain].builtin_) {
+      /* policy decided, a user start chain returns without a verdict */
+      histogram.policy_hits_[chain]++;
+    }
+  }
+
+  return histogram;
+}
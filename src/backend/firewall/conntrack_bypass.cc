@@ -0,0 +1,289 @@
+#include "backend/firewall/conntrack_bypass.h"
+#include "backend/firewall/rule_space.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <array>
+#include <arpa/inet.h>
+#include <charconv>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string_view>
+
+using std::string_view;
+
+namespace {
+
+constexpr uint32_t kMaxPort = 65535;
+constexpr int kMaxPrefix = 32;
+
+const string kAnyAddr = "0.0.0.0";
+
+auto parseNumber(string_view str, uint32_t max) -> optional<uint32_t> {
+  uint32_t value = 0;
+  const auto *end = str.data() + str.size();
+  auto [ptr, ec] = std::from_chars(str.data(), end, value);
+  if (ec != std::errc() || ptr != end || str.empty() || value > max) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+auto formatAddr(uint32_t addr) -> string {
+  struct in_addr in {};
+  in.s_addr = htonl(addr);
+  return inet_ntoa(in);
+}
+
+auto portString(uint16_t port) -> string { return std::to_string(port); }
+
+/* rule of one protocol and port range, local ports are destination ports of
+ * incoming packets and source ports of outgoing ones */
+auto makeRule(const BypassService &service, const string &proto,
+              const PortRange &ports, bool incoming,
+              const string &target) -> shared_ptr<RuleRequest> {
+  auto rule = std::make_shared<RuleRequest>();
+  rule->index_ = 0;
+  rule->proto_ = proto;
+  rule->src_ip_ = rule->src_mask_ = kAnyAddr;
+  rule->dst_ip_ = rule->dst_mask_ = kAnyAddr;
+
+  auto local = std::make_tuple(portString(ports.first),
+                               portString(ports.second));
+  auto any = std::make_tuple(portString(0), portString(kMaxPort));
+  RuleMatch match;
+  if (incoming) {
+    rule->dst_ip_ = service.addr_.value_or(kAnyAddr);
+    rule->dst_mask_ = service.mask_.value_or(kAnyAddr);
+    rule->iniface_ = service.iface_;
+    match.src_port_range_ = any;
+    match.dst_port_range_ = local;
+  } else {
+    rule->src_ip_ = service.addr_.value_or(kAnyAddr);
+    rule->src_mask_ = service.mask_.value_or(kAnyAddr);
+    rule->outiface_ = service.iface_;
+    match.src_port_range_ = local;
+    match.dst_port_range_ = any;
+  }
+  rule->matches_.push_back(match);
+
+  rule->target_ = target;
+  if (target == RequestTarget::CT) {
+    rule->ct_target_ = CtTarget{true, 0};
+  }
+  return rule;
+}
+
+auto sameRule(const RuleRequest &a, const RuleRequest &b) -> bool {
+  auto sameMatch = [](const RuleMatch &x, const RuleMatch &y) {
+    return x.src_port_range_ == y.src_port_range_ &&
+           x.dst_port_range_ == y.dst_port_range_;
+  };
+  auto sameCt = [](const optional<CtTarget> &x, const optional<CtTarget> &y) {
+    auto left = x.value_or(CtTarget{});
+    auto right = y.value_or(CtTarget{});
+    return left.notrack_ == right.notrack_ && left.zone_ == right.zone_;
+  };
+  return a.src_ip_ == b.src_ip_ && a.src_mask_ == b.src_mask_ &&
+         a.dst_ip_ == b.dst_ip_ && a.dst_mask_ == b.dst_mask_ &&
+         a.proto_ == b.proto_ && a.iniface_ == b.iniface_ &&
+         a.outiface_ == b.outiface_ && a.target_ == b.target_ &&
+         sameCt(a.ct_target_, b.ct_target_) && !a.set_match_ &&
+         !b.set_match_ && !a.bpf_match_ && !b.bpf_match_ &&
+         std::ranges::equal(a.matches_, b.matches_, sameMatch);
+}
+
+auto parseAddr(const optional<string> &text) -> uint32_t {
+  struct in_addr addr {};
+  inet_pton(AF_INET, text.value_or(kAnyAddr).c_str(), &addr);
+  return ntohl(addr.s_addr);
+}
+
+auto parsePort(const optional<std::tuple<string, string>> &range,
+               bool high) -> uint16_t {
+  if (!range) {
+    return high ? kMaxPort : 0;
+  }
+  auto port = parseNumber(high ? std::get<1>(*range) : std::get<0>(*range),
+                          kMaxPort);
+  return port.value_or(high ? kMaxPort : 0);
+}
+
+/* region of a rule of makeRule, interfaces are interned into ifaces */
+auto spaceOf(const RuleRequest &rule, StringPool &ifaces) -> RuleSpace {
+  auto smsk = parseAddr(rule.src_mask_);
+  auto dmsk = parseAddr(rule.dst_mask_);
+  auto iface = [&ifaces](const optional<string> &name) {
+    return static_cast<uint16_t>(name ? ifaces.intern(*name) : 0);
+  };
+  const auto &match = rule.matches_.front();
+  return RuleSpace{parseAddr(rule.src_ip_) & smsk,
+                   smsk,
+                   parseAddr(rule.dst_ip_) & dmsk,
+                   dmsk,
+                   static_cast<uint8_t>(rule.proto_ == RequestProto::TCP
+                                            ? IPPROTO_TCP
+                                            : IPPROTO_UDP),
+                   iface(rule.iniface_),
+                   iface(rule.outiface_),
+                   parsePort(match.src_port_range_, false),
+                   parsePort(match.src_port_range_, true),
+                   parsePort(match.dst_port_range_, false),
+                   parsePort(match.dst_port_range_, true)};
+}
+
+} // namespace
+
+const string ConntrackBypass::kRawTable = "raw";
+const string ConntrackBypass::kFilterTable = "filter";
+
+auto BypassRule::note() const -> string {
+  if (present_) {
+    return "  (present)";
+  }
+  if (shadowed_.empty()) {
+    return "";
+  }
+  string note = "  (shadows";
+  for (auto index : shadowed_) {
+    note += fmt::format(" #{}", index);
+  }
+  return note + ")";
+}
+
+auto BypassPlan::pending() const -> size_t {
+  return std::ranges::count(rules_, false, &BypassRule::present_);
+}
+
+auto BypassPlan::summary() const -> string {
+  auto summary = fmt::format("{} of {} rules to insert, {} present already",
+                             pending(), rules_.size(),
+                             rules_.size() - pending());
+  auto shadowing = std::ranges::count_if(
+      rules_, [](const BypassRule &rule) { return !rule.shadowed_.empty(); });
+  if (shadowing > 0) {
+    summary += fmt::format(", {} shadow DROP or REJECT rules", shadowing);
+  }
+  return summary;
+}
+
+auto ConntrackBypass::parsePorts(string_view text)
+    -> optional<vector<PortRange>> {
+  vector<PortRange> ports;
+  for (size_t begin = 0; begin <= text.size();) {
+    auto comma = std::min(text.find(',', begin), text.size());
+    auto item = text.substr(begin, comma - begin);
+    begin = comma + 1;
+
+    auto dash = item.find_first_of(":-");
+    auto low = parseNumber(item.substr(0, dash), kMaxPort);
+    auto high = dash == string_view::npos
+                    ? low
+                    : parseNumber(item.substr(dash + 1), kMaxPort);
+    if (!low || !high || *low > *high) {
+      return std::nullopt;
+    }
+    ports.emplace_back(*low, *high);
+  }
+  return ports;
+}
+
+auto ConntrackBypass::parseAddress(string_view text,
+                                   BypassService &service) -> bool {
+  auto slash = text.find('/');
+  struct in_addr addr {};
+  if (inet_pton(AF_INET, string(text.substr(0, slash)).c_str(), &addr) != 1) {
+    return false;
+  }
+
+  uint32_t mask = ~0U;
+  if (slash != string_view::npos) {
+    auto prefix = parseNumber(text.substr(slash + 1), kMaxPrefix);
+    if (!prefix) {
+      return false;
+    }
+    mask = *prefix == 0 ? 0 : ~0U << (kMaxPrefix - *prefix);
+  }
+
+  /* kernel entries keep the address as given, mask it like iptables */
+  service.addr_ = formatAddr(ntohl(addr.s_addr) & mask);
+  service.mask_ = formatAddr(mask);
+  return true;
+}
+
+auto ConntrackBypass::plan(const BypassService &service) -> BypassPlan {
+  vector<string> protos;
+  if (service.proto_ == RequestProto::TCP ||
+      service.proto_ == RequestProto::ALL) {
+    protos.push_back(RequestProto::TCP);
+  }
+  if (service.proto_ == RequestProto::UDP ||
+      service.proto_ == RequestProto::ALL) {
+    protos.push_back(RequestProto::UDP);
+  }
+  if (protos.empty()) {
+    throw std::invalid_argument(
+        fmt::format("Unknown protocol: {}", service.proto_));
+  }
+  if (service.ports_.empty()) {
+    throw std::invalid_argument("Service without port");
+  }
+
+  /* table, chain, direction and target of each rule of a port range */
+  struct Placement {
+    string table_;
+    string chain_;
+    bool incoming_;
+    string target_;
+  };
+  const std::array<Placement, 4> kPlacements = {
+      Placement{kRawTable, "PREROUTING", true, RequestTarget::CT},
+      Placement{kRawTable, "OUTPUT", false, RequestTarget::CT},
+      Placement{kFilterTable, "INPUT", true, IPTC_LABEL_ACCEPT},
+      Placement{kFilterTable, "OUTPUT", false, IPTC_LABEL_ACCEPT}};
+
+  BypassPlan plan;
+  for (const auto &placement : kPlacements) {
+    for (const auto &proto : protos) {
+      for (const auto &ports : service.ports_) {
+        plan.rules_.push_back(
+            {placement.table_, placement.chain_,
+             makeRule(service, proto, ports, placement.incoming_,
+                      placement.target_)});
+      }
+    }
+  }
+  return plan;
+}
+
+auto ConntrackBypass::isPresent(
+    const RuleRequest &rule, std::span<const shared_ptr<RuleRequest>> chain)
+    -> bool {
+  return std::ranges::any_of(chain, [&rule](const auto &other) {
+    return other != nullptr && sameRule(rule, *other);
+  });
+}
+
+auto ConntrackBypass::shadowed(const RuleRequest &rule,
+                               const RulesetModel &model,
+                               uint32_t chain) -> vector<int> {
+  /* interface of service may be unknown to the rules of model */
+  auto ifaces = model.ifaces_;
+  auto space = spaceOf(rule, ifaces);
+
+  vector<int> indices;
+  const auto &range = model.chains_[chain];
+  for (auto row = range.begin_ + static_cast<uint32_t>(rule.index_);
+       row < range.end_; row++) {
+    const auto &target = model.targetOf(row);
+    if (target.kind_ != TargetKind::DROP &&
+        model.names_.get(target.name_) != "REJECT") {
+      continue;
+    }
+    auto other = RuleSpace::fromRow(model, row);
+    if (other && other->overlaps(space, ifaces)) {
+      indices.push_back(static_cast<int>(row - range.begin_));
+    }
+  }
+  return indices;
+}
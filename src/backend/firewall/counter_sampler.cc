@@ -0,0 +1,328 @@
+#include "backend/firewall/counter_sampler.h"
+#include "backend/firewall/kernel_table.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <utility>
+
+namespace {
+
+/* IPT_SO_GET_ENTRIES fails with EAGAIN if the table is replaced between the
+ * two sockopts */
+constexpr int kMaxAttempts = 3;
+
+auto entryAt(const struct ipt_get_entries &entries,
+             uint32_t offset) -> const struct ipt_entry * {
+  return reinterpret_cast<const struct ipt_entry *>(
+      reinterpret_cast<const char *>(entries.entrytable) + offset);
+}
+
+auto targetOf(const struct ipt_entry *entry) -> const struct xt_entry_target * {
+  return reinterpret_cast<const struct xt_entry_target *>(
+      reinterpret_cast<const char *>(entry) + entry->target_offset);
+}
+
+/* user chains start with an ERROR entry naming the chain, one more ends
+ * the table */
+auto isChainHead(const struct ipt_entry *entry) -> bool {
+  return strcmp(targetOf(entry)->u.user.name, XT_ERROR_TARGET) == 0;
+}
+
+/**
+ * FNV-1a of every entry without its counters, rules reordered or replaced
+ * within the same layout change it
+ */
+auto entriesDigest(const struct ipt_get_entries &entries) -> uint64_t {
+  constexpr uint64_t kOffsetBasis = 0xCBF29CE484222325ULL;
+  constexpr uint64_t kPrime = 0x100000001B3ULL;
+
+  uint64_t digest = kOffsetBasis;
+  auto add = [&digest](const char *begin, const char *end) {
+    for (const auto *byte = begin; byte != end; byte++) {
+      digest = (digest ^ static_cast<uint8_t>(*byte)) * kPrime;
+    }
+  };
+
+  uint32_t offset = 0;
+  while (offset < entries.size) {
+    const auto *entry = entryAt(entries, offset);
+    if (entry->next_offset < sizeof(struct ipt_entry)) {
+      break; /* malformed, never loop forever */
+    }
+    const auto *bytes = reinterpret_cast<const char *>(entry);
+    add(bytes, bytes + offsetof(struct ipt_entry, comefrom));
+    add(bytes + offsetof(struct ipt_entry, elems), bytes + entry->next_offset);
+    offset += entry->next_offset;
+  }
+  return digest;
+}
+
+/* label values may contain any character but backslash, quote and newline
+ * must be escaped */
+auto appendLabel(fmt::memory_buffer &buffer, const string &value) -> void {
+  for (auto c : value) {
+    if (c == '\\' || c == '"') {
+      buffer.push_back('\\');
+    } else if (c == '\n') {
+      buffer.push_back('\\');
+      c = 'n';
+    }
+    buffer.push_back(c);
+  }
+}
+
+} // namespace
+
+CounterSampler::CounterSampler(string table, size_t history)
+    : table_(std::move(table)), history_(std::max<size_t>(history, 2)) {}
+
+auto CounterSampler::sample() -> bool {
+  struct ipt_get_entries *entries = nullptr;
+  optional<struct ipt_getinfo> info;
+  for (int attempt = 0; attempt < kMaxAttempts && entries == nullptr;
+       attempt++) {
+    info = KernelTable::getInfo(table_);
+    if (!info) {
+      return false;
+    }
+    entries = KernelTable::getEntries(*info, buffer_);
+    if (entries == nullptr && errno != EAGAIN) {
+      return false;
+    }
+  }
+  if (entries == nullptr) {
+    return false;
+  }
+
+  auto layout = TableFingerprint::from(*info);
+  auto digest = entriesDigest(*entries);
+  if (!info_ || TableFingerprint::from(*info_) != layout ||
+      digest_ != digest) {
+    info_ = info;
+    digest_ = digest;
+    relabel(*entries);
+  }
+
+  auto rules = ruleCount();
+  head_ = count_ == 0 ? 0 : (head_ + 1) % history_;
+  count_ = std::min(count_ + 1, history_);
+  times_[head_] = std::chrono::steady_clock::now();
+
+  auto *pcnt = pcnt_.data() + head_ * rules;
+  auto *bcnt = bcnt_.data() + head_ * rules;
+  for (size_t rule = 0; rule < rules; rule++) {
+    const auto *entry = entryAt(*entries, offsets_[rule]);
+    pcnt[rule] = entry->counters.pcnt;
+    bcnt[rule] = entry->counters.bcnt;
+  }
+  return true;
+}
+
+auto CounterSampler::relabel(const struct ipt_get_entries &entries) -> void {
+  chains_.clear();
+  indices_.clear();
+  offsets_.clear();
+
+  const auto &info = *info_;
+  auto isHook = [&info](const uint32_t(&offsets)[NF_INET_NUMHOOKS],
+                        uint32_t offset) -> optional<size_t> {
+    for (size_t hook = 0; hook < NF_INET_NUMHOOKS; hook++) {
+      if ((info.valid_hooks & (1U << hook)) != 0 && offsets[hook] == offset) {
+        return hook;
+      }
+    }
+    return std::nullopt;
+  };
+
+  string chain;
+  int index = 0;
+  uint32_t offset = 0;
+  while (offset < entries.size) {
+    const auto *entry = entryAt(entries, offset);
+    if (entry->next_offset < sizeof(struct ipt_entry)) {
+      break; /* malformed, never loop forever */
+    }
+    auto next = offset + entry->next_offset;
+
+    if (auto hook = isHook(info.hook_entry, offset)) {
+      chain = KernelTable::hookNames()[*hook];
+      index = 0;
+    }
+    if (isChainHead(entry)) {
+      chain = reinterpret_cast<const char *>(targetOf(entry)->data);
+      index = 0;
+      offset = next;
+      continue;
+    }
+
+    /* policy of builtin chains and RETURN closing user chains */
+    auto tail = isHook(info.underflow, offset).has_value() ||
+                (next < entries.size && isChainHead(entryAt(entries, next)));
+    if (!tail) {
+      chains_.push_back(chain);
+      indices_.push_back(index++);
+      offsets_.push_back(offset);
+    }
+    offset = next;
+  }
+
+  times_.assign(history_, {});
+  pcnt_.assign(history_ * ruleCount(), 0);
+  bcnt_.assign(history_ * ruleCount(), 0);
+  head_ = 0;
+  count_ = 0;
+}
+
+auto CounterSampler::slot(size_t age) const -> size_t {
+  return (head_ + history_ - age) % history_;
+}
+
+auto CounterSampler::rate(size_t rule) const -> RuleRate {
+  RuleRate rate{chains_[rule], indices_[rule]};
+  if (count_ == 0) {
+    return rate;
+  }
+
+  auto rules = ruleCount();
+  auto latest = slot(0) * rules + rule;
+  rate.pcnt_ = pcnt_[latest];
+  rate.bcnt_ = bcnt_[latest];
+  if (count_ < 2) {
+    return rate;
+  }
+
+  auto oldest = slot(count_ - 1);
+  auto seconds = std::chrono::duration<double>(times_[slot(0)] - times_[oldest])
+                     .count();
+  if (seconds <= 0) {
+    return rate;
+  }
+  auto delta = [](uint64_t now, uint64_t before) {
+    return now > before ? static_cast<double>(now - before) : 0.0;
+  };
+  rate.pps_ = delta(rate.pcnt_, pcnt_[oldest * rules + rule]) / seconds;
+  rate.bps_ = delta(rate.bcnt_, bcnt_[oldest * rules + rule]) / seconds;
+  return rate;
+}
+
+auto CounterSampler::topRules(size_t n) const -> vector<RuleRate> {
+  auto rules = ruleCount();
+  n = std::min(n, rules);
+  if (n == 0 || count_ == 0) {
+    return {};
+  }
+
+  /* rank on packet deltas, rates only differ from them by a common factor */
+  auto latest = slot(0) * rules;
+  auto oldest = slot(count_ - 1) * rules;
+  vector<uint64_t> deltas(rules);
+  for (size_t rule = 0; rule < rules; rule++) {
+    auto now = pcnt_[latest + rule];
+    auto before = pcnt_[oldest + rule];
+    deltas[rule] = now > before ? now - before : 0;
+  }
+
+  vector<size_t> order(rules);
+  std::iota(order.begin(), order.end(), 0);
+  std::partial_sort(order.begin(), order.begin() + static_cast<long>(n),
+                    order.end(), [&](size_t a, size_t b) {
+                      if (deltas[a] != deltas[b]) {
+                        return deltas[a] > deltas[b];
+                      }
+                      return pcnt_[latest + a] > pcnt_[latest + b];
+                    });
+
+  vector<RuleRate> top;
+  top.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    top.push_back(rate(order[i]));
+  }
+  return top;
+}
+
+auto CounterSampler::writePrometheus(std::ostream &output) const -> void {
+  struct Metric {
+    const char *name_;
+    const char *type_;
+    const char *help_;
+  };
+  static constexpr std::array<Metric, 4> kMetrics = {{
+      {"controlpanel_rule_packets_total", "counter",
+       "Packets matched by iptables rule."},
+      {"controlpanel_rule_bytes_total", "counter",
+       "Bytes matched by iptables rule."},
+      {"controlpanel_rule_packets_per_second", "gauge",
+       "Packet rate of iptables rule over the sampling window."},
+      {"controlpanel_rule_bytes_per_second", "gauge",
+       "Byte rate of iptables rule over the sampling window."},
+  }};
+
+  vector<RuleRate> rates;
+  rates.reserve(ruleCount());
+  for (size_t rule = 0; rule < ruleCount() && count_ > 0; rule++) {
+    rates.push_back(rate(rule));
+  }
+
+  fmt::memory_buffer buffer;
+  for (size_t metric = 0; metric < kMetrics.size(); metric++) {
+    const auto &meta = kMetrics[metric];
+    fmt::format_to(std::back_inserter(buffer), "# HELP {} {}\n# TYPE {} {}\n",
+                   meta.name_, meta.help_, meta.name_, meta.type_);
+    for (const auto &rate : rates) {
+      fmt::format_to(std::back_inserter(buffer), "{}{{table=\"", meta.name_);
+      appendLabel(buffer, table_);
+      fmt::format_to(std::back_inserter(buffer), "\",chain=\"");
+      appendLabel(buffer, rate.chain_);
+      fmt::format_to(std::back_inserter(buffer), "\",rule=\"{}\"}} ",
+                     rate.index_);
+      switch (metric) {
+      case 0:
+        fmt::format_to(std::back_inserter(buffer), "{}\n", rate.pcnt_);
+        break;
+      case 1:
+        fmt::format_to(std::back_inserter(buffer), "{}\n", rate.bcnt_);
+        break;
+      case 2:
+        fmt::format_to(std::back_inserter(buffer), "{:.3f}\n", rate.pps_);
+        break;
+      default:
+        fmt::format_to(std::back_inserter(buffer), "{:.3f}\n", rate.bps_);
+        break;
+      }
+    }
+  }
+  output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+auto CounterSampler::writeTextfile(const string &path) const
+    -> optional<string> {
+  /* collector may read at any time, never let it see a partial file */
+  auto temp = path + ".tmp";
+  {
+    std::ofstream output(temp, std::ios::trunc);
+    if (!output) {
+      return fmt::format("Cannot open {}: {}", temp, strerror(errno));
+    }
+    writePrometheus(output);
+    output.flush();
+    if (!output) {
+      return fmt::format("Cannot write {}", temp);
+    }
+  }
+
+  if (std::rename(temp.c_str(), path.c_str()) != 0) {
+    auto error = fmt::format("Cannot rename {} to {}: {}", temp, path,
+                             strerror(errno));
+    std::remove(temp.c_str());
+    return error;
+  }
+  return std::nullopt;
+}
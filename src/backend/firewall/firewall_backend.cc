@@ -1,6 +1,9 @@
 #include "backend/firewall/firewall_backend.h"
+#include "backend/firewall/ipset.h"
+#include "backend/firewall/kernel_table.h"
 #include "backend/firewall/rule_request.h"
 #include "fmt/core.h"
+#include "fmt/format.h"
 #include "tools/log.h"
 #include "tools/nettools.h"
 
@@ -8,43 +11,995 @@
 #include <arpa/inet.h>
 #include <asm-generic/int-ll64.h>
 #include <bits/ranges_algo.h>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
 #include <cstring>
+#include <functional>
 #include <libiptc/libiptc.h>
 #include <linux/in.h>
+#include <linux/netfilter/nf_conntrack_common.h>
 #include <linux/netfilter/nf_tables.h>
 #include <linux/netfilter/x_tables.h>
+#include <linux/netfilter/xt_CT.h>
+#include <linux/netfilter/xt_NFQUEUE.h>
+#include <linux/netfilter/xt_bpf.h>
+#include <linux/netfilter/xt_conntrack.h>
+#include <linux/netfilter/xt_set.h>
+#include <linux/netfilter/xt_state.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <memory>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <numeric>
+#include <ranges>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
-auto FirewallBackend::createHandlers() -> bool {
+namespace {
+
+/* rules inserted by one libiptc batch when importing */
+constexpr size_t kImportBatch = 1024;
+
+/**
+ * feeds parsed iptables-save content into backend, rules of a chain are
+ * collected and inserted in batches
+ */
+class BackendImporter : public SaveSink {
+public:
+  using TableHook = std::function<void(const string &)>;
+
+  /* before_flush is called with each table before its chains are flushed */
+  BackendImporter(FirewallBackend &backend, TableHook before_flush)
+      : backend_(backend), before_flush_(std::move(before_flush)) {}
+
+  auto beginTable(const string &table) -> optional<string> override {
+    auto tables = FirewallBackend::getTableNames();
+    if (std::ranges::find(tables, table) == tables.end()) {
+      return fmt::format("unknown table: {}", table);
+    }
+
+    context_ = FirewallBackend::createContext(
+        std::make_shared<FirewallContext>(), table);
+    counts_.clear();
+    before_flush_(table);
+    if (!backend_.flushTable(context_)) {
+      return context_->getLastError();
+    }
+    return std::nullopt;
+  }
+
+  auto declareChain(const string &chain, const optional<string> &policy)
+      -> optional<string> override {
+    counts_[chain] = 0;
+    if (policy.has_value()) {
+      auto context = FirewallBackend::createContext(context_, chain);
+      if (!backend_.setChainPolicy(context, *policy)) {
+        return context->getLastError();
+      }
+    } else if (!backend_.insertChain(context_,
+                                     std::make_shared<ChainRequest>(chain))) {
+      return context_->getLastError();
+    }
+    return std::nullopt;
+  }
+
+  auto appendRule(const string &chain, shared_ptr<RuleRequest> request)
+      -> optional<string> override {
+    auto count = counts_.find(chain);
+    if (count == counts_.end()) {
+      return fmt::format("chain not declared: {}", chain);
+    }
+
+    if (chain != pending_chain_) {
+      if (auto error = flush(); error) {
+        return error;
+      }
+      pending_chain_ = chain;
+    }
+
+    /* rules are appended, the running count only numbers them in errors */
+    request->index_ = count->second + static_cast<int>(pending_.size());
+    pending_.push_back(std::move(request));
+    if (pending_.size() >= kImportBatch) {
+      return flush();
+    }
+    return std::nullopt;
+  }
+
+  auto commitTable() -> optional<string> override { return flush(); }
+
+private:
+  auto flush() -> optional<string> {
+    if (pending_.empty()) {
+      return std::nullopt;
+    }
+
+    auto context = FirewallBackend::createContext(context_, pending_chain_);
+    auto result = backend_.appendRules(context, pending_);
+    auto &count = counts_[pending_chain_];
+    for (size_t i = 0; i < result.size(); i++) {
+      if (result[i].has_value()) {
+        return fmt::format("rule #{} of {}: {}", count + i, pending_chain_,
+                           *result[i]);
+      }
+    }
+
+    count += static_cast<int>(pending_.size());
+    pending_.clear();
+    return std::nullopt;
+  }
+
+  FirewallBackend &backend_;
+  TableHook before_flush_;
+  ctx_t context_;
+
+  /* rules in each declared chain of current table */
+  unordered_map<string, int> counts_;
+
+  string pending_chain_;
+  vector<shared_ptr<RuleRequest>> pending_;
+};
+
+/* rule accepts packets of ESTABLISHED connections by state or conntrack
+ * match, e.g. -m state --state RELATED,ESTABLISHED -j ACCEPT */
+auto acceptsEstablished(const struct ipt_entry *entry,
+                        struct iptc_handle *handle) -> bool {
+  static constexpr unsigned kEstablished = XT_STATE_BIT(IP_CT_ESTABLISHED);
+
+  if (strcmp(iptc_get_target(entry, handle), IPTC_LABEL_ACCEPT) != 0) {
+    return false;
+  }
+  auto stateOf = [](const auto *info) -> unsigned {
+    if ((info->match_flags & XT_CONNTRACK_STATE) == 0 ||
+        (info->invert_flags & XT_CONNTRACK_STATE) != 0) {
+      return 0;
+    }
+    return info->state_mask;
+  };
+
+  const auto *match = reinterpret_cast<const ipt_entry_match *>(entry->elems);
+  while (reinterpret_cast<const char *>(match) !=
+         reinterpret_cast<const char *>(entry) + entry->target_offset) {
+    unsigned state = 0;
+    if (strcmp(match->u.user.name, "state") == 0) {
+      state =
+          reinterpret_cast<const xt_state_info *>(match->data)->statemask;
+    } else if (strcmp(match->u.user.name, "conntrack") == 0) {
+      /* revision 3 only appends fields to revision 2 */
+      state = match->u.user.revision == 1
+                  ? stateOf(reinterpret_cast<const xt_conntrack_mtinfo1 *>(
+                        match->data))
+              : match->u.user.revision >= 2
+                  ? stateOf(reinterpret_cast<const xt_conntrack_mtinfo2 *>(
+                        match->data))
+                  : 0;
+    }
+    if ((state & kEstablished) != 0) {
+      return true;
+    }
+    match = reinterpret_cast<const ipt_entry_match *>(
+        reinterpret_cast<const char *>(match) + match->u.match_size);
+  }
+  return false;
+}
+
+auto staleTableError(const string &table) -> string {
+  return fmt::format("Table {} changed outside since it was loaded, reload "
+                     "it and apply the changes again.",
+                     table);
+}
+
+} // namespace
+
+auto FirewallBackend::createHandler(const string &table) -> bool {
+  auto start = std::chrono::steady_clock::now();
+
+  /* taken before loading, a change in between only makes handle look stale */
+  auto fingerprint = KernelTable::fingerprint(table);
+
+  auto *handle = iptc_init(table.c_str());
+  if (handle == nullptr) {
+    yuiError() << "Error initializing iptables's table: " << table
+               << " error: " << iptc_strerror(errno) << endl;
+    return false;
+  }
+
+  auto &stat = load_stats_[table];
+  stat.load_time_ = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  stat.load_count_++;
+
+  handles_.insert({table, handle});
+  if (fingerprint) {
+    fingerprints_.insert_or_assign(table, *fingerprint);
+  }
+  return true;
+}
+
+auto FirewallBackend::isStale(const ctx_t &context) -> bool {
+  const auto &table = context->table_;
+  if (!handles_.contains(table)) {
+    return false; /* nothing cached */
+  }
+
+  auto iter = fingerprints_.find(table);
+  auto current = KernelTable::fingerprint(table);
+  return iter == fingerprints_.end() || !current || *current != iter->second;
+}
+
+auto FirewallBackend::reloadIfStale(const ctx_t &context) -> bool {
+  const auto &table = context->table_;
+  if (dirty_tables_.contains(table) || !isStale(context)) {
+    return false;
+  }
+
+  yuiMilestone() << "Table " << table << " changed outside, reloading" << endl;
+  destroyHandler(table);
+  return true;
+}
+
+auto FirewallBackend::reloadTable(const ctx_t &context) -> void {
+  dirty_tables_.erase(context->table_);
+  destroyHandler(context->table_);
+  destroyCreatedSets(context->table_);
+}
+
+auto FirewallBackend::destroyCreatedSets(const string &table) -> void {
+  auto iter = created_sets_.find(table);
+  if (iter == created_sets_.end()) {
+    return;
+  }
+  for (const auto &name : iter->second) {
+    if (!Ipset::destroy(name)) {
+      yuiError() << "Error destroying set " << name << endl;
+    }
+  }
+  created_sets_.erase(iter);
+}
+
+auto FirewallBackend::getHandle(const string &table) -> struct iptc_handle * {
+  if (auto iter = handles_.find(table); iter != handles_.end()) {
+    return iter->second;
+  }
+
   auto tables = getTableNames();
+  if (std::ranges::find(tables, table) == tables.end()) {
+    throw std::out_of_range(fmt::format("Unknown iptables table: {}", table));
+  }
+
+  if (!createHandler(table)) {
+    throw std::runtime_error(
+        fmt::format("Error creating iptables's table handler: {}", table));
+  }
+
+  return handles_.at(table);
+}
+
+auto FirewallBackend::findHandle(const ctx_t &context)
+    -> struct iptc_handle * {
+  return guarded(context, static_cast<struct iptc_handle *>(nullptr),
+                 [&]() { return getHandle(context->table_); });
+}
+
+auto FirewallBackend::getTableLoadStat(const string &table) const
+    -> optional<TableLoadStat> {
+  if (auto iter = load_stats_.find(table); iter != load_stats_.end()) {
+    return iter->second;
+  }
+  return std::nullopt;
+}
 
-  return std::ranges::all_of(tables, [this](const auto &table) {
-    auto *handle = iptc_init(table.c_str());
-    if (handle == nullptr) {
-      yuiError() << "Error initializing iptables's table: " << table
-                 << " error: " << iptc_strerror(errno) << endl;
+auto FirewallBackend::flushTable(const ctx_t &context) -> bool {
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    return false;
+  }
+  auto chains = getChains(context);
+  search_index_.invalidateTable(context->table_);
+
+  /* user chains can only be deleted when no rule jumps to them */
+  for (const auto &chain : chains) {
+    if (iptc_flush_entries(chain.c_str(), handle) == 0) {
+      context->setLastError(fmt::format("Error flushing chain {}: {}", chain,
+                                        iptc_strerror(errno)));
+      return false;
+    }
+  }
+  for (const auto &chain : chains) {
+    if (iptc_builtin(chain.c_str(), handle) == 0 &&
+        iptc_delete_chain(chain.c_str(), handle) == 0) {
+      context->setLastError(fmt::format("Error deleting chain {}: {}", chain,
+                                        iptc_strerror(errno)));
       return false;
     }
-
-    handles_.insert({table, handle});
+  }
+
+  rule_cache_.erase(context->table_);
+  graphs_.erase(context->table_);
+  markDirty(context->table_);
+  return true;
+}
+
+auto FirewallBackend::setChainPolicy(const ctx_t &context,
+                                     const string &policy) -> bool {
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    return false;
+  }
+  if (iptc_set_policy(context->chain_.c_str(), policy.c_str(), nullptr,
+                      handle) == 0) {
+    context->setLastError(fmt::format("Error setting policy of {}: {}",
+                                      context->chain_, iptc_strerror(errno)));
+    return false;
+  }
+
+  markDirty(context->table_);
+  return true;
+}
+
+auto FirewallBackend::importRuleset(std::istream &input) -> optional<string> {
+  vector<ChainSnapshot> snapshots;
+  BackendImporter importer(*this, [this, &snapshots](const string &table) {
+    /* a table that cannot be loaded fails in flushTable next */
+    auto context = createContext(std::make_shared<FirewallContext>(), table);
+    if (findHandle(context) != nullptr) {
+      if (auto snapshot = snapshotChains(context, getChains(context))) {
+        snapshots.emplace_back(std::move(*snapshot));
+      }
+    }
+  });
+  auto error = SaveFormat::parse(input, importer);
+  if (error) {
+    /* newest first, a table imported twice ends at its first snapshot */
+    for (const auto &snapshot : std::views::reverse(snapshots)) {
+      restoreChains(snapshot);
+    }
+  }
+
+  return error;
+}
+
+auto FirewallBackend::exportRuleset(std::ostream &output,
+                                    const ctx_t &context) -> size_t {
+  if (context->level_ != FirewallLevel::OVERALL) {
+    return SaveFormat::write(output, *loadModel(context->table_));
+  }
+
+  size_t skipped = 0;
+  for (const auto &table : getTableNames()) {
+    try {
+      skipped += SaveFormat::write(output, *loadModel(table));
+    } catch (const std::exception &e) {
+      /* table module not loaded, like iptables-save skip it */
+      yuiError() << "Skip exporting table " << table << ": " << e.what()
+                 << endl;
+    }
+  }
+  return skipped;
+}
+
+auto FirewallBackend::getRulesetModel(const ctx_t &context)
+    -> shared_ptr<const RulesetModel> {
+  return guarded(context, shared_ptr<const RulesetModel>(),
+                 [&]() { return loadModel(context->table_); });
+}
+
+auto FirewallBackend::loadModel(const string &table)
+    -> shared_ptr<const RulesetModel> {
+  if (auto iter = models_.find(table); iter != models_.end()) {
+    return iter->second;
+  }
+
+  auto model = RulesetModel::decode(table, getHandle(table));
+  models_.emplace(table, model);
+  return model;
+}
+
+auto FirewallBackend::loadChain(const ctx_t &context)
+    -> std::pair<shared_ptr<const RulesetModel>, uint32_t> {
+  auto model = loadModel(context->table_);
+  auto chain = model->findChain(context->chain_);
+  if (!chain) {
+    throw std::out_of_range(fmt::format("Unknown chain: {}", context->chain_));
+  }
+  return {model, *chain};
+}
+
+auto FirewallBackend::getChainGraph(const ctx_t &context)
+    -> const ChainGraph * {
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    return nullptr;
+  }
+
+  const auto &table = context->table_;
+  auto iter = graphs_.find(table);
+  if (iter == graphs_.end()) {
+    iter = graphs_.emplace(table, ChainGraph::build(handle)).first;
+  } else if (iter->second.needsSync()) {
+    iter->second.sync(handle);
+  }
+  return &iter->second;
+}
+
+auto FirewallBackend::getCounterSampler(const ctx_t &context)
+    -> shared_ptr<CounterSampler> {
+  const auto &table = context->table_;
+  auto &sampler = samplers_[table];
+  if (sampler == nullptr) {
+    sampler = std::make_shared<CounterSampler>(table);
+  }
+  return sampler;
+}
+
+auto FirewallBackend::searchRules(const string &query,
+                                  size_t limit) -> vector<SearchHit> {
+  auto parsed = SearchQuery::parse(query);
+  for (const auto &table : getTableNames()) {
+    auto context = createContext(std::make_shared<FirewallContext>(), table);
+
+    /* uncommitted changes are indexed from the handle, otherwise the index
+     * holds the kernel table it was built from */
+    auto indexed = indexed_fingerprints_.find(table);
+    if (indexed != indexed_fingerprints_.end() &&
+        !dirty_tables_.contains(table)) {
+      auto current = KernelTable::fingerprint(table);
+      if (!current || *current != indexed->second) {
+        reloadIfStale(context);
+        search_index_.invalidateTable(table);
+        indexed_fingerprints_.erase(indexed);
+      }
+    }
+
+    if (!search_index_.needsUpdate(table)) {
+      continue;
+    }
+    try {
+      search_index_.update(*loadModel(table));
+      if (auto iter = fingerprints_.find(table); iter != fingerprints_.end()) {
+        indexed_fingerprints_.insert_or_assign(table, iter->second);
+      }
+    } catch (const std::exception &e) {
+      /* table module not loaded, nothing to find in it */
+      yuiError() << "Skip indexing table " << table << ": " << e.what()
+                 << endl;
+    }
+  }
+  return search_index_.search(parsed, limit);
+}
+
+auto FirewallBackend::queryRules(const string &query,
+                                 const RuleQuery::Sink &sink) -> QueryStat {
+  auto parsed = RuleQuery::parse(query);
+  QueryStat stat;
+  for (const auto &table : getTableNames()) {
+    /* excluded tables are counted even after the sink stopped */
+    if (!parsed.mayMatchTable(table)) {
+      stat.skipped_++;
+      continue;
+    }
+    if (stat.stopped_) {
+      continue;
+    }
+    try {
+      parsed.run(*loadModel(table), sink, stat);
+    } catch (const std::exception &e) {
+      yuiError() << "Skip querying table " << table << ": " << e.what()
+                 << endl;
+    }
+  }
+  return stat;
+}
+
+auto FirewallBackend::analyzeChain(const ctx_t &context)
+    -> optional<ShadowReport> {
+  return guarded(context, optional<ShadowReport>(),
+                 [&]() -> optional<ShadowReport> {
+                   auto [model, chain] = loadChain(context);
+                   return ShadowAnalyzer::analyze(*model, chain);
+                 });
+}
+
+auto FirewallBackend::planOptimization(const ctx_t &context)
+    -> optional<ChainPlan> {
+  auto model = getRulesetModel(context);
+  if (model == nullptr) {
+    return std::nullopt;
+  }
+  return ChainOptimizer::plan(*model, context->chain_, context);
+}
+
+auto FirewallBackend::applyOptimization(const ctx_t &context,
+                                        const ChainPlan &plan) -> bool {
+  auto table_context = make_shared<FirewallContext>(context);
+  table_context->level_ = FirewallLevel::TABLE;
+  auto snapshot = snapshotChains(context, std::span(&plan.chain_, 1));
+  if (!snapshot) {
+    return false;
+  }
+
+  auto apply = [&]() -> optional<string> {
+    const auto &chains = plan.ruleset_.chains_;
+    for (size_t i = 1; i < chains.size(); i++) {
+      if (!insertChain(table_context,
+                       std::make_shared<ChainRequest>(chains[i].name_))) {
+        return table_context->getLastError();
+      }
+    }
+
+    /* leaves first, old rules of chain are removed before dispatch added */
+    auto fillChain = [&](const ChainRuleset &chain) -> optional<string> {
+      auto chain_context = createContext(table_context, chain.name_);
+      for (const auto &rule : chain.rules_) {
+        rule->index_ = 0;
+      }
+      auto result = insertRules(chain_context, chain.rules_);
+      for (size_t i = 0; i < result.size(); i++) {
+        if (result[i].has_value()) {
+          return fmt::format("rule #{} of {}: {}", i, chain.name_, *result[i]);
+        }
+      }
+      return std::nullopt;
+    };
+    for (size_t i = 1; i < chains.size(); i++) {
+      if (auto error = fillChain(chains[i]); error) {
+        return error;
+      }
+    }
+
+    auto chain_context = createContext(table_context, plan.chain_);
+    vector<int> indices(getRuleCount(chain_context));
+    std::iota(indices.begin(), indices.end(), 0);
+    for (const auto &error : removeRules(chain_context, indices)) {
+      if (error.has_value()) {
+        return error;
+      }
+    }
+    return fillChain(chains[0]);
+  };
+
+  if (auto error = apply(); error) {
+    context->setLastError(*error);
+    restoreChains(*snapshot);
+    return false;
+  }
+  return true;
+}
+
+auto FirewallBackend::planCompaction(const ctx_t &context)
+    -> optional<CompactionPlan> {
+  return guarded(context, optional<CompactionPlan>(),
+                 [&]() -> optional<CompactionPlan> {
+                   auto [model, chain] = loadChain(context);
+                   return RuleCompactor::compact(*model, chain);
+                 });
+}
+
+auto FirewallBackend::applyCompaction(const ctx_t &context,
+                                      const CompactionPlan &plan) -> bool {
+  auto chain_context = make_shared<FirewallContext>(context);
+  chain_context->chain_ = plan.chain_;
+
+  auto snapshot = snapshotChains(context, std::span(&plan.chain_, 1));
+  if (!snapshot) {
+    return false;
+  }
+
+  /* widen first, indices of plan refer to chain before removal */
+  optional<string> error;
+  for (const auto &result : replaceRules(chain_context, plan.replaced_)) {
+    error = error ? error : result;
+  }
+  if (!error) {
+    for (const auto &result : removeRules(chain_context, plan.removed_)) {
+      error = error ? error : result;
+    }
+  }
+
+  if (error) {
+    context->setLastError(*error);
+    restoreChains(*snapshot);
+    return false;
+  }
+  return true;
+}
+
+auto FirewallBackend::planSetConversion(const ctx_t &context,
+                                        size_t min_members)
+    -> optional<SetPlan> {
+  return guarded(context, optional<SetPlan>(), [&]() -> optional<SetPlan> {
+    auto [model, chain] = loadChain(context);
+    return SetConverter::plan(*model, chain, min_members);
+  });
+}
+
+auto FirewallBackend::applySetConversion(const ctx_t &context,
+                                         const SetPlan &plan) -> bool {
+  auto chain_context = make_shared<FirewallContext>(context);
+  chain_context->chain_ = plan.chain_;
+
+  auto snapshot = snapshotChains(context, std::span(&plan.chain_, 1));
+  if (!snapshot) {
+    return false;
+  }
+
+  vector<string> created;
+  vector<shared_ptr<RuleRequest>> heads;
+  optional<string> error;
+  for (const auto &family : plan.families_) {
+    auto set = family.set_;
+    /* a set of an earlier conversion may still carry the proposed name */
+    for (int suffix = 2; Ipset::indexOf(set.name_); suffix++) {
+      set.name_ = fmt::format("{}_{}", family.set_.name_, suffix);
+    }
+    if (!Ipset::create(context, set)) {
+      error = context->getLastError();
+      break;
+    }
+    created.emplace_back(set.name_);
+
+    auto rule = std::make_shared<RuleRequest>(*family.rule_);
+    rule->set_match_->name_ = set.name_;
+    heads.emplace_back(rule);
+  }
+
+  /* replace first, indices of plan refer to chain before removal */
+  if (!error) {
+    for (const auto &result : replaceRules(chain_context, heads)) {
+      error = error ? error : result;
+    }
+  }
+  if (!error) {
+    for (const auto &result : removeRules(chain_context, plan.removed_)) {
+      error = error ? error : result;
+    }
+  }
+
+  if (error) {
+    restoreChains(*snapshot);
+    for (const auto &name : created) {
+      Ipset::destroy(name);
+    }
+    context->setLastError(*error);
+    return false;
+  }
+  auto &sets = created_sets_[context->table_];
+  sets.insert(sets.end(), created.begin(), created.end());
+  return true;
+}
+
+auto FirewallBackend::planBpfCompilation(const ctx_t &context,
+                                         size_t min_members)
+    -> optional<BpfPlan> {
+  return guarded(context, optional<BpfPlan>(), [&]() -> optional<BpfPlan> {
+    auto [model, chain] = loadChain(context);
+    return BpfCompiler::plan(*model, chain, min_members);
+  });
+}
+
+auto FirewallBackend::applyBpfCompilation(const ctx_t &context,
+                                          const BpfPlan &plan) -> bool {
+  static constexpr uint32_t kVerifySeed = 1;
+
+  auto chain_context = make_shared<FirewallContext>(context);
+  chain_context->chain_ = plan.chain_;
+
+  auto model = getRulesetModel(chain_context);
+  if (model == nullptr) {
+    context->setLastError(chain_context->getLastError());
+    return false;
+  }
+  auto chain = model->findChain(plan.chain_);
+  if (!chain) {
+    context->setLastError(fmt::format("Unknown chain: {}", plan.chain_));
+    return false;
+  }
+  if (auto mismatch =
+          BpfCompiler::verify(*model, *chain, plan, BpfCompiler::kVerifyPackets,
+                              kVerifySeed)) {
+    context->setLastError(
+        fmt::format("Compiled chain differs: {}", *mismatch));
+    return false;
+  }
+
+  vector<shared_ptr<RuleRequest>> heads;
+  for (const auto &run : plan.runs_) {
+    heads.emplace_back(run.rule_);
+  }
+
+  auto snapshot = snapshotChains(context, std::span(&plan.chain_, 1));
+  if (!snapshot) {
+    return false;
+  }
+
+  /* replace first, indices of plan refer to chain before removal */
+  optional<string> error;
+  for (const auto &result : replaceRules(chain_context, heads)) {
+    error = error ? error : result;
+  }
+  if (!error) {
+    for (const auto &result : removeRules(chain_context, plan.removed_)) {
+      error = error ? error : result;
+    }
+  }
+
+  if (error) {
+    context->setLastError(*error);
+    restoreChains(*snapshot);
+    return false;
+  }
+  return true;
+}
+
+auto FirewallBackend::planConntrackBypass(const BypassService &service)
+    -> BypassPlan {
+  auto plan = ConntrackBypass::plan(service);
+
+  /* decoded rules of each chain of the plan and where rules go */
+  class Chain {
+  public:
+    vector<shared_ptr<RuleRequest>> requests_;
+    int index_;
+  };
+  unordered_map<string, Chain> chains;
+  for (auto &rule : plan.rules_) {
+    auto scope = fmt::format("{}/{}", rule.table_, rule.chain_);
+    auto table =
+        createContext(std::make_shared<FirewallContext>(), rule.table_);
+    auto context = createContext(table, rule.chain_);
+    auto iter = chains.find(scope);
+    if (iter == chains.end()) {
+      Chain chain{{}, 0};
+      auto count = getRuleCount(context);
+      for (int i = 0; i < count; i++) {
+        chain.requests_.emplace_back(getRule(context, i));
+      }
+      /* rules before the ESTABLISHED accept rule may drop, e.g. blocked
+       * sources, untracked packets are accepted where the tracked are */
+      auto *handle = findHandle(context);
+      if (handle != nullptr && rule.table_ == ConntrackBypass::kFilterTable) {
+        const auto &entries = getRules(context);
+        auto found = std::ranges::find_if(
+            entries, [handle](const struct ipt_entry *entry) {
+              return acceptsEstablished(entry, handle);
+            });
+        if (found != entries.end()) {
+          chain.index_ = static_cast<int>(found - entries.begin());
+        }
+      }
+      iter = chains.emplace(scope, std::move(chain)).first;
+    }
+
+    rule.rule_->index_ = iter->second.index_;
+    rule.present_ =
+        ConntrackBypass::isPresent(*rule.rule_, iter->second.requests_);
+    if (!rule.present_) {
+      auto model = getRulesetModel(context);
+      if (auto chain = model ? model->findChain(rule.chain_) : std::nullopt) {
+        rule.shadowed_ = ConntrackBypass::shadowed(*rule.rule_, *model, *chain);
+      }
+    }
+  }
+  return plan;
+}
+
+auto FirewallBackend::applyConntrackBypass(const ctx_t &context,
+                                           const BypassPlan &plan) -> bool {
+  /* pending rules by chain, in plan order */
+  vector<std::pair<ctx_t, vector<shared_ptr<RuleRequest>>>> batches;
+  for (const auto &rule : plan.rules_) {
+    if (rule.present_) {
+      continue;
+    }
+    auto batch = std::ranges::find_if(batches, [&rule](const auto &batch) {
+      return batch.first->table_ == rule.table_ &&
+             batch.first->chain_ == rule.chain_;
+    });
+    if (batch == batches.end()) {
+      auto table =
+          createContext(std::make_shared<FirewallContext>(), rule.table_);
+      batches.emplace_back(createContext(table, rule.chain_),
+                           vector<shared_ptr<RuleRequest>>());
+      batch = std::prev(batches.end());
+    }
+    batch->second.emplace_back(rule.rule_);
+  }
+
+  vector<ChainSnapshot> snapshots;
+  for (const auto &[chain_context, requests] : batches) {
+    auto snapshot =
+        snapshotChains(chain_context, std::span(&chain_context->chain_, 1));
+    if (!snapshot) {
+      context->setLastError(chain_context->getLastError());
+      return false;
+    }
+    snapshots.emplace_back(std::move(*snapshot));
+  }
+
+  optional<string> error;
+  for (const auto &[chain_context, requests] : batches) {
+    for (const auto &result : insertRules(chain_context, requests)) {
+      error = error ? error : result;
+    }
+    if (error) {
+      error = fmt::format("{}/{}: {}", chain_context->table_,
+                          chain_context->chain_, *error);
+      break;
+    }
+  }
+
+  if (error) {
+    context->setLastError(*error);
+    for (const auto &snapshot : snapshots) {
+      restoreChains(snapshot);
+    }
+    return false;
+  }
+  return true;
+}
+
+auto FirewallBackend::planReorder(const ctx_t &context)
+    -> optional<ReorderPlan> {
+  return guarded(context, optional<ReorderPlan>(),
+                 [&]() -> optional<ReorderPlan> {
+                   auto [model, chain] = loadChain(context);
+                   return RuleReorderer::plan(*model, chain);
+                 });
+}
+
+auto FirewallBackend::getTableNames() -> vector<string> {
+  const static vector<string> tables = {"filter", "nat", "mangle", "raw",
+                                        "security"};
+
+  return tables;
+};
+
+auto FirewallBackend::destroyHandler(const string &table) -> void {
+  releaseHandler(table);
+  search_index_.invalidateTable(table);
+}
+
+auto FirewallBackend::releaseHandler(const string &table) -> void {
+  if (auto iter = handles_.find(table); iter != handles_.end()) {
+    if (iter->second != nullptr) {
+      iptc_free(iter->second);
+    }
+    handles_.erase(iter);
+  }
+  rule_cache_.erase(table);
+  models_.erase(table);
+  graphs_.erase(table);
+  fingerprints_.erase(table);
+}
+
+auto FirewallBackend::markDirty(const string &table) -> void {
+  dirty_tables_.insert(table);
+  models_.erase(table);
+}
+
+auto FirewallBackend::copyEntry(struct iptc_handle *handle,
+                                const struct ipt_entry *entry)
+    -> vector<char> {
+  const auto *bytes = reinterpret_cast<const char *>(entry);
+  vector<char> copy(bytes, bytes + entry->next_offset);
+
+  auto *target = reinterpret_cast<struct ipt_entry_target *>(
+      copy.data() + entry->target_offset);
+  const auto *name = iptc_get_target(entry, handle);
+  memset(target->u.user.name, 0, sizeof(target->u.user.name));
+  strncpy(target->u.user.name, name, sizeof(target->u.user.name) - 1);
+  return copy;
+}
+
+auto FirewallBackend::snapshotChains(const ctx_t &context,
+                                     std::span<const string> chains)
+    -> optional<ChainSnapshot> {
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    return std::nullopt;
+  }
+
+  const auto &table = context->table_;
+  auto table_context =
+      createContext(std::make_shared<FirewallContext>(), table);
+  ChainSnapshot snapshot{table, dirty_tables_.contains(table),
+                         getChains(table_context)};
+  for (const auto &name : chains) {
+    ChainSnapshot::Chain chain{name};
+    if (iptc_builtin(name.c_str(), handle) != 0) {
+      chain.policy_ =
+          iptc_get_policy(name.c_str(), &chain.policy_counters_, handle);
+    }
+    for (const auto *entry : getRules(createContext(table_context, name))) {
+      chain.entries_.emplace_back(copyEntry(handle, entry));
+    }
+    snapshot.chains_.emplace_back(std::move(chain));
+  }
+  return snapshot;
+}
+
+auto FirewallBackend::restoreChains(const ChainSnapshot &snapshot) -> void {
+  const auto &table = snapshot.table_;
+  auto iter = handles_.find(table);
+  if (iter == handles_.end() || iter->second == nullptr) {
+    /* handle was discarded, the table is the one in kernel again */
+    return;
+  }
+  auto context = createContext(std::make_shared<FirewallContext>(), table);
+  auto *handle = iter->second;
+
+  auto restore = [&]() -> bool {
+    auto existed = [&snapshot](const string &name) {
+      return std::ranges::find(snapshot.chain_names_, name) !=
+             snapshot.chain_names_.end();
+    };
+    auto saved = [&snapshot](const string &name) {
+      return std::ranges::find(snapshot.chains_, name,
+                               &ChainSnapshot::Chain::name_) !=
+             snapshot.chains_.end();
+    };
+
+    /* flush first, so that nothing refers to the chains deleted next */
+    auto current = getChains(context);
+    for (const auto &name : current) {
+      if ((saved(name) || !existed(name)) &&
+          iptc_flush_entries(name.c_str(), handle) == 0) {
+        return false;
+      }
+    }
+    for (const auto &name : current) {
+      if (!existed(name) && iptc_delete_chain(name.c_str(), handle) == 0) {
+        return false;
+      }
+    }
+    for (const auto &name : snapshot.chain_names_) {
+      if (iptc_is_chain(name.c_str(), handle) == 0 &&
+          iptc_create_chain(name.c_str(), handle) == 0) {
+        return false;
+      }
+    }
+
+    for (const auto &chain : snapshot.chains_) {
+      auto counters = chain.policy_counters_;
+      if (chain.policy_.has_value() &&
+          iptc_set_policy(chain.name_.c_str(), chain.policy_->c_str(),
+                          &counters, handle) == 0) {
+        return false;
+      }
+      for (const auto &entry : chain.entries_) {
+        if (iptc_append_entry(
+                chain.name_.c_str(),
+                reinterpret_cast<const struct ipt_entry *>(entry.data()),
+                handle) == 0) {
+          return false;
+        }
+      }
+    }
     return true;
-  });
-}
+  };
 
-auto FirewallBackend::getTableNames() -> vector<string> {
-  const static vector<string> tables = {"filter", "nat", "mangle", "raw",
-                                        "security"};
+  if (!restore()) {
+    /* last resort, a half restored table must never be committed */
+    yuiError() << "Error restoring table " << table << ": "
+               << iptc_strerror(errno) << ", discarding its changes" << endl;
+    dirty_tables_.erase(table);
+    destroyHandler(table);
+    destroyCreatedSets(table);
+    return;
+  }
 
-  return tables;
-};
+  rule_cache_.erase(table);
+  models_.erase(table);
+  graphs_.erase(table);
+  search_index_.invalidateTable(table);
+  if (!snapshot.dirty_) {
+    dirty_tables_.erase(table);
+  }
+}
 
 auto FirewallBackend::destroyHandlers() -> bool {
   if (std::ranges::all_of(handles_, [](const auto &pair) {
@@ -54,100 +1009,307 @@ auto FirewallBackend::destroyHandlers() -> bool {
         return true;
       })) {
     handles_.clear();
+    rule_cache_.clear();
+    models_.clear();
+    fingerprints_.clear();
     return true;
   }
 
   return false;
 }
 
-FirewallBackend::FirewallBackend() {
-  if (!createHandlers()) {
-    throw std::runtime_error("Error creating iptables's table handlers.");
+FirewallBackend::FirewallBackend() = default;
+
+FirewallBackend::~FirewallBackend() {
+  /* changes never committed are discarded with their sets */
+  while (!created_sets_.empty()) {
+    destroyCreatedSets(created_sets_.begin()->first);
   }
+  destroyHandlers();
 }
 
-FirewallBackend::~FirewallBackend() { destroyHandlers(); }
-
 auto FirewallBackend::apply() -> function<bool()> {
-  return [this]() {
-    if (std::ranges::all_of(handles_, [](const auto &pair) {
-          if (iptc_commit(pair.second) > 0) {
-            return true;
-          }
-
-          yuiError() << "Error committing iptables's table: " << pair.first
-                     << ". " << iptc_strerror(errno) << endl;
-          return false;
-        })) {
-      // after calling commit, close all handle and create new one
-      return destroyHandlers() && createHandlers();
-    }
+  return [this]() { return commit(); };
+}
 
-    return false;
-  };
+auto FirewallBackend::lockXtables() -> unique_ptr<XtablesLock> {
+  auto lock = std::make_unique<XtablesLock>();
+  commit_stat_.lock_wait_ += lock->waited();
+  commit_stat_.max_lock_wait_ =
+      std::max(commit_stat_.max_lock_wait_, lock->waited());
+  if (lock->contended()) {
+    commit_stat_.contended_++;
+    yuiMilestone() << "Waited " << lock->waited().count()
+                   << " us for xtables lock" << endl;
+  }
+  if (!lock->locked()) {
+    commit_stat_.lock_timeouts_++;
+    last_commit_error_ = lock->error();
+    yuiError() << "Error taking xtables lock: " << lock->error() << endl;
+    return nullptr;
+  }
+  return lock;
 }
 
-auto FirewallBackend::getFirewallChildren(
-    const shared_ptr<FirewallContext> &context) -> vector<string> {
-  vector<string> children;
+auto FirewallBackend::commitTable(const string &table) -> bool {
+  static constexpr int kMaxAttempts = 3;
+  static constexpr std::chrono::milliseconds kRetryDelay{10};
+
+  auto context = createContext(std::make_shared<FirewallContext>(), table);
+  for (int attempt = 1;; attempt++) {
+    /* committing would overwrite rules written by another program since the
+     * handle was loaded, the entry count alone is checked by kernel */
+    if (isStale(context)) {
+      last_commit_error_ = staleTableError(table);
+      break;
+    }
+
+    if (iptc_commit(getHandle(table)) != 0) {
+      return true;
+    }
 
-  switch (context->level_) {
-  case FirewallLevel::OVERALL:
-    children = getTableNames();
-    break;
-  case FirewallLevel::TABLE:
-    children = getChains(context);
-    break;
-  case FirewallLevel::CHAIN:
-    auto *handle = handles_.at(context->table_);
-    auto rules = getRules(context);
-    for (const auto &rule : rules) {
-      children.emplace_back(serializeShortRule(handle, rule));
+    auto error = errno;
+    if (error == EAGAIN) {
+      /* kernel table was replaced after the handle was loaded, committing
+       * the same handle again cannot succeed */
+      last_commit_error_ = fmt::format(
+          "Table {} changed outside while committing, reload it and apply "
+          "the changes again.",
+          table);
+      break;
+    }
+    last_commit_error_ = fmt::format("Error committing table {}: {}", table,
+                                     iptc_strerror(error));
+    auto transient = error == EBUSY || error == EINTR;
+    if (!transient || attempt == kMaxAttempts) {
+      break;
     }
-    break;
+    commit_stat_.retries_++;
+    std::this_thread::sleep_for(kRetryDelay * attempt);
   }
 
-  return children;
+  yuiError() << last_commit_error_ << endl;
+  return false;
 }
 
-auto FirewallBackend::getRuleDetails(const ctx_t &context,
-                                     int index) -> string {
-  auto *handle = handles_.at(context->table_);
-  auto chain = context->chain_;
-  const auto *rule = iptc_first_rule(chain.c_str(), handle);
+auto FirewallBackend::lastCommitError() const -> string {
+  return last_commit_error_;
+}
+
+auto FirewallBackend::commit() -> bool {
+  last_commit_error_.clear();
+  if (dirty_tables_.empty()) {
+    return true;
+  }
+
+  commit_stat_.commits_++;
+  auto lock = lockXtables();
+  if (lock == nullptr) {
+    commit_stat_.failures_++;
+    return false;
+  }
+
+  /* a table changed outside fails before any table is committed, rather
+   * than after the ones before it */
+  for (const auto &table : dirty_tables_) {
+    if (isStale(createContext(std::make_shared<FirewallContext>(), table))) {
+      last_commit_error_ = staleTableError(table);
+      yuiError() << last_commit_error_ << endl;
+      commit_stat_.failures_++;
+      return false;
+    }
+  }
+
+  string committed;
+  while (!dirty_tables_.empty()) {
+    auto table = *dirty_tables_.begin();
+    if (!commitTable(table)) {
+      commit_stat_.failures_++;
+      if (!committed.empty()) {
+        last_commit_error_ +=
+            fmt::format(" Already committed: {}.", committed);
+      }
+      return false;
+    }
+    committed += committed.empty() ? table : ", " + table;
+
+    /* committed handle cannot be reused, it is loaded again on next access
+     * instead of eagerly, so tables nobody looks at are never reloaded. The
+     * kernel holds what was indexed, the search index is kept. */
+    dirty_tables_.erase(table);
+    releaseHandler(table);
+    created_sets_.erase(table);
+    if (auto iter = indexed_fingerprints_.find(table);
+        iter != indexed_fingerprints_.end()) {
+      if (auto fingerprint = KernelTable::fingerprint(table); fingerprint) {
+        iter->second = *fingerprint;
+      } else {
+        indexed_fingerprints_.erase(iter);
+        search_index_.invalidateTable(table);
+      }
+    }
+  }
+
+  return true;
+}
 
-  for (int i = 0; i < index; i++) {
-    rule = iptc_next_rule(rule, handle);
+auto FirewallBackend::estimateCommitCost() -> size_t {
+  size_t cost = 0;
+  for (const auto &table : dirty_tables_) {
+    /* dirty tables are loaded, a missing handle has nothing to commit */
+    auto iter = handles_.find(table);
+    if (iter == handles_.end() || iter->second == nullptr) {
+      continue;
+    }
+    auto *handle = iter->second;
+    for (const auto *chain = iptc_first_chain(handle); chain != nullptr;
+         chain = iptc_next_chain(handle)) {
+      for (const auto *entry = iptc_first_rule(chain, handle);
+           entry != nullptr; entry = iptc_next_rule(entry, handle)) {
+        cost++;
+      }
+    }
   }
 
-  return serializeRule(handle, rule);
+  return cost;
+}
+
+auto FirewallBackend::isPending(const string &scope) const -> bool {
+  return dirty_tables_.contains(scope.substr(0, scope.find('/')));
+}
+
+auto FirewallBackend::settle(const vector<string> &pending_scopes) -> void {
+  /* a table left without journaled changes may still hold changes made
+   * outside the journal, e.g. ipsets or an imported ruleset. It is only
+   * clean again if its handle equals the kernel table. */
+  std::erase_if(dirty_tables_, [this, &pending_scopes](const string &table) {
+    return std::ranges::none_of(pending_scopes,
+                                [&table](const string &scope) {
+                                  return scope.starts_with(table + "/");
+                                }) &&
+           !created_sets_.contains(table) && matchesKernel(table);
+  });
 }
 
-auto FirewallBackend::createContext(const ctx_t &current,
-                                    const string &name) -> ctx_t {
-  shared_ptr<FirewallContext> context = make_shared<FirewallContext>(current);
+auto FirewallBackend::matchesKernel(const string &table) -> bool {
+  auto iter = handles_.find(table);
+  if (iter == handles_.end() || iter->second == nullptr) {
+    return false;
+  }
+  auto *handle = iter->second;
+  auto *kernel = iptc_init(table.c_str());
+  if (kernel == nullptr) {
+    return false;
+  }
+
+  /* counters and jump offsets differ between the two, see copyEntry() */
+  auto normalized = [](struct iptc_handle *from,
+                       const struct ipt_entry *entry) {
+    auto copy = copyEntry(from, entry);
+    auto *copied = reinterpret_cast<struct ipt_entry *>(copy.data());
+    copied->counters = {};
+    copied->comefrom = 0;
+    auto *target = reinterpret_cast<struct ipt_entry_target *>(
+        copy.data() + copied->target_offset);
+    const auto *original = reinterpret_cast<const struct ipt_entry_target *>(
+        reinterpret_cast<const char *>(entry) + entry->target_offset);
+    if (strcmp(original->u.user.name, XT_STANDARD_TARGET) == 0) {
+      memset(target->data, 0,
+             target->u.target_size - sizeof(struct ipt_entry_target));
+    }
+    return copy;
+  };
+
+  auto same = true;
+  const auto *chain = iptc_first_chain(handle);
+  const auto *kernel_chain = iptc_first_chain(kernel);
+  for (; same && chain != nullptr && kernel_chain != nullptr;
+       chain = iptc_next_chain(handle),
+       kernel_chain = iptc_next_chain(kernel)) {
+    same = strcmp(chain, kernel_chain) == 0;
+    if (same && iptc_builtin(chain, handle) != 0) {
+      struct xt_counters counters {};
+      const auto *policy = iptc_get_policy(chain, &counters, handle);
+      const auto *kernel_policy = iptc_get_policy(chain, &counters, kernel);
+      same = policy != nullptr && kernel_policy != nullptr &&
+             strcmp(policy, kernel_policy) == 0;
+    }
+
+    const auto *entry = iptc_first_rule(chain, handle);
+    const auto *kernel_entry = iptc_first_rule(chain, kernel);
+    for (; same && entry != nullptr && kernel_entry != nullptr;
+         entry = iptc_next_rule(entry, handle),
+         kernel_entry = iptc_next_rule(kernel_entry, kernel)) {
+      same = normalized(handle, entry) == normalized(kernel, kernel_entry);
+    }
+    same = same && entry == nullptr && kernel_entry == nullptr;
+  }
+  same = same && chain == nullptr && kernel_chain == nullptr;
+
+  iptc_free(kernel);
+  return same;
+}
 
-  switch (context->level_) {
-  case FirewallLevel::OVERALL:
-    context->level_ = FirewallLevel::TABLE;
-    context->table_ = name;
-    break;
-  case FirewallLevel::TABLE:
-    context->level_ = FirewallLevel::CHAIN;
-    context->chain_ = name;
-    break;
-  case FirewallLevel::CHAIN:
-    yuiError() << "Cannot create context from chain." << endl;
-    break;
+auto FirewallBackend::replaceTable(const ctx_t &context,
+                                   const TableRuleset &ruleset) -> bool {
+  auto lock = lockXtables();
+  if (lock == nullptr) {
+    context->setLastError(last_commit_error_);
+    return false;
+  }
+  if (!TableCompiler::replace(ruleset, context)) {
+    yuiError() << "Error replacing table: " << context->getLastError() << endl;
+    return false;
   }
 
-  return context;
+  /* table is reloaded from kernel on next access */
+  dirty_tables_.erase(ruleset.table_);
+  destroyHandler(ruleset.table_);
+  return true;
+}
+
+auto FirewallBackend::getFirewallChildren(
+    const shared_ptr<FirewallContext> &context) -> vector<string> {
+  return guarded(context, vector<string>(), [&]() {
+    vector<string> children;
+
+    switch (context->level_) {
+    case FirewallLevel::OVERALL:
+      children = getTableNames();
+      break;
+    case FirewallLevel::TABLE:
+      children = getChains(context);
+      break;
+    case FirewallLevel::CHAIN:
+      auto *handle = getHandle(context->table_);
+      const auto &rules = getRules(context);
+      children.reserve(rules.size());
+
+      fmt::memory_buffer buffer;
+      for (const auto *rule : rules) {
+        buffer.clear();
+        serializeShortRule(handle, rule, buffer);
+        children.emplace_back(buffer.data(), buffer.size());
+      }
+      break;
+    }
+
+    return children;
+  });
+}
+
+auto FirewallBackend::getRuleDetails(const ctx_t &context,
+                                     int index) -> string {
+  return guarded(context, string(), [&]() {
+    return serializeRule(getHandle(context->table_),
+                         getRuleEntry(context, index));
+  });
 }
 
 auto FirewallBackend::getChains(const ctx_t &context) -> vector<string> {
   vector<string> chains;
 
-  auto *handle = handles_.at(context->table_);
+  auto *handle = getHandle(context->table_);
   for (const auto *chain = iptc_first_chain(handle); chain != nullptr;
        chain = iptc_next_chain(handle)) {
     chains.emplace_back(chain);
@@ -157,41 +1319,88 @@ auto FirewallBackend::getChains(const ctx_t &context) -> vector<string> {
 }
 
 auto FirewallBackend::getRules(const ctx_t &context)
-    -> vector<const struct ipt_entry *> {
-  vector<const struct ipt_entry *> rules;
+    -> const vector<const struct ipt_entry *> & {
+  auto *handle = getHandle(context->table_);
+  auto &chains = rule_cache_[context->table_];
+  if (auto iter = chains.find(context->chain_); iter != chains.end()) {
+    return iter->second;
+  }
 
-  auto *handle = handles_.at(context->table_);
+  vector<const struct ipt_entry *> rules;
   auto chain = context->chain_;
   for (const struct ipt_entry *entry = iptc_first_rule(chain.c_str(), handle);
        entry != nullptr; entry = iptc_next_rule(entry, handle)) {
     rules.emplace_back(entry);
   }
 
-  return rules;
+  return chains.emplace(chain, std::move(rules)).first->second;
 }
 
-auto FirewallBackend::getRule(const ctx_t &context,
-                              int index) -> shared_ptr<RuleRequest> {
-  auto *handle = handles_.at(context->table_);
-  auto chain = context->chain_;
-  const auto *rule = iptc_first_rule(chain.c_str(), handle);
-  for (int i = 0; i < index; i++) {
-    rule = iptc_next_rule(rule, handle);
+auto FirewallBackend::getRuleEntry(const ctx_t &context, int index)
+    -> const struct ipt_entry * {
+  const auto &rules = getRules(context);
+  if (index < 0 || index >= static_cast<int>(rules.size())) {
+    throw std::out_of_range(fmt::format("Rule #{} out of chain {}, size: {}",
+                                        index, context->chain_, rules.size()));
+  }
+
+  return rules[index];
+}
+
+auto FirewallBackend::getRuleCount(const ctx_t &context) -> int {
+  return guarded(context, 0, [&]() {
+    return static_cast<int>(getRules(context).size());
+  });
+}
+
+auto FirewallBackend::invalidateChain(const string &table,
+                                      const string &chain) -> void {
+  if (auto iter = rule_cache_.find(table); iter != rule_cache_.end()) {
+    iter->second.erase(chain);
   }
+  if (auto graph = graphs_.find(table); graph != graphs_.end()) {
+    graph->second.invalidate(chain);
+  }
+  search_index_.invalidateChain(table, chain);
+}
 
-  return std::make_shared<RuleRequest>(handle, rule, index);
+auto FirewallBackend::getRule(const ctx_t &context,
+                              int index) -> shared_ptr<RuleRequest> {
+  return guarded(context, shared_ptr<RuleRequest>(), [&]() {
+    return std::make_shared<RuleRequest>(getHandle(context->table_),
+                                         getRuleEntry(context, index), index);
+  });
 }
 
 auto FirewallBackend::removeChain(const ctx_t &context) -> bool {
+  if (findHandle(context) == nullptr) {
+    return false;
+  }
+
   if (context->level_ == FirewallLevel::CHAIN) {
+    /* the kernel refuses it too, but without saying who refers to it */
+    const auto &graph = *getChainGraph(context);
+    if (auto refs = graph.references(context->chain_); refs > 0) {
+      string referrers;
+      for (const auto &chain : graph.referrers(context->chain_)) {
+        referrers += (referrers.empty() ? "" : ", ") + chain;
+      }
+      context->setLastError(
+          fmt::format("Chain {} is referenced by {} rules in {}\n",
+                      context->chain_, refs, referrers));
+      return false;
+    }
+
     if (iptc_delete_chain(context->chain_.c_str(),
-                          handles_.at(context->table_)) == 0) {
+                          getHandle(context->table_)) == 0) {
       auto msg =
           fmt::format("Error deleting chain: {}\n", iptc_strerror(errno));
       context->setLastError(msg);
       return false;
     }
 
+    invalidateChain(context->table_, context->chain_);
+    markDirty(context->table_);
     return true;
   }
 
@@ -200,12 +1409,10 @@ auto FirewallBackend::removeChain(const ctx_t &context) -> bool {
 }
 
 auto FirewallBackend::removeRule(const ctx_t &context, int index) -> bool {
-  auto *handle = handles_.at(context->table_);
-  auto chain = context->chain_;
-
-  if (iptc_delete_num_entry(chain.c_str(), index, handle) == 0) {
-    yuiError() << "Error deleting rule: " << iptc_strerror(errno) << endl;
-    context->setLastError(iptc_strerror(errno));
+  auto result = removeRules(context, std::span(&index, 1));
+  if (result.front().has_value()) {
+    yuiError() << "Error deleting rule: " << result.front().value() << endl;
+    context->setLastError(result.front().value());
     return false;
   }
 
@@ -214,62 +1421,326 @@ auto FirewallBackend::removeRule(const ctx_t &context, int index) -> bool {
 
 auto FirewallBackend::updateRule(
     const ctx_t &context, const shared_ptr<RuleRequest> &request) -> bool {
-  if (context->level_ != FirewallLevel::CHAIN) {
-    context->setLastError("Cannot update rule over table.");
+  auto result = replaceRules(context, std::span(&request, 1));
+  if (result.front().has_value()) {
+    context->setLastError(result.front().value());
     return false;
   }
 
+  return true;
+}
+
+auto FirewallBackend::insertRule(
+    const ctx_t &context, const shared_ptr<RuleRequest> &request) -> bool {
+  auto result = insertRules(context, std::span(&request, 1));
+  if (result.front().has_value()) {
+    context->setLastError(result.front().value());
+    return false;
+  }
+
+  return true;
+}
+
+auto FirewallBackend::encodeRules(
+    const ctx_t &context, struct iptc_handle *handle,
+    std::span<const shared_ptr<RuleRequest>> requests, vector<char> &buffer,
+    BatchResult &result) -> vector<optional<size_t>> {
+  vector<optional<size_t>> offsets(requests.size());
+  auto is_chain = [handle](const string &name) {
+    return iptc_is_chain(name.c_str(), handle) != 0 &&
+           iptc_builtin(name.c_str(), handle) == 0;
+  };
+
+  size_t total_size = 0;
+  for (const auto &request : requests) {
+    total_size += request->entry_size();
+  }
+  buffer.assign(total_size, 0);
+
+  size_t offset = 0;
+  for (size_t i = 0; i < requests.size(); i++) {
+    try {
+      if (requests[i]->write_entry_bytes(context, buffer.data() + offset,
+                                         is_chain)) {
+        offsets[i] = offset;
+      } else {
+        result[i] = fmt::format("Error creating rule entry, reason: {}",
+                                context->getLastError());
+      }
+    } catch (const std::exception &e) {
+      result[i] =
+          fmt::format("Error creating rule entry, reason: {}", e.what());
+    }
+    offset += requests[i]->entry_size();
+  }
+
+  return offsets;
+}
+
+auto FirewallBackend::insertRules(
+    const ctx_t &context,
+    std::span<const shared_ptr<RuleRequest>> requests) -> BatchResult {
+  BatchResult result(requests.size());
+  if (context->level_ != FirewallLevel::CHAIN) {
+    std::ranges::fill(result, "Cannot add rule to table over chain.\n");
+    return result;
+  }
+
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    std::ranges::fill(result, context->getLastError());
+    return result;
+  }
+
   ipt_chainlabel chain;
-  auto *handle = handles_.at(context->table_);
   strncpy(chain, context->chain_.c_str(), sizeof(ipt_chainlabel));
 
-  if (auto entry_buffer = request->to_entry_bytes(context)) {
-    auto *entry = reinterpret_cast<struct ipt_entry *>(entry_buffer->data());
-    if (iptc_replace_entry(chain, entry, request->index_, handle) == 0) {
-      context->setLastError(
-          fmt::format("Error update rule, reason: {}\n", iptc_strerror(errno)));
-      return false;
+  vector<char> buffer;
+  auto offsets = encodeRules(context, handle, requests, buffer, result);
+
+  /* insert by ascending index, each insert shifts the following ones */
+  vector<size_t> order(requests.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::ranges::stable_sort(
+      order, {}, [&requests](size_t i) { return requests[i]->index_; });
+
+  auto rule_num = getRuleCount(context);
+  auto inserted = 0;
+  for (auto i : order) {
+    if (!offsets[i].has_value()) {
+      continue;
     }
-  } else {
-    context->setLastError(fmt::format("Error creating rule entry, reason: {}",
-                                      context->getLastError()));
-    return false;
+    if (requests[i]->index_ < 0) {
+      result[i] = fmt::format("Invalid rule index: {}", requests[i]->index_);
+      continue;
+    }
+
+    const auto *entry =
+        reinterpret_cast<const struct ipt_entry *>(&buffer[*offsets[i]]);
+    auto position = requests[i]->index_ + inserted;
+    auto res = position >= rule_num
+                   ? iptc_append_entry(chain, entry, handle)
+                   : iptc_insert_entry(chain, entry, position, handle);
+    if (res == 0) {
+      result[i] =
+          fmt::format("Error insert rule, reason: {}\n", iptc_strerror(errno));
+      continue;
+    }
+
+    inserted++;
+    rule_num++;
   }
 
-  return true;
+  if (inserted > 0) {
+    invalidateChain(context->table_, context->chain_);
+    markDirty(context->table_);
+  }
+
+  return result;
 }
 
-auto FirewallBackend::insertRule(
-    const ctx_t &context, const shared_ptr<RuleRequest> &request) -> bool {
+auto FirewallBackend::appendRules(
+    const ctx_t &context,
+    std::span<const shared_ptr<RuleRequest>> requests) -> BatchResult {
+  BatchResult result(requests.size());
+  if (context->level_ != FirewallLevel::CHAIN) {
+    std::ranges::fill(result, "Cannot add rule to table over chain.\n");
+    return result;
+  }
+
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    std::ranges::fill(result, context->getLastError());
+    return result;
+  }
+
+  ipt_chainlabel chain;
+  strncpy(chain, context->chain_.c_str(), sizeof(ipt_chainlabel));
 
+  vector<char> buffer;
+  auto offsets = encodeRules(context, handle, requests, buffer, result);
+
+  auto appended = 0;
+  for (size_t i = 0; i < requests.size(); i++) {
+    if (!offsets[i].has_value()) {
+      continue;
+    }
+
+    const auto *entry =
+        reinterpret_cast<const struct ipt_entry *>(&buffer[*offsets[i]]);
+    if (iptc_append_entry(chain, entry, handle) == 0) {
+      result[i] =
+          fmt::format("Error append rule, reason: {}\n", iptc_strerror(errno));
+      continue;
+    }
+    appended++;
+  }
+
+  if (appended > 0) {
+    invalidateChain(context->table_, context->chain_);
+    markDirty(context->table_);
+  }
+
+  return result;
+}
+
+auto FirewallBackend::removeRules(const ctx_t &context,
+                                  std::span<const int> indices) -> BatchResult {
+  BatchResult result(indices.size());
   if (context->level_ != FirewallLevel::CHAIN) {
-    context->setLastError(fmt::format("Cannot add rule to table over chain.\n",
-                                      iptc_strerror(errno)));
-    return false;
+    std::ranges::fill(result, "Cannot remove rule over table.");
+    return result;
+  }
+
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    std::ranges::fill(result, context->getLastError());
+    return result;
   }
 
   ipt_chainlabel chain;
-  auto *handle = handles_.at(context->table_);
   strncpy(chain, context->chain_.c_str(), sizeof(ipt_chainlabel));
 
-  /* insert it */
-  if (auto entry_buffer = request->to_entry_bytes(context)) {
-    auto *entry = reinterpret_cast<struct ipt_entry *>(entry_buffer->data());
-    if (request->index_ > getFirewallChildren(context).size()) {
-      if (iptc_append_entry(chain, entry, handle) == 0) {
-        context->setLastError(fmt::format("Error insert rule, reason: {}\n",
-                                          iptc_strerror(errno)));
-        return false;
-      }
-    } else if (iptc_insert_entry(chain, entry, request->index_, handle) == 0) {
+  /* remove by descending index so that no index is shifted */
+  vector<size_t> order(indices.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::ranges::stable_sort(order, std::ranges::greater{},
+                           [&indices](size_t i) { return indices[i]; });
+
+  auto rule_num = getRuleCount(context);
+  auto removed = 0;
+  optional<int> last_removed;
+  for (auto i : order) {
+    auto index = indices[i];
+    if (index < 0 || index >= rule_num) {
+      result[i] = fmt::format("Rule #{} out of chain, size: {}", index,
+                              rule_num);
+    } else if (last_removed == index) {
+      result[i] = fmt::format("Rule #{} is removed more than once", index);
+    } else if (iptc_delete_num_entry(chain, index, handle) == 0) {
+      result[i] = iptc_strerror(errno);
+    } else {
+      last_removed = index;
+      removed++;
+    }
+  }
+
+  if (removed > 0) {
+    invalidateChain(context->table_, context->chain_);
+    markDirty(context->table_);
+  }
+
+  return result;
+}
+
+auto FirewallBackend::replaceRules(
+    const ctx_t &context,
+    std::span<const shared_ptr<RuleRequest>> requests) -> BatchResult {
+  BatchResult result(requests.size());
+  if (context->level_ != FirewallLevel::CHAIN) {
+    std::ranges::fill(result, "Cannot update rule over table.");
+    return result;
+  }
+
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    std::ranges::fill(result, context->getLastError());
+    return result;
+  }
+
+  ipt_chainlabel chain;
+  strncpy(chain, context->chain_.c_str(), sizeof(ipt_chainlabel));
+
+  vector<char> buffer;
+  auto offsets = encodeRules(context, handle, requests, buffer, result);
+
+  auto rule_num = getRuleCount(context);
+  auto replaced = 0;
+  for (size_t i = 0; i < requests.size(); i++) {
+    if (!offsets[i].has_value()) {
+      continue;
+    }
+    if (requests[i]->index_ < 0 || requests[i]->index_ >= rule_num) {
+      result[i] = fmt::format("Rule #{} out of chain, size: {}",
+                              requests[i]->index_, rule_num);
+      continue;
+    }
+
+    const auto *entry =
+        reinterpret_cast<const struct ipt_entry *>(&buffer[*offsets[i]]);
+    if (iptc_replace_entry(chain, entry, requests[i]->index_, handle) == 0) {
+      result[i] =
+          fmt::format("Error update rule, reason: {}\n", iptc_strerror(errno));
+      continue;
+    }
+    replaced++;
+  }
+
+  if (replaced > 0) {
+    invalidateChain(context->table_, context->chain_);
+    markDirty(context->table_);
+  }
+
+  return result;
+}
+
+auto FirewallBackend::reorderRules(const ctx_t &context,
+                                   std::span<const int> order) -> bool {
+  if (context->level_ != FirewallLevel::CHAIN) {
+    context->setLastError("Cannot reorder rules over table.");
+    return false;
+  }
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    return false;
+  }
+
+  const auto &rules = getRules(context);
+  auto permutation = order.size() == rules.size();
+  vector<bool> seen(rules.size());
+  for (auto index : order) {
+    if (!permutation || index < 0 ||
+        index >= static_cast<int>(rules.size()) || seen[index]) {
+      permutation = false;
+      break;
+    }
+    seen[index] = true;
+  }
+  if (!permutation) {
+    context->setLastError(
+        fmt::format("Order is not a permutation of {} rules", rules.size()));
+    return false;
+  }
+
+  /* entries are owned by libiptc and freed on flush, copy them first */
+  vector<vector<char>> entries;
+  entries.reserve(order.size());
+  for (auto index : order) {
+    entries.emplace_back(copyEntry(handle, rules[index]));
+  }
+  auto snapshot = snapshotChains(context, std::span(&context->chain_, 1));
+  if (!snapshot) {
+    return false;
+  }
+
+  invalidateChain(context->table_, context->chain_);
+  markDirty(context->table_);
+  if (iptc_flush_entries(context->chain_.c_str(), handle) == 0) {
+    context->setLastError(fmt::format("Error flushing chain {}: {}",
+                                      context->chain_, iptc_strerror(errno)));
+    restoreChains(*snapshot);
+    return false;
+  }
+  for (const auto &entry : entries) {
+    if (iptc_append_entry(
+            context->chain_.c_str(),
+            reinterpret_cast<const struct ipt_entry *>(entry.data()),
+            handle) == 0) {
       context->setLastError(
-          fmt::format("Error insert rule, reason: {}\n", iptc_strerror(errno)));
+          fmt::format("Error append rule, reason: {}", iptc_strerror(errno)));
+      restoreChains(*snapshot);
       return false;
     }
-  } else {
-    context->setLastError(fmt::format("Error creating rule entry, reason: {}",
-                                      context->getLastError()));
-    return false;
   }
 
   return true;
@@ -277,7 +1748,10 @@ auto FirewallBackend::insertRule(
 
 auto FirewallBackend::insertChain(
     const ctx_t &context, const shared_ptr<ChainRequest> &request) -> bool {
-  auto *handle = handles_.at(context->table_);
+  auto *handle = findHandle(context);
+  if (handle == nullptr) {
+    return false;
+  }
   ipt_chainlabel chain;
   strncpy(chain, request->chain_name_.c_str(), sizeof(ipt_chainlabel));
 
@@ -287,41 +1761,66 @@ auto FirewallBackend::insertChain(
     return false;
   }
 
+  invalidateChain(context->table_, request->chain_name_);
+  markDirty(context->table_);
   return true;
 }
 
 auto FirewallBackend::serializeRule(iptc_handle *handle,
                                     const struct ipt_entry *rule) -> string {
-  std::string result;
-
-  result += fmt::format("Source IP: {}\n", inet_ntoa(rule->ip.src));
-  result += fmt::format("Destination IP: {}\n", inet_ntoa(rule->ip.dst));
-  result += fmt::format("Source Mask: {}\n", inet_ntoa(rule->ip.smsk));
-  result += fmt::format("Destination Mask: {}\n", inet_ntoa(rule->ip.dmsk));
-  result += fmt::format("Protocol: {}\n", proto2String(rule->ip.proto));
-  result += fmt::format("Flags: {}\n", rule->ip.flags);
-  result += fmt::format("Inverse Flags: {}\n", rule->ip.invflags);
-  result += fmt::format("Input Interface: {}\n", rule->ip.iniface);
-  result += fmt::format("Output Interface: {}\n", rule->ip.outiface);
-  result += fmt::format("Nf Cache: {}\n", rule->nfcache);
-  result += fmt::format("Come From: {}\n", rule->comefrom);
-  result += fmt::format("Packet Count: {}\n", rule->counters.pcnt);
-  result += fmt::format("Byte Count: {}\n", rule->counters.bcnt);
+  fmt::memory_buffer buffer;
+  serializeRule(handle, rule, buffer);
+  return fmt::to_string(buffer);
+}
+
+auto FirewallBackend::serializeRule(iptc_handle *handle,
+                                    const struct ipt_entry *rule,
+                                    fmt::memory_buffer &buffer) -> void {
+  auto out = std::back_inserter(buffer);
+  auto appendAddr = [&buffer](const char *name, const struct in_addr &addr) {
+    buffer.append(string_view(name));
+    appendIpv4(buffer, ntohl(addr.s_addr));
+    buffer.push_back('\n');
+  };
+
+  appendAddr("Source IP: ", rule->ip.src);
+  appendAddr("Destination IP: ", rule->ip.dst);
+  appendAddr("Source Mask: ", rule->ip.smsk);
+  appendAddr("Destination Mask: ", rule->ip.dmsk);
+  fmt::format_to(out, "Protocol: {}\n", proto2Name(rule->ip.proto));
+  fmt::format_to(out, "Flags: {}\n", rule->ip.flags);
+  fmt::format_to(out, "Inverse Flags: {}\n", rule->ip.invflags);
+  fmt::format_to(out, "Input Interface: {}\n", rule->ip.iniface);
+  fmt::format_to(out, "Output Interface: {}\n", rule->ip.outiface);
+  fmt::format_to(out, "Nf Cache: {}\n", rule->nfcache);
+  fmt::format_to(out, "Come From: {}\n", rule->comefrom);
+  fmt::format_to(out, "Packet Count: {}\n", rule->counters.pcnt);
+  fmt::format_to(out, "Byte Count: {}\n", rule->counters.bcnt);
 
   const auto *match = reinterpret_cast<const ipt_entry_match *>(rule->elems);
   while (reinterpret_cast<const char *>(match) !=
          reinterpret_cast<const char *>(rule) + rule->target_offset) {
-    result += fmt::format("Match Name: {}\n", match->u.user.name);
-    result += fmt::format("Match Size: {}\n", match->u.match_size);
+    fmt::format_to(out, "Match Name: {}\n", match->u.user.name);
+    fmt::format_to(out, "Match Size: {}\n", match->u.match_size);
 
-    if (rule->ip.proto == IPPROTO_TCP) {
+    if (strcmp(match->u.user.name, "set") == 0) {
+      const auto *info = reinterpret_cast<const xt_set_info *>(match->data);
+      fmt::format_to(
+          out, "Match Set: {} {}\n",
+          Ipset::nameOf(info->index).value_or(std::to_string(info->index)),
+          (info->flags & IPSET_DIM_ONE_SRC) != 0 ? "src" : "dst");
+    } else if (strcmp(match->u.user.name, "bpf") == 0) {
+      const auto *info = reinterpret_cast<const xt_bpf_info *>(match->data);
+      fmt::format_to(out, "Match BPF: {} instructions\n",
+                     info->bpf_program_num_elem);
+    } else if (rule->ip.proto == IPPROTO_TCP) {
       const auto *tcp = reinterpret_cast<const ipt_tcp *>(match->data);
-      result += fmt::format("Src Port: {} - {}\n", tcp->spts[0], tcp->spts[1]);
-      result += fmt::format("Dest Port: {} - {}\n", tcp->dpts[0], tcp->dpts[1]);
+      fmt::format_to(out, "Src Port: {} - {}\n", tcp->spts[0], tcp->spts[1]);
+      fmt::format_to(out, "Dest Port: {} - {}\n", tcp->dpts[0], tcp->dpts[1]);
     } else if (rule->ip.proto == IPPROTO_UDP) {
       const auto *udp = reinterpret_cast<const ipt_udp *>(match->data);
-      result += fmt::format("Src Port: {} - {}\n", udp->spts[0], udp->spts[1]);
-      result += fmt::format("Dest Port: {} - {}\n", udp->dpts[0], udp->dpts[1]);
+      fmt::format_to(out, "Src Port: {} - {}\n", udp->spts[0], udp->spts[1]);
+      fmt::format_to(out, "Dest Port: {} - {}\n", udp->dpts[0], udp->dpts[1]);
     }
 
     match = reinterpret_cast<const ipt_entry_match *>(
@@ -332,19 +1831,49 @@ auto FirewallBackend::serializeRule(iptc_handle *handle,
     const auto *target = reinterpret_cast<const ipt_entry_target *>(
         reinterpret_cast<const char *>(rule) + rule->target_offset);
     const auto *target_name = iptc_get_target(rule, handle);
-    result += fmt::format("Target Name: {}\n", target_name);
-    result += fmt::format("Target Size: {}\n", target->u.user.target_size);
+    fmt::format_to(out, "Target Name: {}\n", target_name);
+    fmt::format_to(out, "Target Size: {}\n", target->u.user.target_size);
+    if (strcmp(target_name, "CT") == 0) {
+      const auto *info =
+          reinterpret_cast<const xt_ct_target_info *>(target->data);
+      fmt::format_to(out, "Conntrack: {}, zone {}\n",
+                     (info->flags & XT_CT_NOTRACK) != 0 ? "notrack" : "track",
+                     info->zone);
+    }
+    if (strcmp(target_name, "NFQUEUE") == 0) {
+      /* earlier revisions are prefixes of revision 3 */
+      const auto *info =
+          reinterpret_cast<const xt_NFQ_info_v3 *>(target->data);
+      auto revision = target->u.user.revision;
+      auto total = revision >= 1 ? info->queues_total : 1;
+      auto bypass = revision == 2 ? info->flags != 0
+                                  : revision >= 3 &&
+                                        (info->flags & NFQ_FLAG_BYPASS) != 0;
+      auto fanout = revision >= 3 && (info->flags & NFQ_FLAG_CPU_FANOUT) != 0;
+      fmt::format_to(out, "Queues: {} - {}{}{}\n", info->queuenum,
+                     info->queuenum + total - 1, bypass ? ", bypass" : "",
+                     fanout ? ", cpu fanout" : "");
+    }
   }
-
-  return result;
 }
 
 auto FirewallBackend::serializeShortRule(
     iptc_handle *handle, const struct ipt_entry *rule) -> string {
-  std::string result;
-  result += fmt::format(
-      "SRC: {}, DST: {}, PROTO: {}", string(inet_ntoa(rule->ip.src)),
-      string(inet_ntoa(rule->ip.dst)), proto2String(rule->ip.proto));
+  fmt::memory_buffer buffer;
+  serializeShortRule(handle, rule, buffer);
+  return fmt::to_string(buffer);
+}
+
+auto FirewallBackend::serializeShortRule(iptc_handle *handle,
+                                         const struct ipt_entry *rule,
+                                         fmt::memory_buffer &buffer) -> void {
+  auto out = std::back_inserter(buffer);
+  buffer.append(string_view("SRC: "));
+  appendIpv4(buffer, ntohl(rule->ip.src.s_addr));
+  buffer.append(string_view(", DST: "));
+  appendIpv4(buffer, ntohl(rule->ip.dst.s_addr));
+  buffer.append(string_view(", PROTO: "));
+  buffer.append(proto2Name(rule->ip.proto));
 
   static constexpr int kMinPort = 0;
   static constexpr int kMaxPort = 65535;
@@ -353,7 +1882,16 @@ auto FirewallBackend::serializeShortRule(
          reinterpret_cast<const char *>(rule) + rule->target_offset) {
     auto srcs = std::make_pair(kMinPort, kMaxPort);
     auto dsts = std::make_pair(kMinPort, kMaxPort);
-    if (rule->ip.proto == IPPROTO_TCP) {
+    if (strcmp(match->u.user.name, "set") == 0) {
+      const auto *info = reinterpret_cast<const xt_set_info *>(match->data);
+      fmt::format_to(
+          out, ", SET: {} {}",
+          Ipset::nameOf(info->index).value_or(std::to_string(info->index)),
+          (info->flags & IPSET_DIM_ONE_SRC) != 0 ? "src" : "dst");
+    } else if (strcmp(match->u.user.name, "bpf") == 0) {
+      const auto *info = reinterpret_cast<const xt_bpf_info *>(match->data);
+      fmt::format_to(out, ", BPF: {} insns", info->bpf_program_num_elem);
+    } else if (rule->ip.proto == IPPROTO_TCP) {
       const auto *tcp = reinterpret_cast<const ipt_tcp *>(match->data);
       srcs = std::make_pair(tcp->spts[0], tcp->spts[1]);
       dsts = std::make_pair(tcp->dpts[0], tcp->dpts[1]);
@@ -363,10 +1901,10 @@ auto FirewallBackend::serializeShortRule(
       dsts = std::make_pair(udp->dpts[0], udp->dpts[1]);
     }
     if (srcs.first != kMinPort && srcs.second != kMaxPort) {
-      result += fmt::format(", SRC PORT: {}-{}", srcs.first, srcs.second);
+      fmt::format_to(out, ", SRC PORT: {}-{}", srcs.first, srcs.second);
     }
     if (dsts.first != kMinPort && dsts.second != kMaxPort) {
-      result += fmt::format(", DST PORT: {}-{}", dsts.first, dsts.second);
+      fmt::format_to(out, ", DST PORT: {}-{}", dsts.first, dsts.second);
     }
 
     match = reinterpret_cast<const ipt_entry_match *>(
@@ -374,11 +1912,9 @@ auto FirewallBackend::serializeShortRule(
   }
 
   if (rule->target_offset != rule->next_offset) {
-    auto target_name = string(iptc_get_target(rule, handle));
-    if (!target_name.empty()) {
-      result += fmt::format(" | {}\n", target_name);
+    const auto *target_name = iptc_get_target(rule, handle);
+    if (target_name != nullptr && target_name[0] != '\0') {
+      fmt::format_to(out, " | {}\n", target_name);
     }
   }
-
-  return result;
 }
@@ -0,0 +1,285 @@
+#include "backend/firewall/ipset.h"
+#include "backend/firewall/nft_netlink.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <linux/netfilter.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+/* members per IPSET_CMD_ADD, keeps the ADT nest well below 64K */
+constexpr size_t kMembersPerMessage = 1000;
+
+constexpr uint32_t kMinMaxElem = 65536;
+constexpr uint16_t kMaxPort = 65535;
+
+constexpr auto kNetType = "hash:net";
+constexpr auto kPortType = "bitmap:port";
+
+auto typeName(SetKind kind) -> const char * {
+  return kind == SetKind::NET ? kNetType : kPortType;
+}
+
+auto describe(int error) -> string {
+  /* ipset specific codes start at IPSET_ERR_PRIVATE */
+  if (error >= IPSET_ERR_PRIVATE) {
+    return fmt::format("ipset error {}", error);
+  }
+  return strerror(error);
+}
+
+/* message of command with the protocol attribute every command needs */
+auto beginMessage(NlBuilder &builder, NftSocket &socket, uint8_t command,
+                  uint16_t flags) -> void {
+  uint8_t protocol = IPSET_PROTOCOL;
+  builder.begin(static_cast<uint16_t>((NFNL_SUBSYS_IPSET << 8) | command),
+                flags, socket.nextSeq(), NFPROTO_IPV4);
+  builder.put(IPSET_ATTR_PROTOCOL, &protocol, sizeof(protocol));
+}
+
+/* integers of ipset attributes carry the byte order flag */
+auto putU32(NlBuilder &builder, uint16_t type, uint32_t value) -> void {
+  builder.putU32(type | NLA_F_NET_BYTEORDER, value);
+}
+
+auto putU16(NlBuilder &builder, uint16_t type, uint16_t value) -> void {
+  value = htons(value);
+  builder.put(type | NLA_F_NET_BYTEORDER, &value, sizeof(value));
+}
+
+auto putIpv4(NlBuilder &builder, uint16_t type, uint32_t addr) -> void {
+  auto nest = builder.nest(type);
+  putU32(builder, IPSET_ATTR_IPADDR_IPV4, addr);
+  builder.endNest(nest);
+}
+
+/* newest revision of type the kernel knows */
+auto typeRevision(NftSocket &socket, SetKind kind) -> optional<uint8_t> {
+  NlBuilder request;
+  beginMessage(request, socket, IPSET_CMD_TYPE, NLM_F_ACK);
+  request.putStr(IPSET_ATTR_TYPENAME, typeName(kind));
+  uint8_t family = NFPROTO_IPV4;
+  request.put(IPSET_ATTR_FAMILY, &family, sizeof(family));
+  request.end();
+
+  optional<uint8_t> revision;
+  if (!socket.request(request, [&revision](const struct nlmsghdr *msg) {
+        auto attrs = NlAttr::parse(msg, IPSET_ATTR_CMD_MAX);
+        if (attrs[IPSET_ATTR_REVISION].present()) {
+          revision = attrs[IPSET_ATTR_REVISION].u8();
+        }
+      })) {
+    return std::nullopt;
+  }
+  return revision;
+}
+
+auto addMembers(NftSocket &socket, const SetRequest &request,
+                const vector<SetRange> &members) -> bool {
+  for (size_t begin = 0; begin < members.size();
+       begin += kMembersPerMessage) {
+    auto end = std::min(members.size(), begin + kMembersPerMessage);
+
+    NlBuilder message;
+    beginMessage(message, socket, IPSET_CMD_ADD, NLM_F_ACK);
+    message.putStr(IPSET_ATTR_SETNAME, request.name_);
+    /* the kernel wants a line number with a list of members */
+    putU32(message, IPSET_ATTR_LINENO, 0);
+    auto adt = message.nest(IPSET_ATTR_ADT);
+    for (auto i = begin; i < end; i++) {
+      auto [first, last] = members[i];
+      auto data = message.nest(IPSET_ATTR_DATA);
+      if (request.kind_ == SetKind::NET) {
+        putIpv4(message, IPSET_ATTR_IP, first);
+        if (last != first) {
+          putIpv4(message, IPSET_ATTR_IP_TO, last);
+        }
+      } else {
+        putU16(message, IPSET_ATTR_PORT, static_cast<uint16_t>(first));
+        if (last != first) {
+          putU16(message, IPSET_ATTR_PORT_TO, static_cast<uint16_t>(last));
+        }
+      }
+      message.endNest(data);
+    }
+    message.endNest(adt);
+    message.end();
+
+    if (!socket.request(message, [](const struct nlmsghdr *) {})) {
+      return false;
+    }
+  }
+  return true;
+}
+
+auto destroySet(NftSocket &socket, const string &name) -> bool {
+  NlBuilder request;
+  beginMessage(request, socket, IPSET_CMD_DESTROY, NLM_F_ACK);
+  request.putStr(IPSET_ATTR_SETNAME, name);
+  request.end();
+  return socket.request(request, [](const struct nlmsghdr *) {});
+}
+
+/* SO_IP_SET request of libxt_set, false with errno if it failed */
+auto getSet(struct ip_set_req_get_set &request) -> bool {
+  auto fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+  if (fd < 0) {
+    return false;
+  }
+  socklen_t size = sizeof(request);
+  auto res = getsockopt(fd, SOL_IP, SO_IP_SET, &request, &size);
+  auto saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return res == 0;
+}
+
+} // namespace
+
+auto Ipset::mergeRanges(vector<SetRange> ranges) -> vector<SetRange> {
+  std::ranges::sort(ranges);
+  vector<SetRange> merged;
+  for (const auto &range : ranges) {
+    if (!merged.empty() &&
+        static_cast<uint64_t>(merged.back().second) + 1 >= range.first) {
+      merged.back().second = std::max(merged.back().second, range.second);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
+}
+
+auto Ipset::create(const ctx_t &context, const SetRequest &request) -> bool {
+  if (request.name_.empty() || request.name_.size() > kMaxNameLen) {
+    context->setLastError(fmt::format("Invalid set name: {}", request.name_));
+    return false;
+  }
+
+  NftSocket socket;
+  if (!socket.valid()) {
+    context->setLastError(
+        fmt::format("Cannot open netlink socket: {}", strerror(errno)));
+    return false;
+  }
+
+  auto revision = typeRevision(socket, request.kind_);
+  if (!revision) {
+    context->setLastError(fmt::format("Set type {} is not available: {}",
+                                      typeName(request.kind_),
+                                      describe(errno)));
+    return false;
+  }
+
+  auto members = mergeRanges(request.members_);
+
+  NlBuilder create;
+  /* NLM_F_EXCL, otherwise an existing set of same type is silently kept */
+  beginMessage(create, socket, IPSET_CMD_CREATE, NLM_F_ACK | NLM_F_EXCL);
+  create.putStr(IPSET_ATTR_SETNAME, request.name_);
+  create.putStr(IPSET_ATTR_TYPENAME, typeName(request.kind_));
+  create.put(IPSET_ATTR_REVISION, &*revision, sizeof(*revision));
+  uint8_t family = NFPROTO_IPV4;
+  create.put(IPSET_ATTR_FAMILY, &family, sizeof(family));
+  auto data = create.nest(IPSET_ATTR_DATA);
+  if (request.kind_ == SetKind::NET) {
+    /* a range may expand to many CIDR blocks */
+    putU32(create, IPSET_ATTR_MAXELEM,
+           std::max<uint32_t>(kMinMaxElem, members.size() * 2));
+  } else {
+    putU16(create, IPSET_ATTR_PORT_FROM, 0);
+    putU16(create, IPSET_ATTR_PORT_TO, kMaxPort);
+  }
+  create.endNest(data);
+  create.end();
+
+  if (!socket.request(create, [](const struct nlmsghdr *) {})) {
+    context->setLastError(fmt::format("Failed to create set {}: {}",
+                                      request.name_, describe(errno)));
+    return false;
+  }
+
+  if (!addMembers(socket, request, members)) {
+    context->setLastError(fmt::format("Failed to fill set {}: {}",
+                                      request.name_, describe(errno)));
+    destroySet(socket, request.name_);
+    return false;
+  }
+  return true;
+}
+
+auto Ipset::destroy(const string &name) -> bool {
+  NftSocket socket;
+  return socket.valid() && destroySet(socket, name);
+}
+
+auto Ipset::indexOf(const string &name) -> optional<uint16_t> {
+  struct ip_set_req_get_set request {};
+  request.op = IP_SET_OP_GET_BYNAME;
+  request.version = IPSET_PROTOCOL;
+  strncpy(request.set.name, name.c_str(), kMaxNameLen);
+  if (!getSet(request) || request.set.index == IPSET_INVALID_ID) {
+    return std::nullopt;
+  }
+  return request.set.index;
+}
+
+auto Ipset::nameOf(uint16_t index) -> optional<string> {
+  struct ip_set_req_get_set request {};
+  request.op = IP_SET_OP_GET_BYINDEX;
+  request.version = IPSET_PROTOCOL;
+  request.set.index = index;
+  if (!getSet(request) || request.set.name[0] == '\0') {
+    return std::nullopt;
+  }
+  return string(request.set.name, strnlen(request.set.name, kMaxNameLen));
+}
+
+auto Ipset::list(const string &name) -> optional<vector<SetRange>> {
+  static constexpr uint32_t kHostBits = 32;
+
+  NftSocket socket;
+  if (!socket.valid()) {
+    return std::nullopt;
+  }
+
+  NlBuilder request;
+  beginMessage(request, socket, IPSET_CMD_LIST, NLM_F_DUMP);
+  request.putStr(IPSET_ATTR_SETNAME, name);
+  request.end();
+
+  vector<SetRange> members;
+  auto ok = socket.request(request, [&members](const struct nlmsghdr *msg) {
+    auto attrs = NlAttr::parse(msg, IPSET_ATTR_CMD_MAX);
+    if (!attrs[IPSET_ATTR_ADT].present()) {
+      return;
+    }
+    for (const auto &item : attrs[IPSET_ATTR_ADT].list()) {
+      auto data = item.nested(IPSET_ATTR_ADT_MAX);
+      if (data[IPSET_ATTR_IP].present()) {
+        auto addr =
+            data[IPSET_ATTR_IP].nested(IPSET_ATTR_IPADDR_IPV4)
+                [IPSET_ATTR_IPADDR_IPV4]
+                .u32();
+        auto cidr = data[IPSET_ATTR_CIDR].present()
+                        ? data[IPSET_ATTR_CIDR].u8()
+                        : kHostBits;
+        auto host = cidr == 0 ? ~0U : (1U << (kHostBits - cidr)) - 1;
+        members.emplace_back(addr, addr | host);
+      } else if (data[IPSET_ATTR_PORT].present()) {
+        auto port = data[IPSET_ATTR_PORT].u16();
+        members.emplace_back(port, port);
+      }
+    }
+  });
+  if (!ok) {
+    return std::nullopt;
+  }
+  return members;
+}
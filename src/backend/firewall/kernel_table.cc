@@ -0,0 +1,97 @@
+#include "backend/firewall/kernel_table.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+KernelTable::Socket::Socket()
+    : fd_(socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW)) {}
+
+KernelTable::Socket::~Socket() {
+  if (fd_ >= 0) {
+    auto saved_errno = errno;
+    close(fd_);
+    errno = saved_errno;
+  }
+}
+
+auto TableFingerprint::from(const struct ipt_getinfo &info)
+    -> TableFingerprint {
+  TableFingerprint fingerprint;
+  fingerprint.valid_hooks_ = info.valid_hooks;
+  fingerprint.num_entries_ = info.num_entries;
+  fingerprint.size_ = info.size;
+  std::ranges::copy(info.hook_entry, fingerprint.hook_entry_.begin());
+  std::ranges::copy(info.underflow, fingerprint.underflow_.begin());
+  return fingerprint;
+}
+
+auto KernelTable::hookNames() -> const array<string, NF_INET_NUMHOOKS> & {
+  static const array<string, NF_INET_NUMHOOKS> names = {
+      "PREROUTING", "INPUT", "FORWARD", "OUTPUT", "POSTROUTING"};
+  return names;
+}
+
+auto KernelTable::getInfo(const string &table) -> optional<struct ipt_getinfo> {
+  Socket sock;
+  if (sock.fd() < 0) {
+    return std::nullopt;
+  }
+
+  struct ipt_getinfo info {};
+  strncpy(info.name, table.c_str(), sizeof(info.name) - 1);
+  socklen_t len = sizeof(info);
+  if (getsockopt(sock.fd(), IPPROTO_IP, IPT_SO_GET_INFO, &info, &len) < 0) {
+    return std::nullopt;
+  }
+
+  return info;
+}
+
+auto KernelTable::fingerprint(const string &table)
+    -> optional<TableFingerprint> {
+  auto info = getInfo(table);
+  if (!info) {
+    return std::nullopt;
+  }
+  return TableFingerprint::from(*info);
+}
+
+auto KernelTable::getEntries(const struct ipt_getinfo &info,
+                             vector<char> &buffer)
+    -> struct ipt_get_entries * {
+  Socket sock;
+  if (sock.fd() < 0) {
+    return nullptr;
+  }
+
+  auto size = sizeof(struct ipt_get_entries) + info.size;
+  if (buffer.size() < size) {
+    buffer.resize(size);
+  }
+  auto *entries = reinterpret_cast<struct ipt_get_entries *>(buffer.data());
+  memset(entries, 0, sizeof(*entries));
+  strncpy(entries->name, info.name, sizeof(entries->name) - 1);
+  entries->size = info.size;
+
+  auto len = static_cast<socklen_t>(size);
+  if (getsockopt(sock.fd(), IPPROTO_IP, IPT_SO_GET_ENTRIES, entries, &len) <
+      0) {
+    return nullptr;
+  }
+
+  return entries;
+}
+
+auto KernelTable::replace(struct ipt_replace *blob, size_t size) -> bool {
+  Socket sock;
+  if (sock.fd() < 0) {
+    return false;
+  }
+
+  return setsockopt(sock.fd(), IPPROTO_IP, IPT_SO_SET_REPLACE, blob,
+                    static_cast<socklen_t>(size)) == 0;
+}
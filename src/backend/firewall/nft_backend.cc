@@ -0,0 +1,1315 @@
+#include "backend/firewall/nft_backend.h"
+#include "backend/firewall/kernel_table.h"
+#include "fmt/core.h"
+#include "fmt/format.h"
+#include "tools/log.h"
+#include "tools/nettools.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <linux/netfilter.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdexcept>
+
+namespace {
+
+/* offsets in the ipv4 and tcp/udp headers */
+constexpr uint32_t kProtoOffset = 9;
+constexpr uint32_t kSrcOffset = 12;
+constexpr uint32_t kDstOffset = 16;
+constexpr uint32_t kSportOffset = 0;
+constexpr uint32_t kDportOffset = 2;
+
+constexpr uint16_t kMaxPort = 0xFFFF;
+constexpr uint32_t kFullMask = 0xFFFFFFFF;
+
+/* attempts to read a table while other programs keep changing the ruleset */
+constexpr int kLoadAttempts = 3;
+
+constexpr auto msgType(uint16_t msg) -> uint16_t {
+  return (NFNL_SUBSYS_NFTABLES << 8) | msg;
+}
+
+/**
+ * expressions of one rule, each loads into register 1 and the following
+ * one compares it, like nft generates for the same match
+ */
+class ExprWriter {
+public:
+  explicit ExprWriter(NlBuilder &builder) : builder_(builder) {}
+
+  auto payload(uint32_t base, uint32_t offset, uint32_t len) -> void {
+    begin("payload");
+    builder_.putU32(NFTA_PAYLOAD_DREG, NFT_REG_1);
+    builder_.putU32(NFTA_PAYLOAD_BASE, base);
+    builder_.putU32(NFTA_PAYLOAD_OFFSET, offset);
+    builder_.putU32(NFTA_PAYLOAD_LEN, len);
+    end();
+  }
+
+  auto meta(uint32_t key) -> void {
+    begin("meta");
+    builder_.putU32(NFTA_META_DREG, NFT_REG_1);
+    builder_.putU32(NFTA_META_KEY, key);
+    end();
+  }
+
+  /* register 1 &= mask, len bytes */
+  auto bitwise(const void *mask, uint32_t len) -> void {
+    static constexpr std::array<uint8_t, NFT_REG_SIZE> kZero{};
+    begin("bitwise");
+    builder_.putU32(NFTA_BITWISE_SREG, NFT_REG_1);
+    builder_.putU32(NFTA_BITWISE_DREG, NFT_REG_1);
+    builder_.putU32(NFTA_BITWISE_LEN, len);
+    value(NFTA_BITWISE_MASK, mask, len);
+    value(NFTA_BITWISE_XOR, kZero.data(), len);
+    end();
+  }
+
+  auto cmp(const void *data, uint32_t len) -> void {
+    begin("cmp");
+    builder_.putU32(NFTA_CMP_SREG, NFT_REG_1);
+    builder_.putU32(NFTA_CMP_OP, NFT_CMP_EQ);
+    value(NFTA_CMP_DATA, data, len);
+    end();
+  }
+
+  /* ports in host order */
+  auto range(uint16_t from, uint16_t to) -> void {
+    from = htons(from);
+    to = htons(to);
+    begin("range");
+    builder_.putU32(NFTA_RANGE_SREG, NFT_REG_1);
+    builder_.putU32(NFTA_RANGE_OP, NFT_RANGE_EQ);
+    value(NFTA_RANGE_FROM_DATA, &from, sizeof(from));
+    value(NFTA_RANGE_TO_DATA, &to, sizeof(to));
+    end();
+  }
+
+  auto counter() -> void {
+    begin("counter");
+    end();
+  }
+
+  auto verdict(int32_t code, const string &chain = {}) -> void {
+    begin("immediate");
+    builder_.putU32(NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+    auto data = builder_.nest(NFTA_IMMEDIATE_DATA);
+    auto verdict = builder_.nest(NFTA_DATA_VERDICT);
+    builder_.putU32(NFTA_VERDICT_CODE, static_cast<uint32_t>(code));
+    if (!chain.empty()) {
+      builder_.putStr(NFTA_VERDICT_CHAIN, chain);
+    }
+    builder_.endNest(verdict);
+    builder_.endNest(data);
+    end();
+  }
+
+private:
+  NlBuilder &builder_;
+  size_t elem_{};
+  size_t data_{};
+
+  auto begin(const char *name) -> void {
+    elem_ = builder_.nest(NFTA_LIST_ELEM);
+    builder_.putStr(NFTA_EXPR_NAME, name);
+    data_ = builder_.nest(NFTA_EXPR_DATA);
+  }
+
+  auto end() -> void {
+    builder_.endNest(data_);
+    builder_.endNest(elem_);
+  }
+
+  auto value(uint16_t type, const void *data, uint32_t len) -> void {
+    auto nest = builder_.nest(type);
+    builder_.put(NFTA_DATA_VALUE, data, len);
+    builder_.endNest(nest);
+  }
+};
+
+auto parseAddr(const optional<string> &text, uint32_t fallback,
+               uint32_t &addr) -> bool {
+  if (!text.has_value()) {
+    addr = fallback;
+    return true;
+  }
+  struct in_addr parsed {};
+  if (inet_pton(AF_INET, text->c_str(), &parsed) != 1) {
+    return false;
+  }
+  addr = parsed.s_addr;
+  return true;
+}
+
+auto verdictCode(const string &target, int32_t &code) -> bool {
+  static const vector<std::pair<string, int32_t>> kVerdicts = {
+      {IPTC_LABEL_ACCEPT, NF_ACCEPT},
+      {IPTC_LABEL_DROP, NF_DROP},
+      {IPTC_LABEL_QUEUE, NF_QUEUE},
+      {IPTC_LABEL_RETURN, NFT_RETURN}};
+  auto iter = std::ranges::find(kVerdicts, target,
+                                &std::pair<string, int32_t>::first);
+  if (iter == kVerdicts.end()) {
+    return false;
+  }
+  code = iter->second;
+  return true;
+}
+
+/**
+ * expressions of request into NFTA_RULE_EXPRESSIONS, false with error in
+ * context if the request cannot be expressed
+ */
+auto encodeRule(NlBuilder &builder, const RuleRequest &request,
+                const ctx_t &context) -> bool {
+  if (request.set_match_.has_value()) {
+    context->setLastError("Set matches refer to ipset, which nf_tables "
+                          "rules cannot use");
+    return false;
+  }
+  if (request.bpf_match_.has_value()) {
+    context->setLastError("BPF matches are iptables extensions, which "
+                          "nf_tables rules cannot use");
+    return false;
+  }
+  if (request.target_ == RequestTarget::CT ||
+      request.target_ == RequestTarget::NFQUEUE) {
+    context->setLastError(fmt::format("{} is an iptables target extension, "
+                                      "which nf_tables rules cannot use",
+                                      request.target_));
+    return false;
+  }
+
+  auto list = builder.nest(NFTA_RULE_EXPRESSIONS);
+  ExprWriter expr(builder);
+
+  /* addresses, a zero mask matches every address */
+  auto matchAddr = [&](const optional<string> &ip, const optional<string> &mask,
+                       uint32_t offset) {
+    uint32_t addr = 0;
+    uint32_t netmask = 0;
+    if (!parseAddr(ip, 0, addr) || !parseAddr(mask, kFullMask, netmask)) {
+      context->setLastError(fmt::format("Invalid address: {}/{}",
+                                        ip.value_or(""), mask.value_or("")));
+      return false;
+    }
+    if (!ip.has_value() || netmask == 0) {
+      return true;
+    }
+    expr.payload(NFT_PAYLOAD_NETWORK_HEADER, offset, sizeof(addr));
+    if (netmask != kFullMask) {
+      expr.bitwise(&netmask, sizeof(netmask));
+    }
+    addr &= netmask;
+    expr.cmp(&addr, sizeof(addr));
+    return true;
+  };
+  if (!matchAddr(request.src_ip_, request.src_mask_, kSrcOffset) ||
+      !matchAddr(request.dst_ip_, request.dst_mask_, kDstOffset)) {
+    return false;
+  }
+
+  /* interfaces, name ending with '+' matches every name with the prefix */
+  auto matchIface = [&](const optional<string> &iface, uint32_t key) {
+    if (!iface.has_value()) {
+      return true;
+    }
+    if (iface->size() >= IFNAMSIZ) {
+      context->setLastError(fmt::format("Interface name too long: {}", *iface));
+      return false;
+    }
+    std::array<char, IFNAMSIZ> name{};
+    std::ranges::copy(*iface, name.begin());
+    auto wildcard = !iface->empty() && iface->back() == '+';
+    expr.meta(key);
+    expr.cmp(name.data(), wildcard ? iface->size() - 1 : IFNAMSIZ);
+    return true;
+  };
+  if (!matchIface(request.iniface_, NFT_META_IIFNAME) ||
+      !matchIface(request.outiface_, NFT_META_OIFNAME)) {
+    return false;
+  }
+
+  uint8_t proto = IPPROTO_IP;
+  if (request.proto_ == RequestProto::TCP) {
+    proto = IPPROTO_TCP;
+  } else if (request.proto_ == RequestProto::UDP) {
+    proto = IPPROTO_UDP;
+  } else if (request.proto_ != RequestProto::ALL ||
+             !request.matches_.empty()) {
+    context->setLastError(fmt::format("Unknown protocol: {}\n",
+                                      request.proto_));
+    return false;
+  }
+  if (proto != IPPROTO_IP) {
+    expr.payload(NFT_PAYLOAD_NETWORK_HEADER, kProtoOffset, sizeof(proto));
+    expr.cmp(&proto, sizeof(proto));
+  }
+
+  auto matchPorts = [&](const optional<tuple<string, string>> &range,
+                        uint32_t offset) {
+    if (!range.has_value()) {
+      return;
+    }
+    auto from = static_cast<uint16_t>(std::stoi(get<0>(*range)));
+    auto to = static_cast<uint16_t>(std::stoi(get<1>(*range)));
+    if (from == 0 && to == kMaxPort) {
+      return;
+    }
+    expr.payload(NFT_PAYLOAD_TRANSPORT_HEADER, offset, sizeof(from));
+    if (from == to) {
+      from = htons(from);
+      expr.cmp(&from, sizeof(from));
+    } else {
+      expr.range(from, to);
+    }
+  };
+  for (const auto &match : request.matches_) {
+    matchPorts(match.src_port_range_, kSportOffset);
+    matchPorts(match.dst_port_range_, kDportOffset);
+  }
+
+  expr.counter();
+
+  int32_t code = 0;
+  if (verdictCode(request.target_, code)) {
+    expr.verdict(code);
+  } else if (!request.target_.empty()) {
+    /* any other target is the user chain to jump to */
+    expr.verdict(NFT_JUMP, request.target_);
+  }
+
+  builder.endNest(list);
+  return true;
+}
+
+/**
+ * RuleRequest of expressions in the form encodeRule() writes, nullptr if
+ * the rule has anything else, e.g. written by nft with sets or ct state
+ */
+class RuleDecoder {
+public:
+  shared_ptr<RuleRequest> request_;
+  uint64_t packets_{};
+  uint64_t bytes_{};
+
+  /* names of all expressions, for rules that cannot be decoded */
+  string expressions_;
+
+  explicit RuleDecoder(const NlAttr &list)
+      : request_(std::make_shared<RuleRequest>()) {
+    request_->src_ip_ = "0.0.0.0";
+    request_->src_mask_ = "0.0.0.0";
+    request_->dst_ip_ = "0.0.0.0";
+    request_->dst_mask_ = "0.0.0.0";
+    request_->proto_ = RequestProto::ALL;
+    request_->target_.clear();
+
+    auto decoded = true;
+    for (const auto &elem : list.list()) {
+      auto attrs = elem.nested(NFTA_EXPR_MAX);
+      auto name = attrs[NFTA_EXPR_NAME].str();
+      expressions_ += (expressions_.empty() ? "" : " ") + name;
+      decoded = decoded && decode(name, attrs[NFTA_EXPR_DATA]);
+    }
+    if (!decoded) {
+      request_ = nullptr;
+      return;
+    }
+    if (port_.src_port_range_ || port_.dst_port_range_) {
+      request_->matches_.push_back(port_);
+    }
+  }
+
+private:
+  enum class Load : uint8_t { NONE, NETWORK, TRANSPORT, IIFNAME, OIFNAME };
+
+  Load load_{Load::NONE};
+  uint32_t offset_{};
+  uint32_t len_{};
+  optional<uint32_t> mask_;
+  RuleMatch port_;
+
+  static auto value(const NlAttr &attr) -> std::span<const uint8_t> {
+    return attr.nested(NFTA_DATA_MAX)[NFTA_DATA_VALUE].data_;
+  }
+
+  static auto addr(uint32_t value) -> string {
+    struct in_addr in {
+      value
+    };
+    return inet_ntoa(in);
+  }
+
+  auto decode(const string &name, const NlAttr &data) -> bool {
+    if (name == "payload") {
+      auto attrs = data.nested(NFTA_PAYLOAD_MAX);
+      auto base = attrs[NFTA_PAYLOAD_BASE].u32();
+      load_ = base == NFT_PAYLOAD_NETWORK_HEADER     ? Load::NETWORK
+              : base == NFT_PAYLOAD_TRANSPORT_HEADER ? Load::TRANSPORT
+                                                     : Load::NONE;
+      offset_ = attrs[NFTA_PAYLOAD_OFFSET].u32();
+      len_ = attrs[NFTA_PAYLOAD_LEN].u32();
+      mask_.reset();
+      return load_ != Load::NONE;
+    }
+    if (name == "meta") {
+      auto key = data.nested(NFTA_META_MAX)[NFTA_META_KEY].u32();
+      load_ = key == NFT_META_IIFNAME   ? Load::IIFNAME
+              : key == NFT_META_OIFNAME ? Load::OIFNAME
+                                        : Load::NONE;
+      return load_ != Load::NONE;
+    }
+    if (name == "bitwise") {
+      auto mask = value(data.nested(NFTA_BITWISE_MAX)[NFTA_BITWISE_MASK]);
+      if (load_ != Load::NETWORK || mask.size() != sizeof(uint32_t)) {
+        return false;
+      }
+      uint32_t netmask = 0;
+      memcpy(&netmask, mask.data(), sizeof(netmask));
+      mask_ = netmask;
+      return true;
+    }
+    if (name == "cmp") {
+      auto attrs = data.nested(NFTA_CMP_MAX);
+      return attrs[NFTA_CMP_OP].u32() == NFT_CMP_EQ &&
+             compare(value(attrs[NFTA_CMP_DATA]));
+    }
+    if (name == "range") {
+      auto attrs = data.nested(NFTA_RANGE_MAX);
+      auto from = value(attrs[NFTA_RANGE_FROM_DATA]);
+      auto to = value(attrs[NFTA_RANGE_TO_DATA]);
+      if (attrs[NFTA_RANGE_OP].u32() != NFT_RANGE_EQ ||
+          load_ != Load::TRANSPORT || from.size() != sizeof(uint16_t) ||
+          to.size() != sizeof(uint16_t)) {
+        return false;
+      }
+      return setPorts(from, to);
+    }
+    if (name == "counter") {
+      auto attrs = data.nested(NFTA_COUNTER_MAX);
+      packets_ = attrs[NFTA_COUNTER_PACKETS].u64();
+      bytes_ = attrs[NFTA_COUNTER_BYTES].u64();
+      return true;
+    }
+    if (name == "immediate") {
+      auto attrs = data.nested(NFTA_IMMEDIATE_MAX);
+      if (attrs[NFTA_IMMEDIATE_DREG].u32() != NFT_REG_VERDICT) {
+        return false;
+      }
+      auto verdict = attrs[NFTA_IMMEDIATE_DATA]
+                         .nested(NFTA_DATA_MAX)[NFTA_DATA_VERDICT]
+                         .nested(NFTA_VERDICT_MAX);
+      return setTarget(static_cast<int32_t>(verdict[NFTA_VERDICT_CODE].u32()),
+                       verdict[NFTA_VERDICT_CHAIN].str());
+    }
+    return false;
+  }
+
+  auto compare(std::span<const uint8_t> data) -> bool {
+    switch (load_) {
+    case Load::NETWORK:
+      if (offset_ == kProtoOffset && len_ == 1 && data.size() == 1) {
+        request_->proto_ = proto2String(data[0]);
+        return data[0] == IPPROTO_TCP || data[0] == IPPROTO_UDP;
+      }
+      if ((offset_ == kSrcOffset || offset_ == kDstOffset) &&
+          len_ == sizeof(uint32_t) && data.size() == sizeof(uint32_t)) {
+        uint32_t value = 0;
+        memcpy(&value, data.data(), sizeof(value));
+        auto src = offset_ == kSrcOffset;
+        (src ? request_->src_ip_ : request_->dst_ip_) = addr(value);
+        (src ? request_->src_mask_ : request_->dst_mask_) =
+            addr(mask_.value_or(kFullMask));
+        return true;
+      }
+      return false;
+    case Load::TRANSPORT:
+      return data.size() == sizeof(uint16_t) && setPorts(data, data);
+    case Load::IIFNAME:
+    case Load::OIFNAME: {
+      if (data.size() > IFNAMSIZ) {
+        return false;
+      }
+      string name(reinterpret_cast<const char *>(data.data()),
+                  strnlen(reinterpret_cast<const char *>(data.data()),
+                          data.size()));
+      /* a compare shorter than the name with its NUL matches a prefix */
+      if (name.size() == data.size()) {
+        name += '+';
+      }
+      (load_ == Load::IIFNAME ? request_->iniface_ : request_->outiface_) =
+          name;
+      return true;
+    }
+    default:
+      return false;
+    }
+  }
+
+  auto setPorts(std::span<const uint8_t> from,
+                std::span<const uint8_t> to) -> bool {
+    if (offset_ != kSportOffset && offset_ != kDportOffset) {
+      return false;
+    }
+    auto port = [](std::span<const uint8_t> data) {
+      return std::to_string((data[0] << 8) | data[1]);
+    };
+    (offset_ == kSportOffset ? port_.src_port_range_
+                             : port_.dst_port_range_) =
+        std::make_tuple(port(from), port(to));
+    return true;
+  }
+
+  auto setTarget(int32_t code, const string &chain) -> bool {
+    switch (code) {
+    case NF_ACCEPT:
+      request_->target_ = IPTC_LABEL_ACCEPT;
+      return true;
+    case NF_DROP:
+      request_->target_ = IPTC_LABEL_DROP;
+      return true;
+    case NF_QUEUE:
+      request_->target_ = IPTC_LABEL_QUEUE;
+      return true;
+    case NFT_RETURN:
+      request_->target_ = IPTC_LABEL_RETURN;
+      return true;
+    case NFT_JUMP:
+      request_->target_ = chain;
+      return true;
+    default:
+      /* goto and continue have no RuleRequest form */
+      return false;
+    }
+  }
+};
+
+auto policyName(uint32_t policy) -> string {
+  return policy == NF_DROP ? IPTC_LABEL_DROP : IPTC_LABEL_ACCEPT;
+}
+
+} // namespace
+
+NftBackend::NftBackend() = default;
+
+NftBackend::~NftBackend() = default;
+
+auto NftBackend::getSocket() -> NftSocket & {
+  if (socket_ == nullptr || !socket_->valid()) {
+    socket_ = std::make_unique<NftSocket>();
+  }
+  return *socket_;
+}
+
+auto NftBackend::getGeneration() -> optional<uint32_t> {
+  auto &socket = getSocket();
+  NlBuilder request;
+  request.begin(msgType(NFT_MSG_GETGEN), NLM_F_ACK, socket.nextSeq(),
+                AF_UNSPEC);
+  request.end();
+
+  optional<uint32_t> genid;
+  if (!socket.request(request, [&genid](const struct nlmsghdr *msg) {
+        genid = NlAttr::parse(msg, NFTA_GEN_MAX)[NFTA_GEN_ID].u32();
+      })) {
+    return std::nullopt;
+  }
+  return genid;
+}
+
+auto NftBackend::syncGeneration() -> bool {
+  auto genid = getGeneration();
+  if (!genid) {
+    yuiError() << "Error reading nf_tables generation: " << strerror(errno)
+               << endl;
+    return false;
+  }
+
+  /* with pending changes the cache is kept, the commit is refused then */
+  if (*genid != genid_ && pendingMessages() == 0) {
+    tables_.clear();
+    table_names_.reset();
+    genid_ = *genid;
+  }
+  return true;
+}
+
+auto NftBackend::pendingMessages() const -> size_t {
+  size_t messages = 0;
+  for (const auto &[name, table] : tables_) {
+    messages += table.removed_chains_.size() + (table.added_ ? 1 : 0);
+    for (const auto &chain : table.chains_) {
+      messages += chain.removed_.size() + (chain.added_ ? 1 : 0);
+      if (!chain.dirty_) {
+        continue;
+      }
+      messages += std::ranges::count_if(chain.rules_, [](const Rule &rule) {
+        return rule.state_ != Rule::State::KERNEL;
+      });
+    }
+  }
+  return messages;
+}
+
+auto NftBackend::estimateCommitCost() -> size_t { return pendingMessages(); }
+
+auto NftBackend::getTableNames() -> const vector<string> & {
+  if (table_names_.has_value()) {
+    return *table_names_;
+  }
+
+  vector<string> names;
+  for (int attempt = 0; attempt < kLoadAttempts; attempt++) {
+    if (!syncGeneration()) {
+      break;
+    }
+
+    auto &socket = getSocket();
+    NlBuilder request;
+    request.begin(msgType(NFT_MSG_GETTABLE), NLM_F_DUMP, socket.nextSeq(),
+                  NFPROTO_IPV4);
+    request.end();
+
+    names.clear();
+    if (socket.request(request, [&names](const struct nlmsghdr *msg) {
+          names.push_back(
+              NlAttr::parse(msg, NFTA_TABLE_MAX)[NFTA_TABLE_NAME].str());
+        })) {
+      break;
+    }
+    yuiError() << "Error listing nf_tables tables: " << strerror(errno)
+               << endl;
+  }
+
+  /* tables added but not committed yet */
+  for (const auto &[name, table] : tables_) {
+    if (table.added_ && std::ranges::find(names, name) == names.end()) {
+      names.push_back(name);
+    }
+  }
+  table_names_ = std::move(names);
+  return *table_names_;
+}
+
+auto NftBackend::loadTable(const string &name, Table &table) -> bool {
+  auto &socket = getSocket();
+  for (int attempt = 0; attempt < kLoadAttempts; attempt++) {
+    table = Table{name};
+    auto before = getGeneration();
+
+    NlBuilder chains;
+    chains.begin(msgType(NFT_MSG_GETCHAIN), NLM_F_DUMP, socket.nextSeq(),
+                 NFPROTO_IPV4);
+    chains.end();
+    auto loaded = socket.request(chains, [&](const struct nlmsghdr *msg) {
+      auto attrs = NlAttr::parse(msg, NFTA_CHAIN_MAX);
+      if (attrs[NFTA_CHAIN_TABLE].str() != name) {
+        return;
+      }
+      Chain chain{attrs[NFTA_CHAIN_NAME].str()};
+      if (attrs[NFTA_CHAIN_HOOK].present()) {
+        auto hook = attrs[NFTA_CHAIN_HOOK].nested(NFTA_HOOK_MAX);
+        chain.hook_ = hook[NFTA_HOOK_HOOKNUM].u32();
+        chain.priority_ = static_cast<int32_t>(hook[NFTA_HOOK_PRIORITY].u32());
+        chain.policy_ = attrs[NFTA_CHAIN_POLICY].u32();
+      }
+      table.chains_.push_back(std::move(chain));
+    });
+
+    /* rules come chain after chain, each chain in rule order */
+    NlBuilder rules;
+    rules.begin(msgType(NFT_MSG_GETRULE), NLM_F_DUMP, socket.nextSeq(),
+                NFPROTO_IPV4);
+    rules.putStr(NFTA_RULE_TABLE, name);
+    rules.end();
+    Chain *chain = nullptr;
+    loaded = loaded && socket.request(rules, [&](const struct nlmsghdr *msg) {
+      auto attrs = NlAttr::parse(msg, NFTA_RULE_MAX);
+      if (attrs[NFTA_RULE_TABLE].str() != name) {
+        return;
+      }
+      auto chain_name = attrs[NFTA_RULE_CHAIN].str();
+      if (chain == nullptr || chain->name_ != chain_name) {
+        auto iter = std::ranges::find(table.chains_, chain_name, &Chain::name_);
+        chain = iter == table.chains_.end() ? nullptr : &*iter;
+      }
+      if (chain == nullptr) {
+        return;
+      }
+
+      RuleDecoder decoder(attrs[NFTA_RULE_EXPRESSIONS]);
+      Rule rule;
+      rule.handle_ = attrs[NFTA_RULE_HANDLE].u64();
+      rule.request_ = std::move(decoder.request_);
+      rule.expressions_ = std::move(decoder.expressions_);
+      rule.packets_ = decoder.packets_;
+      rule.bytes_ = decoder.bytes_;
+      chain->rules_.push_back(std::move(rule));
+    });
+
+    if (loaded && before.has_value() && getGeneration() == before) {
+      return true;
+    }
+    if (!loaded && errno != EINTR) {
+      break;
+    }
+  }
+
+  yuiError() << "Error loading nf_tables table " << name << ": "
+             << strerror(errno) << endl;
+  return false;
+}
+
+auto NftBackend::getTable(const ctx_t &context) -> Table * {
+  if (auto iter = tables_.find(context->table_); iter != tables_.end()) {
+    return &iter->second;
+  }
+
+  if (!syncGeneration()) {
+    context->setLastError("Cannot read nf_tables ruleset");
+    return nullptr;
+  }
+  const auto &names = getTableNames();
+  if (std::ranges::find(names, context->table_) == names.end()) {
+    context->setLastError(fmt::format("No table {}", context->table_));
+    return nullptr;
+  }
+
+  Table table;
+  if (!loadTable(context->table_, table)) {
+    context->setLastError(fmt::format("Error loading table {}: {}",
+                                      context->table_, strerror(errno)));
+    return nullptr;
+  }
+  return &tables_.emplace(context->table_, std::move(table)).first->second;
+}
+
+auto NftBackend::getChain(const ctx_t &context) -> Chain * {
+  if (context->level_ != FirewallLevel::CHAIN) {
+    context->setLastError("Not at chain level.");
+    return nullptr;
+  }
+  auto *table = getTable(context);
+  if (table == nullptr) {
+    return nullptr;
+  }
+  auto iter = std::ranges::find(table->chains_, context->chain_, &Chain::name_);
+  if (iter == table->chains_.end()) {
+    context->setLastError(fmt::format("No chain {} in table {}",
+                                      context->chain_, context->table_));
+    return nullptr;
+  }
+  return &*iter;
+}
+
+auto NftBackend::getRuleAt(const ctx_t &context, int index) -> Rule * {
+  auto *chain = getChain(context);
+  if (chain == nullptr) {
+    throw std::invalid_argument(context->getLastError());
+  }
+  if (index < 0 || index >= static_cast<int>(chain->rules_.size())) {
+    throw std::out_of_range(fmt::format("Rule #{} out of chain {}, size: {}",
+                                        index, context->chain_,
+                                        chain->rules_.size()));
+  }
+  return &chain->rules_[index];
+}
+
+auto NftBackend::getFirewallChildren(const ctx_t &context) -> vector<string> {
+  vector<string> children;
+
+  switch (context->level_) {
+  case FirewallLevel::OVERALL:
+    children = getTableNames();
+    break;
+  case FirewallLevel::TABLE:
+    if (const auto *table = getTable(context); table != nullptr) {
+      for (const auto &chain : table->chains_) {
+        children.push_back(chain.name_);
+      }
+    }
+    break;
+  case FirewallLevel::CHAIN:
+    if (const auto *chain = getChain(context); chain != nullptr) {
+      children.reserve(chain->rules_.size());
+      for (const auto &rule : chain->rules_) {
+        children.push_back(describeRule(rule));
+      }
+    }
+    break;
+  }
+
+  return children;
+}
+
+auto NftBackend::describeRule(const Rule &rule) -> string {
+  if (rule.request_ == nullptr) {
+    return fmt::format("[{}]", rule.expressions_);
+  }
+
+  const auto &request = *rule.request_;
+  fmt::memory_buffer buffer;
+  auto out = std::back_inserter(buffer);
+  fmt::format_to(out, "SRC: {}, DST: {}, PROTO: {}",
+                 request.src_ip_.value_or("0.0.0.0"),
+                 request.dst_ip_.value_or("0.0.0.0"), request.proto_);
+  for (const auto &match : request.matches_) {
+    if (match.src_port_range_) {
+      fmt::format_to(out, ", SRC PORT: {}-{}", get<0>(*match.src_port_range_),
+                     get<1>(*match.src_port_range_));
+    }
+    if (match.dst_port_range_) {
+      fmt::format_to(out, ", DST PORT: {}-{}", get<0>(*match.dst_port_range_),
+                     get<1>(*match.dst_port_range_));
+    }
+  }
+  if (!request.target_.empty()) {
+    fmt::format_to(out, " | {}", request.target_);
+  }
+  return fmt::to_string(buffer);
+}
+
+auto NftBackend::getRuleDetails(const ctx_t &context, int index) -> string {
+  return guarded(context, string(), [&]() {
+    const auto &rule = *getRuleAt(context, index);
+
+    fmt::memory_buffer buffer;
+    auto out = std::back_inserter(buffer);
+    if (rule.handle_ != 0) {
+      fmt::format_to(out, "Handle: {}\n", rule.handle_);
+    } else {
+      fmt::format_to(out, "Handle: (not committed)\n");
+    }
+
+    if (rule.request_ == nullptr) {
+      fmt::format_to(out, "Expressions: {}\n", rule.expressions_);
+    } else {
+      const auto &request = *rule.request_;
+      fmt::format_to(out, "Source IP: {}\n", request.src_ip_.value_or(""));
+      fmt::format_to(out, "Source Mask: {}\n", request.src_mask_.value_or(""));
+      fmt::format_to(out, "Destination IP: {}\n", request.dst_ip_.value_or(""));
+      fmt::format_to(out, "Destination Mask: {}\n",
+                     request.dst_mask_.value_or(""));
+      fmt::format_to(out, "Protocol: {}\n", request.proto_);
+      fmt::format_to(out, "Input Interface: {}\n",
+                     request.iniface_.value_or(""));
+      fmt::format_to(out, "Output Interface: {}\n",
+                     request.outiface_.value_or(""));
+      for (const auto &match : request.matches_) {
+        if (match.src_port_range_) {
+          fmt::format_to(out, "Src Port: {} - {}\n",
+                         get<0>(*match.src_port_range_),
+                         get<1>(*match.src_port_range_));
+        }
+        if (match.dst_port_range_) {
+          fmt::format_to(out, "Dest Port: {} - {}\n",
+                         get<0>(*match.dst_port_range_),
+                         get<1>(*match.dst_port_range_));
+        }
+      }
+      fmt::format_to(out, "Target Name: {}\n", request.target_);
+    }
+    fmt::format_to(out, "Packet Count: {}\n", rule.packets_);
+    fmt::format_to(out, "Byte Count: {}\n", rule.bytes_);
+    return fmt::to_string(buffer);
+  });
+}
+
+auto NftBackend::getRule(const ctx_t &context,
+                         int index) -> shared_ptr<RuleRequest> {
+  return guarded(context, shared_ptr<RuleRequest>(), [&]() {
+    const auto *rule = getRuleAt(context, index);
+    if (rule->request_ == nullptr) {
+      context->setLastError("Rule has expressions that cannot be edited: " +
+                            rule->expressions_);
+      return shared_ptr<RuleRequest>();
+    }
+    auto request = std::make_shared<RuleRequest>(*rule->request_);
+    request->index_ = index;
+    return request;
+  });
+}
+
+auto NftBackend::getRuleCount(const ctx_t &context) -> int {
+  const auto *chain = getChain(context);
+  return chain == nullptr ? 0 : static_cast<int>(chain->rules_.size());
+}
+
+auto NftBackend::getRuleHandle(const ctx_t &context,
+                               int index) -> optional<uint64_t> {
+  const auto *rule = getRuleAt(context, index);
+  if (rule->handle_ == 0) {
+    return std::nullopt;
+  }
+  return rule->handle_;
+}
+
+auto NftBackend::insertRule(const ctx_t &context,
+                            const shared_ptr<RuleRequest> &request) -> bool {
+  auto *chain = getChain(context);
+  if (chain == nullptr) {
+    return false;
+  }
+  if (request->index_ < 0) {
+    context->setLastError(
+        fmt::format("Invalid rule index: {}", request->index_));
+    return false;
+  }
+
+  /* encoded once here so that the commit cannot fail on the request */
+  try {
+    NlBuilder scratch;
+    if (!encodeRule(scratch, *request, context)) {
+      return false;
+    }
+  } catch (const std::exception &e) {
+    context->setLastError(
+        fmt::format("Error creating rule, reason: {}", e.what()));
+    return false;
+  }
+
+  Rule rule;
+  rule.state_ = Rule::State::ADDED;
+  rule.request_ = std::make_shared<RuleRequest>(*request);
+  auto position = std::min<size_t>(request->index_, chain->rules_.size());
+  chain->rules_.insert(chain->rules_.begin() + static_cast<long>(position),
+                       std::move(rule));
+  chain->dirty_ = true;
+  return true;
+}
+
+auto NftBackend::updateRule(const ctx_t &context,
+                            const shared_ptr<RuleRequest> &request) -> bool {
+  auto *chain = getChain(context);
+  if (chain == nullptr) {
+    return false;
+  }
+  if (request->index_ < 0 ||
+      request->index_ >= static_cast<int>(chain->rules_.size())) {
+    context->setLastError(fmt::format("Rule #{} out of chain, size: {}",
+                                      request->index_, chain->rules_.size()));
+    return false;
+  }
+
+  try {
+    NlBuilder scratch;
+    if (!encodeRule(scratch, *request, context)) {
+      return false;
+    }
+  } catch (const std::exception &e) {
+    context->setLastError(
+        fmt::format("Error update rule, reason: {}", e.what()));
+    return false;
+  }
+
+  /* an added rule is still added, with the new content */
+  auto &rule = chain->rules_[request->index_];
+  if (rule.state_ == Rule::State::KERNEL) {
+    rule.state_ = Rule::State::REPLACED;
+  }
+  rule.request_ = std::make_shared<RuleRequest>(*request);
+  rule.expressions_.clear();
+  rule.packets_ = 0;
+  rule.bytes_ = 0;
+  chain->dirty_ = true;
+  return true;
+}
+
+auto NftBackend::removeRule(const ctx_t &context, int index) -> bool {
+  auto *chain = getChain(context);
+  if (chain == nullptr) {
+    return false;
+  }
+  if (index < 0 || index >= static_cast<int>(chain->rules_.size())) {
+    context->setLastError(
+        fmt::format("Rule #{} out of chain, size: {}", index,
+                    chain->rules_.size()));
+    return false;
+  }
+
+  auto iter = chain->rules_.begin() + index;
+  if (iter->state_ != Rule::State::ADDED) {
+    chain->removed_.push_back(iter->handle_);
+  }
+  chain->rules_.erase(iter);
+  chain->dirty_ = true;
+  return true;
+}
+
+auto NftBackend::insertTable(const ctx_t &context,
+                             const string &table) -> bool {
+  if (context->level_ != FirewallLevel::OVERALL) {
+    context->setLastError("Tables can only be added at overall level.");
+    return false;
+  }
+  if (table.empty() || table.size() >= NFT_TABLE_MAXNAMELEN) {
+    context->setLastError(fmt::format("Invalid table name: {}", table));
+    return false;
+  }
+  const auto &names = getTableNames();
+  if (std::ranges::find(names, table) != names.end()) {
+    context->setLastError(fmt::format("Table {} already exists", table));
+    return false;
+  }
+
+  Table added{table, true};
+  tables_.insert_or_assign(table, std::move(added));
+  table_names_->push_back(table);
+  return true;
+}
+
+auto NftBackend::insertChain(const ctx_t &context,
+                             const shared_ptr<ChainRequest> &request) -> bool {
+  if (context->level_ != FirewallLevel::TABLE) {
+    context->setLastError("Chains can only be added at table level.");
+    return false;
+  }
+  auto *table = getTable(context);
+  if (table == nullptr) {
+    return false;
+  }
+
+  const auto &name = request->chain_name_;
+  if (name.empty() || name.size() >= NFT_CHAIN_MAXNAMELEN) {
+    context->setLastError(fmt::format("Invalid chain name: {}", name));
+    return false;
+  }
+  if (std::ranges::find(table->chains_, name, &Chain::name_) !=
+      table->chains_.end()) {
+    context->setLastError(fmt::format("Chain {} already exists", name));
+    return false;
+  }
+
+  Chain chain{name};
+  chain.added_ = true;
+  table->chains_.push_back(std::move(chain));
+  return true;
+}
+
+auto NftBackend::insertBaseChain(const ctx_t &context,
+                                 const shared_ptr<ChainRequest> &request,
+                                 const string &hook, int priority,
+                                 const string &policy) -> bool {
+  const auto &hooks = KernelTable::hookNames();
+  auto hook_iter = std::ranges::find(hooks, hook);
+  if (hook_iter == hooks.end()) {
+    context->setLastError(fmt::format("Unknown hook: {}", hook));
+    return false;
+  }
+  if (policy != IPTC_LABEL_ACCEPT && policy != IPTC_LABEL_DROP) {
+    context->setLastError(fmt::format("Invalid policy: {}", policy));
+    return false;
+  }
+  if (!insertChain(context, request)) {
+    return false;
+  }
+
+  auto &chain = getTable(context)->chains_.back();
+  chain.hook_ = static_cast<uint32_t>(hook_iter - hooks.begin());
+  chain.priority_ = priority;
+  chain.policy_ = policy == IPTC_LABEL_DROP ? NF_DROP : NF_ACCEPT;
+  return true;
+}
+
+auto NftBackend::removeChain(const ctx_t &context) -> bool {
+  auto *chain = getChain(context);
+  if (chain == nullptr) {
+    return false;
+  }
+  auto *table = getTable(context);
+
+  /* the kernel refuses it too, but without saying who refers to it */
+  size_t refs = 0;
+  string referrers;
+  for (const auto &other : table->chains_) {
+    auto count = std::ranges::count_if(other.rules_, [&](const Rule &rule) {
+      return rule.request_ != nullptr &&
+             rule.request_->target_ == context->chain_;
+    });
+    if (count > 0) {
+      refs += count;
+      referrers += (referrers.empty() ? "" : ", ") + other.name_;
+    }
+  }
+  if (refs > 0) {
+    context->setLastError(
+        fmt::format("Chain {} is referenced by {} rules in {}\n",
+                    context->chain_, refs, referrers));
+    return false;
+  }
+
+  /* the kernel deletes the rules of a deleted chain */
+  if (!chain->added_) {
+    table->removed_chains_.push_back(chain->name_);
+  }
+  table->chains_.erase(table->chains_.begin() +
+                       (chain - table->chains_.data()));
+  return true;
+}
+
+auto NftBackend::buildBatch(NlBuilder &batch)
+    -> std::pair<uint32_t, uint32_t> {
+  auto &socket = getSocket();
+  scopes_.clear();
+  echoes_.clear();
+
+  auto first = socket.nextSeq();
+  batch.begin(NFNL_MSG_BATCH_BEGIN, 0, first, AF_UNSPEC,
+              NFNL_SUBSYS_NFTABLES);
+  if (genid_ != 0) {
+    batch.putU32(NFNL_BATCH_GENID, genid_);
+  }
+  batch.end();
+
+  uint32_t last = first;
+  auto begin = [&](uint16_t msg, uint16_t flags, string scope) {
+    last = socket.nextSeq();
+    batch.begin(msgType(msg), flags, last, NFPROTO_IPV4);
+    scopes_.emplace(last, std::move(scope));
+  };
+
+  /* removals first, so names can be reused by what is added after */
+  for (auto &[name, table] : tables_) {
+    for (const auto &chain : table.chains_) {
+      for (auto handle : chain.removed_) {
+        begin(NFT_MSG_DELRULE, 0,
+              fmt::format("{}/{} rule {}", name, chain.name_, handle));
+        batch.putStr(NFTA_RULE_TABLE, name);
+        batch.putStr(NFTA_RULE_CHAIN, chain.name_);
+        batch.putU64(NFTA_RULE_HANDLE, handle);
+        batch.end();
+      }
+    }
+    for (const auto &chain : table.removed_chains_) {
+      begin(NFT_MSG_DELCHAIN, 0, fmt::format("{}/{}", name, chain));
+      batch.putStr(NFTA_CHAIN_TABLE, name);
+      batch.putStr(NFTA_CHAIN_NAME, chain);
+      batch.end();
+    }
+  }
+
+  /* then tables and chains, rules may jump to any chain of their table */
+  for (auto &[name, table] : tables_) {
+    if (table.added_) {
+      begin(NFT_MSG_NEWTABLE, NLM_F_CREATE, name);
+      batch.putStr(NFTA_TABLE_NAME, name);
+      batch.end();
+    }
+    for (const auto &chain : table.chains_) {
+      if (!chain.added_) {
+        continue;
+      }
+      begin(NFT_MSG_NEWCHAIN, NLM_F_CREATE,
+            fmt::format("{}/{}", name, chain.name_));
+      batch.putStr(NFTA_CHAIN_TABLE, name);
+      batch.putStr(NFTA_CHAIN_NAME, chain.name_);
+      if (chain.hook_.has_value()) {
+        auto hook = batch.nest(NFTA_CHAIN_HOOK);
+        batch.putU32(NFTA_HOOK_HOOKNUM, *chain.hook_);
+        batch.putU32(NFTA_HOOK_PRIORITY,
+                     static_cast<uint32_t>(chain.priority_));
+        batch.endNest(hook);
+        batch.putStr(NFTA_CHAIN_TYPE, "filter");
+        batch.putU32(NFTA_CHAIN_POLICY, chain.policy_);
+      }
+      batch.end();
+    }
+  }
+
+  /* an added rule goes before the next rule already in kernel, or to the
+   * tail if none follows, so runs of added rules keep their order */
+  for (auto &[name, table] : tables_) {
+    for (auto &chain : table.chains_) {
+      if (!chain.dirty_) {
+        continue;
+      }
+      vector<uint64_t> next(chain.rules_.size());
+      uint64_t handle = 0;
+      for (auto i = chain.rules_.size(); i-- > 0;) {
+        next[i] = handle;
+        if (chain.rules_[i].state_ != Rule::State::ADDED) {
+          handle = chain.rules_[i].handle_;
+        }
+      }
+
+      for (size_t i = 0; i < chain.rules_.size(); i++) {
+        auto &rule = chain.rules_[i];
+        if (rule.state_ == Rule::State::KERNEL) {
+          continue;
+        }
+
+        auto scope = fmt::format("{}/{} rule {}", name, chain.name_,
+                                 describeRule(rule));
+        if (rule.state_ == Rule::State::REPLACED) {
+          begin(NFT_MSG_NEWRULE, NLM_F_REPLACE, std::move(scope));
+          batch.putStr(NFTA_RULE_TABLE, name);
+          batch.putStr(NFTA_RULE_CHAIN, chain.name_);
+          batch.putU64(NFTA_RULE_HANDLE, rule.handle_);
+        } else {
+          begin(NFT_MSG_NEWRULE,
+                NLM_F_CREATE | NLM_F_ECHO | (next[i] == 0 ? NLM_F_APPEND : 0),
+                std::move(scope));
+          batch.putStr(NFTA_RULE_TABLE, name);
+          batch.putStr(NFTA_RULE_CHAIN, chain.name_);
+          if (next[i] != 0) {
+            batch.putU64(NFTA_RULE_POSITION, next[i]);
+          }
+          echoes_.emplace(last, &rule);
+        }
+
+        auto context = std::make_shared<FirewallContext>();
+        encodeRule(batch, *rule.request_, context);
+        batch.end();
+      }
+    }
+  }
+
+  auto changes = last;
+  batch.addFlags(NLM_F_ACK);
+  batch.begin(NFNL_MSG_BATCH_END, 0, socket.nextSeq(), AF_UNSPEC,
+              NFNL_SUBSYS_NFTABLES);
+  batch.end();
+  return {first, changes};
+}
+
+auto NftBackend::markCommitted() -> void {
+  /* a rule whose handle was not echoed cannot be addressed, its table is
+   * read again on next access */
+  vector<string> unknown;
+  for (auto &[name, table] : tables_) {
+    table.added_ = false;
+    table.removed_chains_.clear();
+    for (auto &chain : table.chains_) {
+      chain.added_ = false;
+      chain.removed_.clear();
+      if (!chain.dirty_) {
+        continue;
+      }
+      chain.dirty_ = false;
+      for (auto &rule : chain.rules_) {
+        rule.state_ = Rule::State::KERNEL;
+        if (rule.handle_ == 0) {
+          unknown.push_back(name);
+        }
+      }
+    }
+  }
+  for (const auto &name : unknown) {
+    tables_.erase(name);
+  }
+
+  /* the kernel counts one generation per transaction */
+  do {
+    genid_++;
+  } while (genid_ == 0);
+}
+
+auto NftBackend::lastCommitError() const -> string {
+  return last_commit_error_;
+}
+
+auto NftBackend::commit() -> bool {
+  last_commit_error_.clear();
+  auto messages = pendingMessages();
+  if (messages == 0) {
+    return true;
+  }
+
+  commit_stat_.commits_++;
+  auto &socket = getSocket();
+  if (!socket.valid()) {
+    last_commit_error_ =
+        fmt::format("Cannot open nf_tables socket: {}", strerror(errno));
+    commit_stat_.failures_++;
+    return false;
+  }
+
+  NlBuilder batch;
+  auto [first, last] = buildBatch(batch);
+
+  auto start = std::chrono::steady_clock::now();
+  auto errors = socket.transact(
+      batch, first, last, [this](const struct nlmsghdr *msg) {
+        auto iter = echoes_.find(msg->nlmsg_seq);
+        if (NFNL_MSG_TYPE(msg->nlmsg_type) == NFT_MSG_NEWRULE &&
+            iter != echoes_.end()) {
+          iter->second->handle_ =
+              NlAttr::parse(msg, NFTA_RULE_MAX)[NFTA_RULE_HANDLE].u64();
+        }
+      });
+  auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  commit_stat_.last_messages_ = messages;
+  commit_stat_.last_latency_ = latency;
+  commit_stat_.max_latency_ = std::max(commit_stat_.max_latency_, latency);
+
+  if (!errors.has_value()) {
+    /* the batch may or may not have been applied, only kernel knows */
+    last_commit_error_ =
+        fmt::format("Error sending nf_tables batch: {}, pending changes are "
+                    "discarded",
+                    strerror(errno));
+    commit_stat_.failures_++;
+    reload();
+    return false;
+  }
+
+  for (const auto &error : *errors) {
+    if (error.seq_ == first && error.error_ == ERESTART) {
+      last_commit_error_ += "Ruleset changed by another program since it was "
+                            "read, reload and retry\n";
+      continue;
+    }
+    auto scope = scopes_.find(error.seq_);
+    last_commit_error_ += fmt::format(
+        "{}: {}\n", scope == scopes_.end() ? "batch" : scope->second,
+        strerror(error.error_));
+  }
+  if (!errors->empty()) {
+    yuiError() << "nf_tables commit failed: " << last_commit_error_ << endl;
+    commit_stat_.failures_++;
+    return false;
+  }
+
+  markCommitted();
+  return true;
+}
+
+auto NftBackend::reload() -> void {
+  tables_.clear();
+  table_names_.reset();
+  genid_ = 0;
+}
+
+auto NftBackend::reloadTable(const ctx_t &context) -> void {
+  /* pending changes are kept in the cached table only */
+  auto iter = tables_.find(context->table_);
+  if (iter == tables_.end()) {
+    return;
+  }
+  if (iter->second.added_) {
+    table_names_.reset();
+  }
+  tables_.erase(iter);
+}
+
+auto NftBackend::reloadIfStale(const ctx_t &context) -> bool {
+  (void)context;
+  if (genid_ == 0 || pendingMessages() > 0) {
+    return false;
+  }
+  auto genid = getGeneration();
+  if (!genid.has_value() || *genid == genid_) {
+    return false;
+  }
+  reload();
+  return true;
+}
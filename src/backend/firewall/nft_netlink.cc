@@ -0,0 +1,294 @@
+#include "backend/firewall/nft_netlink.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <endian.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+/* large enough for the biggest skb the kernel puts in a dump */
+constexpr size_t kReceiveBuffer = 1 << 16;
+
+auto attrs(std::span<const uint8_t> data,
+           const function<void(const NlAttr &)> &func) -> void {
+  while (data.size() >= NLA_HDRLEN) {
+    struct nlattr header {};
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.nla_len < NLA_HDRLEN || header.nla_len > data.size()) {
+      break;
+    }
+    func({static_cast<uint16_t>(header.nla_type & NLA_TYPE_MASK),
+          data.subspan(NLA_HDRLEN, header.nla_len - NLA_HDRLEN)});
+    data = data.subspan(std::min<size_t>(NLA_ALIGN(header.nla_len),
+                                         data.size()));
+  }
+}
+
+auto indexed(std::span<const uint8_t> data, size_t max) -> vector<NlAttr> {
+  vector<NlAttr> table(max + 1);
+  attrs(data, [&table](const NlAttr &attr) {
+    if (attr.type_ < table.size()) {
+      table[attr.type_] = attr;
+    }
+  });
+  return table;
+}
+
+auto setBuffer(int fd, int force, int option, size_t size) -> void {
+  auto value = static_cast<int>(std::min<size_t>(size, INT32_MAX));
+  if (setsockopt(fd, SOL_SOCKET, force, &value, sizeof(value)) != 0) {
+    setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value));
+  }
+}
+
+} // namespace
+
+auto NlAttr::u8() const -> uint8_t {
+  return data_.empty() ? 0 : data_[0];
+}
+
+auto NlAttr::u16() const -> uint16_t {
+  uint16_t value = 0;
+  memcpy(&value, data_.data(), std::min(sizeof(value), data_.size()));
+  return be16toh(value);
+}
+
+auto NlAttr::u32() const -> uint32_t {
+  uint32_t value = 0;
+  memcpy(&value, data_.data(), std::min(sizeof(value), data_.size()));
+  return be32toh(value);
+}
+
+auto NlAttr::u64() const -> uint64_t {
+  uint64_t value = 0;
+  memcpy(&value, data_.data(), std::min(sizeof(value), data_.size()));
+  return be64toh(value);
+}
+
+auto NlAttr::str() const -> string {
+  const auto *begin = reinterpret_cast<const char *>(data_.data());
+  return {begin, strnlen(begin, data_.size())};
+}
+
+auto NlAttr::nested(size_t max) const -> vector<NlAttr> {
+  return indexed(data_, max);
+}
+
+auto NlAttr::list() const -> vector<NlAttr> {
+  vector<NlAttr> items;
+  attrs(data_, [&items](const NlAttr &attr) { items.push_back(attr); });
+  return items;
+}
+
+auto NlAttr::parse(const struct nlmsghdr *msg, size_t max) -> vector<NlAttr> {
+  constexpr auto kHeader = NLMSG_ALIGN(sizeof(struct nfgenmsg));
+  if (msg->nlmsg_len < NLMSG_LENGTH(kHeader)) {
+    return vector<NlAttr>(max + 1);
+  }
+  const auto *payload =
+      static_cast<const uint8_t *>(NLMSG_DATA(msg)) + kHeader;
+  return indexed({payload, msg->nlmsg_len - NLMSG_LENGTH(kHeader)}, max);
+}
+
+auto NlBuilder::reserve(size_t len) -> uint8_t * {
+  auto offset = buffer_.size();
+  buffer_.resize(offset + NLMSG_ALIGN(len));
+  return buffer_.data() + offset;
+}
+
+auto NlBuilder::begin(uint16_t type, uint16_t flags, uint32_t seq,
+                      uint8_t family, uint16_t res_id) -> void {
+  message_ = buffer_.size();
+  auto *header = reinterpret_cast<struct nlmsghdr *>(
+      reserve(NLMSG_HDRLEN + sizeof(struct nfgenmsg)));
+  header->nlmsg_type = type;
+  header->nlmsg_flags = NLM_F_REQUEST | flags;
+  header->nlmsg_seq = seq;
+
+  auto *gen = static_cast<struct nfgenmsg *>(NLMSG_DATA(header));
+  gen->nfgen_family = family;
+  gen->version = NFNETLINK_V0;
+  gen->res_id = htobe16(res_id);
+}
+
+auto NlBuilder::end() -> void {
+  auto *header = reinterpret_cast<struct nlmsghdr *>(&buffer_[message_]);
+  header->nlmsg_len = static_cast<uint32_t>(buffer_.size() - message_);
+  messages_++;
+}
+
+auto NlBuilder::addFlags(uint16_t flags) -> void {
+  reinterpret_cast<struct nlmsghdr *>(&buffer_[message_])->nlmsg_flags |=
+      flags;
+}
+
+auto NlBuilder::put(uint16_t type, const void *data, size_t len) -> void {
+  auto *attr = reinterpret_cast<struct nlattr *>(reserve(NLA_HDRLEN + len));
+  attr->nla_type = type;
+  attr->nla_len = static_cast<uint16_t>(NLA_HDRLEN + len);
+  if (len > 0) {
+    memcpy(reinterpret_cast<uint8_t *>(attr) + NLA_HDRLEN, data, len);
+  }
+}
+
+auto NlBuilder::putU32(uint16_t type, uint32_t value) -> void {
+  value = htobe32(value);
+  put(type, &value, sizeof(value));
+}
+
+auto NlBuilder::putU64(uint16_t type, uint64_t value) -> void {
+  value = htobe64(value);
+  put(type, &value, sizeof(value));
+}
+
+auto NlBuilder::putStr(uint16_t type, string_view value) -> void {
+  auto *attr = reinterpret_cast<struct nlattr *>(
+      reserve(NLA_HDRLEN + value.size() + 1));
+  attr->nla_type = type;
+  attr->nla_len = static_cast<uint16_t>(NLA_HDRLEN + value.size() + 1);
+  memcpy(reinterpret_cast<uint8_t *>(attr) + NLA_HDRLEN, value.data(),
+         value.size());
+}
+
+auto NlBuilder::nest(uint16_t type) -> size_t {
+  auto offset = buffer_.size();
+  auto *attr = reinterpret_cast<struct nlattr *>(reserve(NLA_HDRLEN));
+  attr->nla_type = type | NLA_F_NESTED;
+  return offset;
+}
+
+auto NlBuilder::endNest(size_t offset) -> void {
+  auto *attr = reinterpret_cast<struct nlattr *>(&buffer_[offset]);
+  attr->nla_len = static_cast<uint16_t>(buffer_.size() - offset);
+}
+
+auto NlBuilder::clear() -> void {
+  buffer_.clear();
+  messages_ = 0;
+}
+
+NftSocket::NftSocket()
+    : fd_(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)),
+      seq_(static_cast<uint32_t>(time(nullptr))),
+      buffer_(kReceiveBuffer) {
+  if (fd_ < 0) {
+    return;
+  }
+
+  struct sockaddr_nl addr {};
+  addr.nl_family = AF_NETLINK;
+  if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) !=
+      0) {
+    auto saved_errno = errno;
+    close(fd_);
+    fd_ = -1;
+    errno = saved_errno;
+    return;
+  }
+
+  /* errors quote only the header of the failed message, not all of it */
+  int one = 1;
+  setsockopt(fd_, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+}
+
+NftSocket::~NftSocket() {
+  if (fd_ >= 0) {
+    auto saved_errno = errno;
+    close(fd_);
+    errno = saved_errno;
+  }
+}
+
+auto NftSocket::receive(
+    const function<bool(const struct nlmsghdr *)> &handler) -> bool {
+  while (true) {
+    auto len = recv(fd_, buffer_.data(), buffer_.size(), 0);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      return false;
+    }
+
+    auto remaining = static_cast<int>(len);
+    for (const auto *msg = reinterpret_cast<const struct nlmsghdr *>(
+             buffer_.data());
+         NLMSG_OK(msg, remaining); msg = NLMSG_NEXT(msg, remaining)) {
+      if (!handler(msg)) {
+        return true;
+      }
+    }
+  }
+}
+
+auto NftSocket::request(const NlBuilder &request,
+                        const Handler &handler) -> bool {
+  auto data = request.data();
+  if (send(fd_, data.data(), data.size(), 0) < 0) {
+    return false;
+  }
+
+  int error = 0;
+  auto interrupted = false;
+  auto received = receive([&](const struct nlmsghdr *msg) {
+    interrupted = interrupted || (msg->nlmsg_flags & NLM_F_DUMP_INTR) != 0;
+    if (msg->nlmsg_type == NLMSG_DONE) {
+      if (msg->nlmsg_len >= NLMSG_LENGTH(sizeof(int))) {
+        memcpy(&error, NLMSG_DATA(msg), sizeof(error));
+        error = -error;
+      }
+      return false;
+    }
+    if (msg->nlmsg_type == NLMSG_ERROR) {
+      error = -static_cast<const struct nlmsgerr *>(NLMSG_DATA(msg))->error;
+      return false;
+    }
+    handler(msg);
+    return true;
+  });
+
+  if (!received) {
+    return false;
+  }
+  if (error != 0 || interrupted) {
+    errno = error != 0 ? error : EINTR;
+    return false;
+  }
+  return true;
+}
+
+auto NftSocket::transact(const NlBuilder &batch, uint32_t first,
+                         uint32_t last, const Handler &handler)
+    -> optional<vector<NlError>> {
+  /* the kernel refuses a batch larger than the send buffer, and drops
+   * replies that do not fit the receive buffer */
+  auto data = batch.data();
+  setBuffer(fd_, SO_SNDBUFFORCE, SO_SNDBUF, data.size() * 2);
+  setBuffer(fd_, SO_RCVBUFFORCE, SO_RCVBUF, data.size() * 2);
+
+  if (send(fd_, data.data(), data.size(), 0) < 0) {
+    return std::nullopt;
+  }
+
+  vector<NlError> errors;
+  auto received = receive([&](const struct nlmsghdr *msg) {
+    if (msg->nlmsg_type != NLMSG_ERROR) {
+      handler(msg);
+      return true;
+    }
+    auto error = -static_cast<const struct nlmsgerr *>(NLMSG_DATA(msg))->error;
+    if (error != 0) {
+      errors.push_back({msg->nlmsg_seq, error});
+    }
+    return msg->nlmsg_seq != last && (msg->nlmsg_seq != first || error == 0);
+  });
+
+  if (!received) {
+    return std::nullopt;
+  }
+  return errors;
+}
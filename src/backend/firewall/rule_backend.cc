@@ -0,0 +1,25 @@
+#include "backend/firewall/rule_backend.h"
+#include "tools/log.h"
+
+#include <memory>
+
+auto RuleBackend::createContext(const ctx_t &current,
+                                const string &name) -> ctx_t {
+  auto context = std::make_shared<FirewallContext>(current);
+
+  switch (context->level_) {
+  case FirewallLevel::OVERALL:
+    context->level_ = FirewallLevel::TABLE;
+    context->table_ = name;
+    break;
+  case FirewallLevel::TABLE:
+    context->level_ = FirewallLevel::CHAIN;
+    context->chain_ = name;
+    break;
+  case FirewallLevel::CHAIN:
+    yuiError() << "Cannot create context from chain." << endl;
+    break;
+  }
+
+  return context;
+}
@@ -0,0 +1,269 @@
+#include "backend/firewall/rule_compactor.h"
+#include "backend/firewall/rule_space.h"
+
+#include <array>
+#include <bit>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+
+using std::optional;
+
+namespace {
+
+constexpr int kMaxPrefix = 32;
+constexpr unsigned kHalfShift = 16;
+
+/* one pass per prefix bit is enough to merge a full /0 */
+constexpr int kMaxPasses = kMaxPrefix + 1;
+
+enum class MergeField { SRC, DST, SPORT, DPORT };
+
+auto prefixMask(int length) -> uint32_t {
+  return length == 0 ? 0U : ~0U << (kMaxPrefix - length);
+}
+
+auto isContiguous(uint32_t mask) -> bool { return (~mask & (~mask + 1)) == 0; }
+
+/* target ends evaluation, a packet matching twice sees it once */
+auto isDecisive(const ModelTarget &target) -> bool {
+  return target.isTerminal() || target.kind_ == TargetKind::RETURN;
+}
+
+/* every field of a rule, the field being merged on is cleared for ports */
+using MergeKey = std::array<uint32_t, 9>;
+
+class MergeKeyHash {
+public:
+  auto operator()(const MergeKey &key) const -> size_t {
+    size_t hash = 0;
+    for (auto value : key) {
+      hash = (hash ^ value) * 0x100000001B3ULL;
+    }
+    return hash;
+  }
+};
+
+class Item {
+public:
+  /* nullopt for rules that cannot be modeled or rewritten */
+  optional<RuleSpace> space_;
+  uint16_t target_;
+  bool alive_{true};
+  bool widened_{false};
+};
+
+class Compactor {
+public:
+  Compactor(const RulesetModel &model, const ModelChain &chain)
+      : model_(model) {
+    for (auto row = chain.begin_; row < chain.end_; row++) {
+      Item item{RuleSpace::fromRow(model, row), model.target_[row]};
+      if (item.space_ && !item.space_->toRequest(model.ifaces_, "")) {
+        item.space_.reset();
+      }
+      /* never matches and is kept as is, rewriting would make it match */
+      if (item.space_ && RuleSpace::isUnmatchable(model, row)) {
+        item.space_.reset();
+        item.alive_ = false;
+      }
+      items_.push_back(item);
+    }
+  }
+
+  auto run() -> void {
+    for (int pass = 0; pass < kMaxPasses; pass++) {
+      auto merged = false;
+      for (auto field : {MergeField::SRC, MergeField::DST, MergeField::DPORT,
+                         MergeField::SPORT}) {
+        merged = mergeField(field) || merged;
+      }
+      if (!merged) {
+        break;
+      }
+    }
+  }
+
+  [[nodiscard]] auto items() const -> const vector<Item> & { return items_; }
+
+private:
+  const RulesetModel &model_;
+  vector<Item> items_;
+
+  static auto key(const RuleSpace &space, uint16_t target,
+                  MergeField field) -> MergeKey {
+    auto pack = [](uint32_t high, uint32_t low) {
+      return (high << kHalfShift) | low;
+    };
+    MergeKey key = {space.src_,
+                    space.smsk_,
+                    space.dst_,
+                    space.dmsk_,
+                    space.proto_,
+                    pack(space.iniface_, space.outiface_),
+                    pack(space.sport_lo_, space.sport_hi_),
+                    pack(space.dport_lo_, space.dport_hi_),
+                    target};
+    if (field == MergeField::SPORT) {
+      key[6] = 0;
+    } else if (field == MergeField::DPORT) {
+      key[7] = 0;
+    }
+    return key;
+  }
+
+  /* key of the other half of the CIDR block of space */
+  static auto buddyKey(const RuleSpace &space, uint16_t target,
+                       MergeField field) -> optional<MergeKey> {
+    auto buddy = space;
+    auto &addr = field == MergeField::SRC ? buddy.src_ : buddy.dst_;
+    auto mask = field == MergeField::SRC ? buddy.smsk_ : buddy.dmsk_;
+    if (mask == 0 || !isContiguous(mask)) {
+      return std::nullopt;
+    }
+    addr ^= 1U << std::countr_zero(mask);
+    return key(buddy, target, field);
+  }
+
+  /**
+   * later rule can move up to earlier one if each alive rule between that
+   * overlaps it ends evaluation with the same target
+   */
+  auto canMerge(size_t earlier, size_t later) const -> bool {
+    const auto &space = *items_[later].space_;
+    for (auto k = earlier + 1; k < later; k++) {
+      const auto &item = items_[k];
+      /* region of merged rule is part of an earlier rule now */
+      if (!item.alive_) {
+        continue;
+      }
+      if (item.space_ && !item.space_->overlaps(space, model_.ifaces_)) {
+        continue;
+      }
+
+      if (!item.space_ || !isDecisive(model_.targets_[item.target_]) ||
+          item.target_ != items_[later].target_) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  auto widen(RuleSpace &into, const RuleSpace &from, MergeField field) -> void {
+    switch (field) {
+    case MergeField::SRC: {
+      auto length = std::popcount(into.smsk_) - 1;
+      into.smsk_ = prefixMask(length);
+      into.src_ &= into.smsk_;
+      break;
+    }
+    case MergeField::DST: {
+      auto length = std::popcount(into.dmsk_) - 1;
+      into.dmsk_ = prefixMask(length);
+      into.dst_ &= into.dmsk_;
+      break;
+    }
+    case MergeField::SPORT:
+      into.sport_lo_ = std::min(into.sport_lo_, from.sport_lo_);
+      into.sport_hi_ = std::max(into.sport_hi_, from.sport_hi_);
+      break;
+    case MergeField::DPORT:
+      into.dport_lo_ = std::min(into.dport_lo_, from.dport_lo_);
+      into.dport_hi_ = std::max(into.dport_hi_, from.dport_hi_);
+      break;
+    }
+  }
+
+  /**
+   * ranges touch or overlap, overlapping ones only merge when the target
+   * is decisive, a LOG would be applied once instead of twice otherwise
+   */
+  static auto adjacent(uint16_t lo, uint16_t hi, uint16_t other_lo,
+                       uint16_t other_hi, bool decisive) -> bool {
+    auto touching = static_cast<uint32_t>(hi) + 1 >= other_lo &&
+                    static_cast<uint32_t>(other_hi) + 1 >= lo;
+    auto overlapping = hi >= other_lo && other_hi >= lo;
+    return touching && (decisive || !overlapping);
+  }
+
+  auto mergeField(MergeField field) -> bool {
+    auto ports = field == MergeField::SPORT || field == MergeField::DPORT;
+    std::unordered_map<MergeKey, size_t, MergeKeyHash> seen;
+    auto merged = false;
+
+    for (size_t later = 0; later < items_.size(); later++) {
+      auto &item = items_[later];
+      /* extension targets carry data a rewritten rule would lose */
+      if (!item.alive_ || !item.space_ ||
+          model_.targets_[item.target_].kind_ == TargetKind::EXTENSION) {
+        continue;
+      }
+
+      /* addresses merge with their buddy block, ports with last rule */
+      auto lookup = ports ? optional<MergeKey>(
+                                key(*item.space_, item.target_, field))
+                          : buddyKey(*item.space_, item.target_, field);
+      auto found = lookup ? seen.find(*lookup) : seen.end();
+      if (found != seen.end()) {
+        auto &earlier = items_[found->second];
+        const auto &from = *item.space_;
+        auto &into = *earlier.space_;
+        auto decisive = isDecisive(model_.targets_[item.target_]);
+        auto mergeable =
+            field == MergeField::SPORT
+                ? adjacent(into.sport_lo_, into.sport_hi_, from.sport_lo_,
+                           from.sport_hi_, decisive)
+            : field == MergeField::DPORT
+                ? adjacent(into.dport_lo_, into.dport_hi_, from.dport_lo_,
+                           from.dport_hi_, decisive)
+                : true;
+        if (mergeable && canMerge(found->second, later)) {
+          if (!ports) {
+            /* key of earlier changes, it can merge again in next pass */
+            seen.erase(found);
+          }
+          widen(into, from, field);
+          earlier.widened_ = true;
+          item.alive_ = false;
+          merged = true;
+          continue;
+        }
+      }
+
+      seen.insert_or_assign(key(*item.space_, item.target_, field), later);
+    }
+    return merged;
+  }
+};
+
+} // namespace
+
+auto RuleCompactor::compact(const RulesetModel &model,
+                            uint32_t chain) -> CompactionPlan {
+  const auto &model_chain = model.chains_[chain];
+  Compactor compactor(model, model_chain);
+  compactor.run();
+
+  CompactionPlan plan;
+  plan.chain_ = model.names_.get(model_chain.name_);
+  plan.rule_count_ = model_chain.size();
+
+  const auto &items = compactor.items();
+  for (size_t i = 0; i < items.size(); i++) {
+    const auto &item = items[i];
+    if (!item.alive_) {
+      if (item.space_) {
+        plan.removed_.push_back(static_cast<int>(i));
+      }
+      continue;
+    }
+    if (item.widened_) {
+      const auto &target = model.targets_[item.target_];
+      auto request =
+          item.space_->toRequest(model.ifaces_, model.names_.get(target.name_));
+      request->index_ = static_cast<int>(i);
+      plan.replaced_.push_back(std::move(request));
+    }
+  }
+  return plan;
+}
@@ -0,0 +1,847 @@
+#include "backend/firewall/rule_query.h"
+#include "fmt/format.h"
+#include "tools/nettools.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+
+using Field = RuleQuery::Field;
+using Cmp = RuleQuery::Cmp;
+using Kind = RuleQuery::Kind;
+using Node = RuleQuery::Node;
+
+constexpr int kMaxPrefix = 32;
+constexpr uint64_t kMaxPort = 65535;
+constexpr uint64_t kMaxProto = 255;
+
+/* operands each field accepts */
+enum class Operand : uint8_t { NAME, PROTO, ADDR, PORTS, COUNT };
+
+class FieldInfo {
+public:
+  const char *name_;
+  Field field_;
+  Operand operand_;
+};
+
+constexpr std::array<FieldInfo, 12> kFields = {{
+    {"table", Field::TABLE, Operand::NAME},
+    {"chain", Field::CHAIN, Operand::NAME},
+    {"target", Field::TARGET, Operand::NAME},
+    {"in", Field::IN, Operand::NAME},
+    {"out", Field::OUT, Operand::NAME},
+    {"proto", Field::PROTO, Operand::PROTO},
+    {"src", Field::SRC, Operand::ADDR},
+    {"dst", Field::DST, Operand::ADDR},
+    {"sport", Field::SPORT, Operand::PORTS},
+    {"dport", Field::DPORT, Operand::PORTS},
+    {"packets", Field::PACKETS, Operand::COUNT},
+    {"bytes", Field::BYTES, Operand::COUNT},
+}};
+
+constexpr std::array<const char *, 8> kCmpNames = {
+    "==", "!=", "<", "<=", ">", ">=", "overlaps", "within"};
+
+auto infoOf(Field field) -> const FieldInfo & {
+  return kFields[static_cast<size_t>(field)];
+}
+
+auto cmpAllowed(Operand operand, Cmp cmp) -> bool {
+  switch (operand) {
+  case Operand::NAME:
+  case Operand::PROTO:
+    return cmp == Cmp::EQ || cmp == Cmp::NE;
+  case Operand::ADDR:
+  case Operand::PORTS:
+    return cmp == Cmp::EQ || cmp == Cmp::NE || cmp == Cmp::OVERLAPS ||
+           cmp == Cmp::WITHIN;
+  default:
+    return cmp != Cmp::OVERLAPS && cmp != Cmp::WITHIN;
+  }
+}
+
+auto prefixMask(int length) -> uint32_t {
+  return length == 0 ? 0U : ~0U << (kMaxPrefix - length);
+}
+
+auto parseNumber(string_view text, uint64_t max) -> std::optional<uint64_t> {
+  uint64_t value = 0;
+  const auto *end = text.data() + text.size();
+  auto [ptr, ec] = std::from_chars(text.data(), end, value);
+  if (text.empty() || ec != std::errc() || ptr != end || value > max) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+class Token {
+public:
+  string text_;
+  size_t offset_;
+  bool quoted_;
+};
+
+auto tokenize(string_view text) -> vector<Token> {
+  static constexpr string_view kSpecial = "()!<>=&|\"";
+  static constexpr std::array<string_view, 6> kPairs = {"&&", "||", "==",
+                                                        "!=", "<=", ">="};
+
+  vector<Token> tokens;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    if (std::isspace(static_cast<unsigned char>(text[pos])) != 0) {
+      pos++;
+      continue;
+    }
+
+    auto rest = text.substr(pos);
+    if (std::ranges::any_of(kPairs, [rest](string_view pair) {
+          return rest.starts_with(pair);
+        })) {
+      tokens.push_back({string(rest.substr(0, 2)), pos, false});
+      pos += 2;
+    } else if (text[pos] == '"') {
+      auto end = text.find('"', pos + 1);
+      if (end == string_view::npos) {
+        throw std::invalid_argument(
+            fmt::format("Unterminated quote at {}", pos));
+      }
+      tokens.push_back({string(text.substr(pos + 1, end - pos - 1)), pos,
+                        true});
+      pos = end + 1;
+    } else if (kSpecial.find(text[pos]) != string_view::npos) {
+      tokens.push_back({string(1, text[pos]), pos, false});
+      pos++;
+    } else {
+      auto end = pos;
+      while (end < text.size() &&
+             std::isspace(static_cast<unsigned char>(text[end])) == 0 &&
+             kSpecial.find(text[end]) == string_view::npos) {
+        end++;
+      }
+      tokens.push_back({string(text.substr(pos, end - pos)), pos, false});
+      pos = end;
+    }
+  }
+  return tokens;
+}
+
+/* recursive descent over the tokens, || < && < ! and parentheses */
+class Parser {
+public:
+  explicit Parser(string_view text) : tokens_(tokenize(text)) {}
+
+  auto parseQuery() -> Node {
+    if (tokens_.empty()) {
+      throw std::invalid_argument("Empty query");
+    }
+    auto node = parseOr();
+    if (pos_ < tokens_.size()) {
+      fail("Unexpected");
+    }
+    return node;
+  }
+
+private:
+  vector<Token> tokens_;
+  size_t pos_{};
+
+  [[noreturn]] auto fail(const char *what) const -> void {
+    if (pos_ >= tokens_.size()) {
+      throw std::invalid_argument(fmt::format("{} end of query", what));
+    }
+    const auto &token = tokens_[pos_];
+    throw std::invalid_argument(
+        fmt::format("{} '{}' at {}", what, token.text_, token.offset_));
+  }
+
+  [[nodiscard]] auto peek(string_view text) const -> bool {
+    return pos_ < tokens_.size() && !tokens_[pos_].quoted_ &&
+           tokens_[pos_].text_ == text;
+  }
+
+  auto next() -> const Token & {
+    if (pos_ >= tokens_.size()) {
+      fail("Unexpected");
+    }
+    return tokens_[pos_++];
+  }
+
+  auto parseList(Kind kind, string_view op, Node (Parser::*operand)())
+      -> Node {
+    auto first = (this->*operand)();
+    if (!peek(op)) {
+      return first;
+    }
+    Node node{kind};
+    node.children_.push_back(std::move(first));
+    while (peek(op)) {
+      pos_++;
+      node.children_.push_back((this->*operand)());
+    }
+    return node;
+  }
+
+  auto parseOr() -> Node {
+    return parseList(Kind::OR, "||", &Parser::parseAnd);
+  }
+
+  auto parseAnd() -> Node {
+    return parseList(Kind::AND, "&&", &Parser::parseUnary);
+  }
+
+  auto parseUnary() -> Node {
+    if (peek("!")) {
+      pos_++;
+      Node node{Kind::NOT};
+      node.children_.push_back(parseUnary());
+      return node;
+    }
+    if (peek("(")) {
+      pos_++;
+      auto node = parseOr();
+      if (!peek(")")) {
+        fail("Expected ')' instead of");
+      }
+      pos_++;
+      return node;
+    }
+    return parsePredicate();
+  }
+
+  auto parsePredicate() -> Node {
+    Node node{Kind::LEAF};
+
+    const auto &field = next();
+    const auto *info = std::ranges::find_if(kFields, [&](const auto &info) {
+      return !field.quoted_ && field.text_ == info.name_;
+    });
+    if (info == kFields.end()) {
+      pos_--;
+      fail("Unknown field");
+    }
+    node.field_ = info->field_;
+
+    const auto &cmp = next();
+    const auto *name = std::ranges::find(kCmpNames, cmp.text_);
+    if (cmp.quoted_ || name == kCmpNames.end()) {
+      pos_--;
+      fail("Expected comparison instead of");
+    }
+    node.cmp_ = static_cast<Cmp>(name - kCmpNames.begin());
+    if (!cmpAllowed(info->operand_, node.cmp_)) {
+      pos_--;
+      fail(fmt::format("Field {} does not support", info->name_).c_str());
+    }
+
+    const auto &value = next();
+    node.value_ = value.text_;
+    if (!parseValue(info->operand_, node)) {
+      pos_--;
+      fail(fmt::format("Invalid {}", info->name_).c_str());
+    }
+    return node;
+  }
+
+  static auto parseValue(Operand operand, Node &node) -> bool {
+    string_view value = node.value_;
+    switch (operand) {
+    case Operand::NAME:
+      return !value.empty();
+    case Operand::PROTO: {
+      if (auto number = parseNumber(value, kMaxProto)) {
+        node.lo_ = *number;
+        return true;
+      }
+      auto upper = string(value);
+      std::ranges::transform(upper, upper.begin(), [](unsigned char c) {
+        return static_cast<char>(std::toupper(c));
+      });
+      const auto &protos = protocols();
+      auto iter = std::ranges::find_if(protos, [&upper](const auto &proto) {
+        return std::get<0>(proto) == upper;
+      });
+      if (iter == protos.end()) {
+        return false;
+      }
+      node.lo_ = std::get<1>(*iter);
+      return true;
+    }
+    case Operand::ADDR: {
+      auto slash = value.find('/');
+      auto addr_text = string(value.substr(0, slash));
+      struct in_addr addr {};
+      if (inet_pton(AF_INET, addr_text.c_str(), &addr) != 1) {
+        return false;
+      }
+      auto length =
+          slash == string_view::npos
+              ? std::optional<uint64_t>(kMaxPrefix)
+              : parseNumber(value.substr(slash + 1), kMaxPrefix);
+      if (!length) {
+        return false;
+      }
+      auto mask = prefixMask(static_cast<int>(*length));
+      node.lo_ = ntohl(addr.s_addr) & mask;
+      node.hi_ = mask;
+      return true;
+    }
+    case Operand::PORTS: {
+      /* iptables writes ranges with ':' */
+      auto sep = value.find_first_of("-:");
+      auto lo = parseNumber(value.substr(0, sep), kMaxPort);
+      auto hi = sep == string_view::npos
+                    ? lo
+                    : parseNumber(value.substr(sep + 1), kMaxPort);
+      if (!lo || !hi || *lo > *hi) {
+        return false;
+      }
+      node.lo_ = *lo;
+      node.hi_ = *hi;
+      return true;
+    }
+    default: {
+      auto number = parseNumber(value, UINT64_MAX);
+      node.lo_ = number.value_or(0);
+      return number.has_value();
+    }
+    }
+  }
+};
+
+enum class Tri : uint8_t { NO, YES, MAYBE };
+
+auto tableTruth(const Node &node, const string &table) -> Tri {
+  switch (node.kind_) {
+  case Kind::LEAF:
+    if (node.field_ != Field::TABLE) {
+      return Tri::MAYBE;
+    }
+    return (node.value_ == table) == (node.cmp_ == Cmp::EQ) ? Tri::YES
+                                                             : Tri::NO;
+  case Kind::NOT: {
+    auto truth = tableTruth(node.children_.front(), table);
+    return truth == Tri::MAYBE ? truth
+           : truth == Tri::YES ? Tri::NO
+                               : Tri::YES;
+  }
+  default: {
+    /* NO absorbs AND, YES absorbs OR */
+    auto absorbing = node.kind_ == Kind::AND ? Tri::NO : Tri::YES;
+    auto result = node.kind_ == Kind::AND ? Tri::YES : Tri::NO;
+    for (const auto &child : node.children_) {
+      auto truth = tableTruth(child, table);
+      if (truth == absorbing) {
+        return absorbing;
+      }
+      if (truth == Tri::MAYBE) {
+        result = Tri::MAYBE;
+      }
+    }
+    return result;
+  }
+  }
+}
+
+/* step of a query bound to one model */
+enum class Op : uint8_t {
+  FALSE,
+  TRUE,
+  AND,
+  OR,
+  NOT,
+  ROWS,  /* row in [lo_, hi_), from chain predicates */
+  PROTO, /* lo_ == proto */
+  LUT,   /* lut_[column] for target and interface ids */
+  ADDR,
+  PORTS,
+  COUNT
+};
+
+class Step {
+public:
+  Op op_;
+  Cmp cmp_{};
+  uint64_t lo_{};
+  uint64_t hi_{};
+
+  /* columns read by the step */
+  const uint16_t *ids_{};
+  const uint32_t *addr_{};
+  const uint32_t *mask_{};
+  const uint16_t *port_lo_{};
+  const uint16_t *port_hi_{};
+  const uint64_t *count_{};
+  vector<uint8_t> lut_;
+
+  /* bytes read per row, operands are evaluated cheapest first */
+  size_t cost_{};
+
+  string label_;
+  vector<Step> children_;
+};
+
+auto constant(bool value) -> Step {
+  return {value ? Op::TRUE : Op::FALSE};
+}
+
+auto bindLeaf(const Node &node, const RulesetModel &model) -> Step {
+  Step step{Op::FALSE, node.cmp_, node.lo_, node.hi_};
+  step.label_ = fmt::format("{} {} {}", infoOf(node.field_).name_,
+                            kCmpNames[static_cast<size_t>(node.cmp_)],
+                            node.value_);
+  auto negate = node.cmp_ == Cmp::NE;
+
+  auto bindIds = [&](const StringPool &pool, const vector<uint16_t> &column,
+                     auto &&matches) {
+    step.op_ = Op::LUT;
+    step.ids_ = column.data();
+    step.lut_.resize(pool.size());
+    for (uint32_t id = 0; id < pool.size(); id++) {
+      step.lut_[id] = static_cast<uint8_t>(matches(id) != negate);
+    }
+    step.cost_ = sizeof(uint16_t);
+  };
+
+  switch (node.field_) {
+  case Field::TABLE:
+    return constant((model.table_ == node.value_) != negate);
+  case Field::CHAIN: {
+    auto chain = model.findChain(node.value_);
+    if (!chain) {
+      return constant(negate);
+    }
+    step.op_ = Op::ROWS;
+    step.lo_ = model.chains_[*chain].begin_;
+    step.hi_ = model.chains_[*chain].end_;
+    if (!negate) {
+      return step;
+    }
+    Step inverse{Op::NOT};
+    inverse.label_ = "!";
+    inverse.children_.push_back(std::move(step));
+    return inverse;
+  }
+  case Field::TARGET: {
+    /* lut is indexed by target id, not by name id */
+    step.op_ = Op::LUT;
+    step.ids_ = model.target_.data();
+    step.lut_.resize(model.targets_.size());
+    for (size_t id = 0; id < model.targets_.size(); id++) {
+      const auto &name = model.names_.get(model.targets_[id].name_);
+      step.lut_[id] = static_cast<uint8_t>((name == node.value_) != negate);
+    }
+    step.cost_ = sizeof(uint16_t);
+    break;
+  }
+  case Field::IN:
+  case Field::OUT: {
+    auto id = model.ifaces_.find(node.value_);
+    bindIds(model.ifaces_,
+            node.field_ == Field::IN ? model.iniface_ : model.outiface_,
+            [&id](uint32_t other) { return id && *id == other; });
+    break;
+  }
+  case Field::PROTO:
+    step.op_ = Op::PROTO;
+    step.cost_ = sizeof(uint8_t);
+    break;
+  case Field::SRC:
+  case Field::DST: {
+    auto src = node.field_ == Field::SRC;
+    step.op_ = Op::ADDR;
+    step.addr_ = src ? model.src_.data() : model.dst_.data();
+    step.mask_ = src ? model.smsk_.data() : model.dmsk_.data();
+    step.cost_ = 2 * sizeof(uint32_t);
+    break;
+  }
+  case Field::SPORT:
+  case Field::DPORT: {
+    auto src = node.field_ == Field::SPORT;
+    step.op_ = Op::PORTS;
+    step.port_lo_ = src ? model.sport_lo_.data() : model.dport_lo_.data();
+    step.port_hi_ = src ? model.sport_hi_.data() : model.dport_hi_.data();
+    step.cost_ = 2 * sizeof(uint16_t);
+    break;
+  }
+  default:
+    step.op_ = Op::COUNT;
+    step.count_ = node.field_ == Field::PACKETS ? model.pcnt_.data()
+                                                : model.bcnt_.data();
+    step.cost_ = sizeof(uint64_t);
+    break;
+  }
+
+  /* id not used by any rule */
+  if (step.op_ == Op::LUT) {
+    if (std::ranges::none_of(step.lut_, [](uint8_t hit) { return hit; })) {
+      return constant(false);
+    }
+    if (std::ranges::all_of(step.lut_, [](uint8_t hit) { return hit; })) {
+      return constant(true);
+    }
+  }
+  return step;
+}
+
+auto bind(const Node &node, const RulesetModel &model) -> Step {
+  if (node.kind_ == Kind::LEAF) {
+    return bindLeaf(node, model);
+  }
+
+  if (node.kind_ == Kind::NOT) {
+    auto child = bind(node.children_.front(), model);
+    if (child.op_ == Op::TRUE || child.op_ == Op::FALSE) {
+      return constant(child.op_ == Op::FALSE);
+    }
+    if (child.op_ == Op::NOT) {
+      return std::move(child.children_.front());
+    }
+    Step step{Op::NOT};
+    step.label_ = "!";
+    step.cost_ = child.cost_;
+    step.children_.push_back(std::move(child));
+    return step;
+  }
+
+  /* FALSE absorbs AND and is dropped from OR, TRUE the other way round */
+  auto is_and = node.kind_ == Kind::AND;
+  auto absorbing = is_and ? Op::FALSE : Op::TRUE;
+  auto neutral = is_and ? Op::TRUE : Op::FALSE;
+  Step step{is_and ? Op::AND : Op::OR};
+  step.label_ = is_and ? "&&" : "||";
+  for (const auto &child : node.children_) {
+    auto bound = bind(child, model);
+    if (bound.op_ == absorbing) {
+      return bound;
+    }
+    if (bound.op_ == neutral) {
+      continue;
+    }
+    step.cost_ += bound.cost_;
+    step.children_.push_back(std::move(bound));
+  }
+  if (step.children_.empty()) {
+    return constant(is_and);
+  }
+  if (step.children_.size() == 1) {
+    return std::move(step.children_.front());
+  }
+  std::ranges::stable_sort(step.children_, {}, &Step::cost_);
+  return step;
+}
+
+/* narrow [begin, end) by the row ranges the whole plan requires */
+auto pushDownRows(Step &plan, uint64_t &begin, uint64_t &end) -> void {
+  auto narrow = [&begin, &end](const Step &rows) {
+    begin = std::max(begin, rows.lo_);
+    end = std::min(end, rows.hi_);
+  };
+
+  if (plan.op_ == Op::ROWS) {
+    narrow(plan);
+    plan = constant(true);
+  } else if (plan.op_ == Op::AND) {
+    for (const auto &child : plan.children_) {
+      if (child.op_ == Op::ROWS) {
+        narrow(child);
+      }
+    }
+    std::erase_if(plan.children_,
+                  [](const Step &child) { return child.op_ == Op::ROWS; });
+    if (plan.children_.empty()) {
+      plan = constant(true);
+    } else if (plan.children_.size() == 1) {
+      auto child = std::move(plan.children_.front());
+      plan = std::move(child);
+    }
+  }
+  if (begin >= end) {
+    plan = constant(false);
+  }
+}
+
+/* one loop per comparison so that each body is branch free */
+template <typename Pred>
+auto fill(uint8_t *out, uint32_t count, Pred pred) -> void {
+  for (uint32_t i = 0; i < count; i++) {
+    out[i] = static_cast<uint8_t>(pred(i));
+  }
+}
+
+template <typename T>
+auto compare(Cmp cmp, uint8_t *out, uint32_t count, const T *column,
+             uint64_t value) -> void {
+  switch (cmp) {
+  case Cmp::EQ:
+    fill(out, count, [&](uint32_t i) { return column[i] == value; });
+    break;
+  case Cmp::NE:
+    fill(out, count, [&](uint32_t i) { return column[i] != value; });
+    break;
+  case Cmp::LT:
+    fill(out, count, [&](uint32_t i) { return column[i] < value; });
+    break;
+  case Cmp::LE:
+    fill(out, count, [&](uint32_t i) { return column[i] <= value; });
+    break;
+  case Cmp::GT:
+    fill(out, count, [&](uint32_t i) { return column[i] > value; });
+    break;
+  default:
+    fill(out, count, [&](uint32_t i) { return column[i] >= value; });
+    break;
+  }
+}
+
+auto any(const uint8_t *mask, uint32_t count) -> bool {
+  uint8_t acc = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    acc |= mask[i];
+  }
+  return acc != 0;
+}
+
+auto all(const uint8_t *mask, uint32_t count) -> bool {
+  uint8_t acc = 1;
+  for (uint32_t i = 0; i < count; i++) {
+    acc &= mask[i];
+  }
+  return acc != 0;
+}
+
+/* evaluates a plan block by block, one scratch mask per nesting level */
+class Executor {
+public:
+  auto eval(const Step &step, uint32_t begin, uint32_t count, uint8_t *out,
+            size_t depth) -> void {
+    switch (step.op_) {
+    case Op::FALSE:
+    case Op::TRUE:
+      std::fill_n(out, count, static_cast<uint8_t>(step.op_ == Op::TRUE));
+      break;
+    case Op::AND:
+    case Op::OR:
+      evalList(step, begin, count, out, depth);
+      break;
+    case Op::NOT:
+      eval(step.children_.front(), begin, count, out, depth + 1);
+      for (uint32_t i = 0; i < count; i++) {
+        out[i] ^= 1U;
+      }
+      break;
+    case Op::ROWS:
+      fill(out, count, [&](uint32_t i) {
+        return (begin + i >= step.lo_) & (begin + i < step.hi_);
+      });
+      break;
+    case Op::PROTO:
+      compare(step.cmp_, out, count, proto_ + begin, step.lo_);
+      break;
+    case Op::LUT: {
+      const auto *ids = step.ids_ + begin;
+      const auto *lut = step.lut_.data();
+      fill(out, count, [&](uint32_t i) { return lut[ids[i]]; });
+      break;
+    }
+    case Op::ADDR:
+      evalAddr(step, begin, count, out);
+      break;
+    case Op::PORTS:
+      evalPorts(step, begin, count, out);
+      break;
+    default:
+      compare(step.cmp_, out, count, step.count_ + begin, step.lo_);
+      break;
+    }
+  }
+
+  explicit Executor(const RulesetModel &model) : proto_(model.proto_.data()) {}
+
+private:
+  const uint8_t *proto_;
+  vector<vector<uint8_t>> scratch_;
+
+  auto scratch(size_t depth) -> uint8_t * {
+    if (scratch_.size() <= depth) {
+      scratch_.resize(depth + 1, vector<uint8_t>(RuleQuery::kBlock));
+    }
+    return scratch_[depth].data();
+  }
+
+  auto evalList(const Step &step, uint32_t begin, uint32_t count,
+                uint8_t *out, size_t depth) -> void {
+    auto is_and = step.op_ == Op::AND;
+    eval(step.children_.front(), begin, count, out, depth + 1);
+    for (size_t child = 1; child < step.children_.size(); child++) {
+      /* later operands are skipped once the block is decided */
+      if (is_and ? !any(out, count) : all(out, count)) {
+        return;
+      }
+      auto *mask = scratch(depth);
+      eval(step.children_[child], begin, count, mask, depth + 1);
+      if (is_and) {
+        for (uint32_t i = 0; i < count; i++) {
+          out[i] &= mask[i];
+        }
+      } else {
+        for (uint32_t i = 0; i < count; i++) {
+          out[i] |= mask[i];
+        }
+      }
+    }
+  }
+
+  static auto evalAddr(const Step &step, uint32_t begin, uint32_t count,
+                       uint8_t *out) -> void {
+    const auto *addr = step.addr_ + begin;
+    const auto *mask = step.mask_ + begin;
+    auto network = static_cast<uint32_t>(step.lo_);
+    auto prefix = static_cast<uint32_t>(step.hi_);
+    switch (step.cmp_) {
+    case Cmp::EQ:
+      fill(out, count, [&](uint32_t i) {
+        return ((addr[i] & mask[i]) == network) & (mask[i] == prefix);
+      });
+      break;
+    case Cmp::NE:
+      fill(out, count, [&](uint32_t i) {
+        return ((addr[i] & mask[i]) != network) | (mask[i] != prefix);
+      });
+      break;
+    case Cmp::OVERLAPS:
+      fill(out, count, [&](uint32_t i) {
+        return ((addr[i] ^ network) & mask[i] & prefix) == 0;
+      });
+      break;
+    default:
+      fill(out, count, [&](uint32_t i) {
+        return ((mask[i] & prefix) == prefix) &
+               (((addr[i] ^ network) & prefix) == 0);
+      });
+      break;
+    }
+  }
+
+  static auto evalPorts(const Step &step, uint32_t begin, uint32_t count,
+                        uint8_t *out) -> void {
+    const auto *lo = step.port_lo_ + begin;
+    const auto *hi = step.port_hi_ + begin;
+    auto query_lo = static_cast<uint16_t>(step.lo_);
+    auto query_hi = static_cast<uint16_t>(step.hi_);
+    switch (step.cmp_) {
+    case Cmp::EQ:
+      fill(out, count, [&](uint32_t i) {
+        return (lo[i] == query_lo) & (hi[i] == query_hi);
+      });
+      break;
+    case Cmp::NE:
+      fill(out, count, [&](uint32_t i) {
+        return (lo[i] != query_lo) | (hi[i] != query_hi);
+      });
+      break;
+    case Cmp::OVERLAPS:
+      fill(out, count, [&](uint32_t i) {
+        return (lo[i] <= query_hi) & (query_lo <= hi[i]);
+      });
+      break;
+    default:
+      fill(out, count, [&](uint32_t i) {
+        return (query_lo <= lo[i]) & (hi[i] <= query_hi);
+      });
+      break;
+    }
+  }
+};
+
+auto describe(const Step &step, size_t depth, string &output) -> void {
+  string label;
+  switch (step.op_) {
+  case Op::FALSE:
+    label = "false";
+    break;
+  case Op::TRUE:
+    label = "true";
+    break;
+  case Op::ROWS:
+    label = fmt::format("rows [{}, {})", step.lo_, step.hi_);
+    break;
+  default:
+    label = step.label_;
+    break;
+  }
+  output += fmt::format("{:{}}{} (cost {})\n", "", 2 * depth, label,
+                        step.cost_);
+  for (const auto &child : step.children_) {
+    describe(child, depth + 1, output);
+  }
+}
+
+} // namespace
+
+auto RuleQuery::parse(string_view text) -> RuleQuery {
+  RuleQuery query;
+  query.root_ = Parser(text).parseQuery();
+  return query;
+}
+
+auto RuleQuery::mayMatchTable(const string &table) const -> bool {
+  return tableTruth(root_, table) != Tri::NO;
+}
+
+auto RuleQuery::run(const RulesetModel &model, const Sink &sink,
+                    QueryStat &stat) const -> void {
+  uint64_t begin = 0;
+  uint64_t end = model.size();
+  auto plan = bind(root_, model);
+  pushDownRows(plan, begin, end);
+  stat.tables_++;
+  if (plan.op_ == Op::FALSE) {
+    return;
+  }
+
+  Executor executor(model);
+  std::array<uint8_t, kBlock> mask{};
+  for (auto block = static_cast<uint32_t>(begin); block < end;
+       block += kBlock) {
+    auto count =
+        static_cast<uint32_t>(std::min<uint64_t>(kBlock, end - block));
+    stat.scanned_ += count;
+    executor.eval(plan, block, count, mask.data(), 0);
+    for (uint32_t i = 0; i < count; i++) {
+      if (mask[i] == 0) {
+        continue;
+      }
+      stat.matched_++;
+      if (!sink(model, block + i)) {
+        stat.stopped_ = true;
+        return;
+      }
+    }
+  }
+}
+
+auto RuleQuery::explain(const RulesetModel &model) const -> string {
+  uint64_t begin = 0;
+  uint64_t end = model.size();
+  auto plan = bind(root_, model);
+  pushDownRows(plan, begin, end);
+
+  string output;
+  if (plan.op_ == Op::FALSE) {
+    output = "no rule can match\n";
+    return output;
+  }
+  output = fmt::format("scan rows [{}, {}) of {}\n", begin, end, model.size());
+  describe(plan, 1, output);
+  return output;
+}
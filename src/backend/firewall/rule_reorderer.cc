@@ -0,0 +1,83 @@
+#include "backend/firewall/rule_reorderer.h"
+#include "backend/firewall/rule_space.h"
+#include "fmt/format.h"
+
+#include <optional>
+
+using std::optional;
+
+namespace {
+
+/* expected position of the matching rule, 1 based */
+auto averagePosition(const RulesetModel &model, const ModelChain &chain,
+                     const vector<int> &order) -> double {
+  double hits = 0;
+  double evaluated = 0;
+  for (size_t position = 0; position < order.size(); position++) {
+    auto pcnt = static_cast<double>(model.pcnt_[chain.begin_ + order[position]]);
+    hits += pcnt;
+    evaluated += pcnt * static_cast<double>(position + 1);
+  }
+  return hits == 0 ? 0 : evaluated / hits;
+}
+
+} // namespace
+
+auto ReorderPlan::summary() const -> string {
+  return fmt::format("{} rules moved, rules evaluated per matched packet "
+                     "{:.1f} -> {:.1f}",
+                     moved_, before_avg_, after_avg_);
+}
+
+auto RuleReorderer::plan(const RulesetModel &model,
+                         uint32_t chain) -> ReorderPlan {
+  const auto &model_chain = model.chains_[chain];
+  auto begin = model_chain.begin_;
+
+  vector<optional<RuleSpace>> spaces;
+  for (auto row = begin; row < model_chain.end_; row++) {
+    spaces.push_back(RuleSpace::fromRow(model, row));
+  }
+
+  /* swapping keeps the verdict of every packet */
+  auto commutes = [&](int earlier, int later) {
+    const auto &a = spaces[earlier];
+    const auto &b = spaces[later];
+    if (!a || !b) {
+      return false;
+    }
+    if (!a->overlaps(*b, model.ifaces_)) {
+      return true;
+    }
+    /* extension targets of same name may still differ in options */
+    auto target = model.target_[begin + earlier];
+    return target == model.target_[begin + later] &&
+           model.targets_[target].kind_ != TargetKind::EXTENSION;
+  };
+  auto pcnt = [&](int index) { return model.pcnt_[begin + index]; };
+
+  ReorderPlan plan;
+  plan.chain_ = model.names_.get(model_chain.name_);
+
+  /* insertion sort by counter, a rule stops at the first rule it cannot
+   * pass, so the relative order of conflicting rules never changes */
+  auto size = static_cast<int>(model_chain.size());
+  for (int index = 0; index < size; index++) {
+    auto position = plan.order_.size();
+    while (position > 0 && pcnt(plan.order_[position - 1]) < pcnt(index) &&
+           commutes(plan.order_[position - 1], index)) {
+      position--;
+    }
+    plan.order_.insert(plan.order_.begin() + static_cast<long>(position),
+                       index);
+  }
+
+  vector<int> identity(plan.order_.size());
+  for (int index = 0; index < size; index++) {
+    identity[index] = index;
+    plan.moved_ += plan.order_[index] != index ? 1 : 0;
+  }
+  plan.before_avg_ = averagePosition(model, model_chain, identity);
+  plan.after_avg_ = averagePosition(model, model_chain, plan.order_);
+  return plan;
+}
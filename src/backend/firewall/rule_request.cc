@@ -1,14 +1,86 @@
 #include "backend/firewall/rule_request.h"
+#include "backend/firewall/ipset.h"
 #include "fmt/format.h"
 #include "tools/log.h"
 #include "tools/nettools.h"
 #include <arpa/inet.h>
 #include <cstring>
 #include <libiptc/libiptc.h>
+#include <linux/netfilter/xt_CT.h>
+#include <linux/netfilter/xt_NFQUEUE.h>
+#include <linux/netfilter/xt_bpf.h>
+#include <linux/netfilter/xt_set.h>
 #include <optional>
 #include <string>
 #include <utility>
 
+namespace {
+constexpr int kIPTEntrySize = XT_ALIGN(sizeof(struct ipt_entry));
+constexpr int kTCPMatchSize =
+    XT_ALIGN(sizeof(struct ipt_entry_match) + sizeof(struct ipt_tcp));
+constexpr int kUDPMatchSize =
+    XT_ALIGN(sizeof(struct ipt_entry_match) + sizeof(struct ipt_udp));
+constexpr int kIPTEntryTargetSize =
+    XT_ALIGN(sizeof(struct ipt_entry_target)) + XT_ALIGN(sizeof(int));
+constexpr int kMatchSize = kTCPMatchSize;
+constexpr int kSetMatchSize = XT_ALIGN(sizeof(struct ipt_entry_match) +
+                                       sizeof(struct xt_set_info_match_v1));
+
+/* revision 1 and later of the set match start with xt_set_info */
+constexpr int kSetMatchRevision = 1;
+
+constexpr int kBpfMatchSize =
+    XT_ALIGN(sizeof(struct ipt_entry_match) + sizeof(struct xt_bpf_info));
+
+/* revision 0 has no timeout policy, flags and zone are at the same place in
+ * all revisions */
+constexpr int kCtTargetSize = XT_ALIGN(sizeof(struct ipt_entry_target) +
+                                       sizeof(struct xt_ct_target_info));
+
+/* revision 3 has balancing, bypass and cpu fanout */
+constexpr int kNfqueueTargetSize = XT_ALIGN(sizeof(struct ipt_entry_target) +
+                                            sizeof(struct xt_NFQ_info_v3));
+constexpr int kNfqueueRevision = 3;
+
+/* standard targets, written as verdicts, empty target falls through */
+auto isVerdict(const string &target) -> bool {
+  return target.empty() || target == IPTC_LABEL_ACCEPT ||
+         target == IPTC_LABEL_DROP || target == IPTC_LABEL_QUEUE ||
+         target == IPTC_LABEL_RETURN;
+}
+
+auto targetSize(const string &target) -> int {
+  if (target == RequestTarget::CT) {
+    return kCtTargetSize;
+  }
+  if (target == RequestTarget::NFQUEUE) {
+    return kNfqueueTargetSize;
+  }
+  return kIPTEntryTargetSize;
+}
+
+/* options of every revision, earlier revisions are prefixes of the next */
+auto decodeNfqueue(const struct ipt_entry_target *target) -> NfqueueTarget {
+  NfqueueTarget options;
+  const auto *info = reinterpret_cast<const xt_NFQ_info_v3 *>(target->data);
+  options.queue_num_ = info->queuenum;
+  auto revision = target->u.user.revision;
+  if (revision >= 1) {
+    options.queues_total_ = info->queues_total;
+  }
+  if (revision == 2) {
+    options.bypass_ = info->flags != 0;
+  } else if (revision >= 3) {
+    options.bypass_ = (info->flags & NFQ_FLAG_BYPASS) != 0;
+    options.cpu_fanout_ = (info->flags & NFQ_FLAG_CPU_FANOUT) != 0;
+  }
+  return options;
+}
+
+static_assert(kTCPMatchSize == kUDPMatchSize,
+              "reconsider the code iff tcp and udp match sizes are different");
+} // namespace
+
 RuleRequest::RuleRequest(iptc_handle *handle, const struct ipt_entry *rule,
                          int index) {
   index_ = index;
@@ -18,7 +90,8 @@ RuleRequest::RuleRequest(iptc_handle *handle, const struct ipt_entry *rule,
   dst_ip_ = fmt::to_string(inet_ntoa(rule->ip.dst));
   dst_mask_ = fmt::to_string(inet_ntoa(rule->ip.dmsk));
 
-  proto_ = proto2String(rule->ip.proto);
+  proto_ = rule->ip.proto == IPPROTO_IP ? RequestProto::ALL
+                                         : proto2String(rule->ip.proto);
   if (strlen(rule->ip.iniface) > 0) {
     iniface_ = string(rule->ip.iniface);
   }
@@ -28,6 +101,28 @@ RuleRequest::RuleRequest(iptc_handle *handle, const struct ipt_entry *rule,
   const auto *match = reinterpret_cast<const ipt_entry_match *>(rule->elems);
   while (reinterpret_cast<const char *>(match) !=
          reinterpret_cast<const char *>(rule) + rule->target_offset) {
+    if (strcmp(match->u.user.name, "set") == 0 &&
+        match->u.user.revision >= kSetMatchRevision) {
+      const auto *info = reinterpret_cast<const xt_set_info *>(match->data);
+      set_match_ = SetMatch{
+          Ipset::nameOf(info->index).value_or(std::to_string(info->index)),
+          (info->flags & IPSET_DIM_ONE_SRC) != 0};
+      match = reinterpret_cast<const ipt_entry_match *>(
+          reinterpret_cast<const char *>(match) + match->u.match_size);
+      continue;
+    }
+    if (strcmp(match->u.user.name, "bpf") == 0 &&
+        match->u.user.revision == 0) {
+      const auto *info = reinterpret_cast<const xt_bpf_info *>(match->data);
+      auto size = std::min<size_t>(info->bpf_program_num_elem,
+                                   XT_BPF_MAX_NUM_INSTR);
+      bpf_match_ = BpfMatch{vector<struct sock_filter>(
+          info->bpf_program, info->bpf_program + size)};
+      match = reinterpret_cast<const ipt_entry_match *>(
+          reinterpret_cast<const char *>(match) + match->u.match_size);
+      continue;
+    }
+
     RuleMatch rule_match;
 
     if (rule->ip.proto == IPPROTO_TCP) {
@@ -52,47 +147,69 @@ RuleRequest::RuleRequest(iptc_handle *handle, const struct ipt_entry *rule,
   if (rule->target_offset != rule->next_offset) {
     target_ = iptc_get_target(rule, handle);
   }
+  const auto *target = reinterpret_cast<const ipt_entry_target *>(
+      reinterpret_cast<const char *>(rule) + rule->target_offset);
+  if (target_ == RequestTarget::CT) {
+    const auto *info =
+        reinterpret_cast<const xt_ct_target_info *>(target->data);
+    ct_target_ = CtTarget{(info->flags & XT_CT_NOTRACK) != 0, info->zone};
+  } else if (target_ == RequestTarget::NFQUEUE) {
+    nfqueue_target_ = decodeNfqueue(target);
+  }
 }
 
-auto RuleRequest::to_entry_bytes(const ctx_t &context)
+auto RuleRequest::to_entry_bytes(const ctx_t &context,
+                                 const ChainLookup &is_chain)
     -> optional<vector<char>> {
-  static constexpr int kIPTEntrySize = XT_ALIGN(sizeof(struct ipt_entry));
-  static constexpr int kTCPMatchSize =
-      XT_ALIGN(sizeof(struct ipt_entry_match) + sizeof(struct ipt_tcp));
-  static constexpr int kUDPMatchSize =
-      XT_ALIGN(sizeof(struct ipt_entry_match) + sizeof(struct ipt_udp));
-  static constexpr int kIPTEntryTargetSize =
-      XT_ALIGN(sizeof(struct ipt_entry_target)) + XT_ALIGN(sizeof(int));
-  static constexpr int kMatchSize = kTCPMatchSize;
+  std::vector<char> entry_buffer(entry_size(), 0);
+  if (!write_entry_bytes(context, entry_buffer.data(), is_chain)) {
+    return std::nullopt;
+  }
+
+  return entry_buffer;
+}
+
+auto RuleRequest::entry_size() const -> size_t {
+  auto matches_number = static_cast<int>(matches_.size());
+  auto set_size = set_match_.has_value() ? kSetMatchSize : 0;
+  auto bpf_size = bpf_match_.has_value() ? kBpfMatchSize : 0;
+  return kIPTEntrySize + targetSize(target_) + kMatchSize * matches_number +
+         set_size + bpf_size;
+}
+
+auto RuleRequest::write_entry_bytes(const ctx_t &context, char *buffer,
+                                    const ChainLookup &is_chain) -> bool {
   static constexpr int kByteMask = 0xFF;
   static constexpr int max_port = 0xFFFF;
 
-  static_assert(
-      kTCPMatchSize == kUDPMatchSize,
-      "reconsider the code iff tcp and udp match sizes are different");
-
   /* calculate size of the entry */
   auto matches_number = static_cast<int>(matches_.size());
-  auto size = kIPTEntrySize + kIPTEntryTargetSize + kMatchSize * matches_number;
+  auto size = static_cast<int>(entry_size());
+  auto target_size = targetSize(target_);
+  auto target_offset = size - target_size;
 
-  std::vector<char> entry_buffer(size, 0);
-  auto *entry = reinterpret_cast<struct ipt_entry *>(entry_buffer.data());
-  auto *target_entry = reinterpret_cast<struct ipt_entry_target *>(
-      entry_buffer.data() + kIPTEntrySize +
-      static_cast<long>(kMatchSize * matches_number));
+  memset(buffer, 0, size);
+  auto *entry = reinterpret_cast<struct ipt_entry *>(buffer);
+  auto *target_entry =
+      reinterpret_cast<struct ipt_entry_target *>(buffer + target_offset);
 
   /* Part I: ipt_entry */
   entry->next_offset = size;
-  entry->target_offset = kIPTEntrySize + kMatchSize * matches_number;
+  entry->target_offset = target_offset;
 
   if (proto_ == RequestProto::TCP) {
     entry->ip.proto = IPPROTO_TCP;
   } else if (proto_ == RequestProto::UDP) {
     entry->ip.proto = IPPROTO_UDP;
+  } else if (proto_ == RequestProto::ALL && matches_.empty()) {
+    entry->ip.proto = IPPROTO_IP;
+  } else if (proto_ == RequestProto::ALL) {
+    context->setLastError("Port matches need protocol TCP or UDP\n");
+    return false;
   } else {
     auto msg = fmt::format("Unknown protocol: {}\n", proto_);
     context->setLastError(msg);
-    return std::nullopt;
+    return false;
   }
 
   /* src/dst ip and mask */
@@ -114,14 +231,26 @@ auto RuleRequest::to_entry_bytes(const ctx_t &context)
   setIp(dst_ip_, entry->ip.dst, false);
   setIp(dst_mask_, entry->ip.dmsk, true);
 
-  /* iface */
-  if (iniface_.has_value()) {
-    strncpy(entry->ip.iniface, iniface_->c_str(), IFNAMSIZ);
-    memset(entry->ip.iniface_mask, kByteMask, iniface_->size() + 1);
-  }
-  if (outiface_.has_value()) {
-    strncpy(entry->ip.outiface, outiface_->c_str(), IFNAMSIZ);
-    memset(entry->ip.outiface_mask, kByteMask, outiface_->size() + 1);
+  /* iface, name ending with '+' matches every interface with the prefix */
+  auto setIface = [&context](const optional<string> &iface, char *name,
+                             unsigned char *mask) {
+    if (!iface.has_value()) {
+      return true;
+    }
+    if (iface->size() >= IFNAMSIZ) {
+      context->setLastError(
+          fmt::format("Interface name too long: {}", *iface));
+      return false;
+    }
+    strncpy(name, iface->c_str(), IFNAMSIZ);
+    auto wildcard = !iface->empty() && iface->back() == '+';
+    memset(mask, kByteMask,
+           wildcard ? iface->size() - 1 : iface->size() + 1);
+    return true;
+  };
+  if (!setIface(iniface_, entry->ip.iniface, entry->ip.iniface_mask) ||
+      !setIface(outiface_, entry->ip.outiface, entry->ip.outiface_mask)) {
+    return false;
   }
 
   /* we cannot use array here, assert no overflow todo */
@@ -160,14 +289,103 @@ auto RuleRequest::to_entry_bytes(const ctx_t &context)
     }
   }
 
-  /* Part III: target */
-  target_entry->u.user.target_size = kIPTEntryTargetSize;
-  if (target_.empty() ||
-      std::any_of(iptTargets().begin(), iptTargets().end(),
-                  [this](const auto &target) { return target == target_; })) {
-    strncpy(target_entry->u.user.name, target_.c_str(),
-            IPT_FUNCTION_MAXNAMELEN);
+  /* set and bpf matches after the port matches */
+  auto *next_match =
+      entry->elems + static_cast<ptrdiff_t>(kMatchSize * matches_number);
+
+  /* the kernel refers to sets by index */
+  if (set_match_.has_value()) {
+    auto index = Ipset::indexOf(set_match_->name_);
+    if (!index) {
+      context->setLastError(fmt::format("Unknown set: {}", set_match_->name_));
+      return false;
+    }
+    auto *match = reinterpret_cast<struct ipt_entry_match *>(next_match);
+    next_match += kSetMatchSize;
+    match->u.user.match_size = kSetMatchSize;
+    strncpy(match->u.user.name, "set", sizeof(match->u.user.name));
+    match->u.user.revision = kSetMatchRevision;
+
+    auto *info = reinterpret_cast<struct xt_set_info_match_v1 *>(match->data);
+    info->match_set.index = *index;
+    info->match_set.dim = IPSET_DIM_ONE;
+    info->match_set.flags = set_match_->src_ ? IPSET_DIM_ONE_SRC : 0;
   }
 
-  return entry_buffer;
+  if (bpf_match_.has_value()) {
+    const auto &program = bpf_match_->program_;
+    if (program.empty() || program.size() > XT_BPF_MAX_NUM_INSTR) {
+      context->setLastError(fmt::format("BPF program of {} instructions",
+                                        program.size()));
+      return false;
+    }
+    auto *match = reinterpret_cast<struct ipt_entry_match *>(next_match);
+    match->u.user.match_size = kBpfMatchSize;
+    strncpy(match->u.user.name, "bpf", sizeof(match->u.user.name));
+
+    auto *info = reinterpret_cast<struct xt_bpf_info *>(match->data);
+    info->bpf_program_num_elem = program.size();
+    std::ranges::copy(program, info->bpf_program);
+  }
+
+  /* Part III: target, name of user chain makes a jump */
+  if (!isVerdict(target_) && target_ != RequestTarget::CT &&
+      target_ != RequestTarget::NFQUEUE && !is_chain(target_)) {
+    context->setLastError(
+        fmt::format("Unknown target: {}, neither a verdict, a supported "
+                    "extension nor a user chain",
+                    target_));
+    return false;
+  }
+  target_entry->u.user.target_size = target_size;
+  if (target_.size() >= sizeof(target_entry->u.user.name)) {
+    context->setLastError(fmt::format("Target name too long: {}", target_));
+    return false;
+  }
+  strncpy(target_entry->u.user.name, target_.c_str(),
+          sizeof(target_entry->u.user.name) - 1);
+
+  if (target_ == RequestTarget::CT) {
+    auto options = ct_target_.value_or(CtTarget{});
+    auto *info =
+        reinterpret_cast<struct xt_ct_target_info *>(target_entry->data);
+    info->flags = options.notrack_ ? XT_CT_NOTRACK : 0;
+    info->zone = options.zone_;
+  } else if (target_ == RequestTarget::NFQUEUE) {
+    auto options = nfqueue_target_.value_or(NfqueueTarget{});
+    auto last = options.queue_num_ + options.queues_total_ - 1;
+    if (options.queues_total_ == 0 || last > UINT16_MAX) {
+      context->setLastError(fmt::format("Invalid queue range: {}+{}",
+                                        options.queue_num_,
+                                        options.queues_total_));
+      return false;
+    }
+    if (options.cpu_fanout_ && options.queues_total_ < 2) {
+      context->setLastError("CPU fanout needs a balanced queue range");
+      return false;
+    }
+    target_entry->u.user.revision = kNfqueueRevision;
+    auto *info = reinterpret_cast<struct xt_NFQ_info_v3 *>(target_entry->data);
+    info->queuenum = options.queue_num_;
+    info->queues_total = options.queues_total_;
+    info->flags = (options.bypass_ ? NFQ_FLAG_BYPASS : 0) |
+                  (options.cpu_fanout_ ? NFQ_FLAG_CPU_FANOUT : 0);
+  }
+
+  return true;
+}
+
+auto iptTargets() -> vector<string> {
+  static vector<string> r = {IPTC_LABEL_ACCEPT, IPTC_LABEL_DROP,
+                             IPTC_LABEL_QUEUE, RequestTarget::NFQUEUE,
+                             IPTC_LABEL_RETURN};
+  return r;
+}
+
+auto iptTargets(const string &table) -> vector<string> {
+  auto targets = iptTargets();
+  if (table == "raw") {
+    targets.emplace_back(RequestTarget::CT);
+  }
+  return targets;
 }
@@ -0,0 +1,459 @@
+#include "backend/firewall/rule_search.h"
+#include "fmt/format.h"
+#include "tools/nettools.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <iterator>
+#include <stdexcept>
+
+namespace {
+
+constexpr int kMaxPrefix = 32;
+constexpr int kLengthBits = 6;
+constexpr uint16_t kMaxPort = 65535;
+
+/* dead docs kept before postings are compacted */
+constexpr size_t kMinCompaction = 4096;
+
+auto prefixMask(int length) -> uint32_t {
+  return length == 0 ? 0U : ~0U << (kMaxPrefix - length);
+}
+
+auto prefixKey(uint32_t network, int length) -> uint64_t {
+  return (static_cast<uint64_t>(network) << kLengthBits) |
+         static_cast<uint64_t>(length);
+}
+
+auto lower(string_view text) -> string {
+  string result(text);
+  std::ranges::transform(result, result.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  return result;
+}
+
+auto parseNumber(string_view text, int max) -> std::optional<int> {
+  int value = 0;
+  const auto *end = text.data() + text.size();
+  auto [ptr, ec] = std::from_chars(text.data(), end, value);
+  if (ec != std::errc() || ptr != end || value < 0 || value > max) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+auto parsePrefix(string_view text) -> std::optional<SearchQuery::Prefix> {
+  auto slash = text.find('/');
+  auto addr_text = string(text.substr(0, slash));
+  struct in_addr addr {};
+  if (inet_pton(AF_INET, addr_text.c_str(), &addr) != 1) {
+    return std::nullopt;
+  }
+
+  auto length = slash == string_view::npos
+                    ? std::optional<int>(kMaxPrefix)
+                    : parseNumber(text.substr(slash + 1), kMaxPrefix);
+  if (!length) {
+    throw std::invalid_argument(fmt::format("Invalid prefix length: {}", text));
+  }
+  return SearchQuery::Prefix{ntohl(addr.s_addr) & prefixMask(*length),
+                             *length, SearchQuery::Side::ANY};
+}
+
+auto parsePorts(string_view text) -> SearchQuery::Ports {
+  auto dash = text.find('-');
+  auto lo = parseNumber(text.substr(0, dash), kMaxPort);
+  auto hi = dash == string_view::npos
+                ? lo
+                : parseNumber(text.substr(dash + 1), kMaxPort);
+  if (!lo || !hi || *lo > *hi) {
+    throw std::invalid_argument(fmt::format("Invalid port: {}", text));
+  }
+  return {static_cast<uint16_t>(*lo), static_cast<uint16_t>(*hi),
+          SearchQuery::Side::ANY};
+}
+
+auto isNumber(string_view text) -> bool {
+  return !text.empty() && std::ranges::all_of(text, [](unsigned char c) {
+    return std::isdigit(c) != 0 || c == '-';
+  });
+}
+
+auto sortUnique(vector<uint32_t> &docs) -> void {
+  std::ranges::sort(docs);
+  docs.erase(std::unique(docs.begin(), docs.end()), docs.end());
+}
+
+} // namespace
+
+auto SearchQuery::parse(string_view text) -> SearchQuery {
+  vector<string_view> tokens;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    auto begin = text.find_first_not_of(" \t\n", pos);
+    if (begin == string_view::npos) {
+      break;
+    }
+    auto end = std::min(text.find_first_of(" \t\n", begin), text.size());
+    tokens.push_back(text.substr(begin, end - begin));
+    pos = end;
+  }
+
+  SearchQuery query;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    auto token = lower(tokens[i]);
+    auto side = token == "src"   ? Side::SRC
+                : token == "dst" ? Side::DST
+                                 : Side::ANY;
+    auto is_port = token == "port" || token == "sport" || token == "dport";
+    if (side != Side::ANY || is_port) {
+      if (i + 1 == tokens.size()) {
+        throw std::invalid_argument(
+            fmt::format("Missing value after {}", token));
+      }
+      auto value = tokens[++i];
+      if (is_port) {
+        auto ports = parsePorts(value);
+        ports.side_ = token == "sport"   ? Side::SRC
+                      : token == "dport" ? Side::DST
+                                         : Side::ANY;
+        query.ports_.push_back(ports);
+        continue;
+      }
+      auto prefix = parsePrefix(value);
+      if (!prefix) {
+        throw std::invalid_argument(fmt::format("Invalid address: {}", value));
+      }
+      prefix->side_ = side;
+      query.prefixes_.push_back(*prefix);
+      continue;
+    }
+
+    if (auto prefix = parsePrefix(token)) {
+      query.prefixes_.push_back(*prefix);
+    } else if (isNumber(token)) {
+      query.ports_.push_back(parsePorts(token));
+    } else {
+      query.terms_.push_back(token);
+    }
+  }
+  return query;
+}
+
+auto RuleSearchIndex::invalidateTable(const string &table) -> void {
+  stale_tables_.insert(table);
+  stale_chains_.erase(table);
+}
+
+auto RuleSearchIndex::invalidateChain(const string &table,
+                                      const string &chain) -> void {
+  if (!stale_tables_.contains(table)) {
+    stale_chains_[table].insert(chain);
+  }
+}
+
+auto RuleSearchIndex::needsUpdate(const string &table) const -> bool {
+  return !indexed_.contains(table) || stale_tables_.contains(table) ||
+         stale_chains_.contains(table);
+}
+
+auto RuleSearchIndex::update(const RulesetModel &model) -> void {
+  const auto &table = model.table_;
+  auto table_id = names_.intern(table);
+
+  if (!indexed_.contains(table) || stale_tables_.contains(table)) {
+    vector<uint64_t> keys;
+    for (const auto &[key, docs] : chain_docs_) {
+      if (key >> kMaxPrefix == table_id) {
+        keys.push_back(key);
+      }
+    }
+    for (auto key : keys) {
+      dropChain(key);
+    }
+    for (uint32_t chain = 0; chain < model.chains_.size(); chain++) {
+      indexChain(model, chain);
+    }
+  } else if (auto iter = stale_chains_.find(table);
+             iter != stale_chains_.end()) {
+    for (const auto &name : iter->second) {
+      if (auto chain_id = names_.find(name)) {
+        dropChain((static_cast<uint64_t>(table_id) << kMaxPrefix) | *chain_id);
+      }
+      if (auto chain = model.findChain(name)) {
+        indexChain(model, *chain);
+      }
+    }
+  }
+
+  indexed_.insert(table);
+  stale_tables_.erase(table);
+  stale_chains_.erase(table);
+
+  auto dead = docs_.size() - live_;
+  if (dead > kMinCompaction && dead > live_) {
+    compact();
+  }
+}
+
+auto RuleSearchIndex::indexChain(const RulesetModel &model,
+                                 uint32_t chain) -> void {
+  const auto &model_chain = model.chains_[chain];
+  auto table_id = names_.intern(model.table_);
+  const auto &chain_name = model.names_.get(model_chain.name_);
+  auto chain_id = names_.intern(chain_name);
+  auto &docs =
+      chain_docs_[(static_cast<uint64_t>(table_id) << kMaxPrefix) | chain_id];
+
+  for (auto row = model_chain.begin_; row < model_chain.end_; row++) {
+    auto doc = static_cast<uint32_t>(docs_.size());
+    docs_.push_back({table_id, chain_id, row - model_chain.begin_, true});
+    docs.push_back(doc);
+    addRow(model, row, chain_name, doc);
+    live_++;
+  }
+}
+
+auto RuleSearchIndex::addRow(const RulesetModel &model, uint32_t row,
+                             string_view chain, uint32_t doc) -> void {
+  auto add_term = [this, doc](string_view name) {
+    if (name.empty()) {
+      return;
+    }
+    /* same name twice in a rule, e.g. in and out interface */
+    auto &postings = terms_[lower(name)];
+    if (postings.empty() || postings.back() != doc) {
+      postings.push_back(doc);
+    }
+  };
+  add_term(chain);
+  add_term(model.names_.get(model.targetOf(row).name_));
+  add_term(model.ifaces_.get(model.iniface_[row]));
+  add_term(model.ifaces_.get(model.outiface_[row]));
+  if (auto proto = model.proto_[row]; proto != 0) {
+    auto name = proto2Name(proto);
+    add_term(name == "UNKNOWN" ? std::to_string(proto) : string(name));
+  }
+
+  auto add_addr = [this, doc](uint32_t addr, uint32_t mask, bool dst) {
+    if (mask == 0) {
+      return; /* any address is not a mention */
+    }
+    auto length = std::popcount(mask);
+    if (mask != prefixMask(length)) {
+      masked_.push_back({addr & mask, mask, doc, dst});
+      return;
+    }
+    auto &prefixes = dst ? dst_prefixes_ : src_prefixes_;
+    prefixes[prefixKey(addr & mask, length)].push_back(doc);
+  };
+  add_addr(model.src_[row], model.smsk_[row], false);
+  add_addr(model.dst_[row], model.dmsk_[row], true);
+
+  auto add_ports = [this, doc](uint16_t lo, uint16_t hi, bool dst) {
+    if (lo == 0 && hi == kMaxPort) {
+      return;
+    }
+    if (lo == hi) {
+      (dst ? dports_ : sports_)[lo].push_back(doc);
+    } else {
+      ranges_.push_back({lo, hi, doc, dst});
+    }
+  };
+  add_ports(model.sport_lo_[row], model.sport_hi_[row], false);
+  add_ports(model.dport_lo_[row], model.dport_hi_[row], true);
+}
+
+auto RuleSearchIndex::dropChain(uint64_t key) -> void {
+  auto iter = chain_docs_.find(key);
+  if (iter == chain_docs_.end()) {
+    return;
+  }
+  for (auto doc : iter->second) {
+    docs_[doc].alive_ = false;
+    live_--;
+  }
+  chain_docs_.erase(iter);
+}
+
+auto RuleSearchIndex::compact() -> void {
+  static constexpr uint32_t kDead = ~0U;
+
+  vector<uint32_t> remap(docs_.size(), kDead);
+  vector<Doc> docs;
+  docs.reserve(live_);
+  for (size_t doc = 0; doc < docs_.size(); doc++) {
+    if (docs_[doc].alive_) {
+      remap[doc] = static_cast<uint32_t>(docs.size());
+      docs.push_back(docs_[doc]);
+    }
+  }
+
+  /* remapping keeps posting lists sorted, new docs have higher ids */
+  auto rewrite = [&remap](vector<uint32_t> &postings) {
+    auto out = postings.begin();
+    for (auto doc : postings) {
+      if (remap[doc] != kDead) {
+        *out++ = remap[doc];
+      }
+    }
+    postings.erase(out, postings.end());
+  };
+  auto rewrite_map = [&rewrite](auto &lists) {
+    for (auto iter = lists.begin(); iter != lists.end();) {
+      rewrite(iter->second);
+      iter = iter->second.empty() ? lists.erase(iter) : std::next(iter);
+    }
+  };
+  rewrite_map(terms_);
+  rewrite_map(src_prefixes_);
+  rewrite_map(dst_prefixes_);
+  rewrite_map(sports_);
+  rewrite_map(dports_);
+  for (auto &[key, chain] : chain_docs_) {
+    rewrite(chain);
+  }
+
+  auto rewrite_items = [&remap](auto &items) {
+    std::erase_if(items, [&remap](const auto &item) {
+      return remap[item.doc_] == kDead;
+    });
+    for (auto &item : items) {
+      item.doc_ = remap[item.doc_];
+    }
+  };
+  rewrite_items(masked_);
+  rewrite_items(ranges_);
+
+  docs_ = std::move(docs);
+}
+
+auto RuleSearchIndex::matchPrefix(const SearchQuery::Prefix &prefix) const
+    -> vector<uint32_t> {
+  vector<uint32_t> docs;
+  auto query_mask = prefixMask(prefix.length_);
+
+  auto collect = [&](const map<uint64_t, vector<uint32_t>> &prefixes) {
+    /* prefixes containing the query, one lookup per shorter length */
+    for (int length = 1; length <= prefix.length_; length++) {
+      auto iter =
+          prefixes.find(prefixKey(prefix.addr_ & prefixMask(length), length));
+      if (iter != prefixes.end()) {
+        docs.insert(docs.end(), iter->second.begin(), iter->second.end());
+      }
+    }
+
+    /* prefixes inside the query are ordered right after its network */
+    auto last = prefixKey(prefix.addr_ | ~query_mask, kMaxPrefix);
+    for (auto iter = prefixes.lower_bound(prefixKey(prefix.addr_, 0));
+         iter != prefixes.end() && iter->first <= last; iter++) {
+      auto length = static_cast<int>(iter->first & ((1U << kLengthBits) - 1));
+      if (length > prefix.length_) {
+        docs.insert(docs.end(), iter->second.begin(), iter->second.end());
+      }
+    }
+  };
+
+  if (prefix.side_ != SearchQuery::Side::DST) {
+    collect(src_prefixes_);
+  }
+  if (prefix.side_ != SearchQuery::Side::SRC) {
+    collect(dst_prefixes_);
+  }
+  for (const auto &masked : masked_) {
+    auto side_ok = prefix.side_ == SearchQuery::Side::ANY ||
+                   masked.dst_ == (prefix.side_ == SearchQuery::Side::DST);
+    if (side_ok &&
+        ((masked.addr_ ^ prefix.addr_) & masked.mask_ & query_mask) == 0) {
+      docs.push_back(masked.doc_);
+    }
+  }
+
+  sortUnique(docs);
+  return docs;
+}
+
+auto RuleSearchIndex::matchPorts(const SearchQuery::Ports &ports) const
+    -> vector<uint32_t> {
+  vector<uint32_t> docs;
+  auto collect = [&](const map<uint16_t, vector<uint32_t>> &singles) {
+    for (auto iter = singles.lower_bound(ports.lo_);
+         iter != singles.end() && iter->first <= ports.hi_; iter++) {
+      docs.insert(docs.end(), iter->second.begin(), iter->second.end());
+    }
+  };
+
+  if (ports.side_ != SearchQuery::Side::DST) {
+    collect(sports_);
+  }
+  if (ports.side_ != SearchQuery::Side::SRC) {
+    collect(dports_);
+  }
+  for (const auto &range : ranges_) {
+    auto side_ok = ports.side_ == SearchQuery::Side::ANY ||
+                   range.dst_ == (ports.side_ == SearchQuery::Side::DST);
+    if (side_ok && range.lo_ <= ports.hi_ && ports.lo_ <= range.hi_) {
+      docs.push_back(range.doc_);
+    }
+  }
+
+  sortUnique(docs);
+  return docs;
+}
+
+auto RuleSearchIndex::search(const SearchQuery &query,
+                             size_t limit) const -> vector<SearchHit> {
+  if (query.empty()) {
+    return {};
+  }
+
+  vector<vector<uint32_t>> sets;
+  for (const auto &prefix : query.prefixes_) {
+    sets.push_back(matchPrefix(prefix));
+  }
+  for (const auto &ports : query.ports_) {
+    sets.push_back(matchPorts(ports));
+  }
+  for (const auto &term : query.terms_) {
+    auto iter = terms_.find(term);
+    sets.push_back(iter == terms_.end() ? vector<uint32_t>{} : iter->second);
+  }
+
+  /* intersect from the most selective criterion */
+  std::ranges::sort(sets, {}, &vector<uint32_t>::size);
+  auto docs = std::move(sets.front());
+  for (size_t i = 1; i < sets.size() && !docs.empty(); i++) {
+    vector<uint32_t> both;
+    std::ranges::set_intersection(docs, sets[i], std::back_inserter(both));
+    docs = std::move(both);
+  }
+  std::erase_if(docs, [this](uint32_t doc) { return !docs_[doc].alive_; });
+
+  auto before = [this](uint32_t a, uint32_t b) {
+    const auto &x = docs_[a];
+    const auto &y = docs_[b];
+    if (x.table_ != y.table_) {
+      return names_.get(x.table_) < names_.get(y.table_);
+    }
+    if (x.chain_ != y.chain_) {
+      return names_.get(x.chain_) < names_.get(y.chain_);
+    }
+    return x.index_ < y.index_;
+  };
+  auto count = std::min(limit, docs.size());
+  std::partial_sort(docs.begin(), docs.begin() + static_cast<long>(count),
+                    docs.end(), before);
+
+  vector<SearchHit> hits;
+  hits.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    const auto &doc = docs_[docs[i]];
+    hits.push_back({names_.get(doc.table_), names_.get(doc.chain_),
+                    static_cast<int>(doc.index_)});
+  }
+  return hits;
+}
@@ -0,0 +1,135 @@
+#include "backend/firewall/rule_space.h"
+#include "fmt/format.h"
+#include "tools/nettools.h"
+
+#include <netinet/in.h>
+#include <string_view>
+
+namespace {
+
+auto isContiguous(uint32_t mask) -> bool { return (~mask & (~mask + 1)) == 0; }
+
+/* interface pattern a matches every interface b matches */
+auto ifaceCovers(const StringPool &ifaces, uint16_t a, uint16_t b) -> bool {
+  if (a == 0 || a == b) {
+    return true;
+  }
+  if (b == 0) {
+    return false;
+  }
+
+  std::string_view pattern = ifaces.get(a);
+  if (pattern.back() != '+') {
+    return false;
+  }
+  pattern.remove_suffix(1);
+  return ifaces.get(b).starts_with(pattern);
+}
+
+auto formatIpv4(uint32_t addr) -> string {
+  fmt::memory_buffer buffer;
+  appendIpv4(buffer, addr);
+  return fmt::to_string(buffer);
+}
+
+auto ifaceOverlaps(const StringPool &ifaces, uint16_t a, uint16_t b) -> bool {
+  return ifaceCovers(ifaces, a, b) || ifaceCovers(ifaces, b, a);
+}
+
+} // namespace
+
+auto RuleSpace::fromRow(const RulesetModel &model,
+                        uint32_t row) -> optional<RuleSpace> {
+  if (model.flags_[row] != 0) {
+    return std::nullopt;
+  }
+
+  return RuleSpace{model.src_[row] & model.smsk_[row],
+                   model.smsk_[row],
+                   model.dst_[row] & model.dmsk_[row],
+                   model.dmsk_[row],
+                   model.proto_[row],
+                   model.iniface_[row],
+                   model.outiface_[row],
+                   model.sport_lo_[row],
+                   model.sport_hi_[row],
+                   model.dport_lo_[row],
+                   model.dport_hi_[row]};
+}
+
+auto RuleSpace::isUnmatchable(const RulesetModel &model, uint32_t row) -> bool {
+  return (model.src_[row] & ~model.smsk_[row]) != 0 ||
+         (model.dst_[row] & ~model.dmsk_[row]) != 0 ||
+         model.sport_lo_[row] > model.sport_hi_[row] ||
+         model.dport_lo_[row] > model.dport_hi_[row];
+}
+
+auto RuleSpace::covers(const RuleSpace &other,
+                       const StringPool &ifaces) const -> bool {
+  return (smsk_ & ~other.smsk_) == 0 && (other.src_ & smsk_) == src_ &&
+         (dmsk_ & ~other.dmsk_) == 0 && (other.dst_ & dmsk_) == dst_ &&
+         (proto_ == 0 || proto_ == other.proto_) &&
+         ifaceCovers(ifaces, iniface_, other.iniface_) &&
+         ifaceCovers(ifaces, outiface_, other.outiface_) &&
+         sport_lo_ <= other.sport_lo_ && other.sport_hi_ <= sport_hi_ &&
+         dport_lo_ <= other.dport_lo_ && other.dport_hi_ <= dport_hi_;
+}
+
+auto RuleSpace::overlaps(const RuleSpace &other,
+                         const StringPool &ifaces) const -> bool {
+  return ((src_ ^ other.src_) & smsk_ & other.smsk_) == 0 &&
+         ((dst_ ^ other.dst_) & dmsk_ & other.dmsk_) == 0 &&
+         (proto_ == 0 || other.proto_ == 0 || proto_ == other.proto_) &&
+         ifaceOverlaps(ifaces, iniface_, other.iniface_) &&
+         ifaceOverlaps(ifaces, outiface_, other.outiface_) &&
+         sport_lo_ <= other.sport_hi_ && other.sport_lo_ <= sport_hi_ &&
+         dport_lo_ <= other.dport_hi_ && other.dport_lo_ <= dport_hi_;
+}
+
+auto RuleSpace::hasContiguousMasks() const -> bool {
+  return isContiguous(smsk_) && isContiguous(dmsk_);
+}
+
+auto RuleSpace::toRequest(const StringPool &ifaces, const string &target) const
+    -> shared_ptr<RuleRequest> {
+  constexpr uint16_t kMaxPort = 65535;
+
+  auto request = std::make_shared<RuleRequest>();
+  if (proto_ == IPPROTO_TCP) {
+    request->proto_ = RequestProto::TCP;
+  } else if (proto_ == IPPROTO_UDP) {
+    request->proto_ = RequestProto::UDP;
+  } else if (proto_ == 0) {
+    request->proto_ = RequestProto::ALL;
+  } else {
+    return nullptr;
+  }
+
+  /* absent address means host 0.0.0.0 to RuleRequest, so always set it */
+  request->src_ip_ = formatIpv4(src_);
+  request->src_mask_ = formatIpv4(smsk_);
+  request->dst_ip_ = formatIpv4(dst_);
+  request->dst_mask_ = formatIpv4(dmsk_);
+  if (iniface_ != 0) {
+    request->iniface_ = ifaces.get(iniface_);
+  }
+  if (outiface_ != 0) {
+    request->outiface_ = ifaces.get(outiface_);
+  }
+
+  if (sport_lo_ != 0 || sport_hi_ != kMaxPort || dport_lo_ != 0 ||
+      dport_hi_ != kMaxPort) {
+    if (proto_ == 0) {
+      return nullptr;
+    }
+    RuleMatch match;
+    match.src_port_range_ = {std::to_string(sport_lo_),
+                             std::to_string(sport_hi_)};
+    match.dst_port_range_ = {std::to_string(dport_lo_),
+                             std::to_string(dport_hi_)};
+    request->matches_.push_back(std::move(match));
+  }
+
+  request->target_ = target;
+  return request;
+}
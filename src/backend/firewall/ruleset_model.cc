@@ -0,0 +1,234 @@
+#include "backend/firewall/ruleset_model.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <libiptc/libiptc.h>
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <netinet/in.h>
+
+namespace {
+
+constexpr uint16_t kMinPort = 0;
+constexpr uint16_t kMaxPort = 65535;
+
+auto ifaceName(const char *name) -> string_view {
+  return {name, strnlen(name, IFNAMSIZ)};
+}
+
+} // namespace
+
+auto StringPool::intern(string_view str) -> uint32_t {
+  auto iter = ids_.find(string(str));
+  if (iter != ids_.end()) {
+    return iter->second;
+  }
+  auto id = static_cast<uint32_t>(strings_.size());
+  strings_.emplace_back(str);
+  ids_.emplace(strings_.back(), id);
+  return id;
+}
+
+auto StringPool::find(string_view str) const -> optional<uint32_t> {
+  auto iter = ids_.find(string(str));
+  if (iter == ids_.end()) {
+    return std::nullopt;
+  }
+  return iter->second;
+}
+
+auto RulesetModel::findChain(string_view name) const -> optional<uint32_t> {
+  auto id = names_.find(name);
+  if (!id) {
+    return std::nullopt;
+  }
+  auto iter = chain_ids_.find(*id);
+  if (iter == chain_ids_.end()) {
+    return std::nullopt;
+  }
+  return iter->second;
+}
+
+auto RulesetModel::chainOf(uint32_t row) const -> uint32_t {
+  /* chains are stored in row order, find last chain beginning at or before */
+  auto iter = std::upper_bound(
+      chains_.begin(), chains_.end(), row,
+      [](uint32_t value, const ModelChain &chain) {
+        return value < chain.begin_;
+      });
+  /* empty chains share begin_ with their successor */
+  while (iter != chains_.begin() && (iter - 1)->size() == 0) {
+    --iter;
+  }
+  return static_cast<uint32_t>(iter - chains_.begin()) - 1;
+}
+
+auto RulesetModel::columnBytes() const -> size_t {
+  return size() * (4 * sizeof(uint32_t) + 2 * sizeof(uint8_t) +
+                   7 * sizeof(uint16_t) + 2 * sizeof(uint64_t));
+}
+
+auto RulesetModel::internTarget(const string &name) -> uint16_t {
+  auto id = names_.intern(name);
+  if (auto iter = target_ids_.find(id); iter != target_ids_.end()) {
+    return iter->second;
+  }
+
+  ModelTarget target{id, TargetKind::EXTENSION, 0};
+  if (name.empty()) {
+    target.kind_ = TargetKind::FALLTHROUGH;
+  } else if (name == IPTC_LABEL_ACCEPT) {
+    target.kind_ = TargetKind::ACCEPT;
+  } else if (name == IPTC_LABEL_DROP) {
+    target.kind_ = TargetKind::DROP;
+  } else if (name == IPTC_LABEL_QUEUE) {
+    target.kind_ = TargetKind::QUEUE;
+  } else if (name == IPTC_LABEL_RETURN) {
+    target.kind_ = TargetKind::RETURN;
+  } else if (auto chain = findChain(name); chain) {
+    target.kind_ = TargetKind::JUMP;
+    target.chain_ = *chain;
+  }
+  auto index = static_cast<uint16_t>(targets_.size());
+  targets_.push_back(target);
+  target_ids_.emplace(id, index);
+  return index;
+}
+
+auto RulesetModel::appendRule(const struct ipt_entry *entry,
+                              uint16_t target) -> void {
+  const auto &ip = entry->ip;
+  src_.push_back(ntohl(ip.src.s_addr));
+  smsk_.push_back(ntohl(ip.smsk.s_addr));
+  dst_.push_back(ntohl(ip.dst.s_addr));
+  dmsk_.push_back(ntohl(ip.dmsk.s_addr));
+  proto_.push_back(static_cast<uint8_t>(ip.proto));
+
+  uint8_t flags = 0;
+  flags |= (ip.invflags & IPT_INV_SRCIP) != 0 ? kInvSrc : 0;
+  flags |= (ip.invflags & IPT_INV_DSTIP) != 0 ? kInvDst : 0;
+  flags |= (ip.invflags & IPT_INV_VIA_IN) != 0 ? kInvIniface : 0;
+  flags |= (ip.invflags & IPT_INV_VIA_OUT) != 0 ? kInvOutiface : 0;
+  flags |= (ip.invflags & IPT_INV_PROTO) != 0 ? kInvProto : 0;
+  /* "! -f" matches all but later fragments, it is not modeled by columns */
+  if ((ip.flags & IPT_F_FRAG) != 0) {
+    flags |= (ip.invflags & IPT_INV_FRAG) != 0 ? kOpaqueMatch : kFragment;
+  }
+
+  iniface_.push_back(static_cast<uint16_t>(
+      ifaces_.intern(ifaceName(ip.iniface))));
+  outiface_.push_back(static_cast<uint16_t>(
+      ifaces_.intern(ifaceName(ip.outiface))));
+
+  uint16_t sport_lo = kMinPort;
+  uint16_t sport_hi = kMaxPort;
+  uint16_t dport_lo = kMinPort;
+  uint16_t dport_hi = kMaxPort;
+  const auto *match = reinterpret_cast<const ipt_entry_match *>(entry->elems);
+  while (reinterpret_cast<const char *>(match) <
+         reinterpret_cast<const char *>(entry) + entry->target_offset) {
+    const auto *name = match->u.user.name;
+    const uint16_t *spts = nullptr;
+    const uint16_t *dpts = nullptr;
+    uint8_t invflags = 0;
+    if (strcmp(name, "tcp") == 0) {
+      const auto *tcp = reinterpret_cast<const ipt_tcp *>(match->data);
+      spts = tcp->spts;
+      dpts = tcp->dpts;
+      invflags = tcp->invflags;
+      if (tcp->flg_mask != 0 || tcp->option != 0) {
+        flags |= kOpaqueMatch;
+      }
+    } else if (strcmp(name, "udp") == 0) {
+      const auto *udp = reinterpret_cast<const ipt_udp *>(match->data);
+      spts = udp->spts;
+      dpts = udp->dpts;
+      invflags = udp->invflags;
+    }
+
+    if (spts == nullptr || (invflags & (IPT_TCP_INV_SRCPT |
+                                        IPT_TCP_INV_DSTPT)) != 0) {
+      flags |= kOpaqueMatch;
+    } else {
+      sport_lo = std::max(sport_lo, spts[0]);
+      sport_hi = std::min(sport_hi, spts[1]);
+      dport_lo = std::max(dport_lo, dpts[0]);
+      dport_hi = std::min(dport_hi, dpts[1]);
+    }
+
+    if (match->u.match_size == 0) {
+      break;
+    }
+    match = reinterpret_cast<const ipt_entry_match *>(
+        reinterpret_cast<const char *>(match) + match->u.match_size);
+  }
+
+  flags_.push_back(flags);
+  sport_lo_.push_back(sport_lo);
+  sport_hi_.push_back(sport_hi);
+  dport_lo_.push_back(dport_lo);
+  dport_hi_.push_back(dport_hi);
+  target_.push_back(target);
+  pcnt_.push_back(entry->counters.pcnt);
+  bcnt_.push_back(entry->counters.bcnt);
+}
+
+auto RulesetModel::decode(const string &table, struct iptc_handle *handle)
+    -> shared_ptr<RulesetModel> {
+  auto model = std::make_shared<RulesetModel>();
+  model->table_ = table;
+
+  /* chains first, so jump targets can be resolved while decoding rules */
+  for (const auto *chain = iptc_first_chain(handle); chain != nullptr;
+       chain = iptc_next_chain(handle)) {
+    ModelChain item{};
+    item.name_ = model->names_.intern(chain);
+    item.builtin_ = iptc_builtin(chain, handle) != 0;
+    model->chain_ids_.emplace(item.name_,
+                              static_cast<uint32_t>(model->chains_.size()));
+    model->chains_.push_back(item);
+  }
+
+  size_t rows = 0;
+  for (auto &chain : model->chains_) {
+    const auto &name = model->names_.get(chain.name_);
+    for (const auto *entry = iptc_first_rule(name.c_str(), handle);
+         entry != nullptr; entry = iptc_next_rule(entry, handle)) {
+      rows++;
+    }
+  }
+  for (auto *column : {&model->src_, &model->smsk_, &model->dst_,
+                       &model->dmsk_}) {
+    column->reserve(rows);
+  }
+  for (auto *column : {&model->sport_lo_, &model->sport_hi_, &model->dport_lo_,
+                       &model->dport_hi_, &model->iniface_, &model->outiface_,
+                       &model->target_}) {
+    column->reserve(rows);
+  }
+  model->proto_.reserve(rows);
+  model->flags_.reserve(rows);
+  model->pcnt_.reserve(rows);
+  model->bcnt_.reserve(rows);
+
+  for (auto &chain : model->chains_) {
+    /* copy, interning below may reallocate the pool */
+    auto name = model->names_.get(chain.name_);
+    chain.begin_ = static_cast<uint32_t>(model->size());
+    for (const auto *entry = iptc_first_rule(name.c_str(), handle);
+         entry != nullptr; entry = iptc_next_rule(entry, handle)) {
+      auto target = model->internTarget(iptc_get_target(entry, handle));
+      model->appendRule(entry, target);
+    }
+    chain.end_ = static_cast<uint32_t>(model->size());
+
+    if (chain.builtin_) {
+      struct xt_counters counters {};
+      const auto *policy = iptc_get_policy(name.c_str(), &counters, handle);
+      chain.policy_ = model->internTarget(policy != nullptr ? policy : "");
+    }
+  }
+
+  return model;
+}
@@ -0,0 +1,541 @@
+#include "backend/firewall/save_format.h"
+#include "fmt/format.h"
+#include "tools/nettools.h"
+
+#include <arpa/inet.h>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+
+using std::string_view;
+
+namespace {
+
+constexpr size_t kFlushSize = 64 * 1024;
+constexpr uint32_t kMaxPort = 65535;
+constexpr int kMaxPrefix = 32;
+
+/* split off the next blank separated token of line */
+auto nextToken(string_view &line) -> string_view {
+  auto begin = line.find_first_not_of(" \t");
+  if (begin == string_view::npos) {
+    line = {};
+    return {};
+  }
+  line.remove_prefix(begin);
+  auto end = std::min(line.find_first_of(" \t"), line.size());
+  auto token = line.substr(0, end);
+  line.remove_prefix(end);
+  return token;
+}
+
+auto parseNumber(string_view str, uint32_t max) -> optional<uint32_t> {
+  uint32_t value = 0;
+  const auto *end = str.data() + str.size();
+  auto [ptr, ec] = std::from_chars(str.data(), end, value);
+  if (ec != std::errc() || ptr != end || str.empty() || value > max) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+auto formatIpv4(uint32_t addr) -> string {
+  fmt::memory_buffer buffer;
+  appendIpv4(buffer, addr);
+  return fmt::to_string(buffer);
+}
+
+/* "addr[/prefix|/mask]" into dotted address and mask */
+auto parseAddress(string_view value, optional<string> &addr,
+                  optional<string> &mask) -> optional<string> {
+  auto slash = value.find('/');
+  auto host = string(value.substr(0, slash));
+  struct in_addr parsed {};
+  if (inet_pton(AF_INET, host.c_str(), &parsed) != 1) {
+    return fmt::format("invalid address: {}", value);
+  }
+  addr = host;
+
+  if (slash == string_view::npos) {
+    mask = "255.255.255.255";
+    return std::nullopt;
+  }
+
+  auto suffix = value.substr(slash + 1);
+  if (auto prefix = parseNumber(suffix, kMaxPrefix); prefix) {
+    auto bits = *prefix == 0 ? 0U : ~0U << (kMaxPrefix - *prefix);
+    mask = formatIpv4(bits);
+    return std::nullopt;
+  }
+  if (inet_pton(AF_INET, string(suffix).c_str(), &parsed) != 1) {
+    return fmt::format("invalid mask: {}", value);
+  }
+  mask = string(suffix);
+  return std::nullopt;
+}
+
+/* "port", "lo:hi", "lo:" or ":hi" */
+auto parsePorts(string_view value, optional<tuple<string, string>> &range)
+    -> optional<string> {
+  auto colon = value.find(':');
+  auto low = value.substr(0, colon);
+  auto high = colon == string_view::npos ? low : value.substr(colon + 1);
+  auto low_num = low.empty() ? 0U : parseNumber(low, kMaxPort);
+  auto high_num = high.empty() ? kMaxPort : parseNumber(high, kMaxPort);
+  if (!low_num || !high_num || *low_num > *high_num) {
+    return fmt::format("invalid port range: {}", value);
+  }
+  range = std::make_tuple(std::to_string(*low_num), std::to_string(*high_num));
+  return std::nullopt;
+}
+
+/* "N" of --queue-num or "lo:hi" of --queue-balance */
+auto parseQueues(string_view value, bool balance,
+                 optional<NfqueueTarget> &target) -> optional<string> {
+  if (!target.has_value()) {
+    return "queue option without NFQUEUE target";
+  }
+  auto colon = value.find(':');
+  auto low = parseNumber(value.substr(0, colon), UINT16_MAX);
+  auto high = colon == string_view::npos
+                  ? low
+                  : parseNumber(value.substr(colon + 1), UINT16_MAX);
+  if (balance == (colon == string_view::npos) || !low || !high ||
+      *low > *high || *high - *low >= UINT16_MAX) {
+    return fmt::format("invalid queue: {}", value);
+  }
+  target->queue_num_ = static_cast<uint16_t>(*low);
+  target->queues_total_ = static_cast<uint16_t>(*high - *low + 1);
+  return std::nullopt;
+}
+
+auto protoName(string_view value) -> optional<string> {
+  if (value == "tcp" || value == "6") {
+    return RequestProto::TCP;
+  }
+  if (value == "udp" || value == "17") {
+    return RequestProto::UDP;
+  }
+  if (value == "all" || value == "0") {
+    return RequestProto::ALL;
+  }
+  return std::nullopt;
+}
+
+auto writeAddress(fmt::memory_buffer &buffer, string_view option,
+                  uint32_t addr, uint32_t mask, bool inverse) -> void {
+  if (addr == 0 && mask == 0 && !inverse) {
+    return;
+  }
+  buffer.append(string_view(inverse ? " ! " : " "));
+  buffer.append(option);
+  buffer.push_back(' ');
+  appendIpv4(buffer, addr);
+  buffer.push_back('/');
+  /* contiguous mask is written as prefix length */
+  if ((~mask & (~mask + 1)) == 0) {
+    fmt::format_to(std::back_inserter(buffer), "{}", std::popcount(mask));
+  } else {
+    appendIpv4(buffer, mask);
+  }
+}
+
+template <typename Out>
+auto writePorts(Out out, const char *option, uint16_t low,
+                uint16_t high) -> void {
+  if (low == 0 && high == kMaxPort) {
+    return;
+  }
+  if (low == high) {
+    fmt::format_to(out, " {} {}", option, low);
+  } else {
+    fmt::format_to(out, " {} {}:{}", option, low, high);
+  }
+}
+
+/* dotted address of request, absent address is host 0.0.0.0 */
+auto requestAddress(const optional<string> &addr, const optional<string> &mask)
+    -> std::pair<uint32_t, uint32_t> {
+  auto parse = [](const optional<string> &value, uint32_t absent) {
+    struct in_addr parsed {};
+    if (!value.has_value() ||
+        inet_pton(AF_INET, value->c_str(), &parsed) != 1) {
+      return absent;
+    }
+    return ntohl(parsed.s_addr);
+  };
+  return {parse(addr, 0), parse(mask, ~0U)};
+}
+
+} // namespace
+
+auto SaveFormat::parseRule(string_view line, string &chain,
+                           RuleRequest &request) -> optional<string> {
+  /* absent address matches everything, unlike RuleRequest's default mask */
+  static const string kAnyAddr = "0.0.0.0";
+  request.src_ip_ = request.src_mask_ = kAnyAddr;
+  request.dst_ip_ = request.dst_mask_ = kAnyAddr;
+  request.proto_ = RequestProto::ALL;
+  request.target_.clear();
+  request.ct_target_.reset();
+  request.nfqueue_target_.reset();
+  request.matches_.clear();
+  chain.clear();
+
+  auto rest = line;
+  if (!rest.empty() && rest.front() == '[') {
+    nextToken(rest); /* "[pcnt:bcnt]" of iptables-save -c */
+  }
+
+  for (auto option = nextToken(rest); !option.empty();
+       option = nextToken(rest)) {
+    if (option == "!") {
+      return "negation is not supported";
+    }
+
+    /* target options without value */
+    if (option == "--notrack") {
+      if (!request.ct_target_.has_value()) {
+        return "--notrack without CT target";
+      }
+      request.ct_target_->notrack_ = true;
+      continue;
+    }
+    if (option == "--queue-bypass" || option == "--queue-cpu-fanout") {
+      if (!request.nfqueue_target_.has_value()) {
+        return fmt::format("{} without NFQUEUE target", option);
+      }
+      auto &queue = *request.nfqueue_target_;
+      (option == "--queue-bypass" ? queue.bypass_ : queue.cpu_fanout_) = true;
+      continue;
+    }
+
+    auto value = nextToken(rest);
+    if (value.empty()) {
+      return fmt::format("missing value of option: {}", option);
+    }
+
+    optional<string> error;
+    if (option == "-A" || option == "--append") {
+      chain = string(value);
+    } else if (option == "-s" || option == "--source") {
+      error = parseAddress(value, request.src_ip_, request.src_mask_);
+    } else if (option == "-d" || option == "--destination") {
+      error = parseAddress(value, request.dst_ip_, request.dst_mask_);
+    } else if (option == "-i" || option == "--in-interface") {
+      request.iniface_ = string(value);
+    } else if (option == "-o" || option == "--out-interface") {
+      request.outiface_ = string(value);
+    } else if (option == "-p" || option == "--protocol") {
+      auto proto = protoName(value);
+      if (!proto) {
+        return fmt::format("unsupported protocol: {}", value);
+      }
+      request.proto_ = *proto;
+    } else if (option == "-m" || option == "--match") {
+      if (protoName(value) != request.proto_ ||
+          request.proto_ == RequestProto::ALL) {
+        return fmt::format("unsupported match: {}", value);
+      }
+      if (request.matches_.empty()) {
+        request.matches_.emplace_back();
+      }
+    } else if (option == "--sport" || option == "--source-port" ||
+               option == "--dport" || option == "--destination-port") {
+      if (request.proto_ == RequestProto::ALL) {
+        return fmt::format("{} without tcp or udp protocol", option);
+      }
+      if (request.matches_.empty()) {
+        request.matches_.emplace_back(); /* implicit protocol match */
+      }
+      auto &match = request.matches_.front();
+      error = parsePorts(value, option == "--sport" ||
+                                        option == "--source-port"
+                                    ? match.src_port_range_
+                                    : match.dst_port_range_);
+    } else if (option == "-j" || option == "--jump") {
+      request.target_ = string(value);
+      if (request.target_ == RequestTarget::CT) {
+        request.ct_target_.emplace();
+      } else if (request.target_ == RequestTarget::NFQUEUE) {
+        request.nfqueue_target_.emplace();
+      }
+    } else if (option == "--zone") {
+      auto zone = parseNumber(value, UINT16_MAX);
+      if (!request.ct_target_.has_value() || !zone) {
+        return fmt::format("invalid CT zone: {}", value);
+      }
+      request.ct_target_->zone_ = static_cast<uint16_t>(*zone);
+    } else if (option == "--queue-num" || option == "--queue-balance") {
+      error = parseQueues(value, option == "--queue-balance",
+                          request.nfqueue_target_);
+    } else if (option == "-c" || option == "--set-counters") {
+      nextToken(rest); /* counters are not restored */
+    } else {
+      return fmt::format("unsupported option: {}", option);
+    }
+
+    if (error) {
+      return error;
+    }
+  }
+
+  if (chain.empty()) {
+    return "rule without chain";
+  }
+  return std::nullopt;
+}
+
+auto SaveFormat::parse(std::istream &input, SaveSink &sink)
+    -> optional<string> {
+  string line;
+  size_t line_no = 0;
+  bool in_table = false;
+  string chain;
+
+  while (std::getline(input, line)) {
+    line_no++;
+    string_view view = line;
+    while (!view.empty() &&
+           (view.back() == '\r' || view.back() == ' ' || view.back() == '\t')) {
+      view.remove_suffix(1);
+    }
+    if (view.empty() || view.front() == '#') {
+      continue;
+    }
+
+    optional<string> error;
+    if (view.front() == '*') {
+      if (in_table) {
+        error = "table without COMMIT";
+      } else {
+        in_table = true;
+        error = sink.beginTable(string(view.substr(1)));
+      }
+    } else if (!in_table) {
+      error = "content outside of table";
+    } else if (view.front() == ':') {
+      view.remove_prefix(1);
+      auto name = nextToken(view);
+      auto policy = nextToken(view);
+      if (name.empty() || policy.empty()) {
+        error = "invalid chain declaration";
+      } else {
+        error = sink.declareChain(
+            string(name),
+            policy == "-" ? std::nullopt : optional<string>(policy));
+      }
+    } else if (view == "COMMIT") {
+      in_table = false;
+      error = sink.commitTable();
+    } else {
+      auto request = std::make_shared<RuleRequest>();
+      error = parseRule(view, chain, *request);
+      if (!error) {
+        error = sink.appendRule(chain, std::move(request));
+      }
+    }
+
+    if (error) {
+      return fmt::format("line {}: {}", line_no, *error);
+    }
+  }
+
+  if (in_table) {
+    return fmt::format("line {}: table without COMMIT", line_no);
+  }
+  return std::nullopt;
+}
+
+auto SaveFormat::write(std::ostream &output,
+                       const RulesetModel &model) -> size_t {
+  fmt::memory_buffer buffer;
+  auto out = std::back_inserter(buffer);
+  size_t skipped = 0;
+
+  fmt::format_to(out, "*{}\n", model.table_);
+  for (const auto &chain : model.chains_) {
+    const auto &policy =
+        chain.builtin_ ? model.names_.get(model.targets_[chain.policy_].name_)
+                       : string("-");
+    fmt::format_to(out, ":{} {} [0:0]\n", model.names_.get(chain.name_),
+                   policy);
+  }
+
+  for (const auto &chain : model.chains_) {
+    const auto &name = model.names_.get(chain.name_);
+    for (auto row = chain.begin_; row < chain.end_; row++) {
+      const auto &target = model.targetOf(row);
+      auto flags = model.flags_[row];
+      if ((flags & RulesetModel::kOpaqueMatch) != 0 ||
+          (flags & RulesetModel::kFragment) != 0 ||
+          target.kind_ == TargetKind::EXTENSION) {
+        fmt::format_to(out, "# rule #{} of {} cannot be expressed\n",
+                       row - chain.begin_, name);
+        skipped++;
+        continue;
+      }
+
+      fmt::format_to(out, "-A {}", name);
+      writeAddress(buffer, "-s", model.src_[row], model.smsk_[row],
+                   (flags & RulesetModel::kInvSrc) != 0);
+      writeAddress(buffer, "-d", model.dst_[row], model.dmsk_[row],
+                   (flags & RulesetModel::kInvDst) != 0);
+
+      const auto &iniface = model.ifaces_.get(model.iniface_[row]);
+      if (!iniface.empty()) {
+        fmt::format_to(out, "{} -i {}",
+                       (flags & RulesetModel::kInvIniface) != 0 ? " !" : "",
+                       iniface);
+      }
+      const auto &outiface = model.ifaces_.get(model.outiface_[row]);
+      if (!outiface.empty()) {
+        fmt::format_to(out, "{} -o {}",
+                       (flags & RulesetModel::kInvOutiface) != 0 ? " !" : "",
+                       outiface);
+      }
+
+      auto proto = model.proto_[row];
+      if (proto != 0) {
+        auto inverse = (flags & RulesetModel::kInvProto) != 0 ? " !" : "";
+        if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+          const auto *proto_name = proto == IPPROTO_TCP ? "tcp" : "udp";
+          fmt::format_to(out, "{} -p {}", inverse, proto_name);
+          if (model.sport_lo_[row] != 0 || model.sport_hi_[row] != kMaxPort ||
+              model.dport_lo_[row] != 0 || model.dport_hi_[row] != kMaxPort) {
+            fmt::format_to(out, " -m {}", proto_name);
+            writePorts(out, "--sport", model.sport_lo_[row],
+                       model.sport_hi_[row]);
+            writePorts(out, "--dport", model.dport_lo_[row],
+                       model.dport_hi_[row]);
+          }
+        } else {
+          fmt::format_to(out, "{} -p {}", inverse, proto);
+        }
+      }
+
+      if (target.kind_ != TargetKind::FALLTHROUGH) {
+        fmt::format_to(out, " -j {}", model.names_.get(target.name_));
+      }
+      buffer.push_back('\n');
+
+      if (buffer.size() >= kFlushSize) {
+        output.write(buffer.data(),
+                     static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+      }
+    }
+  }
+
+  fmt::format_to(out, "COMMIT\n");
+  output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  return skipped;
+}
+
+auto SaveFormat::write(std::ostream &output,
+                       const TableRuleset &ruleset) -> void {
+  fmt::memory_buffer buffer;
+  auto out = std::back_inserter(buffer);
+
+  fmt::format_to(out, "*{}\n", ruleset.table_);
+  for (const auto &chain : ruleset.chains_) {
+    fmt::format_to(out, ":{} {} [0:0]\n", chain.name_,
+                   chain.policy_.value_or("-"));
+  }
+
+  for (const auto &chain : ruleset.chains_) {
+    for (const auto &rule : chain.rules_) {
+      const auto &proto = rule->proto_;
+      auto ports = proto == RequestProto::TCP || proto == RequestProto::UDP;
+      if (!ports && (proto != RequestProto::ALL || !rule->matches_.empty())) {
+        fmt::format_to(out, "# rule of {} with protocol {} is skipped\n",
+                       chain.name_, proto);
+        continue;
+      }
+
+      fmt::format_to(out, "-A {}", chain.name_);
+      auto [src, smsk] = requestAddress(rule->src_ip_, rule->src_mask_);
+      writeAddress(buffer, "-s", src, smsk, false);
+      auto [dst, dmsk] = requestAddress(rule->dst_ip_, rule->dst_mask_);
+      writeAddress(buffer, "-d", dst, dmsk, false);
+      if (rule->iniface_.has_value()) {
+        fmt::format_to(out, " -i {}", *rule->iniface_);
+      }
+      if (rule->outiface_.has_value()) {
+        fmt::format_to(out, " -o {}", *rule->outiface_);
+      }
+
+      if (ports) {
+        const auto *proto_name = proto == RequestProto::TCP ? "tcp" : "udp";
+        fmt::format_to(out, " -p {}", proto_name);
+        for (const auto &match : rule->matches_) {
+          fmt::format_to(out, " -m {}", proto_name);
+          auto writeRange = [&out](const char *option, const auto &range) {
+            if (range.has_value()) {
+              writePorts(out, option,
+                         static_cast<uint16_t>(stoi(get<0>(*range))),
+                         static_cast<uint16_t>(stoi(get<1>(*range))));
+            }
+          };
+          writeRange("--sport", match.src_port_range_);
+          writeRange("--dport", match.dst_port_range_);
+        }
+      }
+      if (rule->set_match_.has_value()) {
+        fmt::format_to(out, " -m set --match-set {} {}",
+                       rule->set_match_->name_,
+                       rule->set_match_->src_ ? "src" : "dst");
+      }
+      if (rule->bpf_match_.has_value()) {
+        const auto &program = rule->bpf_match_->program_;
+        fmt::format_to(out, " -m bpf --bytecode \"{}", program.size());
+        for (const auto &insn : program) {
+          fmt::format_to(out, ",{} {} {} {}", insn.code, insn.jt, insn.jf,
+                         insn.k);
+        }
+        buffer.push_back('"');
+      }
+
+      if (!rule->target_.empty()) {
+        fmt::format_to(out, " -j {}", rule->target_);
+      }
+      if (rule->target_ == RequestTarget::CT && rule->ct_target_.has_value()) {
+        if (rule->ct_target_->notrack_) {
+          fmt::format_to(out, " --notrack");
+        }
+        if (rule->ct_target_->zone_ != 0) {
+          fmt::format_to(out, " --zone {}", rule->ct_target_->zone_);
+        }
+      }
+      if (rule->target_ == RequestTarget::NFQUEUE &&
+          rule->nfqueue_target_.has_value()) {
+        const auto &queue = *rule->nfqueue_target_;
+        if (queue.queues_total_ > 1) {
+          fmt::format_to(out, " --queue-balance {}:{}", queue.queue_num_,
+                         queue.queue_num_ + queue.queues_total_ - 1);
+        } else if (queue.queue_num_ != 0) {
+          fmt::format_to(out, " --queue-num {}", queue.queue_num_);
+        }
+        if (queue.bypass_) {
+          fmt::format_to(out, " --queue-bypass");
+        }
+        if (queue.cpu_fanout_) {
+          fmt::format_to(out, " --queue-cpu-fanout");
+        }
+      }
+      buffer.push_back('\n');
+
+      if (buffer.size() >= kFlushSize) {
+        output.write(buffer.data(),
+                     static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+      }
+    }
+  }
+
+  fmt::format_to(out, "COMMIT\n");
+  output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
@@ -0,0 +1,326 @@
+#include "backend/firewall/set_converter.h"
+#include "backend/firewall/rule_space.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <array>
+#include <netinet/in.h>
+#include <optional>
+#include <unordered_map>
+
+using std::optional;
+
+namespace {
+
+constexpr unsigned kHalfShift = 16;
+constexpr uint16_t kMaxPort = 65535;
+
+/* families still growing, the least recently grown one is closed beyond */
+constexpr size_t kMaxOpenFamilies = 256;
+
+/* a family that many rules may not be passed by is closed */
+constexpr size_t kMaxBlockers = 1024;
+
+/* set names are "cp_<chain>_<s|p><index>" */
+constexpr size_t kChainNameLen = 16;
+
+enum class Field { SRC, DPORT };
+
+auto isContiguous(uint32_t mask) -> bool { return (~mask & (~mask + 1)) == 0; }
+
+/* every field of a rule but the one its family varies in, and the target */
+using FamilyKey = std::array<uint32_t, 8>;
+
+class FamilyKeyHash {
+public:
+  auto operator()(const FamilyKey &key) const -> size_t {
+    size_t hash = 0;
+    for (auto value : key) {
+      hash = (hash ^ value) * 0x100000001B3ULL;
+    }
+    return hash;
+  }
+};
+
+class Item {
+public:
+  /* row in model */
+  uint32_t row_;
+
+  /* nullopt for rules that cannot be modeled, they block every family */
+  optional<RuleSpace> space_;
+  uint16_t target_;
+
+  /* ends evaluation, so rules with its target may pass it */
+  bool decisive_;
+
+  /* never matches, neither joins nor blocks */
+  bool unmatchable_;
+
+  /* set rule of an earlier pass, stands for all its members */
+  bool folded_{};
+};
+
+class Family {
+public:
+  Field field_;
+  uint16_t target_;
+
+  /* indices in items, ascending */
+  vector<size_t> members_;
+
+  /* rules after the first member that a later member may not overlap */
+  vector<size_t> blockers_;
+
+  /* region of all possible members, the varying field is open */
+  RuleSpace envelope_;
+
+  size_t last_grown_{};
+};
+
+class Converter {
+public:
+  Converter(const RulesetModel &model, vector<Item> items,
+            size_t min_members)
+      : model_(model), items_(std::move(items)), min_members_(min_members) {}
+
+  /* families of field with at least min_members_ members */
+  auto run(Field field) -> vector<Family> {
+    vector<Family> families;
+    std::unordered_map<FamilyKey, size_t, FamilyKeyHash> open;
+
+    for (size_t i = 0; i < items_.size(); i++) {
+      const auto &item = items_[i];
+      if (item.unmatchable_) {
+        continue;
+      }
+      if (!item.space_) {
+        open.clear(); /* no later member may pass it */
+        continue;
+      }
+
+      optional<size_t> joined;
+      if (eligible(item, field)) {
+        auto key = familyKey(*item.space_, item.target_, field);
+        auto found = open.find(key);
+        if (found != open.end() && !blocked(families[found->second], item)) {
+          joined = found->second;
+        } else {
+          if (open.size() >= kMaxOpenFamilies) {
+            closeOldest(open, families);
+          }
+          joined = families.size();
+          families.push_back(
+              {field, item.target_, {}, {}, envelope(*item.space_, field)});
+          open.insert_or_assign(key, *joined);
+        }
+        families[*joined].members_.push_back(i);
+        families[*joined].last_grown_ = i;
+      }
+
+      for (auto it = open.begin(); it != open.end();) {
+        auto &family = families[it->second];
+        if (it->second != joined && blocks(item, family)) {
+          family.blockers_.push_back(i);
+          if (family.blockers_.size() > kMaxBlockers) {
+            it = open.erase(it);
+            continue;
+          }
+        }
+        ++it;
+      }
+    }
+
+    std::erase_if(families, [this](const Family &family) {
+      return family.members_.size() < min_members_;
+    });
+    return families;
+  }
+
+  /* items after folding families, set rules stand at their first member */
+  [[nodiscard]] auto fold(const vector<Family> &families) const
+      -> vector<Item> {
+    vector<int> family_of(items_.size(), -1);
+    for (size_t f = 0; f < families.size(); f++) {
+      for (auto member : families[f].members_) {
+        family_of[member] = static_cast<int>(f);
+      }
+    }
+
+    vector<Item> folded;
+    for (size_t i = 0; i < items_.size(); i++) {
+      if (family_of[i] < 0) {
+        folded.push_back(items_[i]);
+        continue;
+      }
+      const auto &family = families[family_of[i]];
+      if (family.members_.front() == i) {
+        auto item = items_[i];
+        item.space_ = family.envelope_;
+        item.folded_ = true;
+        folded.push_back(item);
+      }
+    }
+    return folded;
+  }
+
+  [[nodiscard]] auto items() const -> const vector<Item> & { return items_; }
+
+private:
+  const RulesetModel &model_;
+  vector<Item> items_;
+  size_t min_members_;
+
+  static auto familyKey(const RuleSpace &space, uint16_t target,
+                        Field field) -> FamilyKey {
+    auto pack = [](uint32_t high, uint32_t low) {
+      return (high << kHalfShift) | low;
+    };
+    FamilyKey key = {space.src_,
+                     space.smsk_,
+                     space.dst_,
+                     space.dmsk_,
+                     pack(space.proto_, target),
+                     pack(space.iniface_, space.outiface_),
+                     pack(space.sport_lo_, space.sport_hi_),
+                     pack(space.dport_lo_, space.dport_hi_)};
+    if (field == Field::SRC) {
+      key[0] = key[1] = 0;
+    } else {
+      key[7] = 0;
+    }
+    return key;
+  }
+
+  static auto envelope(RuleSpace space, Field field) -> RuleSpace {
+    if (field == Field::SRC) {
+      space.src_ = space.smsk_ = 0;
+    } else {
+      space.dport_lo_ = 0;
+      space.dport_hi_ = kMaxPort;
+    }
+    return space;
+  }
+
+  static auto eligible(const Item &item, Field field) -> bool {
+    if (item.folded_ || !item.decisive_) {
+      return false;
+    }
+    if (field == Field::SRC) {
+      return isContiguous(item.space_->smsk_);
+    }
+    /* bitmap:port only looks at ports of tcp and udp */
+    return item.space_->proto_ == IPPROTO_TCP ||
+           item.space_->proto_ == IPPROTO_UDP;
+  }
+
+  /* a later member has to pass item to reach the first member */
+  auto blocks(const Item &item, const Family &family) const -> bool {
+    if (item.decisive_ && item.target_ == family.target_) {
+      return false;
+    }
+    return item.space_->overlaps(family.envelope_, model_.ifaces_);
+  }
+
+  auto blocked(const Family &family, const Item &item) const -> bool {
+    return std::ranges::any_of(family.blockers_, [&](size_t blocker) {
+      return items_[blocker].space_->overlaps(*item.space_, model_.ifaces_);
+    });
+  }
+
+  static auto closeOldest(
+      std::unordered_map<FamilyKey, size_t, FamilyKeyHash> &open,
+      const vector<Family> &families) -> void {
+    auto oldest = std::ranges::min_element(open, [&](const auto &a,
+                                                     const auto &b) {
+      return families[a.second].last_grown_ < families[b.second].last_grown_;
+    });
+    open.erase(oldest);
+  }
+};
+
+auto setName(const string &chain, Field field, int index) -> string {
+  return fmt::format("cp_{}_{}{}", chain.substr(0, kChainNameLen),
+                     field == Field::SRC ? 's' : 'p', index);
+}
+
+auto emit(const RulesetModel &model, const ModelChain &chain,
+          const vector<Item> &items, const Family &family,
+          SetPlan &plan) -> void {
+  const auto &head = items[family.members_.front()];
+  auto index = static_cast<int>(head.row_ - chain.begin_);
+
+  SetFamily result;
+  result.set_.name_ = setName(plan.chain_, family.field_, index);
+  result.set_.kind_ =
+      family.field_ == Field::SRC ? SetKind::NET : SetKind::PORT;
+  for (auto member : family.members_) {
+    const auto &space = *items[member].space_;
+    if (family.field_ == Field::SRC) {
+      result.set_.members_.emplace_back(space.src_, space.src_ | ~space.smsk_);
+    } else {
+      result.set_.members_.emplace_back(space.dport_lo_, space.dport_hi_);
+    }
+    result.members_.push_back(
+        static_cast<int>(items[member].row_ - chain.begin_));
+  }
+
+  const auto &target = model.targets_[family.target_];
+  result.rule_ = family.envelope_.toRequest(model.ifaces_,
+                                            model.names_.get(target.name_));
+  result.rule_->index_ = index;
+  result.rule_->set_match_ = SetMatch{result.set_.name_,
+                                      family.field_ == Field::SRC};
+
+  plan.removed_.insert(plan.removed_.end(), result.members_.begin() + 1,
+                       result.members_.end());
+  plan.families_.push_back(std::move(result));
+}
+
+} // namespace
+
+auto SetPlan::summary() const -> string {
+  return fmt::format("{} families of {} rules fold into set lookups, "
+                     "{} of {} rules removed",
+                     families_.size(), removed_.size() + families_.size(),
+                     removed_.size(), rule_count_);
+}
+
+auto SetConverter::plan(const RulesetModel &model, uint32_t chain,
+                        size_t min_members) -> SetPlan {
+  const auto &model_chain = model.chains_[chain];
+
+  vector<Item> items;
+  for (auto row = model_chain.begin_; row < model_chain.end_; row++) {
+    const auto &target = model.targetOf(row);
+    auto space = RuleSpace::fromRow(model, row);
+    /* set rule is rebuilt from the space, it must be expressible */
+    if (space && !space->toRequest(model.ifaces_, "")) {
+      space.reset();
+    }
+    items.push_back({row, space, model.target_[row],
+                     target.isTerminal() || target.kind_ == TargetKind::RETURN,
+                     space && RuleSpace::isUnmatchable(model, row)});
+  }
+
+  SetPlan plan;
+  plan.chain_ = model.names_.get(model_chain.name_);
+  plan.rule_count_ = model_chain.size();
+
+  Converter by_src(model, std::move(items), min_members);
+  auto src_families = by_src.run(Field::SRC);
+  for (const auto &family : src_families) {
+    emit(model, model_chain, by_src.items(), family, plan);
+  }
+
+  Converter by_port(model, by_src.fold(src_families), min_members);
+  for (const auto &family : by_port.run(Field::DPORT)) {
+    emit(model, model_chain, by_port.items(), family, plan);
+  }
+
+  std::ranges::sort(plan.families_, {}, [](const SetFamily &family) {
+    return family.rule_->index_;
+  });
+  std::ranges::sort(plan.removed_);
+  return plan;
+}
@@ -0,0 +1,219 @@
+#include "backend/firewall/shadow_analyzer.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+constexpr int kMaxPrefix = 32;
+
+/* ranged rules are indexed by every bucket of 256 ports they touch, up to
+ * kMaxPortBuckets. Wider ones, e.g. rules without port match, would be
+ * copied into most buckets and are kept in one list instead. */
+constexpr int kPortBucketShift = 8;
+constexpr int kMaxPortBuckets = 16;
+
+auto portBucket(uint16_t port) -> uint16_t {
+  return port >> kPortBucketShift;
+}
+
+auto prefixMask(int length) -> uint32_t {
+  return length == 0 ? 0U : ~0U << (kMaxPrefix - length);
+}
+
+class PrefixKey {
+public:
+  uint32_t src_;
+  uint32_t dst_;
+  uint8_t src_len_;
+  uint8_t dst_len_;
+
+  auto operator==(const PrefixKey &other) const -> bool = default;
+};
+
+class PrefixKeyHash {
+public:
+  auto operator()(const PrefixKey &key) const -> size_t {
+    constexpr int kShift = 32;
+    auto addrs = (static_cast<uint64_t>(key.src_) << kShift) | key.dst_;
+    auto lens = (static_cast<size_t>(key.src_len_) << 8U) | key.dst_len_;
+    return std::hash<uint64_t>()(addrs) ^ (lens * 0x9E3779B97F4A7C15ULL);
+  }
+};
+
+/* indexed rows of one prefix pair, in row order */
+class Bucket {
+public:
+  std::map<uint16_t, vector<uint32_t>> single_port_;
+  std::unordered_map<uint16_t, vector<uint32_t>> ranged_;
+  vector<uint32_t> wide_;
+};
+
+auto isTerminal(const ModelTarget &target) -> bool {
+  return target.isTerminal() || target.kind_ == TargetKind::RETURN;
+}
+
+} // namespace
+
+auto RuleAnomaly::serialize(const RulesetModel &model) const -> string {
+  const auto &chain = model.chains_[model.chainOf(row_)];
+  auto index = [&chain](uint32_t row) { return row - chain.begin_; };
+  auto target = [&model](uint32_t row) {
+    return model.names_.get(model.targetOf(row).name_);
+  };
+
+  switch (kind_) {
+  case AnomalyKind::SHADOWED:
+    return fmt::format("#{} is shadowed by #{} ({} never applies, {} wins)",
+                       index(row_), index(*other_), target(row_),
+                       target(*other_));
+  case AnomalyKind::REDUNDANT:
+    return fmt::format("#{} is redundant, #{} already applies {}",
+                       index(row_), index(*other_), target(row_));
+  case AnomalyKind::CORRELATED:
+    return fmt::format("#{} is correlated with #{} ({} vs {} on overlap)",
+                       index(row_), index(*other_), target(row_),
+                       target(*other_));
+  case AnomalyKind::UNMATCHABLE:
+    return fmt::format("#{} never matches, address has bits outside of mask",
+                       index(row_));
+  }
+  return {};
+}
+
+auto ShadowAnalyzer::analyze(const RulesetModel &model,
+                             uint32_t chain) -> ShadowReport {
+  ShadowReport report;
+  const auto &range = model.chains_[chain];
+
+  std::unordered_map<PrefixKey, Bucket, PrefixKeyHash> index;
+  /* distinct (src, dst) prefix lengths present in index */
+  vector<std::pair<uint8_t, uint8_t>> lengths;
+  /* spaces of indexed rows, by row - range.begin_ */
+  vector<optional<RuleSpace>> spaces(range.end_ - range.begin_);
+
+  for (auto row = range.begin_; row < range.end_; row++) {
+    if (RuleSpace::isUnmatchable(model, row)) {
+      report.anomalies_.push_back({AnomalyKind::UNMATCHABLE, row, {}});
+      continue;
+    }
+
+    auto space = RuleSpace::fromRow(model, row);
+    if (!space || !space->hasContiguousMasks()) {
+      report.skipped_++;
+      continue;
+    }
+
+    auto src_len = static_cast<uint8_t>(std::popcount(space->smsk_));
+    auto dst_len = static_cast<uint8_t>(std::popcount(space->dmsk_));
+    auto single = space->dport_lo_ == space->dport_hi_;
+
+    optional<uint32_t> cover;
+    optional<uint32_t> correlated;
+    auto visit = [&](const vector<uint32_t> &rows) {
+      for (auto other : rows) {
+        if (cover && other >= *cover) {
+          return;
+        }
+        const auto &other_space = *spaces[other - range.begin_];
+        if (other_space.covers(*space, model.ifaces_)) {
+          cover = other;
+          return;
+        }
+        if (!correlated && model.target_[other] != model.target_[row] &&
+            other_space.overlaps(*space, model.ifaces_)) {
+          correlated = other;
+        }
+      }
+    };
+
+    for (auto [src_prefix, dst_prefix] : lengths) {
+      if (src_prefix > src_len || dst_prefix > dst_len) {
+        continue;
+      }
+      PrefixKey key{space->src_ & prefixMask(src_prefix),
+                    space->dst_ & prefixMask(dst_prefix), src_prefix,
+                    dst_prefix};
+      auto bucket = index.find(key);
+      if (bucket == index.end()) {
+        continue;
+      }
+      /* single port rules can only cover the same port, but correlate
+       * with any range containing it */
+      const auto &singles = bucket->second.single_port_;
+      if (single || !correlated) {
+        auto last = singles.upper_bound(space->dport_hi_);
+        for (auto iter = singles.lower_bound(space->dport_lo_);
+             iter != last && (single || !correlated); ++iter) {
+          visit(iter->second);
+        }
+      }
+
+      visit(bucket->second.wide_);
+
+      /* a cover contains the lowest port, only overlaps are in the others */
+      const auto &ranged = bucket->second.ranged_;
+      auto first = portBucket(space->dport_lo_);
+      auto last = portBucket(space->dport_hi_);
+      if (auto rows = ranged.find(first); rows != ranged.end()) {
+        visit(rows->second);
+      }
+      if (correlated || first == last) {
+        continue;
+      }
+      if (static_cast<size_t>(last - first) > ranged.size()) {
+        /* fewer buckets indexed than spanned, e.g. a rule without port */
+        for (const auto &[port, rows] : ranged) {
+          if (first < port && port <= last && !correlated) {
+            visit(rows);
+          }
+        }
+        continue;
+      }
+      for (auto port = first + 1; port <= last && !correlated; port++) {
+        if (auto rows = ranged.find(port); rows != ranged.end()) {
+          visit(rows->second);
+        }
+      }
+    }
+
+    if (cover) {
+      auto kind = model.target_[*cover] == model.target_[row]
+                      ? AnomalyKind::REDUNDANT
+                      : AnomalyKind::SHADOWED;
+      report.anomalies_.push_back({kind, row, cover});
+      continue; /* never reached, cannot shadow others */
+    }
+    if (correlated) {
+      report.anomalies_.push_back({AnomalyKind::CORRELATED, row, correlated});
+    }
+
+    if (!isTerminal(model.targetOf(row))) {
+      continue;
+    }
+    auto &bucket = index[PrefixKey{space->src_, space->dst_, src_len, dst_len}];
+    auto first = portBucket(space->dport_lo_);
+    auto last = portBucket(space->dport_hi_);
+    if (single) {
+      bucket.single_port_[space->dport_lo_].push_back(row);
+    } else if (last - first >= kMaxPortBuckets) {
+      bucket.wide_.push_back(row);
+    } else {
+      for (auto port = first; port <= last; port++) {
+        bucket.ranged_[port].push_back(row);
+      }
+    }
+    spaces[row - range.begin_] = space;
+    if (std::ranges::find(lengths, std::make_pair(src_len, dst_len)) ==
+        lengths.end()) {
+      lengths.emplace_back(src_len, dst_len);
+    }
+  }
+
+  return report;
+}
@@ -0,0 +1,270 @@
+#include "backend/firewall/table_compiler.h"
+#include "backend/firewall/kernel_table.h"
+#include "fmt/format.h"
+#include "tools/log.h"
+
+#include <cerrno>
+#include <cstring>
+#include <linux/netfilter.h>
+#include <linux/netfilter/x_tables.h>
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using std::unordered_map;
+
+namespace {
+constexpr size_t kEntrySize = XT_ALIGN(sizeof(struct ipt_entry));
+constexpr size_t kStandardTargetSize =
+    XT_ALIGN(sizeof(struct xt_standard_target));
+constexpr size_t kStandardSize = kEntrySize + kStandardTargetSize;
+constexpr size_t kErrorSize =
+    kEntrySize + XT_ALIGN(sizeof(struct xt_error_target));
+
+auto standardVerdict(const string &target) -> optional<int> {
+  static const unordered_map<string, int> verdicts = {
+      {IPTC_LABEL_ACCEPT, -NF_ACCEPT - 1},
+      {IPTC_LABEL_DROP, -NF_DROP - 1},
+      {IPTC_LABEL_QUEUE, -NF_QUEUE - 1},
+      {IPTC_LABEL_RETURN, XT_RETURN},
+  };
+
+  if (auto iter = verdicts.find(target); iter != verdicts.end()) {
+    return iter->second;
+  }
+  return std::nullopt;
+}
+
+auto writeStandardEntry(char *buffer, int verdict) -> void {
+  auto *entry = reinterpret_cast<struct ipt_entry *>(buffer);
+  entry->target_offset = kEntrySize;
+  entry->next_offset = kStandardSize;
+
+  auto *target =
+      reinterpret_cast<struct xt_standard_target *>(buffer + kEntrySize);
+  target->target.u.user.target_size = kStandardTargetSize;
+  target->verdict = verdict;
+}
+
+auto writeErrorEntry(char *buffer, const string &name) -> void {
+  auto *entry = reinterpret_cast<struct ipt_entry *>(buffer);
+  entry->target_offset = kEntrySize;
+  entry->next_offset = kErrorSize;
+
+  auto *target =
+      reinterpret_cast<struct xt_error_target *>(buffer + kEntrySize);
+  target->target.u.user.target_size = XT_ALIGN(sizeof(struct xt_error_target));
+  strncpy(target->target.u.user.name, XT_ERROR_TARGET,
+          sizeof(target->target.u.user.name) - 1);
+  strncpy(target->errorname, name.c_str(), sizeof(target->errorname) - 1);
+}
+} // namespace
+
+MappedBuffer::MappedBuffer(size_t size) : size_(size) {
+  auto *addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  data_ = static_cast<char *>(addr);
+}
+
+MappedBuffer::~MappedBuffer() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+}
+
+MappedBuffer::MappedBuffer(MappedBuffer &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)) {}
+
+auto MappedBuffer::operator=(MappedBuffer &&other) noexcept -> MappedBuffer & {
+  if (this != &other) {
+    if (data_ != nullptr) {
+      munmap(data_, size_);
+    }
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+  }
+  return *this;
+}
+
+auto TableCompiler::compile(const TableRuleset &ruleset, // NOLINT
+                            const struct ipt_getinfo &info,
+                            const ctx_t &context) -> optional<MappedBuffer> {
+  const auto &hooks = KernelTable::hookNames();
+
+  /* builtin chains go first in hook order, then user chains */
+  vector<ChainRuleset> default_chains;
+  default_chains.reserve(NF_INET_NUMHOOKS); /* keep pointers stable */
+  vector<const ChainRuleset *> chains;
+  vector<int> chain_hooks;
+  for (int hook = 0; hook < NF_INET_NUMHOOKS; hook++) {
+    if ((info.valid_hooks & (1U << hook)) == 0) {
+      continue;
+    }
+
+    const ChainRuleset *chain = nullptr;
+    for (const auto &candidate : ruleset.chains_) {
+      if (candidate.name_ == hooks.at(hook)) {
+        chain = &candidate;
+      }
+    }
+    if (chain == nullptr) {
+      default_chains.push_back({hooks.at(hook), IPTC_LABEL_ACCEPT, {}});
+      chain = &default_chains.back();
+    }
+
+    chains.emplace_back(chain);
+    chain_hooks.emplace_back(hook);
+  }
+
+  auto builtin_num = chains.size();
+  for (const auto &chain : ruleset.chains_) {
+    if (std::ranges::find(chains, &chain) == chains.end()) {
+      chains.emplace_back(&chain);
+      chain_hooks.emplace_back(-1);
+    }
+  }
+
+  /* pass 1: layout of all chains */
+  unordered_map<string, unsigned int> user_chain_offsets;
+  vector<unsigned int> chain_offsets;
+  vector<unsigned int> tail_offsets;
+  size_t size = 0;
+  unsigned int num_entries = 0;
+  for (size_t i = 0; i < chains.size(); i++) {
+    if (i >= builtin_num) {
+      size += kErrorSize;
+      num_entries++;
+    }
+
+    if (i >= builtin_num &&
+        !user_chain_offsets.emplace(chains[i]->name_, size).second) {
+      context->setLastError(
+          fmt::format("Duplicated chain: {}", chains[i]->name_));
+      return std::nullopt;
+    }
+    chain_offsets.emplace_back(size);
+
+    for (const auto &rule : chains[i]->rules_) {
+      size += rule->entry_size();
+      num_entries++;
+    }
+
+    tail_offsets.emplace_back(size);
+    size += kStandardSize;
+    num_entries++;
+  }
+  size += kErrorSize;
+  num_entries++;
+
+  MappedBuffer buffer(sizeof(struct ipt_replace) + size);
+  auto *replace = reinterpret_cast<struct ipt_replace *>(buffer.data());
+  strncpy(replace->name, ruleset.table_.c_str(), sizeof(replace->name) - 1);
+  replace->valid_hooks = info.valid_hooks;
+  replace->num_entries = num_entries;
+  replace->size = size;
+  replace->num_counters = info.num_entries;
+
+  /* pass 2: write entries */
+  auto is_chain = [&user_chain_offsets](const string &name) {
+    return user_chain_offsets.contains(name);
+  };
+  auto *entries = reinterpret_cast<char *>(replace->entries);
+  for (size_t i = 0; i < chains.size(); i++) {
+    const auto &chain = *chains[i];
+    auto offset = static_cast<size_t>(chain_offsets[i]);
+
+    if (i >= builtin_num) {
+      writeErrorEntry(entries + offset - kErrorSize, chain.name_);
+    } else {
+      replace->hook_entry[chain_hooks[i]] = chain_offsets[i];
+      replace->underflow[chain_hooks[i]] = tail_offsets[i];
+    }
+
+    for (size_t j = 0; j < chain.rules_.size(); j++) {
+      auto *buf = entries + offset;
+      if (!chain.rules_[j]->write_entry_bytes(context, buf, is_chain)) {
+        context->setLastError(fmt::format("Chain {} rule #{}: {}", chain.name_,
+                                          j, context->getLastError()));
+        return std::nullopt;
+      }
+
+      auto *entry = reinterpret_cast<struct ipt_entry *>(buf);
+      auto *target = reinterpret_cast<struct xt_standard_target *>(
+          buf + entry->target_offset);
+      auto name = string(target->target.u.user.name);
+
+      /* kernel knows standard targets only by verdict */
+      optional<int> verdict = standardVerdict(name);
+      if (auto iter = user_chain_offsets.find(name);
+          iter != user_chain_offsets.end()) {
+        verdict = static_cast<int>(iter->second);
+      } else if (name.empty()) {
+        verdict = static_cast<int>(offset + entry->next_offset);
+      }
+
+      if (verdict.has_value()) {
+        if (target->target.u.user.target_size != kStandardTargetSize) {
+          context->setLastError(fmt::format(
+              "Chain {} rule #{}: bad standard target size", chain.name_, j));
+          return std::nullopt;
+        }
+        memset(target->target.u.user.name, 0,
+               sizeof(target->target.u.user.name));
+        target->verdict = verdict.value();
+      }
+
+      offset += entry->next_offset;
+    }
+
+    /* policy for builtin chain, return for user chain */
+    auto policy = chain.policy_.value_or(IPTC_LABEL_ACCEPT);
+    auto verdict = i < builtin_num ? standardVerdict(policy)
+                                   : optional<int>(XT_RETURN);
+    if (!verdict.has_value() || verdict == -NF_QUEUE - 1 ||
+        (i < builtin_num && verdict == XT_RETURN)) {
+      context->setLastError(
+          fmt::format("Invalid policy of chain {}: {}", chain.name_, policy));
+      return std::nullopt;
+    }
+    writeStandardEntry(entries + offset, verdict.value());
+  }
+  writeErrorEntry(entries + size - kErrorSize, XT_ERROR_TARGET);
+
+  return buffer;
+}
+
+auto TableCompiler::replace(const TableRuleset &ruleset,
+                            const ctx_t &context) -> bool {
+  auto info = KernelTable::getInfo(ruleset.table_);
+  if (!info.has_value()) {
+    context->setLastError(fmt::format("Error getting table {}: {}",
+                                      ruleset.table_, strerror(errno)));
+    return false;
+  }
+
+  auto blob = compile(ruleset, info.value(), context);
+  if (!blob.has_value()) {
+    return false;
+  }
+
+  /* kernel returns counters of old entries here */
+  vector<struct xt_counters> counters(info->num_entries);
+  auto *replace = reinterpret_cast<struct ipt_replace *>(blob->data());
+  replace->counters = counters.data();
+
+  if (!KernelTable::replace(replace, blob->size())) {
+    context->setLastError(fmt::format("Error replacing table {}: {}",
+                                      ruleset.table_, strerror(errno)));
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,63 @@
+#include "backend/firewall/xtables_lock.h"
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <thread>
+#include <unistd.h>
+
+XtablesLock::XtablesLock(std::chrono::milliseconds timeout,
+                         const string &path) {
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed = [&start]() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+  };
+
+  /* same flags and mode as iptables, so either side can create it */
+  fd_ = open(path.c_str(), O_CREAT | O_CLOEXEC, 0600);
+  if (fd_ < 0) {
+    error_ = fmt::format("Cannot open lock file {}: {}", path,
+                         strerror(errno));
+    return;
+  }
+
+  auto backoff = std::chrono::duration_cast<std::chrono::microseconds>(
+      kMinBackoff);
+  while (true) {
+    if (flock(fd_, LOCK_EX | LOCK_NB) == 0) {
+      locked_ = true;
+      break;
+    }
+    if (errno != EWOULDBLOCK && errno != EINTR) {
+      error_ = fmt::format("Cannot lock {}: {}", path, strerror(errno));
+      break;
+    }
+
+    contended_ = true;
+    auto remaining = timeout - elapsed();
+    if (remaining <= std::chrono::microseconds::zero()) {
+      error_ = fmt::format("Another app is holding {}, gave up after {} ms",
+                           path, timeout.count());
+      break;
+    }
+    std::this_thread::sleep_for(std::min(backoff, remaining));
+    backoff = std::min(backoff * 2,
+                       std::chrono::duration_cast<std::chrono::microseconds>(
+                           kMaxBackoff));
+  }
+
+  waited_ = elapsed();
+}
+
+XtablesLock::~XtablesLock() {
+  if (fd_ >= 0) {
+    auto saved_errno = errno;
+    /* closing releases the flock */
+    close(fd_);
+    errno = saved_errno;
+  }
+}
@@ -1,15 +1,22 @@
 #include "controlpanel.h"
 #include "backend/config_manager.h"
+#include "frontend/command_line.h"
 #include "frontend/main_menu.h"
 #include "frontend/ui_base.h"
 #include "tools/log.h"
 
 #include <memory>
+#include <string>
+#include <vector>
 
-auto main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) -> int {
+auto main(int argc, char **argv) -> int {
   YUILog::setLogFileName("/tmp/controlpanel.log");
   YUILog::enableDebugLogging();
 
+  if (argc > 1) {
+    return CommandLine::run(std::vector<std::string>(argv + 1, argv + argc));
+  }
+
   YUI::app()->setApplicationTitle("Control Panel");
 
   auto menu = std::make_shared<MainMenu>("Main Menu");
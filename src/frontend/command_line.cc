@@ -0,0 +1,623 @@
+#include "frontend/command_line.h"
+#include "backend/config_manager.h"
+#include "backend/firewall/classifier.h"
+#include "backend/firewall/firewall_backend.h"
+#include "tools/log.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+/* commit pending changes, the reason is printed if it failed */
+auto commitChanges(const shared_ptr<FirewallBackend> &backend,
+                   const string &command) -> int {
+  if (backend->commit()) {
+    return 0;
+  }
+  std::cerr << command << ": " << backend->lastCommitError() << endl;
+  return 1;
+}
+
+} // namespace
+
+auto CommandLine::commands()
+    -> const vector<tuple<string, string, command_func>> & {
+  static const vector<tuple<string, string, command_func>> kCommands = {
+      {"save", "save [table]  write tables in iptables-save format", save},
+      {"restore", "restore [file]  load iptables-save file and commit",
+       restore},
+      {"classify",
+       "classify table chain src dst proto sport dport [in [out]]  "
+       "show rule hit by packet",
+       classify},
+      {"classify-batch",
+       "classify-batch table chain tuples [rules]  per-rule hits of tuples, "
+       "optionally against an uncommitted iptables-save file",
+       classifyBatch},
+      {"optimize",
+       "optimize table chain [--apply]  print chain restructured into a tree "
+       "of user chains, and commit it with --apply",
+       optimize},
+      {"compact",
+       "compact table chain [--apply]  merge rules of adjacent CIDR blocks "
+       "or port ranges, and commit it with --apply",
+       compact},
+      {"sets",
+       "sets table chain [--apply]  fold rules differing only in source "
+       "address or destination port into ipset lookups, and commit it with "
+       "--apply",
+       sets},
+      {"bpf",
+       "bpf table chain [--apply]  compile runs of rules into bpf matches, "
+       "check them against the chain on random packets, and commit them "
+       "with --apply",
+       bpf},
+      {"bypass",
+       "bypass tcp|udp|all ports [--addr addr[/len]] [--iface name] [--apply]"
+       "  print raw rules skipping conntrack for a local service, e.g. ports "
+       "'53,8000:8100', with filter rules accepting the same packets, and "
+       "commit them with --apply",
+       bypass},
+      {"reorder",
+       "reorder table chain [--apply]  move rules with high packet counters "
+       "earlier, and commit it with --apply",
+       reorder},
+      {"sample",
+       "sample table file [interval_ms [count]]  write rule counters and "
+       "rates for the node_exporter textfile collector, count 0 runs forever",
+       sample},
+      {"query",
+       "query [--explain] expression  print rules of all tables matching "
+       "e.g. 'proto == tcp && dport overlaps 8000-9000 && target == DROP'",
+       query},
+      {"graph",
+       "graph table  print rules evaluated per packet of each hook, chain "
+       "references, unreachable chains and jump cycles",
+       graph},
+  };
+  return kCommands;
+}
+
+auto CommandLine::run(const vector<string> &args) -> int {
+  for (const auto &[name, help, func] : commands()) {
+    if (!args.empty() && args.front() == name) {
+      try {
+        return func(vector<string>(args.begin() + 1, args.end()));
+      } catch (const std::exception &e) {
+        std::cerr << name << ": " << e.what() << endl;
+        return 1;
+      }
+    }
+  }
+
+  return usage();
+}
+
+auto CommandLine::usage() -> int {
+  std::cerr << "Usage: controlpanel [command]" << endl;
+  for (const auto &[name, help, func] : commands()) {
+    std::cerr << "  " << help << endl;
+  }
+  return 2;
+}
+
+auto CommandLine::save(const vector<string> &args) -> int {
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto context = std::make_shared<FirewallContext>();
+  if (!args.empty()) {
+    context = FirewallBackend::createContext(context, args.front());
+  }
+
+  auto skipped = backend->exportRuleset(std::cout, context);
+  std::cout.flush();
+  if (skipped > 0) {
+    std::cerr << skipped << " rules cannot be expressed, written as comments"
+              << endl;
+  }
+  return 0;
+}
+
+auto CommandLine::restore(const vector<string> &args) -> int {
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+
+  optional<string> error;
+  if (args.empty()) {
+    error = backend->importRuleset(std::cin);
+  } else {
+    std::ifstream input(args.front());
+    if (!input) {
+      std::cerr << "Cannot open " << args.front() << endl;
+      return 1;
+    }
+    error = backend->importRuleset(input);
+  }
+
+  if (error) {
+    std::cerr << "restore: " << *error << endl;
+    return 1;
+  }
+  return commitChanges(backend, "restore");
+}
+
+namespace {
+
+/* model of table and index of chain named in args[0], args[1] */
+auto loadChain(const vector<string> &args)
+    -> std::pair<shared_ptr<const RulesetModel>, uint32_t> {
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto context = FirewallBackend::createContext(
+      std::make_shared<FirewallContext>(), args[0]);
+  auto model = backend->getRulesetModel(context);
+  if (model == nullptr) {
+    throw std::runtime_error(context->getLastError());
+  }
+  auto chain = model->findChain(args[1]);
+  if (!chain) {
+    throw std::out_of_range(fmt::format("No chain {} in {}", args[1], args[0]));
+  }
+  return {model, *chain};
+}
+
+auto describeRow(const RulesetModel &model, uint32_t row) -> string {
+  const auto &chain = model.chains_[model.chainOf(row)];
+  return fmt::format("{} #{} -> {}", model.names_.get(chain.name_),
+                     row - chain.begin_,
+                     model.names_.get(model.targetOf(row).name_));
+}
+
+} // namespace
+
+auto CommandLine::classify(const vector<string> &args) -> int {
+  constexpr size_t kTupleStart = 2;
+  if (args.size() < kTupleStart + 5) {
+    return usage();
+  }
+
+  auto tuple = std::accumulate(
+      args.begin() + kTupleStart, args.end(), string(),
+      [](string line, const string &field) { return line + field + ' '; });
+  auto packet = PacketTuple::parse(tuple);
+  if (!packet) {
+    std::cerr << "Invalid packet: " << tuple << endl;
+    return 1;
+  }
+
+  auto [model, chain] = loadChain(args);
+  Classifier classifier(model);
+  auto result = classifier.classify(*packet, chain);
+
+  for (auto row : result.jumps_) {
+    std::cout << "jump   " << describeRow(*model, row) << endl;
+  }
+  for (auto row : result.uncertain_) {
+    std::cout << "unsure " << describeRow(*model, row) << endl;
+  }
+  if (result.rule_) {
+    std::cout << "hit    " << describeRow(*model, *result.rule_) << endl;
+  } else if (result.target_) {
+    std::cout << "policy "
+              << model->names_.get(model->targets_[*result.target_].name_)
+              << endl;
+  } else {
+    std::cout << "return from " << args[1] << endl;
+  }
+  return 0;
+}
+
+auto CommandLine::classifyBatch(const vector<string> &args) -> int {
+  constexpr size_t kRulesArg = 3;
+  if (args.size() < kRulesArg) {
+    return usage();
+  }
+
+  if (args.size() > kRulesArg) {
+    auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+    std::ifstream rules(args[kRulesArg]);
+    if (!rules) {
+      std::cerr << "Cannot open " << args[kRulesArg] << endl;
+      return 1;
+    }
+    if (auto error = backend->importRuleset(rules); error) {
+      std::cerr << "classify-batch: " << *error << endl;
+      return 1;
+    }
+  }
+
+  std::ifstream tuples(args[2]);
+  if (!tuples) {
+    std::cerr << "Cannot open " << args[2] << endl;
+    return 1;
+  }
+
+  auto [model, chain] = loadChain(args);
+  auto histogram = Classifier(model).classifyBatch(tuples, chain);
+
+  auto percent = [&histogram](uint64_t hits) {
+    return histogram.packets_ == 0
+               ? 0.0
+               : 100.0 * static_cast<double>(hits) /
+                     static_cast<double>(histogram.packets_);
+  };
+  for (uint32_t row = 0; row < histogram.rule_hits_.size(); row++) {
+    if (histogram.rule_hits_[row] > 0) {
+      std::cout << fmt::format("{:>12} {:>6.2f}%  {}\n",
+                               histogram.rule_hits_[row],
+                               percent(histogram.rule_hits_[row]),
+                               describeRow(*model, row));
+    }
+  }
+  for (uint32_t index = 0; index < histogram.policy_hits_.size(); index++) {
+    if (histogram.policy_hits_[index] > 0) {
+      std::cout << fmt::format(
+          "{:>12} {:>6.2f}%  {} policy\n", histogram.policy_hits_[index],
+          percent(histogram.policy_hits_[index]),
+          model->names_.get(model->chains_[index].name_));
+    }
+  }
+  std::cout << fmt::format("{} packets, {} invalid lines\n",
+                           histogram.packets_, histogram.invalid_lines_);
+  return 0;
+}
+
+auto CommandLine::optimize(const vector<string> &args) -> int {
+  if (args.size() < 2 || (args.size() > 2 && args[2] != "--apply")) {
+    return usage();
+  }
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto context = FirewallBackend::createContext(
+      FirewallBackend::createContext(std::make_shared<FirewallContext>(),
+                                     args[0]),
+      args[1]);
+  auto plan = backend->planOptimization(context);
+  if (!plan) {
+    std::cerr << "optimize: " << context->getLastError() << endl;
+    return 1;
+  }
+
+  SaveFormat::write(std::cout, plan->ruleset_);
+  std::cout.flush();
+  std::cerr << plan->summary() << endl;
+  if (args.size() == 2) {
+    return 0;
+  }
+
+  if (!backend->applyOptimization(context, *plan)) {
+    std::cerr << "optimize: " << context->getLastError() << endl;
+    return 1;
+  }
+  return commitChanges(backend, "optimize");
+}
+
+auto CommandLine::compact(const vector<string> &args) -> int {
+  if (args.size() < 2 || (args.size() > 2 && args[2] != "--apply")) {
+    return usage();
+  }
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto context = FirewallBackend::createContext(
+      FirewallBackend::createContext(std::make_shared<FirewallContext>(),
+                                     args[0]),
+      args[1]);
+  auto plan = backend->planCompaction(context);
+  if (!plan) {
+    std::cerr << "compact: " << context->getLastError() << endl;
+    return 1;
+  }
+  for (const auto &request : plan->replaced_) {
+    std::cout << fmt::format("#{} widened", request->index_) << endl;
+  }
+  for (auto index : plan->removed_) {
+    std::cout << fmt::format("#{} merged", index) << endl;
+  }
+  std::cerr << fmt::format("{} of {} rules removed", plan->removed_.size(),
+                           plan->rule_count_)
+            << endl;
+  if (args.size() == 2 || plan->removed_.empty()) {
+    return 0;
+  }
+
+  if (!backend->applyCompaction(context, *plan)) {
+    std::cerr << "compact: " << context->getLastError() << endl;
+    return 1;
+  }
+  return commitChanges(backend, "compact");
+}
+
+auto CommandLine::sets(const vector<string> &args) -> int {
+  if (args.size() < 2 || (args.size() > 2 && args[2] != "--apply")) {
+    return usage();
+  }
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto context = FirewallBackend::createContext(
+      FirewallBackend::createContext(std::make_shared<FirewallContext>(),
+                                     args[0]),
+      args[1]);
+  auto plan = backend->planSetConversion(context);
+  if (!plan) {
+    std::cerr << "sets: " << context->getLastError() << endl;
+    return 1;
+  }
+  for (const auto &family : plan->families_) {
+    std::cout << fmt::format("#{} {} rules -> {}", family.rule_->index_,
+                             family.members_.size(), family.set_.name_)
+              << endl;
+  }
+  std::cerr << plan->summary() << endl;
+  if (args.size() == 2 || plan->families_.empty()) {
+    return 0;
+  }
+
+  if (!backend->applySetConversion(context, *plan)) {
+    std::cerr << "sets: " << context->getLastError() << endl;
+    return 1;
+  }
+  return commitChanges(backend, "sets");
+}
+
+auto CommandLine::bpf(const vector<string> &args) -> int {
+  if (args.size() < 2 || (args.size() > 2 && args[2] != "--apply")) {
+    return usage();
+  }
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto context = FirewallBackend::createContext(
+      FirewallBackend::createContext(std::make_shared<FirewallContext>(),
+                                     args[0]),
+      args[1]);
+  auto plan = backend->planBpfCompilation(context);
+  if (!plan) {
+    std::cerr << "bpf: " << context->getLastError() << endl;
+    return 1;
+  }
+  for (const auto &run : plan->runs_) {
+    std::cout << fmt::format("#{}-#{} -> {} instructions",
+                             run.members_.front(), run.members_.back(),
+                             run.rule_->bpf_match_->program_.size())
+              << endl;
+  }
+  std::cerr << plan->summary() << endl;
+  if (args.size() == 2 || plan->runs_.empty()) {
+    return 0;
+  }
+
+  if (!backend->applyBpfCompilation(context, *plan)) {
+    std::cerr << "bpf: " << context->getLastError() << endl;
+    return 1;
+  }
+  return commitChanges(backend, "bpf");
+}
+
+auto CommandLine::bypass(const vector<string> &args) -> int {
+  if (args.size() < 2) {
+    return usage();
+  }
+
+  BypassService service;
+  if (args[0] == "tcp") {
+    service.proto_ = RequestProto::TCP;
+  } else if (args[0] == "udp") {
+    service.proto_ = RequestProto::UDP;
+  } else if (args[0] == "all") {
+    service.proto_ = RequestProto::ALL;
+  } else {
+    return usage();
+  }
+  auto ports = ConntrackBypass::parsePorts(args[1]);
+  if (!ports) {
+    std::cerr << "bypass: invalid ports: " << args[1] << endl;
+    return 1;
+  }
+  service.ports_ = std::move(*ports);
+
+  auto apply = false;
+  for (size_t i = 2; i < args.size(); i++) {
+    if (args[i] == "--apply") {
+      apply = true;
+    } else if (args[i] == "--addr" && i + 1 < args.size()) {
+      if (!ConntrackBypass::parseAddress(args[++i], service)) {
+        std::cerr << "bypass: invalid address: " << args[i] << endl;
+        return 1;
+      }
+    } else if (args[i] == "--iface" && i + 1 < args.size()) {
+      service.iface_ = args[++i];
+    } else {
+      return usage();
+    }
+  }
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto plan = backend->planConntrackBypass(service);
+  for (const auto &rule : plan.rules_) {
+    std::stringstream line;
+    SaveFormat::write(line, TableRuleset{rule.table_,
+                                         {ChainRuleset{rule.chain_,
+                                                       std::nullopt,
+                                                       {rule.rule_}}}});
+    for (string text; std::getline(line, text);) {
+      if (text.starts_with("-A")) {
+        std::cout << fmt::format("{} {}{}", rule.table_, text, rule.note())
+                  << endl;
+      }
+    }
+  }
+  std::cerr << plan.summary() << endl;
+  if (!apply || plan.pending() == 0) {
+    return 0;
+  }
+
+  auto context = std::make_shared<FirewallContext>();
+  if (!backend->applyConntrackBypass(context, plan)) {
+    std::cerr << "bypass: " << context->getLastError() << endl;
+    return 1;
+  }
+  return commitChanges(backend, "bypass");
+}
+
+auto CommandLine::reorder(const vector<string> &args) -> int {
+  if (args.size() < 2 || (args.size() > 2 && args[2] != "--apply")) {
+    return usage();
+  }
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto context = FirewallBackend::createContext(
+      FirewallBackend::createContext(std::make_shared<FirewallContext>(),
+                                     args[0]),
+      args[1]);
+  auto plan = backend->planReorder(context);
+  if (!plan) {
+    std::cerr << "reorder: " << context->getLastError() << endl;
+    return 1;
+  }
+  for (size_t i = 0; i < plan->order_.size(); i++) {
+    if (plan->order_[i] != static_cast<int>(i)) {
+      std::cout << fmt::format("#{} -> #{}", plan->order_[i], i) << endl;
+    }
+  }
+  std::cerr << plan->summary() << endl;
+  if (args.size() == 2 || plan->moved_ == 0) {
+    return 0;
+  }
+
+  if (!backend->reorderRules(context, plan->order_)) {
+    std::cerr << "reorder: " << context->getLastError() << endl;
+    return 1;
+  }
+  return commitChanges(backend, "reorder");
+}
+
+auto CommandLine::sample(const vector<string> &args) -> int {
+  static constexpr int kDefaultIntervalMs = 1000;
+
+  if (args.size() < 2 || args.size() > 4) {
+    return usage();
+  }
+  auto interval = std::chrono::milliseconds(
+      args.size() > 2 ? std::stoi(args[2]) : kDefaultIntervalMs);
+  auto count = args.size() > 3 ? std::stoi(args[3]) : 0;
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto sampler = backend->getCounterSampler(FirewallBackend::createContext(
+      std::make_shared<FirewallContext>(), args[0]));
+
+  /* keep a fixed cadence, rates are computed from sample timestamps */
+  auto next = std::chrono::steady_clock::now();
+  for (int i = 0; count == 0 || i < count; i++) {
+    if (!sampler->sample()) {
+      std::cerr << "sample: " << strerror(errno) << endl;
+      return 1;
+    }
+    if (auto error = sampler->writeTextfile(args[1])) {
+      std::cerr << "sample: " << *error << endl;
+      return 1;
+    }
+
+    if (count == 0 || i + 1 < count) {
+      next += interval;
+      std::this_thread::sleep_until(next);
+    }
+  }
+  return 0;
+}
+
+auto CommandLine::query(const vector<string> &args) -> int {
+  auto explain = !args.empty() && args.front() == "--explain";
+  auto first = args.begin() + (explain ? 1 : 0);
+  if (first == args.end()) {
+    return usage();
+  }
+  /* unquoted words of the shell are joined again */
+  auto text = std::accumulate(
+      first, args.end(), string(),
+      [](string line, const string &word) { return line + word + ' '; });
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  if (explain) {
+    auto parsed = RuleQuery::parse(text);
+    for (const auto &table : FirewallBackend::getTableNames()) {
+      std::cout << table << ": ";
+      if (!parsed.mayMatchTable(table)) {
+        std::cout << "skipped" << endl;
+        continue;
+      }
+      auto context = FirewallBackend::createContext(
+          std::make_shared<FirewallContext>(), table);
+      auto model = backend->getRulesetModel(context);
+      if (model == nullptr) {
+        std::cout << "not loaded, " << context->getLastError() << endl;
+        continue;
+      }
+      std::cout << parsed.explain(*model);
+    }
+    return 0;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto stat = backend->queryRules(
+      text, [](const RulesetModel &model, uint32_t row) {
+        std::cout << fmt::format("{:<8} {}  [{}:{}]\n", model.table_,
+                                 describeRow(model, row), model.pcnt_[row],
+                                 model.bcnt_[row]);
+        return true;
+      });
+  std::cout.flush();
+
+  auto elapsed = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start);
+  std::cerr << fmt::format("{} of {} rules matched, {} tables scanned, {} "
+                           "skipped, {:.2f} ms",
+                           stat.matched_, stat.scanned_, stat.tables_,
+                           stat.skipped_, elapsed.count())
+            << endl;
+  return 0;
+}
+
+auto CommandLine::graph(const vector<string> &args) -> int {
+  if (args.size() != 1) {
+    return usage();
+  }
+
+  auto backend = ConfigManager::instance().getBackend<FirewallBackend>();
+  auto context = FirewallBackend::createContext(
+      std::make_shared<FirewallContext>(), args[0]);
+  const auto *graph = backend->getChainGraph(context);
+  if (graph == nullptr) {
+    std::cerr << "graph: " << context->getLastError() << endl;
+    return 1;
+  }
+
+  for (const auto &hook : graph->hookCosts()) {
+    std::cout << fmt::format("hook {:<12} worst {:>8}  expected {:>8.2f}  "
+                             "packets {}{}\n",
+                             hook.chain_, hook.worst_, hook.expected_,
+                             hook.packets_, hook.cyclic_ ? "  cyclic" : "");
+  }
+  for (const auto &chain : backend->getFirewallChildren(context)) {
+    if (graph->references(chain) > 0) {
+      std::cout << fmt::format("references {:<12} {}\n", chain,
+                               graph->references(chain));
+    }
+  }
+  for (const auto &chain : graph->unreachable()) {
+    std::cout << "unreachable " << chain << '\n';
+  }
+  if (auto cycle = graph->findCycle(); !cycle.empty()) {
+    std::cout << "cycle";
+    for (const auto &chain : cycle) {
+      std::cout << ' ' << chain;
+    }
+    std::cout << '\n';
+  }
+  std::cout.flush();
+  return 0;
+}
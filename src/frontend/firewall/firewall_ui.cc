@@ -46,10 +46,13 @@
 
 #include <algorithm>
 #include <arpa/inet.h>
+#include <chrono>
 #include <cstring>
 #include <memory>
 #include <optional>
+#include <ranges>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <tuple>
 #include <utility>
@@ -62,6 +65,15 @@ const string FirewallConfig::kNonSuWarnText =
 const string FirewallConfig::kAddRuleButtonText = "&Add Firewall Rule";
 const string FirewallConfig::kAddChainButtonText = "&Add Firewall Chain";
 const string FirewallConfig::kDelRuleButtonText = "Delete";
+const string FirewallConfig::kAnalyzeButtonText = "A&nalyze Rules";
+const string FirewallConfig::kOptimizeButtonText = "&Optimize Chain";
+const string FirewallConfig::kCompactButtonText = "Co&mpact Rules";
+const string FirewallConfig::kReorderButtonText = "&Reorder by Hits";
+const string FirewallConfig::kSetsButtonText = "Con&vert to Sets";
+const string FirewallConfig::kBpfButtonText = "Compile to B&PF";
+const string FirewallConfig::kHotRulesButtonText = "&Hot Rules";
+const string FirewallConfig::kBypassButtonText = "Conntrack B&ypass";
+const string FirewallConfig::kReloadButtonText = "Re&load Table";
 
 FirewallConfig::FirewallConfig(const string &name,
                                const shared_ptr<UIBase> &parent,
@@ -76,12 +88,24 @@ FirewallConfig::FirewallConfig(const string &name,
     firewall_context_ = std::make_shared<FirewallContext>();
   }
 
-  firewall_backend_ = ConfigManager::instance().getBackend<FirewallBackend>();
+  rule_backend_ = ConfigManager::instance().getBackend<RuleBackend>();
+  firewall_backend_ = dynamic_pointer_cast<FirewallBackend>(rule_backend_);
 };
 
 auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
   auto res = true;
-  iptable_children = firewall_backend_->getFirewallChildren(firewall_context_);
+
+  /* pick up rules written by other programs while nothing is pending here */
+  rule_backend_->reloadIfStale(firewall_context_);
+  firewall_context_->setLastError("");
+  iptable_children = rule_backend_->getFirewallChildren(firewall_context_);
+  auto loaded = firewall_context_->last_error_.empty();
+  if (!loaded) {
+    showDialog(dialog_meta::ERROR,
+               fmt::format("Failed to load {}, Error: {}\n",
+                           firewall_context_->serialize(),
+                           firewall_context_->getLastError()));
+  }
 
   auto *fac = getFactory();
   auto *main_layout = layout.feature_layout_;
@@ -95,7 +119,7 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
       auto *chain_button = fac->createPushButton(main_layout, child);
       widget_manager_.addWidget(chain_button, [this, chain_button, child]() {
         auto context =
-            firewall_backend_->createContext(firewall_context_, child);
+            rule_backend_->createContext(firewall_context_, child);
 
         auto subpage = std::make_shared<FirewallConfig>(
             child, shared_from_this(), context);
@@ -108,6 +132,10 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
     break;
   }
   case FirewallLevel::TABLE: {
+    /* rule counts and policies come from the iptables blob */
+    auto model = firewall_backend_ != nullptr && loaded
+                     ? firewall_backend_->getRulesetModel(firewall_context_)
+                     : nullptr;
     for (const auto &child : iptable_children) {
       auto *hbox = fac->createHBox(main_layout);
 
@@ -115,9 +143,22 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
       fac->createHSpacing(hbox, 2);
       auto *del_button = fac->createPushButton(hbox, "Delete");
 
+      if (auto index = model != nullptr ? model->findChain(child) : nullopt;
+          index) {
+        const auto &chain = model->chains_[*index];
+        auto brief = fmt::format("{} rules", chain.size());
+        if (chain.builtin_) {
+          brief += fmt::format(", policy {}",
+                               model->names_.get(
+                                   model->targets_[chain.policy_].name_));
+        }
+        fac->createHSpacing(hbox, 2);
+        fac->createLabel(hbox, brief);
+      }
+
       widget_manager_.addWidget(chain_button, [this, chain_button, child]() {
         auto context =
-            firewall_backend_->createContext(firewall_context_, child);
+            rule_backend_->createContext(firewall_context_, child);
 
         auto subpage = std::make_shared<FirewallConfig>(
             child, shared_from_this(), context);
@@ -129,9 +170,9 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
       widget_manager_.addWidget(
           del_button, [this, child, main_dialog, layout]() {
             auto remove_ctx =
-                firewall_backend_->createContext(firewall_context_, child);
+                rule_backend_->createContext(firewall_context_, child);
 
-            if (!firewall_backend_->removeChain(remove_ctx)) {
+            if (!rule_backend_->removeChain(remove_ctx)) {
               auto msg = fmt::format("Failed to remove chain: {}, Error: {}\n",
                                      child, remove_ctx->getLastError());
               showDialog(dialog_meta::ERROR, msg);
@@ -139,8 +180,7 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
               auto msg = fmt::format("Chain removed: {}\n", child);
               showDialog(dialog_meta::INFO, msg);
 
-              ConfigManager::instance().registerApplyFunc(
-                  firewall_backend_->apply());
+              recordChange(ChangeKind::REMOVE_CHAIN, child);
               fresh(main_dialog, layout);
             }
 
@@ -165,13 +205,13 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
       widget_manager_.addWidget(detail_button, [this, index]() {
         auto title = fmt::format("Rule Detail: #{}", index);
         showDialog(title,
-                   firewall_backend_->getRuleDetails(firewall_context_, index));
+                   rule_backend_->getRuleDetails(firewall_context_, index));
         return HandleResult::SUCCESS;
       });
 
       widget_manager_.addWidget(del_button, [this, iptable_child, index,
                                              main_dialog, layout]() {
-        auto res = firewall_backend_->removeRule(firewall_context_, index);
+        auto res = rule_backend_->removeRule(firewall_context_, index);
 
         if (!res) {
           auto msg = fmt::format(
@@ -181,7 +221,7 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
           return HandleResult::SUCCESS;
         }
 
-        ConfigManager::instance().registerApplyFunc(firewall_backend_->apply());
+        recordChange(ChangeKind::REMOVE_RULE, firewall_context_->chain_, index);
         fresh(main_dialog, layout);
         return HandleResult::SUCCESS;
       });
@@ -193,7 +233,7 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
           return HandleResult::SUCCESS; /* cancel */
         }
 
-        if (!firewall_backend_->updateRule(firewall_context_, request)) {
+        if (!rule_backend_->updateRule(firewall_context_, request)) {
           auto msg = fmt::format(
               "Failed to update chain: #{}\nChain brief: {}\nError: {}\n",
               index, iptable_child, firewall_context_->getLastError());
@@ -202,7 +242,7 @@ auto FirewallConfig::fresh(YDialog *main_dialog, DisplayLayout layout) -> bool {
           return HandleResult::SUCCESS;
         }
 
-        ConfigManager::instance().registerApplyFunc(firewall_backend_->apply());
+        recordChange(ChangeKind::UPDATE_RULE, firewall_context_->chain_, index);
         fresh(main_dialog, layout);
         return HandleResult::SUCCESS;
       });
@@ -226,6 +266,18 @@ auto FirewallConfig::userDisplay(YDialog *main_dialog,
   /* control layout */
   switch (firewall_context_->level_) {
   case FirewallLevel::OVERALL: {
+    /* the bypass spans the raw and filter tables of iptables */
+    if (firewall_backend_ == nullptr) {
+      break;
+    }
+    auto *bypass_button =
+        fac->createPushButton(control_layout, kBypassButtonText);
+    widget_manager_.addWidget(bypass_button, [this, main_dialog, layout]() {
+      if (conntrackBypass()) {
+        fresh(main_dialog, layout);
+      }
+      return HandleResult::SUCCESS;
+    });
     break;
   }
   case FirewallLevel::TABLE: {
@@ -238,7 +290,7 @@ auto FirewallConfig::userDisplay(YDialog *main_dialog,
         return HandleResult::SUCCESS; /* cancel */
       }
 
-      if (!firewall_backend_->insertChain(firewall_context_, requset)) {
+      if (!rule_backend_->insertChain(firewall_context_, requset)) {
         auto msg = fmt::format("Failed to add chain, Error: {}\n",
                                firewall_context_->getLastError());
         showDialog(dialog_meta::ERROR, msg);
@@ -246,10 +298,30 @@ auto FirewallConfig::userDisplay(YDialog *main_dialog,
         auto msg = fmt::format("Chain added: {}\n", requset->chain_name_);
         showDialog(dialog_meta::INFO, msg);
 
-        ConfigManager::instance().registerApplyFunc(firewall_backend_->apply());
+        recordChange(ChangeKind::INSERT_CHAIN, requset->chain_name_);
+        fresh(main_dialog, layout);
+      }
+
+      return HandleResult::SUCCESS;
+    });
+
+    auto *reload_button =
+        fac->createPushButton(control_layout, kReloadButtonText);
+    widget_manager_.addWidget(reload_button, [this, main_dialog, layout]() {
+      if (reloadTable()) {
         fresh(main_dialog, layout);
       }
+      return HandleResult::SUCCESS;
+    });
 
+    /* counters are sampled from the iptables blob */
+    if (firewall_backend_ == nullptr) {
+      break;
+    }
+    auto *hot_rules_button =
+        fac->createPushButton(control_layout, kHotRulesButtonText);
+    widget_manager_.addWidget(hot_rules_button, [this]() {
+      showHotRules();
       return HandleResult::SUCCESS;
     });
     break;
@@ -264,18 +336,76 @@ auto FirewallConfig::userDisplay(YDialog *main_dialog,
         return HandleResult::SUCCESS;
       }
 
-      if (!firewall_backend_->insertRule(firewall_context_, request)) {
+      if (!rule_backend_->insertRule(firewall_context_, request)) {
         auto msg = fmt::format("Failed to add rule, Error: {}\n",
                                firewall_context_->getLastError());
         showDialog(dialog_meta::ERROR, msg);
         return HandleResult::SUCCESS;
       }
 
-      ConfigManager::instance().registerApplyFunc(firewall_backend_->apply());
+      /* rule is appended if index is out of chain */
+      auto position = std::min(request->index_,
+                               static_cast<int>(iptable_children.size()));
+      recordChange(ChangeKind::INSERT_RULE, firewall_context_->chain_,
+                   position);
       fresh(main_dialog, layout);
 
       return HandleResult::SUCCESS;
     });
+
+    /* analysis and rewrites work on the iptables ruleset model */
+    if (firewall_backend_ == nullptr) {
+      break;
+    }
+    auto *analyze_button =
+        fac->createPushButton(control_layout, kAnalyzeButtonText);
+    widget_manager_.addWidget(analyze_button, [this]() {
+      showAnalysisReport();
+      return HandleResult::SUCCESS;
+    });
+
+    auto *optimize_button =
+        fac->createPushButton(control_layout, kOptimizeButtonText);
+    widget_manager_.addWidget(optimize_button, [this, main_dialog, layout]() {
+      if (optimizeChain()) {
+        fresh(main_dialog, layout);
+      }
+      return HandleResult::SUCCESS;
+    });
+
+    auto *compact_button =
+        fac->createPushButton(control_layout, kCompactButtonText);
+    widget_manager_.addWidget(compact_button, [this, main_dialog, layout]() {
+      if (compactChain()) {
+        fresh(main_dialog, layout);
+      }
+      return HandleResult::SUCCESS;
+    });
+
+    auto *reorder_button =
+        fac->createPushButton(control_layout, kReorderButtonText);
+    widget_manager_.addWidget(reorder_button, [this, main_dialog, layout]() {
+      if (reorderChain()) {
+        fresh(main_dialog, layout);
+      }
+      return HandleResult::SUCCESS;
+    });
+
+    auto *sets_button = fac->createPushButton(control_layout, kSetsButtonText);
+    widget_manager_.addWidget(sets_button, [this, main_dialog, layout]() {
+      if (convertToSets()) {
+        fresh(main_dialog, layout);
+      }
+      return HandleResult::SUCCESS;
+    });
+
+    auto *bpf_button = fac->createPushButton(control_layout, kBpfButtonText);
+    widget_manager_.addWidget(bpf_button, [this, main_dialog, layout]() {
+      if (compileToBpf()) {
+        fresh(main_dialog, layout);
+      }
+      return HandleResult::SUCCESS;
+    });
     break;
   }
   }
@@ -286,6 +416,550 @@ auto FirewallConfig::userDisplay(YDialog *main_dialog,
   return DisplayResult::SUCCESS;
 }
 
+auto FirewallConfig::showAnalysisReport() -> void {
+  static constexpr size_t kMaxReportLines = 200;
+
+  auto report = firewall_backend_->analyzeChain(firewall_context_);
+  auto model = firewall_backend_->getRulesetModel(firewall_context_);
+  if (!report || model == nullptr) {
+    auto msg = fmt::format("Failed to analyze chain, Error: {}\n",
+                           firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, msg);
+    return;
+  }
+
+  string text;
+  if (report->anomalies_.empty()) {
+    text = "No shadowed, redundant or correlated rule found.\n";
+  }
+  for (size_t i = 0; i < report->anomalies_.size(); i++) {
+    if (i == kMaxReportLines) {
+      text += fmt::format("... and {} more\n",
+                          report->anomalies_.size() - kMaxReportLines);
+      break;
+    }
+    text += report->anomalies_[i].serialize(*model) + "\n";
+  }
+  if (report->skipped_ > 0) {
+    text += fmt::format("{} rules with inversion or unsupported matches are "
+                        "not analyzed.\n",
+                        report->skipped_);
+  }
+
+  showDialog(fmt::format("Rule Analysis: {}", firewall_context_->chain_),
+             text);
+}
+
+auto FirewallConfig::optimizeChain() -> bool {
+  static constexpr size_t kMaxPreviewLines = 100;
+
+  auto plan = firewall_backend_->planOptimization(firewall_context_);
+  if (!plan) {
+    auto msg = fmt::format("Failed to optimize chain, Error: {}\n",
+                           firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, msg);
+    return false;
+  }
+
+  stringstream preview;
+  SaveFormat::write(preview, plan->ruleset_);
+  auto msg = plan->summary() + "\n\n";
+  string line;
+  for (size_t i = 0; std::getline(preview, line); i++) {
+    if (i == kMaxPreviewLines) {
+      msg += "...\n";
+      break;
+    }
+    msg += line + "\n";
+  }
+
+  auto title = fmt::format("Optimize Chain: {}", firewall_context_->chain_);
+  if (!askConfirm(title, msg, "Apply")) {
+    return false;
+  }
+
+  if (!firewall_backend_->applyOptimization(firewall_context_, *plan)) {
+    auto error = fmt::format("Failed to optimize chain, Error: {}\n",
+                             firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, error);
+    return false;
+  }
+
+  const auto &chains = plan->ruleset_.chains_;
+  for (size_t i = 1; i < chains.size(); i++) {
+    recordChange(ChangeKind::INSERT_CHAIN, chains[i].name_);
+  }
+  recordChange(ChangeKind::UPDATE_RULE, firewall_context_->chain_);
+  return true;
+}
+
+auto FirewallConfig::compactChain() -> bool {
+  static constexpr size_t kMaxPreviewLines = 100;
+
+  auto plan = firewall_backend_->planCompaction(firewall_context_);
+  if (!plan) {
+    auto msg = fmt::format("Failed to compact rules, Error: {}\n",
+                           firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, msg);
+    return false;
+  }
+  if (plan->removed_.empty()) {
+    showDialog(dialog_meta::INFO, "No rules can be merged.");
+    return false;
+  }
+
+  auto msg = fmt::format("{} of {} rules are merged into {} widened rules:\n",
+                         plan->removed_.size(), plan->rule_count_,
+                         plan->replaced_.size());
+  stringstream preview;
+  SaveFormat::write(preview,
+                    TableRuleset{firewall_context_->table_,
+                                 {ChainRuleset{plan->chain_, std::nullopt,
+                                               plan->replaced_}}});
+  string line;
+  for (size_t i = 0; std::getline(preview, line); i++) {
+    if (i == kMaxPreviewLines) {
+      msg += "...\n";
+      break;
+    }
+    if (line.starts_with("-A")) {
+      msg += line + "\n";
+    }
+  }
+
+  auto title = fmt::format("Compact Rules: {}", firewall_context_->chain_);
+  if (!askConfirm(title, msg, "Apply")) {
+    return false;
+  }
+
+  if (!firewall_backend_->applyCompaction(firewall_context_, *plan)) {
+    auto error = fmt::format("Failed to compact rules, Error: {}\n",
+                             firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, error);
+    return false;
+  }
+
+  for (const auto &request : plan->replaced_) {
+    recordChange(ChangeKind::UPDATE_RULE, plan->chain_, request->index_);
+  }
+  for (auto index : plan->removed_ | std::views::reverse) {
+    recordChange(ChangeKind::REMOVE_RULE, plan->chain_, index);
+  }
+  return true;
+}
+
+auto FirewallConfig::reorderChain() -> bool {
+  static constexpr size_t kMaxPreviewLines = 50;
+
+  auto plan = firewall_backend_->planReorder(firewall_context_);
+  if (!plan) {
+    auto msg = fmt::format("Failed to reorder rules, Error: {}\n",
+                           firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, msg);
+    return false;
+  }
+  if (plan->moved_ == 0) {
+    showDialog(dialog_meta::INFO,
+               "No rule can move earlier, or no packet counted yet.");
+    return false;
+  }
+
+  auto msg = plan->summary() + "\n\n";
+  for (size_t i = 0; i < plan->order_.size() && i < kMaxPreviewLines; i++) {
+    if (plan->order_[i] != static_cast<int>(i)) {
+      msg += fmt::format("#{} -> #{}\n", plan->order_[i], i);
+    }
+  }
+
+  auto title = fmt::format("Reorder Rules: {}", firewall_context_->chain_);
+  if (!askConfirm(title, msg, "Apply")) {
+    return false;
+  }
+
+  if (!firewall_backend_->reorderRules(firewall_context_, plan->order_)) {
+    auto error = fmt::format("Failed to reorder rules, Error: {}\n",
+                             firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, error);
+    return false;
+  }
+
+  recordChange(ChangeKind::UPDATE_RULE, plan->chain_);
+  return true;
+}
+
+auto FirewallConfig::convertToSets() -> bool {
+  static constexpr size_t kMaxPreviewLines = 50;
+
+  auto plan = firewall_backend_->planSetConversion(firewall_context_);
+  if (!plan) {
+    auto msg = fmt::format("Failed to convert rules to sets, Error: {}\n",
+                           firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, msg);
+    return false;
+  }
+  if (plan->families_.empty()) {
+    showDialog(dialog_meta::INFO, "No rules can be folded into a set.");
+    return false;
+  }
+
+  auto msg = plan->summary() + "\n\n";
+  for (size_t i = 0; i < plan->families_.size() && i < kMaxPreviewLines; i++) {
+    const auto &family = plan->families_[i];
+    msg += fmt::format("#{} {} rules -> {}\n", family.rule_->index_,
+                       family.members_.size(), family.set_.name_);
+  }
+
+  auto title = fmt::format("Convert to Sets: {}", firewall_context_->chain_);
+  if (!askConfirm(title, msg, "Apply")) {
+    return false;
+  }
+
+  if (!firewall_backend_->applySetConversion(firewall_context_, *plan)) {
+    auto error = fmt::format("Failed to convert rules to sets, Error: {}\n",
+                             firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, error);
+    return false;
+  }
+
+  for (const auto &family : plan->families_) {
+    recordChange(ChangeKind::UPDATE_RULE, plan->chain_, family.rule_->index_);
+  }
+  for (auto index : plan->removed_ | std::views::reverse) {
+    recordChange(ChangeKind::REMOVE_RULE, plan->chain_, index);
+  }
+  return true;
+}
+
+auto FirewallConfig::compileToBpf() -> bool {
+  static constexpr size_t kMaxPreviewLines = 50;
+
+  auto plan = firewall_backend_->planBpfCompilation(firewall_context_);
+  if (!plan) {
+    auto msg = fmt::format("Failed to compile rules, Error: {}\n",
+                           firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, msg);
+    return false;
+  }
+  if (plan->runs_.empty()) {
+    showDialog(dialog_meta::INFO, "No run of rules can be compiled.");
+    return false;
+  }
+
+  auto msg = plan->summary() + "\n\n";
+  for (size_t i = 0; i < plan->runs_.size() && i < kMaxPreviewLines; i++) {
+    const auto &run = plan->runs_[i];
+    msg += fmt::format("#{}-#{} -> {} instructions\n", run.members_.front(),
+                       run.members_.back(),
+                       run.rule_->bpf_match_->program_.size());
+  }
+
+  auto title = fmt::format("Compile to BPF: {}", firewall_context_->chain_);
+  if (!askConfirm(title, msg, "Apply")) {
+    return false;
+  }
+
+  if (!firewall_backend_->applyBpfCompilation(firewall_context_, *plan)) {
+    auto error = fmt::format("Failed to compile rules, Error: {}\n",
+                             firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, error);
+    return false;
+  }
+
+  for (const auto &run : plan->runs_) {
+    recordChange(ChangeKind::UPDATE_RULE, plan->chain_, run.rule_->index_);
+  }
+  for (auto index : plan->removed_ | std::views::reverse) {
+    recordChange(ChangeKind::REMOVE_RULE, plan->chain_, index);
+  }
+  return true;
+}
+
+auto FirewallConfig::conntrackBypass() -> bool {
+  static constexpr int button_space = 5;
+  static const vector<std::pair<string, string>> kProtos = {
+      {"UDP", RequestProto::UDP},
+      {"TCP", RequestProto::TCP},
+      {"TCP and UDP", RequestProto::ALL}};
+
+  auto *fac = getFactory();
+  YDialog *dialog = fac->createPopupDialog();
+  YLayoutBox *vbox = fac->createVBox(dialog);
+
+  auto *title = fac->createLabel(vbox, "Conntrack Bypass of a Local Service");
+  title->autoWrap();
+
+  BypassService service;
+  WidgetManager collector;
+
+  auto *proto_box = fac->createComboBox(vbox, "Protocol");
+  YItemCollection items;
+  for (const auto &proto : kProtos) {
+    items.push_back(new YItem(proto.first));
+  }
+  proto_box->addItems(items);
+  collector.addWidget(proto_box, [proto_box, &service]() {
+    auto label = proto_box->selectedItem()->label();
+    for (const auto &proto : kProtos) {
+      if (proto.first == label) {
+        service.proto_ = proto.second;
+      }
+    }
+    return HandleResult::SUCCESS;
+  });
+
+  auto *ports = fac->createInputField(vbox, "Ports, e.g. 53,8000:8100");
+  collector.addWidget(ports, [ports, &service]() {
+    auto parsed = ConntrackBypass::parsePorts(ports->value());
+    if (!parsed) {
+      return HandleResult::ERROR;
+    }
+    service.ports_ = std::move(*parsed);
+    return HandleResult::SUCCESS;
+  });
+
+  auto *addr = fac->createInputField(vbox, "Service Address[/Len], optional");
+  collector.addWidget(addr, [addr, &service]() {
+    if (addr->value().empty()) {
+      return HandleResult::SUCCESS;
+    }
+    return ConntrackBypass::parseAddress(addr->value(), service)
+               ? HandleResult::SUCCESS
+               : HandleResult::ERROR;
+  });
+
+  auto *iface = fac->createInputField(vbox, "Interface, optional");
+  iface->setInputMaxLength(IFNAMSIZ - 1);
+  collector.addWidget(iface, [iface, &service]() {
+    if (!iface->value().empty()) {
+      service.iface_ = iface->value();
+    }
+    return HandleResult::SUCCESS;
+  });
+
+  auto *control_layout = fac->createHBox(vbox);
+  auto *confirm = fac->createPushButton(control_layout, "&OK");
+  fac->createHSpacing(control_layout, button_space);
+  auto *cancel = fac->createPushButton(control_layout, "&Cancel");
+
+  auto accepted = false;
+  while (true) {
+    auto *event = dialog->waitForEvent();
+    if (event->widget() == confirm) {
+      if (collector.exec()) {
+        accepted = true;
+        break;
+      }
+      showDialog(dialog_meta::ERROR, "Invalid ports or address.");
+      continue;
+    }
+
+    if (event->widget() == cancel ||
+        event->eventType() == YEvent::CancelEvent) {
+      break;
+    }
+  }
+  dialog->destroy();
+  if (!accepted) {
+    return false;
+  }
+
+  auto plan = firewall_backend_->planConntrackBypass(service);
+  if (plan.pending() == 0) {
+    showDialog(dialog_meta::INFO, "All rules of the bypass are present.");
+    return false;
+  }
+
+  auto msg = plan.summary() + "\n\n";
+  for (const auto &rule : plan.rules_) {
+    stringstream preview;
+    SaveFormat::write(preview, TableRuleset{rule.table_,
+                                            {ChainRuleset{rule.chain_,
+                                                          std::nullopt,
+                                                          {rule.rule_}}}});
+    for (string line; std::getline(preview, line);) {
+      if (line.starts_with("-A")) {
+        msg += fmt::format("{} {}{}\n", rule.table_, line, rule.note());
+      }
+    }
+  }
+
+  if (!askConfirm("Conntrack Bypass", msg, "Apply")) {
+    return false;
+  }
+
+  if (!firewall_backend_->applyConntrackBypass(firewall_context_, plan)) {
+    auto error = fmt::format("Failed to insert bypass rules, Error: {}\n",
+                             firewall_context_->getLastError());
+    showDialog(dialog_meta::ERROR, error);
+    return false;
+  }
+
+  /* rules of a chain are inserted at their index in plan order */
+  unordered_map<string, int> inserted;
+  for (const auto &rule : plan.rules_) {
+    if (rule.present_) {
+      continue;
+    }
+    auto scope = fmt::format("{}/{}", rule.table_, rule.chain_);
+    ConfigManager::instance().recordChange(
+        rule_backend_,
+        PendingChange(ChangeKind::INSERT_RULE, scope,
+                      rule.rule_->index_ + inserted[scope]++));
+  }
+  return true;
+}
+
+auto FirewallConfig::showHotRules() -> void {
+  static constexpr int kSampleIntervalMs = 1000;
+  static constexpr size_t kTopRules = 20;
+
+  auto sampler = firewall_backend_->getCounterSampler(firewall_context_);
+  if (!sampler->sample()) {
+    auto msg = fmt::format("Failed to read counters, Error: {}\n",
+                           strerror(errno));
+    showDialog(dialog_meta::ERROR, msg);
+    return;
+  }
+
+  auto *fac = getFactory();
+  YDialog *dialog = fac->createPopupDialog();
+  YLayoutBox *vbox = fac->createVBox(dialog);
+
+  fac->createHeading(vbox,
+                     fmt::format("Hot Rules: {}", firewall_context_->table_));
+  auto *status = fac->createLabel(vbox, "");
+
+  auto *header = new YTableHeader();
+  for (const auto *column : {"Chain", "#", "Packets/s", "Bytes/s", "Packets"}) {
+    header->addColumn(column);
+  }
+  auto *table = fac->createTable(vbox, header);
+
+  auto refresh = [&]() {
+    table->deleteAllItems();
+    for (const auto &rate : sampler->topRules(kTopRules)) {
+      auto *item = new YTableItem();
+      item->addCell(rate.chain_);
+      item->addCell(std::to_string(rate.index_));
+      item->addCell(fmt::format("{:.1f}", rate.pps_));
+      item->addCell(fmt::format("{:.0f}", rate.bps_));
+      item->addCell(std::to_string(rate.pcnt_));
+      table->addItem(item);
+    }
+    status->setValue(fmt::format("{} rules, rates over last {} samples",
+                                 sampler->ruleCount(),
+                                 sampler->sampleCount()));
+  };
+  refresh();
+
+  auto *close = fac->createPushButton(vbox, "&Close");
+
+  /* timeout events drive the sampling, no thread touches the widgets */
+  while (true) {
+    auto *event = dialog->waitForEvent(kSampleIntervalMs);
+    if (event->eventType() == YEvent::TimeoutEvent) {
+      if (!sampler->sample()) {
+        status->setValue(fmt::format("Failed to read counters, Error: {}",
+                                     strerror(errno)));
+        continue;
+      }
+      refresh();
+      continue;
+    }
+
+    if (event->widget() == close ||
+        event->eventType() == YEvent::CancelEvent) {
+      break;
+    }
+  }
+
+  dialog->destroy();
+}
+
+auto FirewallConfig::userSearch() -> void {
+  static constexpr size_t kMaxHits = 200;
+
+  auto *fac = getFactory();
+  YDialog *dialog = fac->createPopupDialog();
+  YLayoutBox *vbox = fac->createVBox(dialog);
+
+  fac->createHeading(vbox, "Search Rules");
+  auto *query = fac->createInputField(vbox, "&Query");
+  auto *search_button = fac->createPushButton(vbox, "&Search");
+  auto *status = fac->createLabel(
+      vbox, "Address or CIDR, port or range, chain, target or interface");
+
+  auto *header = new YTableHeader();
+  for (const auto *column : {"Table", "Chain", "#"}) {
+    header->addColumn(column);
+  }
+  auto *table = fac->createTable(vbox, header);
+  auto *close_button = fac->createPushButton(vbox, "&Close");
+
+  while (true) {
+    auto *event = dialog->waitForEvent();
+    if (event->widget() == close_button ||
+        event->eventType() == YEvent::CancelEvent) {
+      break;
+    }
+    if (event->widget() != search_button) {
+      continue;
+    }
+
+    table->deleteAllItems();
+    try {
+      auto begin = std::chrono::steady_clock::now();
+      auto hits = rule_backend_->searchRules(query->value(), kMaxHits);
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - begin);
+
+      for (const auto &hit : hits) {
+        auto *item = new YTableItem();
+        item->addCell(hit.table_);
+        item->addCell(hit.chain_);
+        item->addCell(std::to_string(hit.index_));
+        table->addItem(item);
+      }
+      status->setValue(fmt::format("{}{} rules found in {} us", hits.size(),
+                                   hits.size() == kMaxHits ? "+" : "",
+                                   elapsed.count()));
+    } catch (const std::invalid_argument &e) {
+      status->setValue(e.what());
+    }
+  }
+
+  dialog->destroy();
+}
+
+auto FirewallConfig::reloadTable() -> bool {
+  const auto &table = firewall_context_->table_;
+  auto prefix = table + "/";
+  auto pending = ConfigManager::instance().pendingChanges();
+  auto changes = std::ranges::count_if(pending, [&prefix](const auto &change) {
+    return change.scope_.starts_with(prefix);
+  });
+
+  if (changes > 0) {
+    auto msg = fmt::format("{} uncommitted changes of table {} are discarded "
+                           "and its rules are read again from kernel.",
+                           changes, table);
+    if (!askConfirm(fmt::format("Reload Table: {}", table), msg, "Reload")) {
+      return false;
+    }
+  }
+
+  rule_backend_->reloadTable(firewall_context_);
+  ConfigManager::instance().discardChanges(rule_backend_, prefix);
+  return true;
+}
+
+auto FirewallConfig::recordChange(ChangeKind kind, const string &chain,
+                                  int index) -> void {
+  auto scope = fmt::format("{}/{}", firewall_context_->table_, chain);
+  ConfigManager::instance().recordChange(rule_backend_,
+                                         PendingChange(kind, scope, index));
+}
+
 auto FirewallConfig::userHandleEvent(YEvent *event) -> HandleResult {
   return widget_manager_.handleEvent(event);
 }
@@ -330,7 +1004,14 @@ auto FirewallConfig::createUpdateRule(optional<int> index) // NOLINT
 
   shared_ptr<RuleRequest> request;
   if (index.has_value()) { /* update dialog */
-    request = firewall_backend_->getRule(firewall_context_, index.value());
+    request = rule_backend_->getRule(firewall_context_, index.value());
+    if (request == nullptr) {
+      dialog->destroy();
+      showDialog(dialog_meta::ERROR,
+                 fmt::format("Rule #{} cannot be edited here, Error: {}\n",
+                             index.value(), firewall_context_->getLastError()));
+      return nullptr;
+    }
   } else { /* insert dialog */
     request = std::make_shared<RuleRequest>();
   }
@@ -361,8 +1042,7 @@ auto FirewallConfig::createUpdateRule(optional<int> index) // NOLINT
       auto text = fmt::format("Rule to update: #{}", index.value());
       fac->createLabel(hbox, text);
     } else {
-      auto rule_num = static_cast<int>(
-          firewall_backend_->getFirewallChildren(firewall_context_).size());
+      auto rule_num = rule_backend_->getRuleCount(firewall_context_);
       auto text = fmt::format("Rule #(1-{})", rule_num);
       auto *pos_input = fac->createIntField(hbox, text, 1, rule_num + 1, 1);
       collector.addWidget(pos_input, [pos_input, &request]() {
@@ -391,7 +1071,7 @@ auto FirewallConfig::createUpdateRule(optional<int> index) // NOLINT
       return HandleResult::SUCCESS;
     });
 
-    auto iptables_targets = iptTargets();
+    auto iptables_targets = iptTargets(firewall_context_->table_);
     YComboBox *target_box = fac->createComboBox(hbox, "Target");
     YItemCollection target_items;
     for (const auto &target : iptables_targets) {
@@ -411,6 +1091,10 @@ auto FirewallConfig::createUpdateRule(optional<int> index) // NOLINT
 
       auto value = item->label();
       request->target_ = value;
+      /* a new CT rule skips conntrack, options of an existing one are kept */
+      if (value == RequestTarget::CT && !request->ct_target_.has_value()) {
+        request->ct_target_ = CtTarget{true, 0};
+      }
       return HandleResult::SUCCESS;
     });
   }
@@ -538,6 +1222,42 @@ auto FirewallConfig::createUpdateRule(optional<int> index) // NOLINT
     port_input("Dest", request->matches_.front().dst_port_range_);
   }
 
+  /* queues of target NFQUEUE, the rule balances over them if more than one */
+  {
+    constexpr int kQueueMax = 65535;
+
+    auto options = request->nfqueue_target_.value_or(NfqueueTarget{});
+    auto *frame = YUI::widgetFactory()->createCheckBoxFrame(
+        vbox, "NFQUEUE Queues", request->nfqueue_target_.has_value());
+    frame->setAutoEnable(true);
+
+    auto *hbox = fac->createHBox(frame);
+    auto *from = fac->createIntField(hbox, "Queue from", 0, kQueueMax,
+                                     options.queue_num_);
+    auto *to = fac->createIntField(
+        hbox, "Queue to", 0, kQueueMax,
+        options.queue_num_ + options.queues_total_ - 1);
+    auto *bypass = fac->createCheckBox(hbox, "Bypass if unused",
+                                       options.bypass_);
+    auto *fanout = fac->createCheckBox(hbox, "CPU fanout",
+                                       options.cpu_fanout_);
+
+    collector.addWidget(frame, [hbox, from, to, bypass, fanout, &request]() {
+      if (!hbox->isEnabled() || request->target_ != RequestTarget::NFQUEUE) {
+        return HandleResult::SUCCESS;
+      }
+      if (to->value() < from->value() ||
+          (fanout->isChecked() && to->value() == from->value())) {
+        return HandleResult::ERROR;
+      }
+      request->nfqueue_target_ = NfqueueTarget{
+          static_cast<uint16_t>(from->value()),
+          static_cast<uint16_t>(to->value() - from->value() + 1),
+          bypass->isChecked(), fanout->isChecked()};
+      return HandleResult::SUCCESS;
+    });
+  }
+
   auto *control_layout = fac->createHBox(vbox);
   auto *confirm = fac->createPushButton(control_layout, "&OK");
   fac->createHSpacing(control_layout, button_space);
@@ -73,7 +73,7 @@ auto UIBase::display() -> void {
     {
       auto *search_button = factory_->createPushButton(gcl, kSearchButtonName);
       widget_manager_.addWidget(search_button, [this]() {
-        showDialog(dialog_meta::ERROR, "Search is not implemented yet.");
+        userSearch();
         return HandleResult::SUCCESS;
       });
     }
@@ -98,7 +98,9 @@ auto UIBase::display() -> void {
         static const string succ_msg = "Successfully applied changes.";
 
         if (!ConfigManager::instance().apply()) {
-          showDialog(dialog_meta::ERROR, fail_msg);
+          showDialog(dialog_meta::ERROR,
+                     fail_msg + "\n" +
+                         ConfigManager::instance().lastCommitError());
         } else {
           showDialog(dialog_meta::INFO, succ_msg);
         }
@@ -147,7 +149,20 @@ auto UIBase::checkExit() -> bool {
       vbox, dialog_meta::kPopDialogMinWidth, dialog_meta::kPopDialogMinHeight);
 
   /* get unsave configs */
-  auto msg = msg_head + msg_tail;
+  static constexpr size_t kMaxChangesShown = 10;
+  auto &manager = ConfigManager::instance();
+  auto changes = manager.pendingChanges();
+
+  auto msg = fmt::format("{} {} pending, estimated commit cost: {} entries.\n",
+                         msg_head, manager.pendingChangeCount(),
+                         manager.estimatedCommitCost());
+  for (size_t i = 0; i < changes.size() && i < kMaxChangesShown; i++) {
+    msg += changes[i].serialize() + "\n";
+  }
+  if (changes.size() > kMaxChangesShown) {
+    msg += fmt::format("... and {} more\n", changes.size() - kMaxChangesShown);
+  }
+  msg += msg_tail;
   YLabel *label = fac->createOutputField(minSize, msg);
   label->setAutoWrap();
 
@@ -165,6 +180,10 @@ auto UIBase::checkExit() -> bool {
   return res;
 }
 
+auto UIBase::userSearch() -> void {
+  showDialog(dialog_meta::ERROR, "Search is not implemented yet.");
+}
+
 auto UIBase::handleEvent() -> void {
   if (main_dialog_ == nullptr) {
     auto msg = fmt::format("main_dialog is nullptr when handling event\n");
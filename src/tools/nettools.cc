@@ -1,6 +1,6 @@
 #include "tools/nettools.h"
 #include <arpa/inet.h>
-#include <libiptc/libiptc.h>
+#include <array>
 
 auto ip2Tuple(uint32_t ip) -> std::tuple<uint8_t, uint8_t, uint8_t, uint8_t> {
   constexpr uint8_t mask = 0xFF;
@@ -25,15 +25,43 @@ auto tuple2Ip(const std::tuple<uint8_t, uint8_t, uint8_t, uint8_t> &tuple)
   return ip;
 }
 
-auto protocols() -> vector<tuple<string, uint8_t>> {
+auto appendIpv4(fmt::memory_buffer &buffer, uint32_t ip) -> void {
+  constexpr uint32_t kMask = 0xFF;
+  constexpr int kShift = 8;
+  constexpr uint32_t kHundred = 100;
+  constexpr uint32_t kTen = 10;
+
+  /* "255.255.255.255" */
+  std::array<char, 15> text{};
+  auto *out = text.data();
+  for (int shift = kShift * 3; shift >= 0; shift -= kShift) {
+    auto octet = (ip >> shift) & kMask;
+    if (octet >= kHundred) {
+      *out++ = static_cast<char>('0' + octet / kHundred);
+    }
+    if (octet >= kTen) {
+      *out++ = static_cast<char>('0' + octet / kTen % kTen);
+    }
+    *out++ = static_cast<char>('0' + octet % kTen);
+    if (shift > 0) {
+      *out++ = '.';
+    }
+  }
+  buffer.append(text.data(), out);
+}
+
+auto protocols() -> const vector<tuple<string, uint8_t>> & {
   static vector<tuple<string, uint8_t>> r = {{"TCP", IPPROTO_TCP},
                                              {"UDP", IPPROTO_UDP}};
   return r;
 }
 
 auto proto2String(uint8_t proto) -> string {
-  auto protos = protocols();
-  for (const auto &p : protos) {
+  return string(proto2Name(proto));
+}
+
+auto proto2Name(uint8_t proto) -> std::string_view {
+  for (const auto &p : protocols()) {
     if (std::get<1>(p) == proto) {
       return std::get<0>(p);
     }
@@ -42,8 +70,7 @@ auto proto2String(uint8_t proto) -> string {
 }
 
 auto string2Proto(const string &proto) -> uint8_t {
-  auto protos = protocols();
-  for (const auto &p : protos) {
+  for (const auto &p : protocols()) {
     if (std::get<0>(p) == proto) {
       return std::get<1>(p);
     }
@@ -51,9 +78,3 @@ auto string2Proto(const string &proto) -> uint8_t {
 
   return 0;
 }
-
-auto iptTargets() -> vector<string> {
-  static vector<string> r = {IPTC_LABEL_ACCEPT, IPTC_LABEL_DROP,
-                             IPTC_LABEL_QUEUE, IPTC_LABEL_RETURN};
-  return r;
-}
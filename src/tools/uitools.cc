@@ -39,3 +39,34 @@ auto showDialog(const string &title, const string &msg) -> void {
 
   dialog->destroy();
 }
+
+auto askConfirm(const string &title, const string &msg,
+                const string &confirm) -> bool {
+  static constexpr YLayoutSize_t kVSpaceSize = 1;
+
+  auto *factory = YUI::widgetFactory();
+  auto *dialog = factory->createPopupDialog();
+
+  auto *vbox = factory->createVBox(dialog);
+  factory->createLabel(vbox, title);
+  factory->createVSpacing(vbox, kVSpaceSize);
+
+  YAlignment *minSize = factory->createMinSize(
+      vbox, dialog_meta::kPopDialogMinWidth, dialog_meta::kPopDialogMinHeight);
+  YLabel *label = factory->createOutputField(minSize, msg);
+  label->setAutoWrap();
+
+  auto *confirm_button = factory->createPushButton(vbox, confirm);
+  auto *cancel_button = factory->createPushButton(vbox, "Cancel");
+
+  auto *event = dialog->waitForEvent();
+  while (event->widget() != confirm_button &&
+         event->widget() != cancel_button &&
+         event->eventType() != YEvent::CancelEvent) {
+    event = dialog->waitForEvent();
+  }
+
+  auto res = event->widget() == confirm_button;
+  dialog->destroy();
+  return res;
+}
@@ -0,0 +1,141 @@
+#include <gtest/gtest.h>
+#include <memory>
+
+#include "backend/config_backend_base.h"
+#include "backend/config_manager.h"
+
+using std::make_shared;
+
+class CountingBackend : public ConfigBackendBase {
+public:
+  auto commit() -> bool override {
+    commits_++;
+    return !fail_;
+  }
+
+  auto estimateCommitCost() -> size_t override { return 1; }
+
+  [[nodiscard]] auto isPending(const string &scope) const -> bool override {
+    return !scope.starts_with(committed_);
+  }
+
+  auto settle(const vector<string> &pending_scopes) -> void override {
+    settled_.push_back(pending_scopes);
+  }
+
+  int commits_{};
+  bool fail_{};
+  /* scope prefix written by a partial commit */
+  string committed_{"-"};
+  vector<vector<string>> settled_;
+};
+
+class ConfigManagerTest : public ::testing::Test {
+protected:
+  void SetUp() override { backend = make_shared<CountingBackend>(); }
+
+  void TearDown() override { ConfigManager::instance().apply(); }
+
+  shared_ptr<CountingBackend> backend;
+};
+
+TEST_F(ConfigManagerTest, commitOncePerApply) {
+  auto &manager = ConfigManager::instance();
+  for (int i = 0; i < 200; i++) {
+    manager.recordChange(backend,
+                         PendingChange(ChangeKind::INSERT_RULE, "t/c", i));
+  }
+
+  ASSERT_TRUE(manager.hasUnsavedConfig());
+  ASSERT_EQ(manager.pendingChangeCount(), 200);
+  ASSERT_EQ(manager.estimatedCommitCost(), 1);
+
+  ASSERT_TRUE(manager.apply());
+  ASSERT_EQ(backend->commits_, 1);
+  ASSERT_FALSE(manager.hasUnsavedConfig());
+}
+
+TEST_F(ConfigManagerTest, insertThenRemoveCancels) {
+  auto &manager = ConfigManager::instance();
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::INSERT_RULE, "t/c", 3));
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::UPDATE_RULE, "t/c", 3));
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::REMOVE_RULE, "t/c", 3));
+
+  ASSERT_FALSE(manager.hasUnsavedConfig());
+  ASSERT_EQ(backend->settled_, vector<vector<string>>{{}});
+  ASSERT_TRUE(manager.apply());
+  ASSERT_EQ(backend->commits_, 0);
+}
+
+TEST_F(ConfigManagerTest, insertThenRemoveOtherRuleKept) {
+  auto &manager = ConfigManager::instance();
+  manager.recordChange(backend, PendingChange(ChangeKind::INSERT_CHAIN, "t/n"));
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::INSERT_RULE, "t/c", 1));
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::REMOVE_RULE, "t/c", 2));
+  manager.recordChange(backend, PendingChange(ChangeKind::REMOVE_CHAIN, "t/n"));
+
+  ASSERT_EQ(manager.pendingChangeCount(), 2);
+  ASSERT_EQ(backend->settled_,
+            (vector<vector<string>>{{"t/c", "t/c"}}));
+  ASSERT_TRUE(manager.apply());
+  ASSERT_EQ(backend->commits_, 1);
+}
+
+TEST_F(ConfigManagerTest, failedCommitKeepsJournal) {
+  auto &manager = ConfigManager::instance();
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::INSERT_RULE, "t/c", 0));
+
+  backend->fail_ = true;
+  ASSERT_FALSE(manager.apply());
+  ASSERT_TRUE(manager.hasUnsavedConfig());
+  ASSERT_EQ(manager.pendingChangeCount(), 1);
+
+  backend->fail_ = false;
+  ASSERT_TRUE(manager.apply());
+  ASSERT_EQ(backend->commits_, 2);
+  ASSERT_FALSE(manager.hasUnsavedConfig());
+}
+
+TEST_F(ConfigManagerTest, partialCommitDropsCommittedScopes) {
+  auto &manager = ConfigManager::instance();
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::INSERT_RULE, "t/c", 0));
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::INSERT_RULE, "u/c", 0));
+
+  backend->fail_ = true;
+  backend->committed_ = "t/";
+  ASSERT_FALSE(manager.apply());
+  ASSERT_EQ(manager.pendingChangeCount(), 1);
+  ASSERT_EQ(manager.pendingChanges()[0].scope_, "u/c");
+
+  backend->fail_ = false;
+  ASSERT_TRUE(manager.apply());
+  ASSERT_FALSE(manager.hasUnsavedConfig());
+}
+
+TEST_F(ConfigManagerTest, discardChangesOfTable) {
+  auto &manager = ConfigManager::instance();
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::INSERT_RULE, "t/c", 0));
+  manager.recordChange(backend,
+                       PendingChange(ChangeKind::INSERT_RULE, "u/c", 0));
+
+  manager.discardChanges(backend, "t/");
+  ASSERT_EQ(manager.pendingChangeCount(), 1);
+  ASSERT_EQ(manager.pendingChanges()[0].scope_, "u/c");
+
+  manager.discardChanges(backend, "u/");
+  ASSERT_FALSE(manager.hasUnsavedConfig());
+}
+
+auto main(int argc, char **argv) -> int {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
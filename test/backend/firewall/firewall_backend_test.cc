@@ -1,17 +1,28 @@
 #include <gtest/gtest-param-test.h>
 #include <gtest/gtest.h>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <linux/netfilter/nf_conntrack_common.h>
+#include <linux/netfilter/xt_state.h>
 #include <memory>
 #include <optional>
 #include <random>
+#include <sstream>
 #include <string>
 #include <tuple>
 #include <utility>
 #include <vector>
 
+#include "backend/firewall/bpf_compiler.h"
+#include "backend/firewall/bpf_interpreter.h"
 #include "backend/firewall/chain_request.h"
+#include "backend/firewall/classifier.h"
+#include "backend/firewall/conntrack_bypass.h"
 #include "backend/firewall/firewall_backend.h"
 #include "backend/firewall/firewall_context.h"
+#include "backend/firewall/ipset.h"
+#include "backend/firewall/rule_compactor.h"
 #include "backend/firewall/rule_request.h"
 #include "tools/log.h"
 #include "tools/nettools.h"
@@ -133,6 +144,107 @@ TEST_F(FirewallTestFixture, getChain) {
   }
 }
 
+TEST_F(FirewallTestFixture, lazyTableLoad) {
+  auto tables = fwb->getTableNames();
+  for (const auto &table : tables) {
+    ASSERT_FALSE(fwb->getTableLoadStat(table).has_value());
+  }
+
+  auto ctx = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  fwb->getFirewallChildren(ctx);
+
+  for (const auto &table : tables) {
+    auto stat = fwb->getTableLoadStat(table);
+    ASSERT_EQ(stat.has_value(), table == "filter");
+    if (stat.has_value()) {
+      ASSERT_EQ(stat->load_count_, 1);
+    }
+  }
+}
+
+TEST_F(FirewallTestFixture, commitTouchesDirtyTablesOnly) {
+  auto overall = make_shared<FirewallContext>();
+  auto tables = fwb->getTableNames();
+  for (const auto &table : tables) {
+    fwb->getFirewallChildren(fwb->createContext(overall, table));
+  }
+
+  /* nat changes behind the loaded handle, committing it would overwrite */
+  auto other = make_shared<FirewallBackend>();
+  auto other_nat = other->createContext(overall, "nat");
+  ASSERT_TRUE(other->insertChain(other_nat, make_shared<ChainRequest>("KEPT")));
+  ASSERT_TRUE(other->commit());
+
+  auto filter = fwb->createContext(overall, "filter");
+  ASSERT_TRUE(fwb->insertChain(filter, make_shared<ChainRequest>("DIRTY")));
+  ASSERT_TRUE(fwb->commit());
+
+  /* committed handles are released and loaded again, others are kept */
+  for (const auto &table : tables) {
+    fwb->getFirewallChildren(fwb->createContext(overall, table));
+    ASSERT_EQ(fwb->getTableLoadStat(table)->load_count_,
+              table == "filter" ? 2 : 1);
+  }
+
+  auto check = make_shared<FirewallBackend>();
+  auto chains =
+      check->getFirewallChildren(check->createContext(overall, "nat"));
+  ASSERT_NE(std::ranges::find(chains, "KEPT"), chains.end());
+
+  ASSERT_TRUE(other->removeChain(other->createContext(other_nat, "KEPT")));
+  ASSERT_TRUE(other->commit());
+  ASSERT_TRUE(fwb->removeChain(fwb->createContext(filter, "DIRTY")));
+  ASSERT_TRUE(fwb->commit());
+}
+
+TEST_F(FirewallTestFixture, settledTableIsNotCommitted) {
+  auto overall = make_shared<FirewallContext>();
+  auto filter = fwb->createContext(overall, "filter");
+  auto nat = fwb->createContext(overall, "nat");
+  ASSERT_TRUE(fwb->insertChain(filter, make_shared<ChainRequest>("PAIR")));
+  ASSERT_TRUE(fwb->insertChain(nat, make_shared<ChainRequest>("PAIR")));
+  ASSERT_TRUE(fwb->removeChain(fwb->createContext(filter, "PAIR")));
+  ASSERT_TRUE(fwb->removeChain(fwb->createContext(nat, "PAIR")));
+
+  /* the filter pair cancelled out, nat is still pending */
+  fwb->settle({"nat/PAIR"});
+  ASSERT_TRUE(fwb->commit());
+
+  /* only the committed handle is released and loaded again */
+  fwb->getFirewallChildren(filter);
+  fwb->getFirewallChildren(nat);
+  ASSERT_EQ(fwb->getTableLoadStat("filter")->load_count_, 1);
+  ASSERT_EQ(fwb->getTableLoadStat("nat")->load_count_, 2);
+}
+
+TEST_F(FirewallTestFixture, settleKeepsChangesOutsideJournal) {
+  auto filter = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  ASSERT_TRUE(fwb->insertChain(filter, make_shared<ChainRequest>("KEPT")));
+
+  /* no scope pending, but the handle still differs from kernel */
+  fwb->settle({});
+  ASSERT_TRUE(fwb->commit());
+  auto check = make_shared<FirewallBackend>();
+  auto chains = check->getFirewallChildren(
+      check->createContext(make_shared<FirewallContext>(), "filter"));
+  ASSERT_NE(std::ranges::find(chains, "KEPT"), chains.end());
+
+  ASSERT_TRUE(fwb->removeChain(fwb->createContext(filter, "KEPT")));
+  ASSERT_TRUE(fwb->commit());
+}
+
+TEST_F(FirewallTestFixture, unknownTableReportsError) {
+  auto ctx = fwb->createContext(make_shared<FirewallContext>(), "nosuch");
+  ASSERT_TRUE(fwb->getFirewallChildren(ctx).empty());
+  ASSERT_NE(ctx->getLastError().find("nosuch"), string::npos);
+
+  auto chain = fwb->createContext(ctx, "INPUT");
+  ASSERT_EQ(fwb->getRuleCount(chain), 0);
+  ASSERT_EQ(fwb->getRule(chain, 0), nullptr);
+  ASSERT_FALSE(fwb->insertRule(chain, make_shared<RuleRequest>()));
+  ASSERT_FALSE(fwb->removeRule(chain, 0));
+}
+
 TEST_F(FirewallTestFixture, addDelChain) {
   auto ctx = make_shared<FirewallContext>();
   auto tables = fwb->getTableNames();
@@ -141,6 +253,1063 @@ TEST_F(FirewallTestFixture, addDelChain) {
   }
 }
 
+TEST_F(FirewallTestFixture, batchInsertRemove) {
+  auto context = make_shared<FirewallContext>();
+  context = fwb->createContext(context, "filter");
+  context = fwb->createContext(context, "INPUT");
+
+  auto rule_num = fwb->getRuleCount(context);
+
+  /* indices refer to chain before batch, same index keeps request order */
+  vector<shared_ptr<RuleRequest>> requests;
+  for (const auto &[index, src] :
+       vector<tuple<int, string>>{{0, "10.0.0.2"}, {0, "10.0.0.1"},
+                                  {rule_num, "10.0.0.3"}}) {
+    auto request = make_shared<RuleRequest>();
+    request->index_ = index;
+    request->src_ip_ = src;
+    requests.emplace_back(request);
+  }
+  requests.emplace_back(make_shared<RuleRequest>());
+  requests.back()->proto_ = "ICMP";
+
+  auto result = fwb->insertRules(context, requests);
+  ASSERT_FALSE(result[0].has_value());
+  ASSERT_FALSE(result[1].has_value());
+  ASSERT_FALSE(result[2].has_value());
+  ASSERT_TRUE(result[3].has_value());
+
+  ASSERT_EQ(fwb->getRuleCount(context), rule_num + 3);
+  ASSERT_EQ(fwb->getRule(context, 0)->src_ip_.value(), "10.0.0.2");
+  ASSERT_EQ(fwb->getRule(context, 1)->src_ip_.value(), "10.0.0.1");
+  ASSERT_EQ(fwb->getRule(context, rule_num + 2)->src_ip_.value(), "10.0.0.3");
+
+  vector<int> indices = {rule_num + 2, 0, 1, 1};
+  result = fwb->removeRules(context, indices);
+  ASSERT_FALSE(result[0].has_value());
+  ASSERT_FALSE(result[1].has_value());
+  ASSERT_NE(result[2].has_value(), result[3].has_value());
+  ASSERT_EQ(fwb->getRuleCount(context), rule_num);
+
+  /* appended in request order whatever the indices */
+  result = fwb->appendRules(context, requests);
+  ASSERT_FALSE(result[0].has_value());
+  ASSERT_TRUE(result[3].has_value());
+  ASSERT_EQ(fwb->getRuleCount(context), rule_num + 3);
+  ASSERT_EQ(fwb->getRule(context, rule_num)->src_ip_.value(), "10.0.0.2");
+  ASSERT_EQ(fwb->getRule(context, rule_num + 2)->src_ip_.value(), "10.0.0.3");
+}
+
+TEST_F(FirewallTestFixture, unknownTargetIsRejected) {
+  auto table = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  auto context = fwb->createContext(table, "INPUT");
+  ASSERT_TRUE(fwb->insertChain(table, make_shared<ChainRequest>("KNOWN")));
+
+  vector<shared_ptr<RuleRequest>> requests;
+  for (const auto *target : {"KNOWN", "NOSUCH", "OUTPUT", "RETURN", ""}) {
+    requests.emplace_back(make_shared<RuleRequest>());
+    requests.back()->index_ = 0;
+    requests.back()->target_ = target;
+  }
+
+  /* builtin chains cannot be jumped to */
+  auto result = fwb->insertRules(context, requests);
+  ASSERT_FALSE(result[0].has_value());
+  ASSERT_NE(result[1].value_or("").find("Unknown target: NOSUCH"),
+            string::npos);
+  ASSERT_TRUE(result[2].has_value());
+  ASSERT_FALSE(result[3].has_value());
+  ASSERT_FALSE(result[4].has_value());
+  fwb->reloadTable(table);
+}
+
+TEST_F(FirewallTestFixture, rulesetModel) {
+  auto context = make_shared<FirewallContext>();
+  context = fwb->createContext(context, "filter");
+  auto table_ctx = context;
+  context = fwb->createContext(context, "INPUT");
+
+  auto request = make_shared<RuleRequest>();
+  request->index_ = 0;
+  request->src_ip_ = "10.0.0.9";
+  ASSERT_TRUE(fwb->insertRule(context, request));
+
+  auto model = fwb->getRulesetModel(table_ctx);
+  ASSERT_EQ(model, fwb->getRulesetModel(context)); /* decoded once */
+
+  auto index = model->findChain("INPUT");
+  ASSERT_TRUE(index.has_value());
+  const auto &chain = model->chains_[*index];
+  ASSERT_TRUE(chain.builtin_);
+  ASSERT_EQ(chain.size(), fwb->getRuleCount(context));
+  ASSERT_EQ(model->chainOf(chain.begin_), *index);
+  ASSERT_EQ(model->src_[chain.begin_], 0x0a000009U);
+  ASSERT_EQ(model->dport_hi_[chain.begin_], 65535);
+
+  ASSERT_TRUE(fwb->removeRule(context, 0));
+  ASSERT_NE(model, fwb->getRulesetModel(context));
+  ASSERT_EQ(fwb->getRulesetModel(context)->chains_[*index].size(),
+            fwb->getRuleCount(context));
+}
+
+TEST_F(FirewallTestFixture, saveRestoreRoundTrip) {
+  const string saved = "*filter\n"
+                       ":INPUT ACCEPT [0:0]\n"
+                       ":FORWARD ACCEPT [0:0]\n"
+                       ":OUTPUT ACCEPT [0:0]\n"
+                       ":cp_test - [0:0]\n"
+                       "-A INPUT -s 10.0.0.0/8 -i eth+ -p tcp -m tcp "
+                       "--dport 22 -j cp_test\n"
+                       "-A INPUT -d 192.168.1.1/32 -p udp -m udp --sport 53 "
+                       "-j ACCEPT\n"
+                       "-A cp_test -o lo -j DROP\n"
+                       "-A cp_test -p tcp -m tcp --sport 1024:65535 -j RETURN\n"
+                       "COMMIT\n";
+
+  std::istringstream input(saved);
+  auto error = fwb->importRuleset(input);
+  ASSERT_FALSE(error.has_value()) << error.value();
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  std::ostringstream output;
+  ASSERT_EQ(fwb->exportRuleset(output, context), 0);
+  ASSERT_EQ(output.str(), saved);
+}
+
+TEST_F(FirewallTestFixture, restoreRejectsUnsupported) {
+  std::istringstream input("*filter\n"
+                           "-A INPUT ! -s 10.0.0.1 -j DROP\n"
+                           "COMMIT\n");
+  auto error = fwb->importRuleset(input);
+  ASSERT_TRUE(error.has_value());
+  ASSERT_EQ(error->rfind("line 2:", 0), 0);
+
+  std::istringstream unterminated("*filter\n:INPUT ACCEPT [0:0]\n");
+  ASSERT_TRUE(fwb->importRuleset(unterminated).has_value());
+}
+
+TEST_F(FirewallTestFixture, failedImportKeepsEarlierEdits) {
+  const string saved = "*filter\n"
+                       ":INPUT ACCEPT [0:0]\n"
+                       ":FORWARD DROP [0:0]\n"
+                       ":OUTPUT ACCEPT [0:0]\n"
+                       ":cp_keep - [0:0]\n"
+                       "-A INPUT -p tcp -m tcp --dport 22 -j cp_keep\n"
+                       "-A cp_keep -s 10.0.0.0/8 -j ACCEPT\n"
+                       "-A cp_keep -j DROP\n"
+                       "COMMIT\n";
+  std::istringstream first(saved);
+  ASSERT_FALSE(fwb->importRuleset(first).has_value());
+
+  /* fails after flushing the table, creating a chain and adding rules */
+  std::istringstream second("*filter\n"
+                            ":FORWARD ACCEPT [0:0]\n"
+                            ":cp_other - [0:0]\n"
+                            "-A INPUT -j cp_other\n"
+                            "-A INPUT ! -s 10.0.0.1 -j DROP\n"
+                            "COMMIT\n");
+  ASSERT_TRUE(fwb->importRuleset(second).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  std::ostringstream output;
+  ASSERT_EQ(fwb->exportRuleset(output, context), 0);
+  ASSERT_EQ(output.str(), saved);
+  ASSERT_GT(fwb->estimateCommitCost(), 0);
+}
+
+TEST_F(FirewallTestFixture, classifyFollowsJumps) {
+  std::istringstream input("*filter\n"
+                           ":INPUT DROP [0:0]\n"
+                           ":FORWARD ACCEPT [0:0]\n"
+                           ":OUTPUT ACCEPT [0:0]\n"
+                           ":cp_ssh - [0:0]\n"
+                           "-A INPUT -s 10.0.0.0/8 -p tcp -m tcp --dport 22 "
+                           "-j cp_ssh\n"
+                           "-A INPUT -i eth+ -p udp -j ACCEPT\n"
+                           "-A INPUT -s 172.16.0.0/12 -j RETURN\n"
+                           "-A cp_ssh -s 10.0.0.1/32 -j ACCEPT\n"
+                           "-A cp_ssh -j RETURN\n"
+                           "COMMIT\n");
+  ASSERT_FALSE(fwb->importRuleset(input).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  auto model = fwb->getRulesetModel(context);
+  auto input_chain = model->findChain("INPUT").value();
+  auto ssh_chain = model->findChain("cp_ssh").value();
+  Classifier classifier(model);
+
+  auto result = classifier.classify(
+      PacketTuple::parse("10.0.0.1 192.168.0.1 tcp 40000 22").value(),
+      input_chain);
+  ASSERT_EQ(result.jumps_.size(), 1);
+  ASSERT_EQ(result.rule_, model->chains_[ssh_chain].begin_);
+
+  result = classifier.classify(
+      PacketTuple::parse("10.0.0.2 192.168.0.1 tcp 40000 22").value(),
+      input_chain);
+  ASSERT_FALSE(result.rule_.has_value());
+  ASSERT_EQ(model->targetOf(model->chains_[input_chain].begin_).kind_,
+            TargetKind::JUMP);
+
+  /* RETURN of a builtin chain leaves the verdict to its policy */
+  auto policy = model->chains_[input_chain].policy_;
+  result = classifier.classify(
+      PacketTuple::parse("172.16.0.1 192.168.0.1 tcp 40000 80").value(),
+      input_chain);
+  ASSERT_FALSE(result.rule_.has_value());
+  ASSERT_EQ(result.target_, policy);
+
+  result = classifier.classify(
+      PacketTuple::parse("10.0.0.2 192.168.0.1 tcp 40000 22").value(),
+      ssh_chain);
+  ASSERT_FALSE(result.rule_.has_value());
+  ASSERT_FALSE(result.target_.has_value());
+
+  std::istringstream tuples("10.0.0.1 1.1.1.1 tcp 1 22\n"
+                            "10.0.0.2 1.1.1.1 udp 1 53 eth1\n"
+                            "10.0.0.2 1.1.1.1 udp 1 53 lo\n"
+                            "not a tuple\n");
+  auto histogram = classifier.classifyBatch(tuples, input_chain);
+  auto input_begin = model->chains_[input_chain].begin_;
+  ASSERT_EQ(histogram.packets_, 3);
+  ASSERT_EQ(histogram.invalid_lines_, 1);
+  ASSERT_EQ(histogram.rule_hits_[input_begin], 1);
+  ASSERT_EQ(histogram.rule_hits_[input_begin + 1], 1);
+  ASSERT_EQ(histogram.policy_hits_[input_chain], 1);
+
+  std::istringstream returned("10.0.0.2 1.1.1.1 tcp 1 22\n");
+  histogram = classifier.classifyBatch(returned, ssh_chain);
+  ASSERT_EQ(histogram.packets_, 1);
+  ASSERT_EQ(histogram.policy_hits_[ssh_chain], 0);
+}
+
+TEST_F(FirewallTestFixture, analyzeShadowedRules) {
+  std::istringstream input("*filter\n"
+                           ":INPUT ACCEPT [0:0]\n"
+                           ":FORWARD ACCEPT [0:0]\n"
+                           ":OUTPUT ACCEPT [0:0]\n"
+                           "-A INPUT -s 10.0.0.0/8 -p tcp -m tcp --dport 22 "
+                           "-j ACCEPT\n"
+                           "-A INPUT -s 10.1.0.0/16 -p tcp -m tcp --dport 22 "
+                           "-j DROP\n"
+                           "-A INPUT -s 10.2.0.0/16 -p tcp -m tcp --dport 22 "
+                           "-j ACCEPT\n"
+                           "-A INPUT -s 10.0.0.0/8 -p tcp -m tcp "
+                           "--dport 20:30 -j DROP\n"
+                           "-A INPUT -s 192.168.0.0/16 -j DROP\n"
+                           "-A INPUT -s 192.168.1.0/24 -p tcp -m tcp "
+                           "--dport 443 -j ACCEPT\n"
+                           "COMMIT\n");
+  ASSERT_FALSE(fwb->importRuleset(input).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  context = fwb->createContext(context, "INPUT");
+  auto report = fwb->analyzeChain(context).value();
+  auto model = fwb->getRulesetModel(context);
+  auto begin = model->chains_[model->findChain("INPUT").value()].begin_;
+
+  ASSERT_EQ(report.skipped_, 0);
+  ASSERT_EQ(report.anomalies_.size(), 4);
+  ASSERT_EQ(report.anomalies_[0].kind_, AnomalyKind::SHADOWED);
+  ASSERT_EQ(report.anomalies_[0].row_, begin + 1);
+  ASSERT_EQ(report.anomalies_[0].other_, begin);
+  ASSERT_EQ(report.anomalies_[1].kind_, AnomalyKind::REDUNDANT);
+  ASSERT_EQ(report.anomalies_[1].row_, begin + 2);
+  ASSERT_EQ(report.anomalies_[2].kind_, AnomalyKind::CORRELATED);
+  ASSERT_EQ(report.anomalies_[2].row_, begin + 3);
+
+  /* rules without port are found from any port */
+  ASSERT_EQ(report.anomalies_[3].kind_, AnomalyKind::SHADOWED);
+  ASSERT_EQ(report.anomalies_[3].row_, begin + 5);
+  ASSERT_EQ(report.anomalies_[3].other_, begin + 4);
+}
+
+TEST_F(FirewallTestFixture, optimizeChainKeepsVerdicts) {
+  constexpr int kRules = 48;
+  string rules = "*filter\n:INPUT DROP [0:0]\n:FORWARD ACCEPT [0:0]\n"
+                 ":OUTPUT ACCEPT [0:0]\n";
+  for (int i = 0; i < kRules; i++) {
+    rules += fmt::format("-A INPUT -i eth{} -d 10.0.{}.0/24 -p {} -m {} "
+                         "--dport {} -j {}\n",
+                         i % 4, i % 8, i % 3 == 0 ? "udp" : "tcp",
+                         i % 3 == 0 ? "udp" : "tcp", 1000 + i,
+                         i % 5 == 0 ? "DROP" : "ACCEPT");
+  }
+  rules += "-A INPUT -p udp -j RETURN\nCOMMIT\n";
+  std::istringstream input(rules);
+  ASSERT_FALSE(fwb->importRuleset(input).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  context = fwb->createContext(context, "INPUT");
+  auto plan = fwb->planOptimization(context);
+  ASSERT_TRUE(plan.has_value()) << context->getLastError();
+  ASSERT_GT(plan->ruleset_.chains_.size(), 1);
+  ASSERT_LT(plan->after_avg_, plan->before_avg_);
+
+  /* verdict of every packet, RETURN of builtin chain is its policy */
+  auto verdicts = [this, &context]() {
+    auto model = fwb->getRulesetModel(context);
+    Classifier classifier(model);
+    auto chain = model->findChain("INPUT").value();
+    vector<string> result;
+    for (int i = 0; i < kRules + 4; i++) {
+      auto packet = PacketTuple::parse(
+          fmt::format("1.1.1.1 10.0.{}.1 {} 40000 {} eth{}", i % 8,
+                      i % 2 == 0 ? "udp" : "tcp", 1000 + i, i % 4));
+      auto hit = classifier.classify(packet.value(), chain);
+      if (hit.rule_ && model->targetOf(*hit.rule_).kind_ !=
+                           TargetKind::RETURN) {
+        result.push_back(model->names_.get(model->targetOf(*hit.rule_).name_));
+      } else {
+        result.emplace_back("DROP");
+      }
+    }
+    return result;
+  };
+
+  auto before = verdicts();
+  ASSERT_TRUE(fwb->applyOptimization(context, *plan))
+      << context->getLastError();
+  ASSERT_EQ(verdicts(), before);
+}
+
+TEST_F(FirewallTestFixture, compactMergesAdjacentRules) {
+  string rules = "*filter\n:INPUT ACCEPT [0:0]\n:FORWARD ACCEPT [0:0]\n"
+                 ":OUTPUT ACCEPT [0:0]\n";
+  for (int i = 3; i < 13; i++) {
+    rules += fmt::format("-A INPUT -s 10.0.0.{}/32 -j DROP\n", i);
+  }
+  /* overlaps 10.0.0.12 with another target, so 12 cannot move up */
+  rules += "-A INPUT -s 10.0.0.12/30 -p tcp -j ACCEPT\n";
+  for (int i = 0; i < 8; i++) {
+    rules += fmt::format("-A INPUT -p udp -m udp --dport {} -j DROP\n",
+                         1000 + i);
+  }
+  rules += "-A INPUT -s 10.0.0.13/32 -j DROP\nCOMMIT\n";
+  std::istringstream input(rules);
+  ASSERT_FALSE(fwb->importRuleset(input).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  context = fwb->createContext(context, "INPUT");
+  auto plan = fwb->planCompaction(context).value();
+  ASSERT_EQ(plan.rule_count_, 20);
+  ASSERT_EQ(plan.removed_.size(), 13);
+  ASSERT_TRUE(fwb->applyCompaction(context, plan)) << context->getLastError();
+
+  auto children = fwb->getFirewallChildren(context);
+  ASSERT_EQ(children.size(), 7);
+  auto rule = fwb->getRule(context, 1);
+  ASSERT_EQ(rule->src_ip_, "10.0.0.4");
+  ASSERT_EQ(rule->src_mask_, "255.255.255.252");
+  rule = fwb->getRule(context, 5);
+  ASSERT_EQ(get<0>(rule->matches_[0].dst_port_range_.value()), "1000");
+  ASSERT_EQ(get<1>(rule->matches_[0].dst_port_range_.value()), "1007");
+}
+
+TEST_F(FirewallTestFixture, compactKeepsOverlappingLogRules) {
+  /* LOG cannot be encoded, rows are added to the model directly */
+  RulesetModel model;
+  auto target = [&model](const string &name, TargetKind kind) {
+    model.targets_.push_back({model.names_.intern(name), kind, 1});
+    return static_cast<uint16_t>(model.targets_.size() - 1);
+  };
+  auto log = target("LOG", TargetKind::EXTENSION);
+  auto jump = target("cp_log", TargetKind::JUMP);
+  auto drop = target(IPTC_LABEL_DROP, TargetKind::DROP);
+  auto row = [&model](uint16_t lo, uint16_t hi, uint16_t target) {
+    for (auto *column : {&model.src_, &model.smsk_, &model.dst_,
+                         &model.dmsk_}) {
+      column->push_back(0);
+    }
+    model.proto_.push_back(IPPROTO_UDP);
+    model.flags_.push_back(0);
+    model.iniface_.push_back(0);
+    model.outiface_.push_back(0);
+    model.sport_lo_.push_back(0);
+    model.sport_hi_.push_back(UINT16_MAX);
+    model.dport_lo_.push_back(lo);
+    model.dport_hi_.push_back(hi);
+    model.target_.push_back(target);
+    model.pcnt_.push_back(0);
+    model.bcnt_.push_back(0);
+  };
+
+  /* a packet on an overlapping port is logged twice */
+  row(1000, 1010, log);
+  row(1005, 1020, log);
+  row(1021, 1030, log);
+  /* and walks cp_log twice, touching ranges may merge */
+  row(2000, 2010, jump);
+  row(2005, 2020, jump);
+  row(2021, 2030, jump);
+  /* the first DROP ends evaluation, overlapping ranges may merge */
+  row(3000, 3010, drop);
+  row(3005, 3020, drop);
+  auto rows = static_cast<uint32_t>(model.size());
+  model.chains_.push_back({model.names_.intern("INPUT"), 0, rows, true, drop});
+  model.chains_.push_back({model.names_.intern("cp_log"), rows, rows, false});
+
+  auto plan = RuleCompactor::compact(model, 0);
+  ASSERT_EQ(plan.removed_, vector<int>({5, 7}));
+  ASSERT_EQ(plan.replaced_.size(), 2);
+  ASSERT_EQ(plan.replaced_[0]->index_, 4);
+  ASSERT_EQ(plan.replaced_[1]->index_, 6);
+}
+
+TEST_F(FirewallTestFixture, reorderRulesKeepsEntries) {
+  std::istringstream input("*filter\n"
+                           ":INPUT ACCEPT [0:0]\n"
+                           ":FORWARD ACCEPT [0:0]\n"
+                           ":OUTPUT ACCEPT [0:0]\n"
+                           ":cp_ssh - [0:0]\n"
+                           "-A INPUT -s 10.0.0.1/32 -j DROP\n"
+                           "-A INPUT -s 10.0.0.2/32 -j ACCEPT\n"
+                           "-A INPUT -s 10.0.0.3/32 -p tcp -m tcp "
+                           "--dport 22 -j DROP\n"
+                           "-A INPUT -s 10.0.0.4/32 -j cp_ssh\n"
+                           "COMMIT\n");
+  ASSERT_FALSE(fwb->importRuleset(input).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  context = fwb->createContext(context, "INPUT");
+
+  /* no packet counted yet, nothing to gain */
+  auto plan = fwb->planReorder(context).value();
+  ASSERT_EQ(plan.moved_, 0);
+  ASSERT_EQ(plan.order_, vector<int>({0, 1, 2, 3}));
+
+  /* unknown chain is an error in context, not an exception */
+  auto missing = fwb->createContext(
+      fwb->createContext(make_shared<FirewallContext>(), "filter"),
+      "CP_MISSING");
+  ASSERT_FALSE(fwb->planReorder(missing).has_value());
+  ASSERT_EQ(missing->getLastError(), "Unknown chain: CP_MISSING");
+
+  ASSERT_FALSE(fwb->reorderRules(context, vector<int>{0, 0, 1, 2}));
+  ASSERT_TRUE(fwb->reorderRules(context, vector<int>{2, 3, 0, 1}));
+  auto rule = fwb->getRule(context, 0);
+  ASSERT_EQ(rule->src_ip_, "10.0.0.3");
+  ASSERT_EQ(rule->target_, "DROP");
+  ASSERT_EQ(get<0>(rule->matches_[0].dst_port_range_.value()), "22");
+  ASSERT_EQ(fwb->getRule(context, 1)->target_, "cp_ssh");
+  ASSERT_EQ(fwb->getRule(context, 3)->src_ip_, "10.0.0.2");
+  ASSERT_EQ(fwb->getRule(context, 3)->target_, "ACCEPT");
+}
+
+TEST_F(FirewallTestFixture, counterSamplerLabelsRules) {
+  auto table_ctx = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  ASSERT_TRUE(
+      fwb->insertChain(table_ctx, make_shared<ChainRequest>("CP_SAMPLE")));
+  auto chain_ctx = fwb->createContext(table_ctx, "CP_SAMPLE");
+  vector<shared_ptr<RuleRequest>> rules;
+  for (int i = 0; i < 2; i++) {
+    auto rule = make_shared<RuleRequest>();
+    rule->index_ = i;
+    rule->src_ip_ = fmt::format("10.0.0.{}", i + 1);
+    rule->target_ = "DROP";
+    rules.push_back(rule);
+  }
+  fwb->insertRules(chain_ctx, rules);
+  auto commit = fwb->apply();
+  ASSERT_TRUE(commit());
+
+  auto sampler = fwb->getCounterSampler(table_ctx);
+  ASSERT_TRUE(sampler->sample());
+  ASSERT_TRUE(sampler->sample());
+  ASSERT_EQ(sampler->sampleCount(), 2);
+
+  vector<int> indices;
+  for (size_t rule = 0; rule < sampler->ruleCount(); rule++) {
+    auto rate = sampler->rate(rule);
+    if (rate.chain_ == "CP_SAMPLE") {
+      indices.push_back(rate.index_);
+    }
+  }
+  ASSERT_EQ(indices, vector<int>({0, 1}));
+
+  std::ostringstream output;
+  sampler->writePrometheus(output);
+  ASSERT_NE(output.str().find("controlpanel_rule_packets_total{table="
+                              "\"filter\",chain=\"CP_SAMPLE\",rule=\"1\"}"),
+            string::npos);
+
+  /* swapped rules keep the layout, they are relabeled all the same */
+  ASSERT_TRUE(fwb->reorderRules(chain_ctx, vector<int>{1, 0}));
+  ASSERT_TRUE(commit());
+  ASSERT_TRUE(sampler->sample());
+  ASSERT_EQ(sampler->sampleCount(), 1);
+  ASSERT_TRUE(sampler->sample());
+  ASSERT_EQ(sampler->sampleCount(), 2);
+
+  /* layout change relabels and restarts the history */
+  ASSERT_TRUE(fwb->removeRule(chain_ctx, 0));
+  ASSERT_TRUE(commit());
+  ASSERT_TRUE(sampler->sample());
+  ASSERT_EQ(sampler->sampleCount(), 1);
+
+  ASSERT_TRUE(fwb->removeRule(chain_ctx, 0));
+  ASSERT_TRUE(fwb->removeChain(chain_ctx));
+  ASSERT_TRUE(commit());
+}
+
+TEST_F(FirewallTestFixture, staleTableIsNotCommitted) {
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  auto chains = fwb->getFirewallChildren(context);
+  ASSERT_FALSE(fwb->isStale(context));
+
+  /* another program changes the table after it was loaded */
+  auto other = make_shared<FirewallBackend>();
+  auto other_context =
+      other->createContext(make_shared<FirewallContext>(), "filter");
+  ASSERT_TRUE(
+      other->insertChain(other_context, make_shared<ChainRequest>("CP_OTHER")));
+  ASSERT_TRUE(other->commit());
+  ASSERT_TRUE(fwb->isStale(context));
+
+  ASSERT_TRUE(fwb->insertChain(context, make_shared<ChainRequest>("CP_MINE")));
+  ASSERT_FALSE(fwb->reloadIfStale(context));
+  ASSERT_FALSE(fwb->commit());
+
+  fwb->reloadTable(context);
+  ASSERT_EQ(fwb->getFirewallChildren(context).size(), chains.size() + 1);
+  ASSERT_FALSE(fwb->isStale(context));
+
+  ASSERT_TRUE(fwb->removeChain(fwb->createContext(context, "CP_OTHER")));
+  ASSERT_TRUE(fwb->commit());
+  ASSERT_FALSE(other->reloadIfStale(other_context));
+}
+
+TEST_F(FirewallTestFixture, xtablesLockBacksOff) {
+  const string path = "/tmp/controlpanel_test_xtables.lock";
+  {
+    XtablesLock holder(XtablesLock::kTimeout, path);
+    ASSERT_TRUE(holder.locked());
+    ASSERT_FALSE(holder.contended());
+
+    /* flock is per open file, a second descriptor waits like iptables */
+    XtablesLock waiter(std::chrono::milliseconds(20), path);
+    ASSERT_FALSE(waiter.locked());
+    ASSERT_TRUE(waiter.contended());
+    ASSERT_GE(waiter.waited(), std::chrono::milliseconds(20));
+    ASSERT_FALSE(waiter.error().empty());
+  }
+  XtablesLock after(std::chrono::milliseconds(20), path);
+  ASSERT_TRUE(after.locked());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  ASSERT_TRUE(fwb->insertChain(context, make_shared<ChainRequest>("CP_LOCK")));
+  ASSERT_TRUE(fwb->removeChain(fwb->createContext(context, "CP_LOCK")));
+  ASSERT_TRUE(fwb->commit());
+  ASSERT_EQ(fwb->getCommitStat().commits_, 1);
+  ASSERT_EQ(fwb->getCommitStat().failures_, 0);
+  ASSERT_TRUE(fwb->lastCommitError().empty());
+}
+
+TEST_F(FirewallTestFixture, searchFindsRulesAcrossChains) {
+  auto table_ctx = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  for (const auto *chain : {"CP_SEARCH_A", "CP_SEARCH_B"}) {
+    ASSERT_TRUE(fwb->insertChain(table_ctx, make_shared<ChainRequest>(chain)));
+  }
+  auto chain_a = fwb->createContext(table_ctx, "CP_SEARCH_A");
+  auto chain_b = fwb->createContext(table_ctx, "CP_SEARCH_B");
+
+  auto makeRule = [](int index, const string &src, const string &mask,
+                     const string &port) {
+    auto rule = make_shared<RuleRequest>();
+    rule->index_ = index;
+    rule->src_ip_ = src;
+    rule->src_mask_ = mask;
+    RuleMatch match;
+    match.dst_port_range_ = {port, port};
+    rule->matches_.push_back(match);
+    return rule;
+  };
+  vector<shared_ptr<RuleRequest>> rules_a{
+      makeRule(0, "10.2.3.0", "255.255.255.0", "443"),
+      makeRule(1, "10.9.0.0", "255.255.0.0", "443")};
+  vector<shared_ptr<RuleRequest>> rules_b{
+      makeRule(0, "10.0.0.0", "255.0.0.0", "22"),
+      makeRule(1, "10.2.0.0", "255.255.0.0", "443")};
+  fwb->insertRules(chain_a, rules_a);
+  fwb->insertRules(chain_b, rules_b);
+
+  /* one rule inside the query prefix, one containing it */
+  auto hits = fwb->searchRules("10.2.0.0/16 port 443", 10);
+  ASSERT_EQ(hits, vector<SearchHit>({{"filter", "CP_SEARCH_A", 0},
+                                     {"filter", "CP_SEARCH_B", 1}}));
+  ASSERT_EQ(fwb->searchRules("cp_search_b 10.2.3.4", 10).size(), 2);
+  ASSERT_EQ(fwb->searchRules("10.2.0.0/16 port 443", 1).size(), 1);
+  ASSERT_THROW(fwb->searchRules("port 99999", 10), std::invalid_argument);
+
+  /* only the changed chain is indexed again */
+  ASSERT_TRUE(fwb->removeRule(chain_a, 0));
+  hits = fwb->searchRules("10.2.0.0/16 port 443", 10);
+  ASSERT_EQ(hits, vector<SearchHit>({{"filter", "CP_SEARCH_B", 1}}));
+
+  /* nothing is committed, reloading forgets the chains */
+  fwb->reloadTable(table_ctx);
+  ASSERT_TRUE(fwb->searchRules("cp_search_b", 10).empty());
+}
+
+TEST_F(FirewallTestFixture, searchSeesChangesFromOutside) {
+  ASSERT_TRUE(fwb->searchRules("cp_outside", 10).empty());
+
+  /* another program adds a chain while the index is kept */
+  auto other = make_shared<FirewallBackend>();
+  auto table_ctx =
+      other->createContext(make_shared<FirewallContext>(), "filter");
+  ASSERT_TRUE(
+      other->insertChain(table_ctx, make_shared<ChainRequest>("CP_OUTSIDE")));
+  auto rule = make_shared<RuleRequest>();
+  rule->target_ = "DROP";
+  ASSERT_TRUE(other->insertRule(other->createContext(table_ctx, "CP_OUTSIDE"),
+                                rule));
+  auto commit = other->apply();
+  ASSERT_TRUE(commit());
+
+  ASSERT_EQ(fwb->searchRules("cp_outside", 10),
+            vector<SearchHit>({{"filter", "CP_OUTSIDE", 0}}));
+
+  ASSERT_TRUE(other->removeRule(other->createContext(table_ctx, "CP_OUTSIDE"),
+                                0));
+  ASSERT_TRUE(
+      other->removeChain(other->createContext(table_ctx, "CP_OUTSIDE")));
+  ASSERT_TRUE(commit());
+}
+
+TEST_F(FirewallTestFixture, queryRulesStreamsMatches) {
+  auto table_ctx = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  ASSERT_TRUE(
+      fwb->insertChain(table_ctx, make_shared<ChainRequest>("CP_QUERY")));
+  auto chain_ctx = fwb->createContext(table_ctx, "CP_QUERY");
+
+  vector<shared_ptr<RuleRequest>> rules;
+  for (const auto &[proto, port, target] :
+       vector<tuple<string, string, string>>{
+           {RequestProto::TCP, "8080", "DROP"},
+           {RequestProto::UDP, "8080", "DROP"},
+           {RequestProto::TCP, "22", "DROP"},
+           {RequestProto::TCP, "8443", "ACCEPT"}}) {
+    auto rule = make_shared<RuleRequest>();
+    rule->index_ = static_cast<int>(rules.size());
+    rule->proto_ = proto;
+    rule->target_ = target;
+    RuleMatch match;
+    match.dst_port_range_ = {port, port};
+    rule->matches_.push_back(match);
+    rules.push_back(rule);
+  }
+  fwb->insertRules(chain_ctx, rules);
+
+  vector<int> indices;
+  auto collect = [&indices](const RulesetModel &model, uint32_t row) {
+    indices.push_back(
+        static_cast<int>(row - model.chains_[model.chainOf(row)].begin_));
+    return true;
+  };
+  auto stat = fwb->queryRules("chain == CP_QUERY && proto == tcp && "
+                              "dport overlaps 8000-9000 && target == DROP",
+                              collect);
+  ASSERT_EQ(indices, vector<int>({0}));
+  ASSERT_EQ(stat.matched_, 1);
+  /* the chain predicate narrows the scan to the chain */
+  ASSERT_EQ(stat.scanned_, rules.size());
+
+  indices.clear();
+  stat = fwb->queryRules(
+      "chain == CP_QUERY && !(proto == udp || target == ACCEPT)", collect);
+  ASSERT_EQ(indices, vector<int>({0, 2}));
+
+  /* other tables are excluded without loading them */
+  stat = fwb->queryRules("table == filter && chain == CP_QUERY",
+                         [](const RulesetModel &, uint32_t) { return false; });
+  ASSERT_EQ(stat.tables_, 1);
+  ASSERT_EQ(stat.skipped_, FirewallBackend::getTableNames().size() - 1);
+  ASSERT_TRUE(stat.stopped_);
+  ASSERT_EQ(stat.matched_, 1);
+
+  ASSERT_THROW(fwb->queryRules("dport < 80", collect), std::invalid_argument);
+  fwb->reloadTable(table_ctx);
+}
+
+TEST_F(FirewallTestFixture, chainGraphTracksReferences) {
+  auto table_ctx = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  auto worst = [&](const string &hook) {
+    for (const auto &cost : fwb->getChainGraph(table_ctx)->hookCosts()) {
+      if (cost.chain_ == hook) {
+        return cost.worst_;
+      }
+    }
+    return uint64_t{0};
+  };
+  auto input_worst = worst("INPUT");
+
+  for (const auto *chain : {"CP_GRAPH_A", "CP_GRAPH_B", "CP_GRAPH_C"}) {
+    ASSERT_TRUE(fwb->insertChain(table_ctx, make_shared<ChainRequest>(chain)));
+  }
+  auto addRule = [&](const string &chain, int index, const string &target) {
+    auto rule = make_shared<RuleRequest>();
+    rule->index_ = index;
+    rule->target_ = target;
+    return fwb->insertRule(fwb->createContext(table_ctx, chain), rule);
+  };
+  ASSERT_TRUE(addRule("INPUT", 0, "CP_GRAPH_A"));
+  ASSERT_TRUE(addRule("CP_GRAPH_A", 0, "CP_GRAPH_B"));
+  ASSERT_TRUE(addRule("CP_GRAPH_A", 1, "DROP"));
+  ASSERT_TRUE(addRule("CP_GRAPH_B", 0, "ACCEPT"));
+
+  const auto &graph = *fwb->getChainGraph(table_ctx);
+  ASSERT_EQ(graph.references("CP_GRAPH_A"), 1);
+  ASSERT_EQ(graph.references("CP_GRAPH_B"), 1);
+  ASSERT_EQ(graph.references("CP_GRAPH_C"), 0);
+  auto unreachable = graph.unreachable();
+  ASSERT_NE(std::ranges::find(unreachable, "CP_GRAPH_C"), unreachable.end());
+  ASSERT_EQ(std::ranges::find(unreachable, "CP_GRAPH_B"), unreachable.end());
+  ASSERT_TRUE(graph.findCycle().empty());
+  /* the jump rule plus both rules of A plus the rule of B */
+  ASSERT_EQ(worst("INPUT"), input_worst + 4);
+
+  auto chain_b = fwb->createContext(table_ctx, "CP_GRAPH_B");
+  ASSERT_FALSE(fwb->removeChain(chain_b));
+  ASSERT_NE(chain_b->getLastError().find("CP_GRAPH_A"), string::npos);
+
+  ASSERT_TRUE(fwb->removeRule(fwb->createContext(table_ctx, "CP_GRAPH_A"), 0));
+  ASSERT_EQ(fwb->getChainGraph(table_ctx)->references("CP_GRAPH_B"), 0);
+  ASSERT_TRUE(fwb->removeRule(chain_b, 0));
+  ASSERT_TRUE(fwb->removeChain(chain_b));
+  ASSERT_FALSE(fwb->getChainGraph(table_ctx)->hasChain("CP_GRAPH_B"));
+  fwb->reloadTable(table_ctx);
+}
+
+TEST_F(FirewallTestFixture, setConversionFoldsFamilies) {
+  string input = "*filter\n"
+                 ":INPUT ACCEPT [0:0]\n"
+                 ":FORWARD ACCEPT [0:0]\n"
+                 ":OUTPUT ACCEPT [0:0]\n";
+  for (int i = 1; i <= 10; i++) {
+    input += fmt::format("-A INPUT -s 10.0.0.{}/32 -j DROP\n", i);
+    /* later members must not pass it, the last one cannot */
+    if (i == 5) {
+      input += "-A INPUT -s 10.0.0.3/32 -j ACCEPT\n";
+    }
+  }
+  input += "-A INPUT -s 10.0.0.3/32 -j DROP\n";
+  for (int i = 0; i < 8; i++) {
+    input += fmt::format("-A INPUT -p tcp -m tcp --dport {} -j ACCEPT\n",
+                         1000 + 2 * i);
+  }
+  input += "COMMIT\n";
+  std::istringstream stream(input);
+  ASSERT_FALSE(fwb->importRuleset(stream).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  context = fwb->createContext(context, "INPUT");
+  auto plan = fwb->planSetConversion(context).value();
+  ASSERT_EQ(plan.rule_count_, 20);
+  ASSERT_EQ(plan.families_.size(), 2);
+  ASSERT_EQ(plan.families_[0].members_.size(), 10);
+  ASSERT_EQ(plan.families_[1].rule_->index_, 12);
+  ASSERT_EQ(plan.removed_.size(), 16);
+  ASSERT_TRUE(fwb->applySetConversion(context, plan))
+      << context->getLastError();
+
+  ASSERT_EQ(fwb->getFirewallChildren(context).size(), 4);
+  auto by_src = fwb->getRule(context, 0)->set_match_;
+  ASSERT_TRUE(by_src.has_value());
+  ASSERT_TRUE(by_src->src_);
+  ASSERT_EQ(fwb->getRule(context, 2)->src_ip_, "10.0.0.3");
+  auto by_port = fwb->getRule(context, 3)->set_match_;
+  ASSERT_TRUE(by_port.has_value());
+  ASSERT_FALSE(by_port->src_);
+
+  /* 10.0.0.1-10.0.0.10 as CIDR blocks, ports one by one */
+  ASSERT_EQ(Ipset::list(by_src->name_)->size(), 5);
+  ASSERT_EQ(Ipset::list(by_port->name_)->size(), 8);
+
+  /* sets of discarded conversion are destroyed with it */
+  fwb->reloadTable(context);
+  ASSERT_FALSE(Ipset::indexOf(by_src->name_).has_value());
+  ASSERT_FALSE(Ipset::indexOf(by_port->name_).has_value());
+}
+
+TEST_F(FirewallTestFixture, bpfInterpreterChecksPrograms) {
+  /* ldb [9]; jeq #6 jt 0 jf 1; ret #1; ret #0 */
+  vector<struct sock_filter> program = {
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, 1), BPF_STMT(BPF_RET | BPF_K, 0)};
+  ASSERT_FALSE(BpfInterpreter::check(program).has_value());
+
+  vector<uint8_t> packet(20);
+  packet[9] = IPPROTO_TCP;
+  ASSERT_EQ(BpfInterpreter::run(program, packet), 1);
+  packet[9] = IPPROTO_UDP;
+  ASSERT_EQ(BpfInterpreter::run(program, packet), 0);
+  /* load beyond the packet */
+  ASSERT_EQ(BpfInterpreter::run(program, vector<uint8_t>(8)), 0);
+
+  program[1].jf = 2;
+  ASSERT_TRUE(BpfInterpreter::check(program).has_value());
+  program.pop_back();
+  ASSERT_TRUE(BpfInterpreter::check(program).has_value());
+}
+
+TEST_F(FirewallTestFixture, bpfCompilerKeepsVerdicts) {
+  std::mt19937 gen(RANDOM_SEED);
+  auto below = [&gen](uint32_t bound) {
+    return std::uniform_int_distribution<uint32_t>(0, bound - 1)(gen);
+  };
+
+  /* few distinct values so that rules overlap and targets repeat in runs */
+  string input = "*filter\n"
+                 ":INPUT ACCEPT [0:0]\n"
+                 ":FORWARD ACCEPT [0:0]\n"
+                 ":OUTPUT ACCEPT [0:0]\n"
+                 ":CP_BPF - [0:0]\n";
+  for (int i = 0; i < 300; i++) {
+    /* every rule has a source, a rule matching everything would shadow
+     * the rest of the chain */
+    auto prefix = 20 + 4 * below(4);
+    auto src = ((10U << 24) | (below(2) << 16) | (below(4) << 8) | below(16)) &
+               (~0U << (32 - prefix));
+    auto rule = fmt::format("-A CP_BPF -s {}.{}.{}.{}/{}", src >> 24,
+                            (src >> 16) & 0xff, (src >> 8) & 0xff, src & 0xff,
+                            prefix);
+    if (below(3) == 0) {
+      rule += fmt::format(" -d 192.168.{}.{}", below(2), below(4));
+    }
+    if (below(4) == 0) {
+      rule += below(2) == 0 ? " -i eth0" : " -i veth+";
+    }
+    switch (below(4)) {
+    case 0:
+      rule += fmt::format(" -p tcp -m tcp --dport {}", 20 + below(8));
+      break;
+    case 1:
+      rule += fmt::format(" -p udp -m udp --sport {}:{}", 50 + below(8),
+                          60 + below(8));
+      break;
+    case 2:
+      rule += " -p tcp";
+      break;
+    default:
+      break;
+    }
+    /* long runs of the same target */
+    if (i % 40 < 30) {
+      rule += " -j DROP";
+    } else {
+      rule += below(2) == 0 ? " -j ACCEPT" : " -j RETURN";
+    }
+    input += rule + "\n";
+  }
+  input += "COMMIT\n";
+  std::istringstream stream(input);
+  ASSERT_FALSE(fwb->importRuleset(stream).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  context = fwb->createContext(context, "CP_BPF");
+  auto model = fwb->getRulesetModel(context);
+  auto chain = *model->findChain("CP_BPF");
+
+  auto plan = fwb->planBpfCompilation(context, 1).value();
+  ASSERT_FALSE(plan.runs_.empty());
+  for (const auto &run : plan.runs_) {
+    ASSERT_LE(run.rule_->bpf_match_->program_.size(),
+              BpfCompiler::kMaxInstructions);
+  }
+  auto mismatch = BpfCompiler::verify(*model, chain, plan, 50000, 7);
+  ASSERT_FALSE(mismatch.has_value()) << *mismatch;
+
+  /* the harness notices wrong constants, runs may be shadowed so all of
+   * them are broken */
+  auto broken = plan;
+  for (auto &run : broken.runs_) {
+    run.rule_ = make_shared<RuleRequest>(*run.rule_);
+    for (auto &insn : run.rule_->bpf_match_->program_) {
+      if (insn.code == (BPF_JMP | BPF_JEQ | BPF_K)) {
+        insn.k ^= 1;
+        break;
+      }
+    }
+  }
+  ASSERT_TRUE(BpfCompiler::verify(*model, chain, broken, 50000, 7));
+
+  plan = fwb->planBpfCompilation(context).value();
+  ASSERT_FALSE(plan.runs_.empty());
+  ASSERT_TRUE(fwb->applyBpfCompilation(context, plan))
+      << context->getLastError();
+  ASSERT_EQ(fwb->getFirewallChildren(context).size(),
+            plan.rule_count_ - plan.removed_.size());
+  auto head = fwb->getRule(context, plan.runs_.front().rule_->index_);
+  ASSERT_TRUE(head->bpf_match_.has_value());
+  ASSERT_EQ(head->bpf_match_->program_.size(),
+            plan.runs_.front().rule_->bpf_match_->program_.size());
+
+  fwb->reloadTable(context);
+}
+
+TEST_F(FirewallTestFixture, conntrackBypassInsertsPairs) {
+  std::istringstream input(
+      "*raw\n"
+      ":PREROUTING ACCEPT [0:0]\n"
+      ":OUTPUT ACCEPT [0:0]\n"
+      "-A PREROUTING -d 192.0.2.1/32 -p udp -m udp --dport 53 "
+      "-j CT --notrack\n"
+      "COMMIT\n");
+  ASSERT_FALSE(fwb->importRuleset(input).has_value());
+
+  BypassService service;
+  service.proto_ = RequestProto::ALL;
+  service.ports_ = *ConntrackBypass::parsePorts("53,8000:8100");
+  ASSERT_TRUE(ConntrackBypass::parseAddress("192.0.2.1", service));
+  ASSERT_FALSE(ConntrackBypass::parsePorts("53,").has_value());
+  ASSERT_FALSE(ConntrackBypass::parsePorts("8100:8000").has_value());
+
+  auto plan = fwb->planConntrackBypass(service);
+  ASSERT_EQ(plan.rules_.size(), 16);
+  ASSERT_EQ(plan.pending(), 15);
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "raw");
+  auto filter = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  auto input_count =
+      fwb->getRuleCount(fwb->createContext(filter, "INPUT"));
+  ASSERT_TRUE(fwb->applyConntrackBypass(context, plan))
+      << context->getLastError();
+
+  auto prerouting = fwb->createContext(context, "PREROUTING");
+  ASSERT_EQ(fwb->getRuleCount(prerouting), 4);
+  auto rule = fwb->getRule(prerouting, 0);
+  ASSERT_EQ(rule->target_, RequestTarget::CT);
+  ASSERT_TRUE(rule->ct_target_.has_value());
+  ASSERT_TRUE(rule->ct_target_->notrack_);
+  ASSERT_EQ(rule->dst_ip_, "192.0.2.1");
+  rule = fwb->getRule(fwb->createContext(context, "OUTPUT"), 0);
+  ASSERT_EQ(rule->src_ip_, "192.0.2.1");
+  ASSERT_EQ(get<0>(*rule->matches_.front().src_port_range_), "53");
+  ASSERT_EQ(fwb->getRuleCount(fwb->createContext(filter, "INPUT")),
+            input_count + 4);
+
+  /* applying twice inserts nothing */
+  ASSERT_EQ(fwb->planConntrackBypass(service).pending(), 0);
+
+  std::ostringstream saved;
+  SaveFormat::write(saved, TableRuleset{"raw", {ChainRuleset{
+                                                   "PREROUTING", std::nullopt,
+                                                   {rule}}}});
+  ASSERT_NE(saved.str().find("-j CT --notrack"), string::npos);
+
+  fwb->reloadTable(context);
+  fwb->reloadTable(filter);
+}
+
+TEST_F(FirewallTestFixture, conntrackBypassKeepsEarlierDrops) {
+  std::istringstream input(
+      "*filter\n"
+      ":INPUT ACCEPT [0:0]\n"
+      "-A INPUT -s 198.51.100.0/24 -j DROP\n"
+      "-A INPUT -p udp -m udp --dport 53 -j DROP\n"
+      "COMMIT\n");
+  ASSERT_FALSE(fwb->importRuleset(input).has_value());
+  ASSERT_TRUE(fwb->commit());
+
+  /* -m state --state ESTABLISHED -j ACCEPT, not expressible by RuleRequest */
+  constexpr size_t kMatchSize =
+      XT_ALIGN(sizeof(ipt_entry_match) + sizeof(xt_state_info));
+  constexpr size_t kTargetSize = XT_ALIGN(sizeof(xt_standard_target));
+  vector<char> buffer(sizeof(ipt_entry) + kMatchSize + kTargetSize);
+  auto *entry = reinterpret_cast<ipt_entry *>(buffer.data());
+  entry->target_offset = sizeof(ipt_entry) + kMatchSize;
+  entry->next_offset = buffer.size();
+  auto *match = reinterpret_cast<ipt_entry_match *>(entry->elems);
+  match->u.match_size = kMatchSize;
+  strcpy(match->u.user.name, "state");
+  reinterpret_cast<xt_state_info *>(match->data)->statemask =
+      XT_STATE_BIT(IP_CT_ESTABLISHED);
+  auto *target = reinterpret_cast<ipt_entry_target *>(
+      buffer.data() + entry->target_offset);
+  target->u.target_size = kTargetSize;
+  strcpy(target->u.user.name, IPTC_LABEL_ACCEPT);
+
+  auto *handle = iptc_init("filter");
+  ASSERT_NE(handle, nullptr);
+  ASSERT_NE(iptc_insert_entry("INPUT", entry, 1, handle), 0);
+  auto committed = iptc_commit(handle) != 0;
+  iptc_free(handle);
+
+  auto filter = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  auto chain = fwb->createContext(filter, "INPUT");
+  if (committed) {
+    fwb->reloadTable(filter);
+
+    BypassService service;
+    service.ports_ = *ConntrackBypass::parsePorts("53");
+    auto plan = fwb->planConntrackBypass(service);
+    auto accept = std::ranges::find(plan.rules_, "INPUT", &BypassRule::chain_);
+    ASSERT_NE(accept, plan.rules_.end());
+    ASSERT_EQ(accept->rule_->index_, 1);
+    ASSERT_EQ(accept->shadowed_, vector<int>{2});
+    ASSERT_EQ(accept->note(), "  (shadows #2)");
+
+    ASSERT_TRUE(fwb->applyConntrackBypass(filter, plan))
+        << filter->getLastError();
+    ASSERT_EQ(fwb->getRule(chain, 0)->target_, IPTC_LABEL_DROP);
+    ASSERT_EQ(fwb->getRule(chain, 1)->target_, IPTC_LABEL_ACCEPT);
+    ASSERT_EQ(fwb->getRuleCount(chain), 4);
+    fwb->reloadTable(fwb->createContext(make_shared<FirewallContext>(),
+                                        "raw"));
+    fwb->reloadTable(filter);
+  }
+
+  std::istringstream empty("*filter\n:INPUT ACCEPT [0:0]\nCOMMIT\n");
+  ASSERT_FALSE(fwb->importRuleset(empty).has_value());
+  ASSERT_TRUE(fwb->commit());
+  if (!committed) {
+    GTEST_SKIP() << "state match is not available";
+  }
+}
+
+TEST_F(FirewallTestFixture, nfqueueTargetRoundTrips) {
+  string rules = "-A CP_NFQ -p tcp -m tcp --dport 80 -j NFQUEUE "
+                 "--queue-balance 2:5 --queue-bypass --queue-cpu-fanout\n"
+                 "-A CP_NFQ -j NFQUEUE --queue-num 7\n";
+  std::istringstream input("*filter\n"
+                           ":INPUT ACCEPT [0:0]\n"
+                           ":FORWARD ACCEPT [0:0]\n"
+                           ":OUTPUT ACCEPT [0:0]\n"
+                           ":CP_NFQ - [0:0]\n" +
+                           rules + "COMMIT\n");
+  ASSERT_FALSE(fwb->importRuleset(input).has_value());
+
+  auto context = fwb->createContext(make_shared<FirewallContext>(), "filter");
+  context = fwb->createContext(context, "CP_NFQ");
+  auto balanced = fwb->getRule(context, 0);
+  ASSERT_EQ(balanced->target_, RequestTarget::NFQUEUE);
+  ASSERT_TRUE(balanced->nfqueue_target_.has_value());
+  ASSERT_EQ(balanced->nfqueue_target_->queue_num_, 2);
+  ASSERT_EQ(balanced->nfqueue_target_->queues_total_, 4);
+  ASSERT_TRUE(balanced->nfqueue_target_->bypass_);
+  ASSERT_TRUE(balanced->nfqueue_target_->cpu_fanout_);
+  ASSERT_NE(fwb->getRuleDetails(context, 0)
+                .find("Queues: 2 - 5, bypass, cpu fanout"),
+            string::npos);
+
+  std::ostringstream saved;
+  SaveFormat::write(saved,
+                    TableRuleset{"filter",
+                                 {ChainRuleset{"CP_NFQ", std::nullopt,
+                                               {balanced,
+                                                fwb->getRule(context, 1)}}}});
+  ASSERT_NE(saved.str().find(rules), string::npos) << saved.str();
+
+  /* cpu fanout picks one of several queues */
+  auto single = make_shared<RuleRequest>(*balanced);
+  single->nfqueue_target_->queues_total_ = 1;
+  ASSERT_FALSE(fwb->insertRule(context, single));
+
+  fwb->reloadTable(context);
+}
+
 /* gtest param test for add/delete rule */
 struct FirewallTestAddDelRuleData {
   FirewallTestAddDelRuleData(string a, string b,
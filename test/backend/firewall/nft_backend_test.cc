@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sched.h>
+#include <string>
+#include <tuple>
+
+#include "backend/firewall/chain_request.h"
+#include "backend/firewall/firewall_context.h"
+#include "backend/firewall/nft_backend.h"
+#include "backend/firewall/rule_request.h"
+
+using std::make_shared;
+using std::make_tuple;
+
+/**
+ * Each test works in a table of its own name, main() moves the process into
+ * a private network namespace so nothing on the host is touched.
+ */
+class NftFixture : public ::testing::Test {
+protected:
+  void SetUp() override {
+    nft = make_shared<NftBackend>();
+    root = make_shared<FirewallContext>();
+    string name =
+        ::testing::UnitTest::GetInstance()->current_test_info()->name();
+    ASSERT_TRUE(nft->insertTable(root, name)) << root->getLastError();
+    table = RuleBackend::createContext(root, name);
+    ASSERT_TRUE(nft->insertBaseChain(table, make_shared<ChainRequest>("INPUT"),
+                                     "INPUT", 0, IPTC_LABEL_ACCEPT))
+        << table->getLastError();
+    ASSERT_TRUE(nft->insertChain(table, make_shared<ChainRequest>("USER")));
+    input = RuleBackend::createContext(table, "INPUT");
+    user = RuleBackend::createContext(table, "USER");
+  }
+
+  static auto makeRule(int index, const string &src,
+                       const string &target) -> shared_ptr<RuleRequest> {
+    auto rule = make_shared<RuleRequest>();
+    rule->index_ = index;
+    rule->proto_ = RequestProto::ALL;
+    rule->src_ip_ = src;
+    rule->target_ = target;
+    return rule;
+  }
+
+  shared_ptr<NftBackend> nft;
+  ctx_t root;
+  ctx_t table;
+  ctx_t input;
+  ctx_t user;
+};
+
+TEST_F(NftFixture, commitThenReloadKeepsRules) {
+  auto rule = make_shared<RuleRequest>();
+  rule->index_ = 0;
+  rule->src_ip_ = "10.1.0.0";
+  rule->src_mask_ = "255.255.0.0";
+  rule->proto_ = RequestProto::TCP;
+  rule->matches_.push_back({make_tuple(string("1000"), string("2000")),
+                            make_tuple(string("22"), string("22"))});
+  rule->iniface_ = "eth+";
+  rule->target_ = IPTC_LABEL_DROP;
+  ASSERT_TRUE(nft->insertRule(input, rule)) << input->getLastError();
+  ASSERT_TRUE(nft->insertRule(input, makeRule(1, "10.2.0.1", "USER")));
+  ASSERT_TRUE(nft->insertRule(user, makeRule(0, "10.3.0.1", "RETURN")));
+
+  EXPECT_FALSE(nft->getRuleHandle(input, 0).has_value());
+  ASSERT_TRUE(nft->commit()) << nft->lastCommitError();
+  EXPECT_EQ(nft->getCommitStat().commits_, 1);
+
+  /* handles are echoed back by the kernel */
+  auto first = nft->getRuleHandle(input, 0);
+  auto second = nft->getRuleHandle(input, 1);
+  ASSERT_TRUE(first.has_value());
+  ASSERT_TRUE(second.has_value());
+  EXPECT_NE(*first, *second);
+
+  auto reloaded = make_shared<NftBackend>();
+  ASSERT_EQ(reloaded->getRuleCount(input), 2);
+  EXPECT_EQ(reloaded->getRuleHandle(input, 0), first);
+
+  auto decoded = reloaded->getRule(input, 0);
+  ASSERT_NE(decoded, nullptr);
+  EXPECT_EQ(decoded->src_ip_, rule->src_ip_);
+  EXPECT_EQ(decoded->src_mask_, rule->src_mask_);
+  EXPECT_EQ(decoded->proto_, RequestProto::TCP);
+  ASSERT_EQ(decoded->matches_.size(), 1);
+  EXPECT_EQ(decoded->matches_[0].src_port_range_,
+            rule->matches_[0].src_port_range_);
+  EXPECT_EQ(decoded->matches_[0].dst_port_range_,
+            rule->matches_[0].dst_port_range_);
+  EXPECT_EQ(decoded->iniface_, rule->iniface_);
+  EXPECT_EQ(decoded->target_, IPTC_LABEL_DROP);
+  EXPECT_EQ(reloaded->getRule(input, 1)->target_, "USER");
+
+  /* USER is still jumped to */
+  EXPECT_FALSE(reloaded->removeChain(user));
+  EXPECT_NE(user->getLastError().find("referenced"), string::npos);
+}
+
+TEST_F(NftFixture, incrementalCommitKeepsHandles) {
+  static constexpr int kRules = 100;
+
+  for (int i = 0; i < kRules; i++) {
+    ASSERT_TRUE(nft->insertRule(
+        input, makeRule(i, "10.0.0." + std::to_string(i), IPTC_LABEL_DROP)));
+  }
+  ASSERT_TRUE(nft->commit()) << nft->lastCommitError();
+  auto kept = nft->getRuleHandle(input, kRules - 1);
+
+  /* one update, one removal and one insert at head are three messages */
+  auto update = nft->getRule(input, 1);
+  update->target_ = IPTC_LABEL_ACCEPT;
+  ASSERT_TRUE(nft->updateRule(input, update));
+  ASSERT_TRUE(nft->removeRule(input, 0));
+  ASSERT_TRUE(nft->insertRule(input, makeRule(0, "1.2.3.4", "RETURN")));
+  EXPECT_EQ(nft->estimateCommitCost(), 3);
+
+  auto stale = make_shared<NftBackend>();
+  ASSERT_EQ(stale->getRuleCount(input), kRules);
+
+  ASSERT_TRUE(nft->commit()) << nft->lastCommitError();
+  EXPECT_EQ(nft->getCommitStat().last_messages_, 3);
+  EXPECT_EQ(nft->getRuleHandle(input, kRules - 1), kept);
+
+  auto reloaded = make_shared<NftBackend>();
+  ASSERT_EQ(reloaded->getRuleCount(input), kRules);
+  EXPECT_EQ(reloaded->getRule(input, 0)->target_, "RETURN");
+  EXPECT_EQ(reloaded->getRule(input, 1)->target_, IPTC_LABEL_ACCEPT);
+
+  /* a backend that read the ruleset before is refused as a whole */
+  ASSERT_TRUE(stale->removeRule(input, 0));
+  EXPECT_FALSE(stale->commit());
+  EXPECT_NE(stale->lastCommitError().find("reload"), string::npos);
+  EXPECT_EQ(make_shared<NftBackend>()->getRuleCount(input), kRules);
+}
+
+auto main(int argc, char **argv) -> int {
+  if (unshare(CLONE_NEWNET) != 0) {
+    std::cerr << "unshare failed: " << strerror(errno) << ", run as root"
+              << std::endl;
+    return 1;
+  }
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}